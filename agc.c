@@ -0,0 +1,741 @@
+/*
+   Automatic gain control with a look-ahead limiter.
+
+   agc_process() levels the captured periods in place on their way from the
+   PCM to the file, so that quiet recordings come out at a usable level
+   without a second pass over the file afterwards.  It works in two stages
+   on samples converted to float:
+
+   AGC: the mean square of every BLOCK_TIME block is smoothed over
+   LEVEL_TIME and the gain that brings it to "target" dBFS RMS, within
+   [MIN_GAIN, max_gain] dB, is approached in dB with ATTACK_TIME when it has
+   to go down and RELEASE_TIME when it may go up; the gain ramps linearly
+   from frame to frame in between.  Blocks quieter than GATE are left out,
+   so that pauses do not pump up the noise.
+
+   Limiter: whatever the AGC gain would push above CEILING is turned down
+   before it gets there.  For every frame, t = the gain that just keeps its
+   loudest channel at the ceiling (1 if it is below).  The limiter gain is
+   the lowest t of the next "look" frames, recovering with LIMIT_RELEASE,
+   averaged over the last "look" frames: every one of those minima already
+   covers the frame, so the average never exceeds its t, and the gain
+   glides down over the look-ahead instead of jumping.  The output is
+   therefore late by "look" frames (agc_delay()), which are held back from
+   one call to the next; the first ones out are silence, and agc_flush()
+   gets the last ones out at the end.
+
+   The format conversions of 16 bit samples and the peak, mean square and
+   gain kernels for mono and stereo have SSE2 and AVX2 versions, picked at
+   runtime like in meter.c.  Samples go through float, so 32 bit input
+   keeps 24 bits of it.
+
+   agc_log() writes the gain curve as text, a line every LOG_TIME:
+
+     <frame> <AGC gain dB> <lowest total gain dB> <output peak dBFS>
+
+   frames counted from the agc_log() call, in the output.
+*/
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+
+#include "cpu.h"
+#include "meter.h"
+#include "agc.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define AGC_X86 1
+#endif
+
+#define BLOCK_TIME	0.01	/* s, AGC update interval */
+#define LEVEL_TIME	0.4	/* s, loudness smoothing */
+#define ATTACK_TIME	0.5	/* s, AGC gain going down */
+#define RELEASE_TIME	3.0	/* s, AGC gain going up */
+#define MIN_GAIN	-20.0	/* dB */
+#define GATE		-50.0	/* dBFS RMS */
+#define CEILING		-1.0	/* dBFS */
+#define LOOKAHEAD	0.005	/* s */
+#define LIMIT_RELEASE	0.1	/* s */
+#define LOG_TIME	0.1	/* s */
+
+struct agc {
+	int fmt;		/* METER_* */
+	unsigned channels;
+	size_t max;		/* frames per step */
+	unsigned look;		/* look-ahead frames, also the delay */
+
+	/* look held back frames, then max new ones */
+	float *x;		/* samples, interleaved */
+	float *pk;		/* loudest channel of each frame */
+	float *ga;		/* AGC gain of each frame */
+	float *t;		/* gain that keeps each frame at the ceiling */
+	unsigned *dq;		/* sliding minimum of t */
+	float *g;		/* total gain of the max frames going out */
+
+	/* AGC */
+	double target;		/* dBFS RMS */
+	double max_gain;	/* dB */
+	double gate;		/* mean square */
+	double level;		/* smoothed mean square, 0 until the first */
+	double gain_db;
+	double smooth, attack, release;	/* per block */
+	float gain, step;	/* of the frame, per frame */
+	double block_sq;
+	unsigned block, block_n;
+
+	/* limiter */
+	float ceiling;
+	float hold;		/* minimum of t, recovering */
+	float lim_release;	/* per frame */
+	float *avg;		/* the last look values of hold */
+	double avg_sum;
+	unsigned avg_pos;
+	unsigned flushed;	/* held back frames agc_flush() gave out */
+
+	FILE *log;
+	unsigned long long log_frame;
+	unsigned log_every, log_n;
+	float log_min, log_peak;
+};
+
+/*
+ *  kernels
+ */
+
+static void load_s16_c(const uint8_t *in, float *out, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++, in += 2)
+		out[i] = (int16_t)(in[0] | in[1] << 8) / 32768.0f;
+}
+
+static void store_s16_c(const float *in, uint8_t *out, size_t n)
+{
+	float v;
+	long r;
+	size_t i;
+
+	for (i = 0; i < n; i++, out += 2) {
+		v = in[i] * 32768.0f;
+		v = v < -32768.0f ? -32768.0f : v > 32767.0f ? 32767.0f : v;
+		r = lrintf(v);
+		out[0] = r;
+		out[1] = r >> 8;
+	}
+}
+
+static void peak_c(const float *x, float *pk, size_t frames, unsigned ch)
+{
+	size_t i;
+	unsigned c;
+	float m, v;
+
+	for (i = 0; i < frames; i++) {
+		for (m = 0, c = 0; c < ch; c++) {
+			v = fabsf(x[i * ch + c]);
+			if (v > m)
+				m = v;
+		}
+		pk[i] = m;
+	}
+}
+
+static void apply_c(float *x, const float *g, size_t frames, unsigned ch)
+{
+	size_t i;
+	unsigned c;
+
+	for (i = 0; i < frames; i++)
+		for (c = 0; c < ch; c++)
+			x[i * ch + c] *= g[i];
+}
+
+static double sumsq_c(const float *x, size_t n)
+{
+	double s = 0;
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		s += (double)x[i] * x[i];
+	return s;
+}
+
+#ifdef AGC_X86
+
+#pragma GCC push_options
+#pragma GCC target("sse2")
+
+static void load_s16_sse2(const uint8_t *in, float *out, size_t n)
+{
+	__m128 scale = _mm_set1_ps(1 / 32768.0f);
+	__m128i x;
+	size_t i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		x = _mm_loadu_si128((const __m128i *)(in + 2 * i));
+		_mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(
+			_mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16)), scale));
+		_mm_storeu_ps(out + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(
+			_mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16)), scale));
+	}
+	load_s16_c(in + 2 * i, out + i, n - i);
+}
+
+static inline __m128i s16_sse2(const float *in)
+{
+	__m128 v = _mm_mul_ps(_mm_loadu_ps(in), _mm_set1_ps(32768.0f));
+
+	v = _mm_min_ps(_mm_max_ps(v, _mm_set1_ps(-32768.0f)),
+		       _mm_set1_ps(32767.0f));
+	return _mm_cvtps_epi32(v);
+}
+
+static void store_s16_sse2(const float *in, uint8_t *out, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i + 8 <= n; i += 8)
+		_mm_storeu_si128((__m128i *)(out + 2 * i),
+				 _mm_packs_epi32(s16_sse2(in + i),
+						 s16_sse2(in + i + 4)));
+	store_s16_c(in + i, out + 2 * i, n - i);
+}
+
+static void peak_sse2(const float *x, float *pk, size_t frames, unsigned ch)
+{
+	__m128 sign = _mm_set1_ps(-0.0f), a, b;
+	size_t i = 0;
+
+	if (ch == 1) {
+		for (; i + 4 <= frames; i += 4)
+			_mm_storeu_ps(pk + i, _mm_andnot_ps(sign,
+							    _mm_loadu_ps(x + i)));
+	} else if (ch == 2) {
+		for (; i + 4 <= frames; i += 4) {
+			a = _mm_andnot_ps(sign, _mm_loadu_ps(x + 2 * i));
+			b = _mm_andnot_ps(sign, _mm_loadu_ps(x + 2 * i + 4));
+			/* left and right of four frames */
+			_mm_storeu_ps(pk + i, _mm_max_ps(
+				_mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)),
+				_mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1))));
+		}
+	}
+	peak_c(x + i * ch, pk + i, frames - i, ch);
+}
+
+static void apply_sse2(float *x, const float *g, size_t frames, unsigned ch)
+{
+	__m128 v;
+	size_t i = 0;
+
+	if (ch == 1) {
+		for (; i + 4 <= frames; i += 4)
+			_mm_storeu_ps(x + i, _mm_mul_ps(_mm_loadu_ps(x + i),
+							_mm_loadu_ps(g + i)));
+	} else if (ch == 2) {
+		for (; i + 4 <= frames; i += 4) {
+			v = _mm_loadu_ps(g + i);
+			_mm_storeu_ps(x + 2 * i, _mm_mul_ps(_mm_loadu_ps(x + 2 * i),
+				_mm_unpacklo_ps(v, v)));
+			_mm_storeu_ps(x + 2 * i + 4, _mm_mul_ps(
+				_mm_loadu_ps(x + 2 * i + 4), _mm_unpackhi_ps(v, v)));
+		}
+	}
+	apply_c(x + i * ch, g + i, frames - i, ch);
+}
+
+static double sumsq_sse2(const float *x, size_t n)
+{
+	__m128d lo = _mm_setzero_pd(), hi = _mm_setzero_pd();
+	__m128 v;
+	double s[2];
+	size_t i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		v = _mm_loadu_ps(x + i);
+		v = _mm_mul_ps(v, v);
+		lo = _mm_add_pd(lo, _mm_cvtps_pd(v));
+		hi = _mm_add_pd(hi, _mm_cvtps_pd(_mm_movehl_ps(v, v)));
+	}
+	_mm_storeu_pd(s, _mm_add_pd(lo, hi));
+	return s[0] + s[1] + sumsq_c(x + i, n - i);
+}
+
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx2")
+
+static void load_s16_avx2(const uint8_t *in, float *out, size_t n)
+{
+	__m256 scale = _mm256_set1_ps(1 / 32768.0f);
+	size_t i;
+
+	for (i = 0; i + 8 <= n; i += 8)
+		_mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_cvtepi32_ps(
+			_mm256_cvtepi16_epi32(_mm_loadu_si128(
+				(const __m128i *)(in + 2 * i)))), scale));
+	load_s16_c(in + 2 * i, out + i, n - i);
+}
+
+static inline __m256i s16_avx2(const float *in)
+{
+	__m256 v = _mm256_mul_ps(_mm256_loadu_ps(in),
+				 _mm256_set1_ps(32768.0f));
+
+	v = _mm256_min_ps(_mm256_max_ps(v, _mm256_set1_ps(-32768.0f)),
+			  _mm256_set1_ps(32767.0f));
+	return _mm256_cvtps_epi32(v);
+}
+
+static void store_s16_avx2(const float *in, uint8_t *out, size_t n)
+{
+	size_t i;
+
+	/* the pack works per 128 bit lane, the permute undoes that */
+	for (i = 0; i + 16 <= n; i += 16)
+		_mm256_storeu_si256((__m256i *)(out + 2 * i),
+			_mm256_permute4x64_epi64(_mm256_packs_epi32(
+				s16_avx2(in + i), s16_avx2(in + i + 8)), 0xd8));
+	store_s16_c(in + i, out + 2 * i, n - i);
+}
+
+static void peak_avx2(const float *x, float *pk, size_t frames, unsigned ch)
+{
+	__m256 sign = _mm256_set1_ps(-0.0f), a, b, m;
+	size_t i = 0;
+
+	if (ch == 1) {
+		for (; i + 8 <= frames; i += 8)
+			_mm256_storeu_ps(pk + i, _mm256_andnot_ps(sign,
+				_mm256_loadu_ps(x + i)));
+	} else if (ch == 2) {
+		for (; i + 8 <= frames; i += 8) {
+			a = _mm256_andnot_ps(sign, _mm256_loadu_ps(x + 2 * i));
+			b = _mm256_andnot_ps(sign, _mm256_loadu_ps(x + 2 * i + 8));
+			/* frames 0 1 4 5 | 2 3 6 7, put in order */
+			m = _mm256_max_ps(
+				_mm256_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)),
+				_mm256_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+			_mm256_storeu_ps(pk + i, _mm256_castpd_ps(
+				_mm256_permute4x64_pd(_mm256_castps_pd(m), 0xd8)));
+		}
+	}
+	peak_c(x + i * ch, pk + i, frames - i, ch);
+}
+
+static void apply_avx2(float *x, const float *g, size_t frames, unsigned ch)
+{
+	__m128 v;
+	size_t i = 0;
+
+	if (ch == 1) {
+		for (; i + 8 <= frames; i += 8)
+			_mm256_storeu_ps(x + i, _mm256_mul_ps(
+				_mm256_loadu_ps(x + i), _mm256_loadu_ps(g + i)));
+	} else if (ch == 2) {
+		for (; i + 4 <= frames; i += 4) {
+			v = _mm_loadu_ps(g + i);
+			_mm256_storeu_ps(x + 2 * i, _mm256_mul_ps(
+				_mm256_loadu_ps(x + 2 * i),
+				_mm256_set_m128(_mm_unpackhi_ps(v, v),
+						_mm_unpacklo_ps(v, v))));
+		}
+	}
+	apply_c(x + i * ch, g + i, frames - i, ch);
+}
+
+static double sumsq_avx2(const float *x, size_t n)
+{
+	__m256d lo = _mm256_setzero_pd(), hi = _mm256_setzero_pd();
+	__m256 v;
+	double s[4];
+	size_t i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		v = _mm256_loadu_ps(x + i);
+		v = _mm256_mul_ps(v, v);
+		lo = _mm256_add_pd(lo, _mm256_cvtps_pd(_mm256_castps256_ps128(v)));
+		hi = _mm256_add_pd(hi, _mm256_cvtps_pd(_mm256_extractf128_ps(v, 1)));
+	}
+	_mm256_storeu_pd(s, _mm256_add_pd(lo, hi));
+	return s[0] + s[1] + s[2] + s[3] + sumsq_c(x + i, n - i);
+}
+
+#pragma GCC pop_options
+
+#endif /* AGC_X86 */
+
+/* one row per CPU_*, see cpu.c */
+static const struct agc_impl {
+	void (*load_s16)(const uint8_t *in, float *out, size_t n);
+	void (*store_s16)(const float *in, uint8_t *out, size_t n);
+	void (*peak)(const float *x, float *pk, size_t frames, unsigned ch);
+	void (*apply)(float *x, const float *g, size_t frames, unsigned ch);
+	double (*sumsq)(const float *x, size_t n);
+} agc_impls[] = {
+	{ load_s16_c, store_s16_c, peak_c, apply_c, sumsq_c },
+#ifdef AGC_X86
+	{ load_s16_sse2, store_s16_sse2, peak_sse2, apply_sse2, sumsq_sse2 },
+	{ load_s16_avx2, store_s16_avx2, peak_avx2, apply_avx2, sumsq_avx2 },
+#endif
+};
+
+static const void *impl;
+
+static const struct agc_impl *agc_dispatch(void)
+{
+	return cpu_resolve(&impl, agc_impls, sizeof(agc_impls[0]),
+			   sizeof(agc_impls) / sizeof(agc_impls[0]), -1);
+}
+
+/*
+ *  other formats
+ */
+
+static void load_c(int fmt, const uint8_t *in, float *out, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		switch (fmt) {
+		case METER_S8:
+			out[i] = (int8_t)in[i] / 128.0f;
+			break;
+		case METER_U8:
+			out[i] = (in[i] - 128) / 128.0f;
+			break;
+		case METER_S24_3LE:
+			out[i] = ((int32_t)((uint32_t)in[3 * i] << 8 |
+					    (uint32_t)in[3 * i + 1] << 16 |
+					    (uint32_t)in[3 * i + 2] << 24) >> 8) /
+				 8388608.0f;
+			break;
+		case METER_S24_LE:
+			out[i] = ((int32_t)((uint32_t)in[4 * i] << 8 |
+					    (uint32_t)in[4 * i + 1] << 16 |
+					    (uint32_t)in[4 * i + 2] << 24) >> 8) /
+				 8388608.0f;
+			break;
+		case METER_S32_LE:
+			out[i] = (int32_t)(in[4 * i] | in[4 * i + 1] << 8 |
+					   in[4 * i + 2] << 16 |
+					   (uint32_t)in[4 * i + 3] << 24) /
+				 2147483648.0f;
+			break;
+		case METER_FLOAT_LE:
+			memcpy(out + i, in + 4 * i, 4);
+			break;
+		}
+	}
+}
+
+/* x of full scale as a sample of "bits", saturated */
+static inline int32_t to_int(float x, int bits)
+{
+	double v = ldexp(x, bits - 1), max = ldexp(1, bits - 1);
+
+	v = v < -max ? -max : v > max - 1 ? max - 1 : v;
+	return lrint(v);
+}
+
+static void store_c(int fmt, const float *in, uint8_t *out, size_t n)
+{
+	int32_t v;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		switch (fmt) {
+		case METER_S8:
+			out[i] = to_int(in[i], 8);
+			break;
+		case METER_U8:
+			out[i] = to_int(in[i], 8) + 128;
+			break;
+		case METER_S24_3LE:
+			v = to_int(in[i], 24);
+			out[3 * i] = v;
+			out[3 * i + 1] = v >> 8;
+			out[3 * i + 2] = v >> 16;
+			break;
+		case METER_S24_LE:
+		case METER_S32_LE:
+			v = to_int(in[i], fmt == METER_S32_LE ? 32 : 24);
+			out[4 * i] = v;
+			out[4 * i + 1] = v >> 8;
+			out[4 * i + 2] = v >> 16;
+			out[4 * i + 3] = v >> 24;
+			break;
+		case METER_FLOAT_LE:
+			memcpy(out + 4 * i, in + i, 4);
+			break;
+		}
+	}
+}
+
+/*
+ *  the two stages
+ */
+
+static double db(double x)
+{
+	return 20 * log10(x > 1e-10 ? x : 1e-10);
+}
+
+/* at the end of a block: the AGC gain to ramp to over the next one */
+static void agc_update(struct agc *a)
+{
+	double ms = a->block_sq / ((double)a->block * a->channels), want;
+
+	a->block_sq = 0;
+	a->block_n = 0;
+	a->step = 0;
+	if (ms < a->gate)
+		return;
+	if (a->level == 0)
+		a->level = ms;
+	else
+		a->level += (ms - a->level) * a->smooth;
+	want = a->target - 10 * log10(a->level);
+	if (want < MIN_GAIN)
+		want = MIN_GAIN;
+	if (want > a->max_gain)
+		want = a->max_gain;
+	a->gain_db += (want - a->gain_db) *
+		      (want < a->gain_db ? a->attack : a->release);
+	a->step = (pow(10, a->gain_db / 20) - a->gain) / a->block;
+}
+
+static void agc_log_frame(struct agc *a, float ga, float g, float peak)
+{
+	if (g < a->log_min)
+		a->log_min = g;
+	if (peak > a->log_peak)
+		a->log_peak = peak;
+	if (++a->log_n < a->log_every)
+		return;
+	fprintf(a->log, "%llu %.2f %.2f %.2f\n", a->log_frame, db(ga),
+		db(a->log_min), db(a->log_peak));
+	a->log_frame += a->log_n;
+	a->log_n = 0;
+	a->log_min = 1e30f;
+	a->log_peak = 0;
+}
+
+static void agc_step(struct agc *a, uint8_t *data, size_t n)
+{
+	const struct agc_impl *k = agc_dispatch();
+	unsigned ch = a->channels, look = a->look, *dq = a->dq;
+	float *x = a->x + (size_t)look * ch, *t = a->t, v, m, hold;
+	size_t i, j, q, seg, h, e;
+
+	/* the new frames go in behind the ones held back */
+	if (a->fmt == METER_S16_LE)
+		k->load_s16(data, x, n * ch);
+	else
+		load_c(a->fmt, data, x, n * ch);
+	k->peak(x, a->pk + look, n, ch);
+	for (i = 0; i < n; i += seg) {
+		seg = a->block - a->block_n;
+		if (seg > n - i)
+			seg = n - i;
+		a->block_sq += k->sumsq(x + i * ch, seg * ch);
+		for (j = look + i; j < look + i + seg; j++) {
+			a->ga[j] = a->gain;
+			a->gain += a->step;
+		}
+		a->block_n += seg;
+		if (a->block_n == a->block)
+			agc_update(a);
+	}
+	for (j = look; j < look + n; j++) {
+		v = a->pk[j] * a->ga[j];
+		t[j] = v > a->ceiling ? a->ceiling / v : 1;
+	}
+
+	/* the frames going out: minimum of t over the look-ahead (a
+	   monotonic queue of its indices), released, averaged */
+	hold = a->hold;
+	for (q = h = e = 0; q < n + look - 1; q++) {
+		while (e > h && t[dq[e - 1]] >= t[q])
+			e--;
+		dq[e++] = q;
+		if (q + 1 < look)
+			continue;
+		j = q + 1 - look;
+		if (dq[h] < j)
+			h++;
+		m = t[dq[h]];
+		hold += (1 - hold) * a->lim_release;
+		if (m < hold)
+			hold = m;
+		a->avg_sum += hold - a->avg[a->avg_pos];
+		a->avg[a->avg_pos] = hold;
+		if (++a->avg_pos == look) {
+			/* no drift, however long the capture */
+			for (a->avg_pos = 0, a->avg_sum = 0, i = 0; i < look; i++)
+				a->avg_sum += a->avg[i];
+		}
+		a->g[j] = a->avg_sum / look * a->ga[j];
+		if (a->log)
+			agc_log_frame(a, a->ga[j], a->g[j],
+				      a->pk[j] * a->g[j]);
+	}
+	a->hold = hold;
+	k->apply(a->x, a->g, n, ch);
+	if (a->fmt == METER_S16_LE)
+		k->store_s16(a->x, data, n * ch);
+	else
+		store_c(a->fmt, a->x, data, n * ch);
+
+	memmove(a->x, a->x + n * ch, (size_t)look * ch * sizeof(*a->x));
+	memmove(a->pk, a->pk + n, look * sizeof(*a->pk));
+	memmove(a->ga, a->ga + n, look * sizeof(*a->ga));
+	memmove(a->t, a->t + n, look * sizeof(*a->t));
+}
+
+/*
+ * Levels "frames" frames of "data" in place.  Every call gives back as
+ * many frames as it takes, agc_delay() frames late.
+ */
+void agc_process(struct agc *a, void *data, size_t frames)
+{
+	size_t n, bytes = (size_t)meter_sample_bytes(a->fmt) * a->channels;
+	uint8_t *p = data;
+
+	for (; frames > 0; frames -= n, p += n * bytes) {
+		n = frames < a->max ? frames : a->max;
+		agc_step(a, p, n);
+	}
+}
+
+/* frames the output lags behind the input */
+unsigned agc_delay(struct agc *a)
+{
+	return a->look;
+}
+
+/*
+ * Once the input has ended, puts up to "frames" of the frames still held
+ * back into "data", leveled and in order, by feeding silence behind them.
+ * Returns how many, 0 once all agc_delay() of them are out.
+ */
+size_t agc_flush(struct agc *a, void *data, size_t frames)
+{
+	size_t bytes = (size_t)meter_sample_bytes(a->fmt) * a->channels;
+
+	if (frames > a->look - a->flushed)
+		frames = a->look - a->flushed;
+	memset(data, a->fmt == METER_U8 ? 0x80 : 0, frames * bytes);
+	agc_process(a, data, frames);
+	a->flushed += frames;
+	return frames;
+}
+
+/*
+ * Writes the gain curve to "f" (NULL to stop), frames counted from now.
+ * The caller closes f.
+ */
+void agc_log(struct agc *a, FILE *f)
+{
+	a->log = f;
+	a->log_frame = 0;
+	a->log_n = 0;
+	a->log_min = 1e30f;
+	a->log_peak = 0;
+	if (f == NULL)
+		return;
+	fprintf(f, "# agc: target %.1f dBFS rms, gain %.1f to %.1f dB, "
+		"ceiling %.1f dBFS, %u frames look-ahead\n",
+		a->target, MIN_GAIN, a->max_gain, CEILING, a->look);
+	fprintf(f, "# frame agc_db gain_db peak_dbfs\n");
+}
+
+static double per_step(double step, double time)
+{
+	return 1 - exp(-step / time);
+}
+
+/*
+ * A gain control for "channels" channels of METER_* "fmt" at "rate" Hz,
+ * fed up to "max_frames" frames at a time (more just take several steps),
+ * that aims at "target" dBFS RMS with at most "max_gain" dB.  Returns NULL
+ * with errno set on failure, EINVAL for a format it does not handle (the
+ * big endian ones).
+ */
+struct agc *agc_new(int fmt, unsigned channels, unsigned rate,
+		    size_t max_frames, double target, double max_gain)
+{
+	struct agc *a;
+	size_t frames;
+	unsigned i;
+
+	if ((fmt != METER_S8 && fmt != METER_U8 && fmt != METER_S16_LE &&
+	     fmt != METER_S24_3LE && fmt != METER_S24_LE &&
+	     fmt != METER_S32_LE && fmt != METER_FLOAT_LE) ||
+	    channels == 0 || rate == 0 || max_frames == 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+	a = calloc(1, sizeof(*a));
+	if (a == NULL)
+		return NULL;
+	a->fmt = fmt;
+	a->channels = channels;
+	a->max = max_frames;
+	a->look = rate * LOOKAHEAD;
+	if (a->look == 0)
+		a->look = 1;
+	frames = a->look + max_frames;
+	a->x = calloc(frames * channels, sizeof(*a->x));
+	a->pk = calloc(frames, sizeof(*a->pk));
+	a->ga = malloc(frames * sizeof(*a->ga));
+	a->t = malloc(frames * sizeof(*a->t));
+	a->dq = malloc(frames * sizeof(*a->dq));
+	a->g = malloc(max_frames * sizeof(*a->g));
+	a->avg = malloc(a->look * sizeof(*a->avg));
+	if (!a->x || !a->pk || !a->ga || !a->t || !a->dq || !a->g || !a->avg) {
+		agc_free(a);
+		errno = ENOMEM;
+		return NULL;
+	}
+	for (i = 0; i < a->look; i++)
+		a->ga[i] = a->t[i] = a->avg[i] = 1;
+	a->avg_sum = a->look;
+	a->hold = 1;
+	a->target = target;
+	a->max_gain = max_gain;
+	a->gate = pow(10, GATE / 10);
+	a->gain = 1;
+	a->block = rate * BLOCK_TIME;
+	if (a->block == 0)
+		a->block = 1;
+	a->smooth = per_step(a->block, rate * LEVEL_TIME);
+	a->attack = per_step(a->block, rate * ATTACK_TIME);
+	a->release = per_step(a->block, rate * RELEASE_TIME);
+	a->ceiling = pow(10, CEILING / 20);
+	a->lim_release = per_step(1, rate * LIMIT_RELEASE);
+	a->log_every = rate * LOG_TIME;
+	if (a->log_every == 0)
+		a->log_every = 1;
+	return a;
+}
+
+void agc_free(struct agc *a)
+{
+	if (a == NULL)
+		return;
+	free(a->x);
+	free(a->pk);
+	free(a->ga);
+	free(a->t);
+	free(a->dq);
+	free(a->g);
+	free(a->avg);
+	free(a);
+}
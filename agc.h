@@ -0,0 +1,20 @@
+/*
+   Automatic gain control with a look-ahead limiter, see agc.c.
+*/
+#ifndef AGC_H
+#define AGC_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+struct agc;
+
+struct agc *agc_new(int fmt, unsigned channels, unsigned rate,
+		    size_t max_frames, double target, double max_gain);
+void agc_free(struct agc *a);
+void agc_process(struct agc *a, void *data, size_t frames);
+unsigned agc_delay(struct agc *a);
+size_t agc_flush(struct agc *a, void *data, size_t frames);
+void agc_log(struct agc *a, FILE *f);
+
+#endif
@@ -1,38 +1,27 @@
 #! /usr/bin/env python
 
 """
-Amplifies a wav file.
-"""
+Amplifies a wav file, so that its loudest sample is at full scale.
 
-from sys import argv
-import wave
-import audioop
+The work is done by audio.normalize(), which maps the file a piece at a
+time, so even hours long recordings take no memory to speak of.  Without
+an output file the input is amplified in place.
+"""
 
-def normalize(filein, fileout):
-    a = wave.open(filein)
-    params = a.getparams()
-    nchannels, sampwidth, framerate, nframes, comptype, compname = params
-    data = a.readframes(nframes)
+from sys import argv, exit
 
-    if sampwidth == 1:
-        max_val = 0x7f
-    elif sampwidth == 2:
-        max_val = 0x7fff
-    elif sampwidth == 4:
-        max_val == 0x7fffffff
+import audio
 
-    max = audioop.max(data, sampwidth)
-    factor = float(max_val)/max
-    #factor = 200
+def normalize(filein, fileout=None):
+    peak, rms, factor = audio.normalize(filein, fileout)
+    print "peak was %.1f%%, rms %.1f%%" % (peak * 100, rms * 100)
     print "amplifying by F=%f" % factor
 
-    data = audioop.mul(data, sampwidth, factor)
-
-    b = wave.open(fileout, "w")
-    b.setparams(params)
-    b.writeframes(data)
-
-if len(argv) == 3:
-    normalize(argv[1], argv[2])
+if len(argv) in (2, 3):
+    try:
+        normalize(*argv[1:])
+    except IOError, e:
+        print "amplify.py: %s" % e
+        exit(1)
 else:
-    print "usage: amplify.py infile outfile"
+    print "usage: amplify.py infile [outfile]"
@@ -0,0 +1,287 @@
+/*
+   Parallel lossless archiving of a capture file.
+
+   The calling thread decodes the frames of a vidfile.c file in order and
+   copies them into a ring of jobs.  A pool of worker threads encodes one
+   frame each with scodec.c, and one writer thread appends them in frame
+   order to a new vidfile.c file of codec VF_SCC, which VideoReader,
+   export_png() and this again read like any other capture file.
+
+   A delta frame is encoded against the original frame before it, which is
+   still in the ring: a job is only filled again once the frame after it,
+   the last one to need its pixels, has been written too.  So the workers
+   never wait for each other and the frames come out exactly as they went
+   in.
+*/
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "vidfile.h"
+#include "scodec.h"
+#include "archive.h"
+
+#define MAX_THREADS	64
+
+#define JOB_FREE	0	/* the producer may fill it */
+#define JOB_QUEUED	1	/* waits for or is with a worker */
+#define JOB_DONE	2	/* waits for the writer */
+
+struct archive_job {
+	int state;
+	int key;
+	unsigned skip;
+	int64_t tstamp;
+	const unsigned char *prev;	/* the frame before, NULL for a key frame */
+	unsigned char *pixels;	/* stride bytes per row */
+	unsigned char *data;	/* encoded */
+	size_t len;
+	int error;		/* errno the encoding failed with */
+};
+
+struct archive {
+	struct vf_writer *w;
+	int width, height, stride, level;
+	struct archive_job *jobs;
+	unsigned njobs;
+	unsigned head;		/* next frame the producer queues */
+	unsigned next;		/* next frame a worker takes */
+	unsigned tail;		/* next frame the writer writes */
+	int quit;		/* nothing more will be queued */
+	int error;		/* first errno the writer hit, ends the archiving */
+	pthread_mutex_t lock;
+	pthread_cond_t work, done, free;
+	struct archive_stats *st;
+};
+
+static void *archive_worker(void *arg)
+{
+	struct archive *a = arg;
+	struct sc_coder *c = sc_coder_new(a->width, a->height, a->stride);
+	struct archive_job *j;
+
+	pthread_mutex_lock(&a->lock);
+	for (;;) {
+		while (a->next == a->head && !a->quit)
+			pthread_cond_wait(&a->work, &a->lock);
+		if (a->next == a->head)
+			break;
+		j = &a->jobs[a->next++ % a->njobs];
+		pthread_mutex_unlock(&a->lock);
+		j->error = 0;
+		if (c == NULL)
+			j->error = ENOMEM;
+		else if ((j->len = sc_encode(c, j->pixels, j->prev, a->level,
+					     j->data)) == 0)
+			j->error = ENOMEM;
+		pthread_mutex_lock(&a->lock);
+		j->state = JOB_DONE;
+		pthread_cond_broadcast(&a->done);
+	}
+	pthread_mutex_unlock(&a->lock);
+	sc_coder_free(c);
+	return NULL;
+}
+
+static int archive_write(struct archive *a, struct archive_job *j)
+{
+	int err;
+
+	if (j->error)
+		return -j->error;
+	err = vf_write(a->w, j->data, j->len, j->skip, j->tstamp,
+		       j->key ? VF_KEY : 0);
+	if (err < 0)
+		return err;
+	a->st->frames++;
+	a->st->keyframes += j->key;
+	a->st->raw += (uint64_t)a->width * 4 * a->height;
+	a->st->bytes += j->len;
+	return 0;
+}
+
+static void *archive_writer(void *arg)
+{
+	struct archive *a = arg;
+	struct archive_job *j;
+	int err;
+
+	pthread_mutex_lock(&a->lock);
+	for (;;) {
+		j = &a->jobs[a->tail % a->njobs];
+		while (a->tail != a->head && j->state != JOB_DONE)
+			pthread_cond_wait(&a->done, &a->lock);
+		if (a->tail == a->head) {
+			if (a->quit)
+				break;
+			pthread_cond_wait(&a->done, &a->lock);
+			continue;
+		}
+		pthread_mutex_unlock(&a->lock);
+		err = a->error ? 0 : archive_write(a, j);
+		pthread_mutex_lock(&a->lock);
+		if (err < 0 && !a->error)
+			a->error = -err;
+		j->state = JOB_FREE;
+		a->tail++;
+		pthread_cond_broadcast(&a->free);
+	}
+	pthread_mutex_unlock(&a->lock);
+	return NULL;
+}
+
+/*
+ * The job for the next frame.  It waits for the writer until the frame
+ * that last had the job and the one after it are both written.
+ */
+static struct archive_job *archive_reserve(struct archive *a)
+{
+	struct archive_job *j;
+
+	pthread_mutex_lock(&a->lock);
+	while (a->head - a->tail >= a->njobs - 1 && !a->error)
+		pthread_cond_wait(&a->free, &a->lock);
+	j = a->error ? NULL : &a->jobs[a->head % a->njobs];
+	pthread_mutex_unlock(&a->lock);
+	return j;
+}
+
+/* hands the job from archive_reserve() to the workers */
+static void archive_submit(struct archive *a, struct archive_job *j)
+{
+	pthread_mutex_lock(&a->lock);
+	j->state = JOB_QUEUED;
+	a->head++;
+	pthread_cond_signal(&a->work);
+	pthread_cond_broadcast(&a->done);
+	pthread_mutex_unlock(&a->lock);
+}
+
+/*
+ * Writes every frame of the capture file "video" losslessly to the new
+ * capture file "archive", with a key frame every "keyint" frames (0 for
+ * every 10 seconds) and the frames between them predicted from the one
+ * before.  "threads" workers encode at zlib "level", 0 threads for one per
+ * CPU.  Returns 0 or -errno, and how it went in *st.
+ */
+int archive_video(const char *video, const char *archive, int threads,
+		  int level, int keyint, struct archive_stats *st)
+{
+	struct archive a;
+	struct archive_job *j;
+	struct vf_reader *r;
+	struct vf_frame f;
+	struct sc_coder *c;
+	pthread_t worker[MAX_THREADS], writer;
+	const unsigned char *pixels;
+	size_t data_max;
+	unsigned i, k, started = 0;
+	int codec, fps, fin, err = 0;
+
+	memset(st, 0, sizeof(*st));
+	r = vf_open(video);
+	if (r == NULL)
+		return -errno;
+	memset(&a, 0, sizeof(a));
+	a.level = level;
+	a.st = st;
+	vf_geometry(r, &a.width, &a.height, &a.stride, &fps, &codec);
+	if (keyint <= 0)
+		keyint = 10 * fps;
+	if (keyint <= 0)
+		keyint = 1;
+	if (threads <= 0)
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads <= 0)
+		threads = 1;
+	if (threads > MAX_THREADS)
+		threads = MAX_THREADS;
+	c = sc_coder_new(a.width, a.height, a.stride);
+	if (c == NULL) {
+		vf_close(r);
+		return -EINVAL;
+	}
+	data_max = sc_bound(c);
+	sc_coder_free(c);
+	a.njobs = 2 * threads + 2;
+	a.jobs = calloc(a.njobs, sizeof(*a.jobs));
+	if (a.jobs == NULL) {
+		vf_close(r);
+		return -ENOMEM;
+	}
+	for (k = 0; k < a.njobs; k++) {
+		a.jobs[k].pixels = malloc((size_t)a.stride * a.height);
+		a.jobs[k].data = malloc(data_max);
+		if (!a.jobs[k].pixels || !a.jobs[k].data) {
+			err = -ENOMEM;
+			goto __free;
+		}
+	}
+	a.w = vf_create(archive, a.width, a.height, a.stride, fps, VF_SCC);
+	if (a.w == NULL) {
+		err = -errno;
+		goto __free;
+	}
+	pthread_mutex_init(&a.lock, NULL);
+	pthread_cond_init(&a.work, NULL);
+	pthread_cond_init(&a.done, NULL);
+	pthread_cond_init(&a.free, NULL);
+	if ((err = -pthread_create(&writer, NULL, archive_writer, &a)) < 0)
+		goto __destroy;
+	for (started = 0; started < (unsigned)threads; started++)
+		if ((err = -pthread_create(&worker[started], NULL,
+					   archive_worker, &a)) < 0)
+			break;
+
+	for (i = 0; i < vf_frames(r) && err == 0; i++) {
+		vf_get_frame(r, i, &f);
+		if (vf_pixels(r, i, &pixels) < 0) {
+			err = -EINVAL;
+			break;
+		}
+		j = archive_reserve(&a);
+		if (j == NULL) {
+			err = -a.error;
+			break;
+		}
+		j->key = i % keyint == 0;
+		/* only the producer moves head */
+		j->prev = j->key ? NULL : a.jobs[(a.head - 1) % a.njobs].pixels;
+		j->skip = f.skip;
+		j->tstamp = f.tstamp;
+		memcpy(j->pixels, pixels, (size_t)a.stride * a.height);
+		archive_submit(&a, j);
+	}
+
+	pthread_mutex_lock(&a.lock);
+	a.quit = 1;
+	pthread_cond_broadcast(&a.work);
+	pthread_cond_broadcast(&a.done);
+	pthread_mutex_unlock(&a.lock);
+	for (k = 0; k < started; k++)
+		pthread_join(worker[k], NULL);
+	pthread_join(writer, NULL);
+	if (err == 0 && a.error)
+		err = -a.error;
+
+      __destroy:
+	pthread_mutex_destroy(&a.lock);
+	pthread_cond_destroy(&a.work);
+	pthread_cond_destroy(&a.done);
+	pthread_cond_destroy(&a.free);
+	fin = vf_finish(a.w);
+	if (err == 0)
+		err = fin;
+      __free:
+	for (k = 0; k < a.njobs; k++) {
+		free(a.jobs[k].pixels);
+		free(a.jobs[k].data);
+	}
+	free(a.jobs);
+	vf_close(r);
+	return err;
+}
@@ -0,0 +1,19 @@
+/*
+   Parallel lossless archiving of a capture file, see archive.c.
+*/
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include <stdint.h>
+
+struct archive_stats {
+	unsigned frames;	/* frames written */
+	unsigned keyframes;	/* of those, key frames */
+	uint64_t raw;		/* bytes of pixels they hold */
+	uint64_t bytes;		/* bytes they were encoded to */
+};
+
+int archive_video(const char *video, const char *archive, int threads,
+		  int level, int keyint, struct archive_stats *st);
+
+#endif
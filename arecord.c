@@ -23,9 +23,30 @@
 #include <sys/time.h>
 #include <sys/signal.h>
 #include <asm/byteorder.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <semaphore.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING 1
+#endif
+#endif
 
 #include <libintl.h>
 
+#include "meter.h"
+#include "agc.h"
+#include "flac.h"
+#include "planar.h"
+#include "capture.h"
+#include "tap.h"
+
 #include <endian.h>
 #include <byteswap.h>
 
@@ -35,12 +56,14 @@
 #define COMPOSE_ID(a,b,c,d)	((a) | ((b)<<8) | ((c)<<16) | ((d)<<24))
 #define LE_SHORT(v)		(v)
 #define LE_INT(v)		(v)
+#define LE_LONG(v)		(v)
 #define BE_SHORT(v)		bswap_16(v)
 #define BE_INT(v)		bswap_32(v)
 #elif __BYTE_ORDER == __BIG_ENDIAN
 #define COMPOSE_ID(a,b,c,d)	((d) | ((c)<<8) | ((b)<<16) | ((a)<<24))
 #define LE_SHORT(v)		bswap_16(v)
 #define LE_INT(v)		bswap_32(v)
+#define LE_LONG(v)		bswap_64(v)
 #define BE_SHORT(v)		(v)
 #define BE_INT(v)		(v)
 #else
@@ -51,6 +74,9 @@
 #define WAV_WAVE		COMPOSE_ID('W','A','V','E')
 #define WAV_FMT			COMPOSE_ID('f','m','t',' ')
 #define WAV_DATA		COMPOSE_ID('d','a','t','a')
+#define WAV_RF64		COMPOSE_ID('R','F','6','4')
+#define WAV_DS64		COMPOSE_ID('d','s','6','4')
+#define WAV_JUNK		COMPOSE_ID('J','U','N','K')
 
 /* WAVE fmt block constants from Microsoft mmreg.h header */
 #define WAV_FMT_PCM             0x0001
@@ -80,6 +106,94 @@ typedef struct {
 	u_int length;		/* samplecount */
 } WaveChunkHeader;
 
+/*
+ * RF64 (EBU Tech 3306): a WAVE file whose 32 bit RIFF and data lengths are
+ * 0xffffffff, the real ones being in the ds64 chunk right after the header.
+ * A file that ends up small enough is turned back into a plain WAVE file,
+ * the ds64 chunk into a JUNK chunk.
+ */
+typedef struct {
+	u_int type;		/* 'ds64' or 'JUNK' */
+	u_int length;		/* 28 */
+	u_int64_t riff_length;
+	u_int64_t data_length;
+	u_int64_t frames;
+	u_int table_length;	/* no other chunk needs 64 bits */
+} __attribute__((packed)) Ds64Chunk;
+
+typedef struct {
+	WaveHeader h;		/* 'RF64' or 'RIFF' */
+	Ds64Chunk ds;
+	WaveChunkHeader cf;
+	WaveFmtBody f;
+	WaveChunkHeader cd;
+} __attribute__((packed)) Rf64Header;
+
+/*
+ * Sony Wave64: the chunks of a WAVE file with 16 byte GUIDs for ids and
+ * 64 bit lengths that count the chunk header too, every chunk 8 byte
+ * aligned.
+ */
+typedef struct {
+	u_char guid[16];
+	u_int64_t length;
+} __attribute__((packed)) W64ChunkHeader;
+
+typedef struct {
+	W64ChunkHeader riff;
+	u_char wave[16];
+	W64ChunkHeader cf;
+	WaveFmtBody f;
+	W64ChunkHeader cd;
+} __attribute__((packed)) W64Header;
+
+static const u_char w64_riff[16] = {
+	'r', 'i', 'f', 'f', 0x2e, 0x91, 0xcf, 0x11,
+	0xa5, 0xd6, 0x28, 0xdb, 0x04, 0xc1, 0x00, 0x00
+};
+static const u_char w64_wave[16] = {
+	'w', 'a', 'v', 'e', 0xf3, 0xac, 0xd3, 0x11,
+	0x8c, 0xd1, 0x00, 0xc0, 0x4f, 0x8e, 0xdb, 0x8a
+};
+static const u_char w64_fmt[16] = {
+	'f', 'm', 't', ' ', 0xf3, 0xac, 0xd3, 0x11,
+	0x8c, 0xd1, 0x00, 0xc0, 0x4f, 0x8e, 0xdb, 0x8a
+};
+static const u_char w64_data[16] = {
+	'd', 'a', 't', 'a', 0xf3, 0xac, 0xd3, 0x11,
+	0x8c, 0xd1, 0x00, 0xc0, 0x4f, 0x8e, 0xdb, 0x8a
+};
+
+/*
+ * Timestamp index: "<file>.tidx" next to an output file, a header and then
+ * a record per period saying when the hardware captured which frame of the
+ * file, so that other streams (the video) can be mapped onto the audio
+ * timeline.  All little endian, times in ns of the clock in the header.
+ */
+#define TIDX_MAGIC		COMPOSE_ID('T','I','D','X')
+#define TIDX_VERSION		1
+#define TIDX_CLOCK_REALTIME	0
+#define TIDX_CLOCK_MONOTONIC	1
+#define TIDX_START		1	/* tstamp is the trigger of a (re)start */
+
+typedef struct {
+	u_int magic;		/* 'TIDX' */
+	u_int version;
+	u_int rate;
+	u_int channels;
+	u_int clock;		/* TIDX_CLOCK_* */
+	u_int record_size;	/* sizeof(TidxRecord) */
+	u_int reserved[2];
+} TidxHeader;
+
+typedef struct {
+	u_int64_t frame;	/* frame of the file captured at tstamp */
+	int64_t tstamp;		/* snd_pcm_htimestamp() */
+	int64_t status_tstamp;	/* snd_pcm_status() time of the same period */
+	u_int avail;		/* frames waiting in the buffer at tstamp */
+	u_int flags;		/* TIDX_* */
+} TidxRecord;
+
 #define _(msgid) gettext (msgid)
 #define gettext_noop(msgid) msgid
 #define N_(msgid) gettext_noop (msgid)
@@ -96,13 +210,25 @@ typedef struct {
 #define FORMAT_VOC		1
 #define FORMAT_WAVE		2
 #define FORMAT_AU		3
+#define FORMAT_RF64		4
+#define FORMAT_W64		5
+#define FORMAT_FLAC		6
 
-/* global data */
+/*
+ * Planar capture: snd_pcm_readn() reads a period into a buffer per channel,
+ * which is metered channel by channel and either interleaved into one file
+ * as it is handed on (planar.c) or written to one mono file per channel,
+ * "name-chNN.ext", the buffers as they are.
+ */
+#define PLANAR_OFF		0	/* snd_pcm_readi(), interleaved throughout */
+#define PLANAR_INTERLEAVE	1	/* planar in memory, one interleaved file */
+#define PLANAR_SPLIT		2	/* a mono file per channel */
+
+/* the header of a file that grows without bounds is brought up to date
+   every this many seconds of data, so that a crash leaves a readable file */
+#define HEADER_UPDATE_TIME	10
 
-static snd_pcm_sframes_t (*readi_func)(snd_pcm_t *handle, void *buffer, snd_pcm_uframes_t size);
-static snd_pcm_sframes_t (*writei_func)(snd_pcm_t *handle, const void *buffer, snd_pcm_uframes_t size);
-static snd_pcm_sframes_t (*readn_func)(snd_pcm_t *handle, void **bufs, snd_pcm_uframes_t size);
-static snd_pcm_sframes_t (*writen_func)(snd_pcm_t *handle, void **bufs, snd_pcm_uframes_t size);
+/* global data */
 
 enum {
 	VUMETER_NONE,
@@ -110,58 +236,323 @@ enum {
 	VUMETER_STEREO
 };
 
-static char *command;
-static snd_pcm_t *handle;
-static struct {
-	snd_pcm_format_t format;
-	unsigned int channels;
-	unsigned int rate;
-} hwparams, rhwparams;
-static int timelimit = 0;
-static int quiet_mode = 0;
-static int file_type = FORMAT_DEFAULT;
-static int open_mode = 0;
-static int capture_stop = 0;
-static snd_pcm_stream_t stream = SND_PCM_STREAM_PLAYBACK;
-static int interleaved = 1;
-static int nonblock = 0;
-static u_char *audiobuf = NULL;
-static snd_pcm_uframes_t chunk_size = 0;
-static unsigned period_time = 0;
-static unsigned buffer_time = 0;
-static snd_pcm_uframes_t period_frames = 0;
-static snd_pcm_uframes_t buffer_frames = 0;
-static int avail_min = -1;
-static int start_delay = 0;
-static int stop_delay = 0;
-static int verbose = 0;
-static int vumeter = VUMETER_NONE;
-static int buffer_pos = 0;
-static size_t bits_per_sample, bits_per_frame;
-static size_t chunk_bytes;
-static snd_output_t *log;
-
-static int fd = -1;
-static off64_t pbrec_count = LLONG_MAX, fdcount;
-static int vocmajor, vocminor;
+static char *command = "arecord";
 
-/* needed prototypes */
+/*
+ * Capture ring: when ring_chunks > 0 the PCM thread only fills preallocated
+ * chunk_bytes slots and a writer thread drains them to fd, so a slow write()
+ * no longer holds up snd_pcm_readi().  Single producer (capture thread),
+ * single consumer (writer thread); head and tail are each written by one side
+ * only, the semaphores are used just to sleep when the ring is empty/full.
+ */
+#define RING_DRAIN	((size_t)0)
+#define RING_QUIT	((size_t)-1)
+
+struct capture_ring {
+	u_char *buf;		/* slots * chunk_bytes */
+	size_t *len;		/* bytes in each slot, or RING_DRAIN/RING_QUIT */
+	int *fd;		/* the file each slot goes to */
+	int **chfd;		/* and its channel files, with PLANAR_SPLIT */
+	unsigned slots;
+	unsigned head;		/* next slot to fill, owned by the capture thread */
+	unsigned tail;		/* next slot to write, owned by the writer thread */
+	int reserved;		/* capture thread holds the slot at head */
+	int running;		/* writer thread is up */
+	unsigned high_water;	/* most slots ever queued at once */
+	unsigned long stalls;	/* times the capture thread found the ring full */
+	sem_t filled, free, drained;
+	pthread_t writer;
+};
+
+/*
+ * File rotation: a capture is split into files at max_filesize, or every
+ * rotate_time seconds.  The rotation thread sets up the next file (opened,
+ * preallocated, header, index and gain curve files written) while the
+ * current one is still being filled, and finishes the previous one (header
+ * completed, closed, the first one renamed to "-01") once it is all written,
+ * so the capture thread just swaps descriptors at the frame where a file
+ * ends.  The ring writer follows the swap by the file every slot is tagged
+ * with.
+ */
+#define ROTATE_FILES		4	/* full files the rotation thread may lag behind */
+#define ROTATE_PREALLOC		(64LL << 20)
+
+struct capture_file {
+	int fd;
+	FILE *tidx;		/* "<name>.tidx" or NULL */
+	FILE *gain;		/* "<name>.gain" or NULL */
+	int index;		/* 1 for the first file */
+	off64_t rest;		/* data bytes it is set up for */
+	off64_t bytes;		/* data bytes written to it */
+	off64_t tl_file;	/* tl_frames where it begins */
+	int err;		/* errno if it could not be set up */
+	int *chfd;		/* PLANAR_SPLIT's channel files, chfd[0] == fd */
+	char name[PATH_MAX+1];
+};
+
+struct capture_rotation {
+	struct capture_file cur;	/* owned by the capture thread */
+	struct capture_file next;	/* owned by the rotation thread until ready */
+	struct capture_file done[ROTATE_FILES];	/* full, to be finished */
+	unsigned head, tail;	/* of done */
+	unsigned flushed;	/* done[] before this one are all written */
+	int want;		/* set up "next" */
+	int ready;		/* "next" is set up, or failed with next.err */
+	int quit;
+	int running;		/* rotation thread is up */
+	unsigned long stalls;	/* times the capture thread waited for "next" */
+	char *orig_name;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t thread;
+};
+
+/*
+ * Output sinks: how the captured data gets from the capture (or writer)
+ * thread into fd.  The fmt_rec_table start hook writes its header first,
+ * then the sink is opened at the current file offset and takes over the data
+ * until it is closed right before the end hook rewrites the header.
+ */
+#define SINK_WRITE		0	/* one write() per period */
+#define SINK_BATCH		1	/* preallocated, batched io_uring/pwritev */
+#define SINK_FLAC		2	/* FLAC frames, encoded by flac.c's threads */
+#define SINK_SPLIT		3	/* every channel to its own file */
+
+#define BATCH_BUFFERS		2	/* one filling while the other is written */
+#define PREALLOC_BYTES		(64LL << 20)
+
+#ifdef HAVE_IO_URING
+struct uring {
+	int fd;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ptr, *cq_ptr;
+	size_t sq_size, cq_size, sqes_size;
+};
+#endif
+
+struct batch_sink {
+	u_char *buf[BATCH_BUFFERS];
+	size_t size;		/* bytes per buffer */
+	size_t fill;		/* bytes in buf[cur] */
+	int cur;
+	int busy[BATCH_BUFFERS];	/* submitted, not completed yet */
+	size_t busy_len[BATCH_BUFFERS];
+	off64_t busy_pos[BATCH_BUFFERS];
+	struct iovec iov[BATCH_BUFFERS];
+	off64_t pos;		/* file offset of buf[cur] */
+	off64_t start;		/* of the data, where the sink was opened */
+	off64_t allocated;	/* preallocated up to here, -1 if unsupported */
+#ifdef HAVE_IO_URING
+	struct uring ring;
+	int have_ring;
+#endif
+};
+
+/*
+ * All the state of one capture, so that a process can run any number of
+ * them at once, each from its own thread.  capture_stop is the only field
+ * that other threads touch (through capture_ctx_stop()), always atomically,
+ * and stop_fd the only file, to wake the capture thread out of poll().
+ */
+struct capture_group;
+
+struct capture_ctx {
+	snd_pcm_sframes_t (*readi_func)(snd_pcm_t *handle, void *buffer, snd_pcm_uframes_t size);
+	snd_pcm_sframes_t (*writei_func)(snd_pcm_t *handle, const void *buffer, snd_pcm_uframes_t size);
+	snd_pcm_sframes_t (*readn_func)(snd_pcm_t *handle, void **bufs, snd_pcm_uframes_t size);
+	snd_pcm_sframes_t (*writen_func)(snd_pcm_t *handle, void **bufs, snd_pcm_uframes_t size);
+
+	char *pcm_name;
+	snd_pcm_t *handle;
+	struct {
+		snd_pcm_format_t format;
+		unsigned int channels;
+		unsigned int rate;
+	} hwparams, rhwparams;
+	int timelimit;
+	unsigned rotate_time;	/* seconds per file, 0 splits at max_filesize only */
+	int quiet_mode;
+	int file_type;
+	int open_mode;
+	int capture_stop;
+	int stop_fd;		/* eventfd, readable once capture_stop is set */
+	struct pollfd *pfd;	/* the PCM's descriptors, then stop_fd */
+	unsigned int npfd;	/* of the PCM */
+	snd_pcm_stream_t stream;
+	int interleaved;
+	int planar;		/* PLANAR_*, interleaved is !planar */
+	unsigned file_channels;	/* channels per file, 1 with PLANAR_SPLIT */
+	u_char *planes;		/* PLANAR_INTERLEAVE's period, channel by channel */
+	void **plane_bufs;	/* snd_pcm_readn()'s pointers into them */
+	int nonblock;
+	int mmap_flag;
+	u_char *audiobuf;
+	snd_pcm_uframes_t chunk_size;
+	unsigned period_time;
+	unsigned buffer_time;
+	snd_pcm_uframes_t period_frames;
+	snd_pcm_uframes_t buffer_frames;
+	int avail_min;
+	int start_delay;
+	int stop_delay;
+	struct capture_config negotiated;	/* by set_params() ... */
+	int negotiated_set;	/* ... once this is set */
+	int verbose;
+	int vumeter;
+	int meter;		/* keep per-channel levels */
+	int meter_fmt;		/* METER_* of hwparams.format */
+	float *meter_peak;	/* per channel, of the last read */
+	double *meter_sumsq;
+	size_t meter_frames;
+	int meter_warned;	/* unsupported format reported */
+	int agc;		/* level the periods with agc_process() */
+	double agc_target;	/* dBFS RMS */
+	double agc_max_gain;	/* dB */
+	struct agc *agc_dsp;	/* for the current hwparams, or NULL */
+	FILE *agc_log;		/* "<file>.gain", the gain curve */
+	int maxperc[2];		/* VU meter peak hold ... */
+	time_t maxperc_time;	/* ... of this second */
+	size_t bits_per_sample, bits_per_frame;
+	size_t chunk_bytes;
+	snd_output_t *log;
+
+	int fd;
+	int *chfd;		/* PLANAR_SPLIT: the current file's channel files */
+	int *split_fd;		/* those the sink writes to */
+	off64_t pbrec_count, fdcount;
+	off64_t header_every;	/* see HEADER_UPDATE_TIME, 0 for none */
+	off64_t written;	/* of the current file, by the thread writing it */
+	off64_t header_due;	/* the header is updated once written is here */
+
+	unsigned ring_chunks;
+	struct capture_ring ring;
+
+	int sink_type;
+	unsigned batch_periods;
+	struct batch_sink batch;
+	struct flac_encoder *flac;	/* SINK_FLAC's, of the open file */
+	struct tap *tap;	/* live copy of the periods, the caller's, or NULL */
+
+	struct capture_rotation rot;
+
+	struct capture_group *group;	/* multi-device capture, or NULL */
+	int group_index;
+	int group_state;	/* GROUP_* */
+	int group_linked;	/* started by the group's trigger */
+	int tindex;		/* write a timestamp index per file */
+	FILE *tidx;
+	int tstamp_clock;	/* TIDX_CLOCK_* of the PCM's timestamps */
+	off64_t tl_file;	/* tl_frames where the current file begins */
+	int tl_restart;		/* (re)started, log the trigger */
+	off64_t tl_frames;	/* frames captured since the start */
+	off64_t tl_start;	/* tl_frames at the last (re)start */
+
+	jmp_buf fail;		/* fatal errors return from capture_ctx_run() */
+	int write_error;	/* errno of a failed write in the writer thread */
+	void (*write_hook)(void *arg, size_t count);	/* see bench.c */
+	void *write_hook_arg;
+};
+
+/*
+ * Multi-device capture: every member of a group reads its own PCM into its
+ * own file from its own thread, but they all wait for each other once set
+ * up, so that their PCMs can be linked and started by a single trigger where
+ * the driver allows it.  Either way, every member logs a hardware timestamp
+ * per period to the shared timeline, which maps the frames of all the files
+ * onto one clock.
+ */
+#define GROUP_SETUP	0	/* not at the meeting point yet */
+#define GROUP_READY	1	/* PCM set up, can be linked */
+#define GROUP_FAILED	2	/* gave up before the start */
+#define GROUP_SYNCED	3
+
+struct capture_group {
+	int n;
+	struct capture_ctx **ctx;
+	char **filename;
+	int *ret;
+	pthread_barrier_t ready;	/* all members set up (or failed) */
+	pthread_barrier_t go;		/* linked, off they go */
+	pthread_mutex_t lock;		/* timeline */
+	FILE *timeline;
+};
 
-static void capture(char *filename);
+/* give up on the capture, capture_ctx_run() cleans up */
+#define fatal(ctx)	longjmp((ctx)->fail, 1)
+
+/* needed prototypes */
 
-static void begin_wave(int fd, size_t count);
-static void end_wave(int fd);
+static void capture(struct capture_ctx *ctx, char *filename);
+static void sink_write(struct capture_ctx *ctx, u_char *data, size_t count, char *name);
+static void ring_stop(struct capture_ctx *ctx);
+static void group_sync(struct capture_ctx *ctx, int state);
+static void tidx_close(struct capture_ctx *ctx, char *name);
+static void gain_close(struct capture_ctx *ctx, char *name);
+static void rotate_stop(struct capture_ctx *ctx);
+static void rotate_flushed(struct capture_ctx *ctx);
+static void file_end(struct capture_ctx *ctx, int fd, int *chfd, off64_t bytes);
+static void batch_release(struct capture_ctx *ctx);
+static unsigned int file_count(struct capture_ctx *ctx);
+static void end_raw(struct capture_ctx *ctx, int fd, off64_t bytes);
+static int begin_wave(struct capture_ctx *ctx, int fd, size_t count);
+static void end_wave(struct capture_ctx *ctx, int fd, off64_t bytes);
+static int begin_rf64(struct capture_ctx *ctx, int fd, size_t count);
+static void update_rf64(struct capture_ctx *ctx, int fd, off64_t bytes);
+static void end_rf64(struct capture_ctx *ctx, int fd, off64_t bytes);
+static int begin_w64(struct capture_ctx *ctx, int fd, size_t count);
+static void update_w64(struct capture_ctx *ctx, int fd, off64_t bytes);
+static void end_w64(struct capture_ctx *ctx, int fd, off64_t bytes);
+static int begin_flac(struct capture_ctx *ctx, int fd, size_t count);
+static void end_flac(struct capture_ctx *ctx, int fd, off64_t bytes);
 
+/*
+ * start writes the header for count bytes of data, -1 with errno if it
+ * could not; update, if any, rewrites it for the data so far; end completes
+ * it for the bytes written and closes fd.  The rotation thread calls them
+ * for every file but the first.
+ */
 struct fmt_capture {
-	void (*start) (int fd, size_t count);
-	void (*end) (int fd);
+	int (*start) (struct capture_ctx *ctx, int fd, size_t count);
+	void (*update) (struct capture_ctx *ctx, int fd, off64_t bytes);
+	void (*end) (struct capture_ctx *ctx, int fd, off64_t bytes);
 	char *what;
 	long long max_filesize;
 } fmt_rec_table[] = {
-	{	NULL,		NULL,		N_("raw data"),		LLONG_MAX },
-	{	NULL,	NULL,	N_("VOC"),		16000000LL },
-	{	begin_wave,	end_wave,	N_("WAVE"),		2147483648LL },
-	{	NULL,	NULL,		N_("Sparc Audio"),	LLONG_MAX }
+	{	NULL,		NULL,		end_raw,	N_("raw data"),		LLONG_MAX },
+	{	NULL,		NULL,		NULL,		N_("VOC"),		16000000LL },
+	{	begin_wave,	NULL,		end_wave,	N_("WAVE"),		2147483648LL },
+	{	NULL,		NULL,		NULL,		N_("Sparc Audio"),	LLONG_MAX },
+	{	begin_rf64,	update_rf64,	end_rf64,	N_("RF64"),		LLONG_MAX },
+	{	begin_w64,	update_w64,	end_w64,	N_("Wave64"),		LLONG_MAX },
+	{	begin_flac,	NULL,		end_flac,	N_("FLAC"),		LLONG_MAX },
+};
+
+static int write_sink_write(struct capture_ctx *ctx, int fd, u_char *data, size_t count);
+static int batch_open(struct capture_ctx *ctx, int fd);
+static int batch_write(struct capture_ctx *ctx, int fd, u_char *data, size_t count);
+static int batch_close(struct capture_ctx *ctx, int fd);
+static off64_t batch_written(struct capture_ctx *ctx);
+static int flac_open(struct capture_ctx *ctx, int fd);
+static int flac_sink_write(struct capture_ctx *ctx, int fd, u_char *data, size_t count);
+static int flac_sink_close(struct capture_ctx *ctx, int fd);
+static int split_write(struct capture_ctx *ctx, int fd, u_char *data, size_t count);
+
+struct sink {
+	/* by the thread that writes, so it fails with -1 and errno */
+	int (*open) (struct capture_ctx *ctx, int fd);
+	int (*write) (struct capture_ctx *ctx, int fd, u_char *data, size_t count);
+	int (*close) (struct capture_ctx *ctx, int fd);
+	/* bytes in the file so far, NULL if write() writes them right away */
+	off64_t (*written) (struct capture_ctx *ctx);
+	char *what;
+} sink_table[] = {
+	{	NULL,		write_sink_write,	NULL,		NULL,		N_("write") },
+	{	batch_open,	batch_write,		batch_close,	batch_written,	N_("batched") },
+	{	flac_open,	flac_sink_write,	flac_sink_close, NULL,		N_("FLAC") },
+	{	NULL,		split_write,		NULL,		NULL,		N_("per channel") },
 };
 
 #if __GNUC__ > 2 || (__GNUC__ == 2 && __GNUC_MINOR__ >= 95)
@@ -182,30 +573,6 @@ static void version(void)
 {
 }
 
-static void signal_handler(int sig)
-{
-	if (verbose==2)
-		putchar('\n');
-	if (!quiet_mode)
-		fprintf(stderr, _("Aborted by signal %s...\n"), strsignal(sig));
-	if (stream == SND_PCM_STREAM_CAPTURE) {
-		if (fmt_rec_table[file_type].end) {
-			fmt_rec_table[file_type].end(fd);
-			fd = -1;
-		}
-		stream = -1;
-	}
-	if (fd > 1) {
-		close(fd);
-		fd = -1;
-	}
-	if (handle && sig != SIGABRT) {
-		snd_pcm_close(handle);
-		handle = NULL;
-	}
-	exit(EXIT_FAILURE);
-}
-
 enum {
 	OPT_VERSION = 1,
 	OPT_PERIOD_SIZE,
@@ -217,166 +584,584 @@ enum {
 	OPT_TEST_POSITION
 };
 
-int main()
+/* a new capture with the defaults: 44.1 kHz stereo S16_LE wav */
+struct capture_ctx *capture_ctx_create(void)
+{
+	struct capture_ctx *ctx;
+
+	ctx = calloc(1, sizeof(*ctx));
+	if (ctx == NULL) {
+		error(_("not enough memory"));
+		return NULL;
+	}
+	ctx->stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (ctx->stop_fd == -1) {
+		error(_("cannot create stop event: %s"), strerror(errno));
+		free(ctx);
+		return NULL;
+	}
+	ctx->stream = SND_PCM_STREAM_CAPTURE;
+	ctx->file_type = FORMAT_WAVE;
+	ctx->interleaved = 1;
+	/* reads never block, pcm_wait() polls for the PCM and the stop */
+	ctx->nonblock = 1;
+	ctx->avail_min = -1;
+	ctx->start_delay = 1;
+	ctx->vumeter = VUMETER_NONE;
+	ctx->meter_fmt = -1;
+	ctx->fd = -1;
+	ctx->pbrec_count = LLONG_MAX;
+	ctx->sink_type = SINK_WRITE;
+	ctx->batch_periods = 16;
+
+	// cdr:
+	// rhwparams.format = SND_PCM_FORMAT_S16_BE;
+	ctx->rhwparams.format = ctx->file_type == FORMAT_AU ? SND_PCM_FORMAT_S16_BE : SND_PCM_FORMAT_S16_LE;
+	ctx->rhwparams.rate = 44100;
+	ctx->rhwparams.channels = 2;
+
+	ctx->writei_func = snd_pcm_writei;
+	ctx->readi_func = snd_pcm_readi;
+	ctx->writen_func = snd_pcm_writen;
+	ctx->readn_func = snd_pcm_readn;
+	return ctx;
+}
+
+void capture_ctx_destroy(struct capture_ctx *ctx)
 {
-    run("b.wav");
-    return 0;
+	int i;
+
+	if (ctx == NULL)
+		return;
+	free(ctx->pcm_name);
+	free(ctx->audiobuf);
+	free(ctx->planes);
+	free(ctx->plane_bufs);
+	free(ctx->ring.buf);
+	free(ctx->ring.len);
+	free(ctx->ring.fd);
+	free(ctx->ring.chfd);
+	free(ctx->meter_peak);
+	free(ctx->meter_sumsq);
+	agc_free(ctx->agc_dsp);
+	for (i = 0; i < BATCH_BUFFERS; i++)
+		free(ctx->batch.buf[i]);
+	free(ctx->pfd);
+	close(ctx->stop_fd);
+	free(ctx);
 }
 
-void stop()
+/*
+ * end capture_ctx_run(), safe to call from any thread, also before the run;
+ * the capture thread wakes up at once, the frames read so far are written
+ */
+void capture_ctx_stop(struct capture_ctx *ctx)
 {
-    capture_stop = 1;
+	uint64_t one = 1;
+
+	__atomic_store_n(&ctx->capture_stop, 1, __ATOMIC_RELEASE);
+	if (write(ctx->stop_fd, &one, sizeof(one)) < 0) {
+		/* the counter is full, it is readable anyway */
+	}
 }
 
-int run(char *filename)
+static int capture_stopped(struct capture_ctx *ctx)
 {
-    capture_stop = 0;
-	char *pcm_name = "default";
-	int tmp, err;
-	snd_pcm_info_t *info;
+	return __atomic_load_n(&ctx->capture_stop, __ATOMIC_ACQUIRE);
+}
 
-	snd_pcm_info_alloca(&info);
+/* ALSA PCM to capture from, NULL for "default" */
+int capture_ctx_set_device(struct capture_ctx *ctx, const char *name)
+{
+	char *s = NULL;
 
-	err = snd_output_stdio_attach(&log, stderr, 0);
-	assert(err >= 0);
+	if (name && (s = strdup(name)) == NULL)
+		return -ENOMEM;
+	free(ctx->pcm_name);
+	ctx->pcm_name = s;
+	return 0;
+}
+
+/* the preset configurations, see capture.h */
+void capture_config_preset(struct capture_config *cfg, int preset)
+{
+	memset(cfg, 0, sizeof(*cfg));
+	cfg->rate = 44100;
+	cfg->format = SND_PCM_FORMAT_S16_LE;
+	cfg->channels = 2;
+	cfg->avail_min = -1;
+	cfg->start_delay = 1;
+	switch (preset) {
+	case CAPTURE_PRESET_LOW_LATENCY:
+		/* 200 wakeups a second, a sink that stalls for 15 ms overruns */
+		cfg->period_time = 5000;
+		cfg->buffer_time = 20000;
+		break;
+	case CAPTURE_PRESET_LOW_WAKEUP:
+		/* 2 wakeups a second, the writes in half second chunks */
+		cfg->period_time = 500000;
+		cfg->buffer_time = 2000000;
+		break;
+	}
+}
+
+/*
+ * Device, sample format and latency of the next run; a NULL device keeps
+ * the current one.  -EINVAL for a configuration no device could have.
+ */
+int capture_ctx_set_config(struct capture_ctx *ctx,
+			   const struct capture_config *cfg)
+{
+	if (cfg->rate == 0 || cfg->channels == 0 ||
+	    snd_pcm_format_physical_width(cfg->format) <= 0)
+		return -EINVAL;
+	if (cfg->device && capture_ctx_set_device(ctx, cfg->device) < 0)
+		return -ENOMEM;
+	ctx->rhwparams.rate = cfg->rate;
+	ctx->rhwparams.format = cfg->format;
+	ctx->rhwparams.channels = cfg->channels;
+	ctx->period_time = cfg->period_time;
+	ctx->buffer_time = cfg->buffer_time;
+	ctx->period_frames = cfg->period_frames;
+	ctx->buffer_frames = cfg->buffer_frames;
+	ctx->avail_min = cfg->avail_min;
+	ctx->start_delay = cfg->start_delay;
+	ctx->stop_delay = cfg->stop_delay;
+	return 0;
+}
+
+/*
+ * What the device came to in the current or last run, -ENODATA before it
+ * was set up.  cfg->device points into ctx until the device changes.
+ */
+int capture_ctx_get_config(struct capture_ctx *ctx, struct capture_config *cfg)
+{
+	if (!__atomic_load_n(&ctx->negotiated_set, __ATOMIC_ACQUIRE))
+		return -ENODATA;
+	*cfg = ctx->negotiated;
+	return 0;
+}
 
-	file_type = FORMAT_DEFAULT;
-    stream = SND_PCM_STREAM_CAPTURE;
-    file_type = FORMAT_WAVE;
-    command = "arecord";
-    start_delay = 1;
+/* number of chunks in the capture ring, 0 writes from the capture thread */
+void capture_ctx_set_ring_chunks(struct capture_ctx *ctx, int chunks)
+{
+	ctx->ring_chunks = chunks > 0 ? chunks : 0;
+}
 
-	chunk_size = -1;
-	rhwparams.format = DEFAULT_FORMAT;
-	rhwparams.rate = DEFAULT_SPEED;
-	rhwparams.channels = 1;
+unsigned capture_ctx_ring_high_water(struct capture_ctx *ctx)
+{
+	return ctx->ring.high_water;
+}
 
-    file_type = FORMAT_WAVE;
+/* SINK_WRITE or SINK_BATCH; periods is the number of periods per batch */
+void capture_ctx_set_sink(struct capture_ctx *ctx, int type, int periods)
+{
+	ctx->sink_type = (type == SINK_BATCH) ? SINK_BATCH : SINK_WRITE;
+	if (periods > 0)
+		ctx->batch_periods = periods;
+}
 
-    // cdr:
-    // rhwparams.format = SND_PCM_FORMAT_S16_BE;
-    rhwparams.format = file_type == FORMAT_AU ? SND_PCM_FORMAT_S16_BE : SND_PCM_FORMAT_S16_LE;
-    rhwparams.rate = 44100;
-    rhwparams.channels = 2;
+/* write "<file>.tidx" with the hardware timestamp of every period */
+void capture_ctx_set_tindex(struct capture_ctx *ctx, int enable)
+{
+	ctx->tindex = enable;
+}
 
-	err = snd_pcm_open(&handle, pcm_name, stream, open_mode);
-	if (err < 0) {
-		error(_("audio open error: %s"), snd_strerror(err));
-		return 1;
+/*
+ * FORMAT_RAW, FORMAT_WAVE (split at 2 GiB), FORMAT_RF64, FORMAT_W64 or
+ * FORMAT_FLAC (compressed as it is captured, whatever the sink)
+ */
+void capture_ctx_set_file_type(struct capture_ctx *ctx, int type)
+{
+	switch (type) {
+	case FORMAT_RAW:
+	case FORMAT_RF64:
+	case FORMAT_W64:
+	case FORMAT_FLAC:
+		ctx->file_type = type;
+		break;
+	default:
+		ctx->file_type = FORMAT_WAVE;
 	}
+}
 
-	if ((err = snd_pcm_info(handle, info)) < 0) {
-		error(_("info error: %s"), snd_strerror(err));
-		return 1;
+/* start a new file every "seconds" (0 only when a file is full) */
+void capture_ctx_set_rotate(struct capture_ctx *ctx, unsigned seconds)
+{
+	ctx->rotate_time = seconds;
+}
+
+/* measure per-channel peak and RMS of everything captured */
+void capture_ctx_set_meter(struct capture_ctx *ctx, int enable)
+{
+	ctx->meter = enable;
+}
+
+/*
+ * level what is captured to "target" dBFS RMS, with up to "max_gain" dB,
+ * before it is written, and write the gain curve to "<file>.gain"
+ */
+void capture_ctx_set_agc(struct capture_ctx *ctx, int enable, double target,
+			 double max_gain)
+{
+	ctx->agc = enable;
+	ctx->agc_target = target;
+	ctx->agc_max_gain = max_gain;
+}
+
+/* peak and RMS (full scale = 1.0) of the last period, returns channels */
+int capture_ctx_get_levels(struct capture_ctx *ctx, float *peak, float *rms,
+			   int n)
+{
+	if (!ctx->meter_peak)
+		return 0;
+	if (n > (int)ctx->hwparams.channels)
+		n = ctx->hwparams.channels;
+	memcpy(peak, ctx->meter_peak, n * sizeof(*peak));
+	meter_rms(ctx->meter_sumsq, ctx->meter_frames, n, rms);
+	return ctx->hwparams.channels;
+}
+
+/* channels to capture, 2 unless set */
+void capture_ctx_set_channels(struct capture_ctx *ctx, unsigned channels)
+{
+	if (channels > 0)
+		ctx->rhwparams.channels = channels;
+}
+
+/*
+ * PLANAR_OFF, PLANAR_INTERLEAVE or PLANAR_SPLIT (no AGC, no FLAC and not to
+ * stdout); either planar mode reads with snd_pcm_readn() and leaves mmap
+ * alone
+ */
+void capture_ctx_set_planar(struct capture_ctx *ctx, int mode)
+{
+	ctx->planar = (mode == PLANAR_INTERLEAVE || mode == PLANAR_SPLIT) ?
+		      mode : PLANAR_OFF;
+	ctx->interleaved = ctx->planar == PLANAR_OFF;
+}
+
+/* capture through the mmap'ed DMA buffer instead of snd_pcm_readi() */
+void capture_ctx_set_mmap(struct capture_ctx *ctx, int enable)
+{
+	ctx->mmap_flag = enable;
+}
+
+/*
+ * also copy every period into the tap t (NULL for none), see tap.c; the
+ * caller keeps it until it is taken away again, only between runs.  The
+ * one it replaces is ended.
+ */
+void capture_ctx_set_tap(struct capture_ctx *ctx, struct tap *t)
+{
+	if (ctx->tap && ctx->tap != t)
+		tap_end(ctx->tap);
+	ctx->tap = t;
+}
+
+/* read through fn instead of snd_pcm_readi(), NULL for ALSA's; see bench.c */
+void capture_ctx_set_readi(struct capture_ctx *ctx,
+			   snd_pcm_sframes_t (*fn)(snd_pcm_t *handle,
+						   void *buffer,
+						   snd_pcm_uframes_t size))
+{
+	ctx->readi_func = fn ? fn : snd_pcm_readi;
+}
+
+/*
+ * call hook(arg, count) right before every write of count bytes to the
+ * sink, in whichever thread does it; for bench.c to count or stall them
+ */
+void capture_ctx_set_write_hook(struct capture_ctx *ctx,
+				void (*hook)(void *arg, size_t count), void *arg)
+{
+	ctx->write_hook = hook;
+	ctx->write_hook_arg = arg;
+}
+
+/* release what a capture that failed half way left behind */
+static void capture_abort(struct capture_ctx *ctx)
+{
+	/* the rest of the group is waiting for us */
+	group_sync(ctx, GROUP_FAILED);
+	if (ctx->ring.running)
+		ring_stop(ctx);
+	if (ctx->flac) {
+		/* the encoder's threads are still up, the file ends here */
+		flac_close(ctx->flac, NULL);
+		ctx->flac = NULL;
 	}
+	tidx_close(ctx, ctx->rot.cur.name);	/* the current file */
+	gain_close(ctx, ctx->rot.cur.name);
+	rotate_stop(ctx);
+	batch_release(ctx);
+}
+
+/*
+ * Record to filename until capture_ctx_stop() is called.  Any number of
+ * contexts can run at the same time, each in its own thread.  Returns
+ * EXIT_FAILURE if the capture had to be given up.
+ */
+int capture_ctx_run(struct capture_ctx *ctx, char *filename)
+{
+	char *pcm_name = ctx->pcm_name ? ctx->pcm_name : "default";
+	int err, ret = EXIT_SUCCESS;
+	snd_pcm_info_t *info;
+	uint64_t stops;
+
+	snd_pcm_info_alloca(&info);
+
+	err = snd_output_stdio_attach(&ctx->log, stderr, 0);
+	assert(err >= 0);
+
+	__atomic_store_n(&ctx->negotiated_set, 0, __ATOMIC_RELEASE);
+	ctx->group_state = GROUP_SETUP;
+	ctx->group_linked = 0;
+	ctx->tl_restart = 1;
+	ctx->tl_frames = 0;
+	ctx->tl_start = 0;
+	ctx->tl_file = 0;
 
-	if (nonblock) {
-		err = snd_pcm_nonblock(handle, 1);
+	if (setjmp(ctx->fail) == 0) {
+		err = snd_pcm_open(&ctx->handle, pcm_name, ctx->stream, ctx->open_mode);
 		if (err < 0) {
-			error(_("nonblock setting error: %s"), snd_strerror(err));
-			return 1;
+			error(_("audio open error: %s"), snd_strerror(err));
+			fatal(ctx);
 		}
-	}
 
-	chunk_size = 1024;
-	hwparams = rhwparams;
+		if ((err = snd_pcm_info(ctx->handle, info)) < 0) {
+			error(_("info error: %s"), snd_strerror(err));
+			fatal(ctx);
+		}
 
-	audiobuf = (u_char *)malloc(1024);
-	if (audiobuf == NULL) {
-		error(_("not enough memory"));
-		return 1;
-	}
+		if (ctx->nonblock) {
+			err = snd_pcm_nonblock(ctx->handle, 1);
+			if (err < 0) {
+				error(_("nonblock setting error: %s"), snd_strerror(err));
+				fatal(ctx);
+			}
+		}
 
-    writei_func = snd_pcm_writei;
-	readi_func = snd_pcm_readi;
-	writen_func = snd_pcm_writen;
-	readn_func = snd_pcm_readn;
+		ctx->chunk_size = 1024;
+		ctx->hwparams = ctx->rhwparams;
 
+		capture(ctx, filename);
+	} else {
+		capture_abort(ctx);
+		ret = EXIT_FAILURE;
+	}
+	/* the consumer has all there is */
+	if (ctx->tap)
+		tap_end(ctx->tap);
+
+	if (ctx->fd >= 0 && (fmt_rec_table[ctx->file_type].end || ctx->chfd)) {
+		file_end(ctx, ctx->fd, ctx->chfd, ctx->fdcount);
+		ctx->chfd = NULL;
+		ctx->fd = -1;
+	}
+	if (ctx->fd > 1)
+		close(ctx->fd);
+	ctx->fd = -1;
+	if (ctx->handle) {
+		/* closing a linked PCM would stop the whole group */
+		if (ctx->group_linked)
+			snd_pcm_unlink(ctx->handle);
+		snd_pcm_close(ctx->handle);
+		ctx->handle = NULL;
+	}
+	snd_output_close(ctx->log);
+	ctx->log = NULL;
+	/* a stop that came in during this run must not cancel the next one */
+	__atomic_store_n(&ctx->capture_stop, 0, __ATOMIC_RELEASE);
+	if (read(ctx->stop_fd, &stops, sizeof(stops)) < 0) {
+		/* there was none */
+	}
+	return ret;
+}
 
-	//signal(SIGINT, signal_handler);
-	//signal(SIGTERM, signal_handler);
-	//signal(SIGABRT, signal_handler);
-    capture(filename);
+static void *group_thread(void *arg)
+{
+	struct capture_ctx *ctx = arg;
+	struct capture_group *g = ctx->group;
+
+	/* wait until capture_multi_run() has counted the members */
+	pthread_mutex_lock(&g->lock);
+	pthread_mutex_unlock(&g->lock);
+	g->ret[ctx->group_index] = capture_ctx_run(ctx,
+						   g->filename[ctx->group_index]);
+	return NULL;
+}
 
-    if (fmt_rec_table[file_type].end) {
-        fmt_rec_table[file_type].end(fd);
-        fd = -1;
-    }
-	stream = -1;
-	if (fd > 1) {
-		close(fd);
-		fd = -1;
+/*
+ * Record ctx[i] into filename[i] for all n contexts at once, one thread per
+ * device, until every one of them has been stopped.  The shared time index
+ * goes to timeline.  Returns the number of captures that failed.
+ */
+int capture_multi_run(struct capture_ctx **ctx, char **filename, int n,
+		      char *timeline)
+{
+	struct capture_group g;
+	pthread_t *thread;
+	int i, err, members = 0, failed = 0;
+
+	memset(&g, 0, sizeof(g));
+	g.n = n;
+	g.ctx = ctx;
+	g.filename = filename;
+	g.ret = calloc(n, sizeof(*g.ret));
+	thread = calloc(n, sizeof(*thread));
+	if (g.ret == NULL || thread == NULL) {
+		error(_("not enough memory"));
+		failed = n;
+		goto out;
+	}
+	if ((g.timeline = fopen(timeline, "w")) == NULL) {
+		perror(timeline);
+		failed = n;
+		goto out;
+	}
+	fprintf(g.timeline, "# arecord timeline\n");
+	pthread_mutex_init(&g.lock, NULL);
+
+	pthread_mutex_lock(&g.lock);
+	for (i = 0; i < n; i++) {
+		ctx[i]->group = &g;
+		ctx[i]->group_index = i;
+		err = pthread_create(&thread[i], NULL, group_thread, ctx[i]);
+		if (err != 0) {
+			error(_("cannot start capture thread: %s"), strerror(err));
+			ctx[i]->group = NULL;
+			g.ret[i] = EXIT_FAILURE;
+			continue;
+		}
+		members++;
+	}
+	if (members) {
+		pthread_barrier_init(&g.ready, NULL, members);
+		pthread_barrier_init(&g.go, NULL, members);
+	}
+	pthread_mutex_unlock(&g.lock);
+
+	for (i = 0; i < n; i++)
+		if (ctx[i]->group)
+			pthread_join(thread[i], NULL);
+	for (i = 0; i < n; i++) {
+		ctx[i]->group = NULL;
+		if (g.ret[i] != 0)
+			failed++;
+	}
+	if (members) {
+		pthread_barrier_destroy(&g.ready);
+		pthread_barrier_destroy(&g.go);
 	}
-	if (handle) {
-		snd_pcm_close(handle);
-		handle = NULL;
+	pthread_mutex_destroy(&g.lock);
+	if (fclose(g.timeline) != 0)
+		perror(timeline);
+ out:
+	free(g.ret);
+	free(thread);
+	return failed;
+}
+
+static int meter_format(snd_pcm_format_t format)
+{
+	switch ((unsigned long) format) {
+	case SND_PCM_FORMAT_S8:
+		return METER_S8;
+	case SND_PCM_FORMAT_U8:
+		return METER_U8;
+	case SND_PCM_FORMAT_S16_LE:
+		return METER_S16_LE;
+	case SND_PCM_FORMAT_S16_BE:
+		return METER_S16_BE;
+	case SND_PCM_FORMAT_S24_3LE:
+		return METER_S24_3LE;
+	case SND_PCM_FORMAT_S24_3BE:
+		return METER_S24_3BE;
+	case SND_PCM_FORMAT_S24_LE:
+		return METER_S24_LE;
+	case SND_PCM_FORMAT_S24_BE:
+		return METER_S24_BE;
+	case SND_PCM_FORMAT_S32_LE:
+		return METER_S32_LE;
+	case SND_PCM_FORMAT_S32_BE:
+		return METER_S32_BE;
+	case SND_PCM_FORMAT_FLOAT_LE:
+		return METER_FLOAT_LE;
+	case SND_PCM_FORMAT_FLOAT_BE:
+		return METER_FLOAT_BE;
 	}
-	//snd_pcm_close(handle);
-	//free(audiobuf);
-	//snd_output_close(log);
-	//snd_config_update_free_global();
-	return EXIT_SUCCESS;
+	return -1;
 }
 
-static void set_params(void)
+static void set_params(struct capture_ctx *ctx)
 {
 	snd_pcm_hw_params_t *params;
 	snd_pcm_sw_params_t *swparams;
 	snd_pcm_uframes_t buffer_size;
+	/* as asked for, the next run starts from the same */
+	unsigned int period_time = ctx->period_time;
+	unsigned int buffer_time = ctx->buffer_time;
+	snd_pcm_uframes_t period_frames = ctx->period_frames;
+	snd_pcm_uframes_t buffer_frames = ctx->buffer_frames;
+	struct capture_config *got = &ctx->negotiated;
 	int err;
 	size_t n;
 	unsigned int rate;
-	snd_pcm_uframes_t start_threshold, stop_threshold;
+	snd_pcm_uframes_t start_threshold, stop_threshold, avail_min;
 	snd_pcm_hw_params_alloca(&params);
 	snd_pcm_sw_params_alloca(&swparams);
-	err = snd_pcm_hw_params_any(handle, params);
+	err = snd_pcm_hw_params_any(ctx->handle, params);
 	if (err < 0) {
 		error(_("Broken configuration for this PCM: no configurations available"));
-		exit(EXIT_FAILURE);
+		fatal(ctx);
 	}
-	else if (interleaved)
-		err = snd_pcm_hw_params_set_access(handle, params,
-						   SND_PCM_ACCESS_RW_INTERLEAVED);
-	else
-		err = snd_pcm_hw_params_set_access(handle, params,
+	if (!ctx->interleaved)
+		err = snd_pcm_hw_params_set_access(ctx->handle, params,
 						   SND_PCM_ACCESS_RW_NONINTERLEAVED);
+	else if (ctx->mmap_flag)
+		err = snd_pcm_hw_params_set_access(ctx->handle, params,
+						   SND_PCM_ACCESS_MMAP_INTERLEAVED);
+	else
+		err = snd_pcm_hw_params_set_access(ctx->handle, params,
+						   SND_PCM_ACCESS_RW_INTERLEAVED);
 	if (err < 0) {
 		error(_("Access type not available"));
-		exit(EXIT_FAILURE);
+		fatal(ctx);
 	}
-	err = snd_pcm_hw_params_set_format(handle, params, hwparams.format);
+	err = snd_pcm_hw_params_set_format(ctx->handle, params, ctx->hwparams.format);
 	if (err < 0) {
 		error(_("Sample format non available"));
-		exit(EXIT_FAILURE);
+		fatal(ctx);
 	}
-	err = snd_pcm_hw_params_set_channels(handle, params, hwparams.channels);
+	err = snd_pcm_hw_params_set_channels(ctx->handle, params, ctx->hwparams.channels);
 	if (err < 0) {
 		error(_("Channels count non available"));
-		exit(EXIT_FAILURE);
+		fatal(ctx);
 	}
 
 #if 0
-	err = snd_pcm_hw_params_set_periods_min(handle, params, 2);
+	err = snd_pcm_hw_params_set_periods_min(ctx->handle, params, 2);
 	assert(err >= 0);
 #endif
-	rate = hwparams.rate;
-	err = snd_pcm_hw_params_set_rate_near(handle, params, &hwparams.rate, 0);
+	rate = ctx->hwparams.rate;
+	err = snd_pcm_hw_params_set_rate_near(ctx->handle, params, &ctx->hwparams.rate, 0);
 	assert(err >= 0);
-	if ((float)rate * 1.05 < hwparams.rate || (float)rate * 0.95 > hwparams.rate) {
-		if (!quiet_mode) {
+	if ((float)rate * 1.05 < ctx->hwparams.rate || (float)rate * 0.95 > ctx->hwparams.rate) {
+		if (!ctx->quiet_mode) {
 			char plugex[64];
-			const char *pcmname = snd_pcm_name(handle);
-			fprintf(stderr, _("Warning: rate is not accurate (requested = %iHz, got = %iHz)\n"), rate, hwparams.rate);
-			if (! pcmname || strchr(snd_pcm_name(handle), ':'))
+			const char *pcmname = snd_pcm_name(ctx->handle);
+			fprintf(stderr, _("Warning: rate is not accurate (requested = %iHz, got = %iHz)\n"), rate, ctx->hwparams.rate);
+			if (! pcmname || strchr(snd_pcm_name(ctx->handle), ':'))
 				*plugex = 0;
 			else
 				snprintf(plugex, sizeof(plugex), "(-Dplug:%s)",
-					 snd_pcm_name(handle));
+					 snd_pcm_name(ctx->handle));
 			fprintf(stderr, _("         please, try the plug plugin %s\n"),
 				plugex);
 		}
 	}
-	rate = hwparams.rate;
+	rate = ctx->hwparams.rate;
 	if (buffer_time == 0 && buffer_frames == 0) {
 		err = snd_pcm_hw_params_get_buffer_time_max(params,
 							    &buffer_time, 0);
@@ -391,167 +1176,263 @@ static void set_params(void)
 			period_frames = buffer_frames / 4;
 	}
 	if (period_time > 0)
-		err = snd_pcm_hw_params_set_period_time_near(handle, params,
+		err = snd_pcm_hw_params_set_period_time_near(ctx->handle, params,
 							     &period_time, 0);
 	else
-		err = snd_pcm_hw_params_set_period_size_near(handle, params,
+		err = snd_pcm_hw_params_set_period_size_near(ctx->handle, params,
 							     &period_frames, 0);
 	assert(err >= 0);
 	if (buffer_time > 0) {
-		err = snd_pcm_hw_params_set_buffer_time_near(handle, params,
+		err = snd_pcm_hw_params_set_buffer_time_near(ctx->handle, params,
 							     &buffer_time, 0);
 	} else {
-		err = snd_pcm_hw_params_set_buffer_size_near(handle, params,
+		err = snd_pcm_hw_params_set_buffer_size_near(ctx->handle, params,
 							     &buffer_frames);
 	}
 	assert(err >= 0);
-	err = snd_pcm_hw_params(handle, params);
+	err = snd_pcm_hw_params(ctx->handle, params);
 	if (err < 0) {
 		error(_("Unable to install hw params:"));
-		snd_pcm_hw_params_dump(params, log);
-		exit(EXIT_FAILURE);
+		snd_pcm_hw_params_dump(params, ctx->log);
+		fatal(ctx);
 	}
-	snd_pcm_hw_params_get_period_size(params, &chunk_size, 0);
+	snd_pcm_hw_params_get_period_size(params, &ctx->chunk_size, 0);
 	snd_pcm_hw_params_get_buffer_size(params, &buffer_size);
-	if (chunk_size == buffer_size) {
+	if (ctx->chunk_size == buffer_size) {
 		error(_("Can't use period equal to buffer size (%lu == %lu)"),
-		      chunk_size, buffer_size);
-		exit(EXIT_FAILURE);
+		      ctx->chunk_size, buffer_size);
+		fatal(ctx);
 	}
-	snd_pcm_sw_params_current(handle, swparams);
-	if (avail_min < 0)
-		n = chunk_size;
+	snd_pcm_sw_params_current(ctx->handle, swparams);
+	if (ctx->avail_min < 0)
+		n = ctx->chunk_size;
 	else
-		n = (double) rate * avail_min / 1000000;
-	err = snd_pcm_sw_params_set_avail_min(handle, swparams, n);
+		n = (double) rate * ctx->avail_min / 1000000;
+	err = snd_pcm_sw_params_set_avail_min(ctx->handle, swparams, n);
 
 	/* round up to closest transfer boundary */
 	n = buffer_size;
-	if (start_delay <= 0) {
-		start_threshold = n + (double) rate * start_delay / 1000000;
+	if (ctx->start_delay <= 0) {
+		start_threshold = n + (double) rate * ctx->start_delay / 1000000;
 	} else
-		start_threshold = (double) rate * start_delay / 1000000;
+		start_threshold = (double) rate * ctx->start_delay / 1000000;
 	if (start_threshold < 1)
 		start_threshold = 1;
 	if (start_threshold > n)
 		start_threshold = n;
-	err = snd_pcm_sw_params_set_start_threshold(handle, swparams, start_threshold);
+	err = snd_pcm_sw_params_set_start_threshold(ctx->handle, swparams, start_threshold);
 	assert(err >= 0);
-	if (stop_delay <= 0) 
-		stop_threshold = buffer_size + (double) rate * stop_delay / 1000000;
+	if (ctx->stop_delay <= 0) 
+		stop_threshold = buffer_size + (double) rate * ctx->stop_delay / 1000000;
 	else
-		stop_threshold = (double) rate * stop_delay / 1000000;
-	err = snd_pcm_sw_params_set_stop_threshold(handle, swparams, stop_threshold);
+		stop_threshold = (double) rate * ctx->stop_delay / 1000000;
+	err = snd_pcm_sw_params_set_stop_threshold(ctx->handle, swparams, stop_threshold);
 	assert(err >= 0);
 
-	if (snd_pcm_sw_params(handle, swparams) < 0) {
+	/* hardware timestamps for the timeline, monotonic where it can be */
+	snd_pcm_sw_params_set_tstamp_mode(ctx->handle, swparams, SND_PCM_TSTAMP_ENABLE);
+	ctx->tstamp_clock = TIDX_CLOCK_REALTIME;
+#if SND_LIB_VERSION >= 0x01001c
+	if (snd_pcm_sw_params_set_tstamp_type(ctx->handle, swparams,
+					      SND_PCM_TSTAMP_TYPE_MONOTONIC) == 0)
+		ctx->tstamp_clock = TIDX_CLOCK_MONOTONIC;
+	else if (ctx->verbose)
+		fprintf(stderr, _("%s: no monotonic timestamps, using the wall clock\n"),
+			snd_pcm_name(ctx->handle));
+#endif
+
+	if (snd_pcm_sw_params(ctx->handle, swparams) < 0) {
 		error(_("unable to install sw params:"));
-		snd_pcm_sw_params_dump(swparams, log);
-		exit(EXIT_FAILURE);
+		snd_pcm_sw_params_dump(swparams, ctx->log);
+		fatal(ctx);
 	}
 
-	if (verbose)
-		snd_pcm_dump(handle, log);
-
-	bits_per_sample = snd_pcm_format_physical_width(hwparams.format);
-	bits_per_frame = bits_per_sample * hwparams.channels;
-	chunk_bytes = chunk_size * bits_per_frame / 8;
-	audiobuf = realloc(audiobuf, chunk_bytes);
-	if (audiobuf == NULL) {
+	/* what pcm_wait() polls */
+	err = snd_pcm_poll_descriptors_count(ctx->handle);
+	if (err <= 0) {
+		error(_("Invalid poll descriptors count"));
+		fatal(ctx);
+	}
+	ctx->npfd = err;
+	ctx->pfd = realloc(ctx->pfd, (ctx->npfd + 1) * sizeof(*ctx->pfd));
+	if (ctx->pfd == NULL) {
+		error(_("not enough memory"));
+		fatal(ctx);
+	}
+	err = snd_pcm_poll_descriptors(ctx->handle, ctx->pfd, ctx->npfd);
+	if (err < 0) {
+		error(_("Unable to obtain poll descriptors: %s"), snd_strerror(err));
+		fatal(ctx);
+	}
+	ctx->pfd[ctx->npfd].fd = ctx->stop_fd;
+	ctx->pfd[ctx->npfd].events = POLLIN;
+
+	/* for capture_ctx_get_config() */
+	got->device = ctx->pcm_name ? ctx->pcm_name : "default";
+	got->rate = ctx->hwparams.rate;
+	got->format = ctx->hwparams.format;
+	got->channels = ctx->hwparams.channels;
+	snd_pcm_hw_params_get_period_time(params, &got->period_time, 0);
+	snd_pcm_hw_params_get_buffer_time(params, &got->buffer_time, 0);
+	got->period_frames = ctx->chunk_size;
+	got->buffer_frames = buffer_size;
+	got->avail_min = ctx->avail_min;
+	got->start_delay = ctx->start_delay;
+	got->stop_delay = ctx->stop_delay;
+	snd_pcm_sw_params_get_avail_min(swparams, &avail_min);
+	got->avail_min_frames = avail_min;
+	got->start_threshold = start_threshold;
+	got->stop_threshold = stop_threshold;
+	__atomic_store_n(&ctx->negotiated_set, 1, __ATOMIC_RELEASE);
+
+	if (ctx->verbose)
+		snd_pcm_dump(ctx->handle, ctx->log);
+
+	ctx->bits_per_sample = snd_pcm_format_physical_width(ctx->hwparams.format);
+	ctx->bits_per_frame = ctx->bits_per_sample * ctx->hwparams.channels;
+	ctx->chunk_bytes = ctx->chunk_size * ctx->bits_per_frame / 8;
+	ctx->file_channels = ctx->planar == PLANAR_SPLIT ? 1 : ctx->hwparams.channels;
+	ctx->audiobuf = realloc(ctx->audiobuf, ctx->chunk_bytes);
+	if (ctx->audiobuf == NULL) {
 		error(_("not enough memory"));
-		exit(EXIT_FAILURE);
+		fatal(ctx);
+	}
+	if (!ctx->interleaved) {
+		/* per-channel files are read straight into the output buffer */
+		free(ctx->planes);
+		ctx->planes = NULL;
+		if ((ctx->planar == PLANAR_INTERLEAVE &&
+		     posix_memalign((void **)&ctx->planes, 64, ctx->chunk_bytes)) ||
+		    (ctx->plane_bufs = realloc(ctx->plane_bufs, ctx->hwparams.channels *
+					       sizeof(*ctx->plane_bufs))) == NULL) {
+			error(_("not enough memory"));
+			fatal(ctx);
+		}
+	}
+	if (ctx->ring_chunks) {
+		ctx->ring.slots = ctx->ring_chunks;
+		ctx->ring.buf = realloc(ctx->ring.buf, ctx->ring.slots * ctx->chunk_bytes);
+		ctx->ring.len = realloc(ctx->ring.len, ctx->ring.slots * sizeof(*ctx->ring.len));
+		ctx->ring.fd = realloc(ctx->ring.fd, ctx->ring.slots * sizeof(*ctx->ring.fd));
+		ctx->ring.chfd = realloc(ctx->ring.chfd, ctx->ring.slots * sizeof(*ctx->ring.chfd));
+		if (ctx->ring.buf == NULL || ctx->ring.len == NULL ||
+		    ctx->ring.fd == NULL || ctx->ring.chfd == NULL) {
+			error(_("not enough memory"));
+			fatal(ctx);
+		}
+		/* fault the slots in now rather than on the first pass */
+		memset(ctx->ring.buf, 0, ctx->ring.slots * ctx->chunk_bytes);
+	}
+	ctx->meter_fmt = meter_format(ctx->hwparams.format);
+	ctx->meter_peak = realloc(ctx->meter_peak, ctx->hwparams.channels * sizeof(*ctx->meter_peak));
+	ctx->meter_sumsq = realloc(ctx->meter_sumsq, ctx->hwparams.channels * sizeof(*ctx->meter_sumsq));
+	if (ctx->meter_peak == NULL || ctx->meter_sumsq == NULL) {
+		error(_("not enough memory"));
+		fatal(ctx);
+	}
+	memset(ctx->meter_peak, 0, ctx->hwparams.channels * sizeof(*ctx->meter_peak));
+	ctx->meter_frames = 0;
+	agc_free(ctx->agc_dsp);
+	ctx->agc_dsp = NULL;
+	if (ctx->agc && ctx->planar == PLANAR_SPLIT) {
+		/* it levels all channels alike, which separate files are not */
+		fprintf(stderr, _("No AGC for per-channel files, recording as is.\n"));
+	} else if (ctx->agc) {
+		ctx->agc_dsp = agc_new(ctx->meter_fmt, ctx->hwparams.channels,
+				       ctx->hwparams.rate, ctx->chunk_size,
+				       ctx->agc_target, ctx->agc_max_gain);
+		if (ctx->agc_dsp == NULL && errno == ENOMEM) {
+			error(_("not enough memory"));
+			fatal(ctx);
+		}
+		if (ctx->agc_dsp == NULL)
+			fprintf(stderr, _("No AGC for sample format %s, recording as is.\n"),
+				snd_pcm_format_name(ctx->hwparams.format));
 	}
 	// fprintf(stderr, "real chunk_size = %i, frags = %i, total = %i\n", chunk_size, setup.buf.block.frags, setup.buf.block.frags * chunk_size);
 
 	/* stereo VU-meter isn't always available... */
-	if (vumeter == VUMETER_STEREO) {
-		if (hwparams.channels != 2 || !interleaved || verbose > 2)
-			vumeter = VUMETER_MONO;
+	if (ctx->vumeter == VUMETER_STEREO) {
+		if (ctx->hwparams.channels != 2 || !ctx->interleaved || ctx->verbose > 2)
+			ctx->vumeter = VUMETER_MONO;
 	}
-
-	buffer_frames = buffer_size;	/* for position test */
 }
 
-#ifndef timersub
-#define	timersub(a, b, result) \
-do { \
-	(result)->tv_sec = (a)->tv_sec - (b)->tv_sec; \
-	(result)->tv_usec = (a)->tv_usec - (b)->tv_usec; \
-	if ((result)->tv_usec < 0) { \
-		--(result)->tv_sec; \
-		(result)->tv_usec += 1000000; \
-	} \
-} while (0)
-#endif
-
 /* I/O error handler */
-static void xrun(void)
+static void xrun(struct capture_ctx *ctx)
 {
 	snd_pcm_status_t *status;
 	int res;
 	
+	/* the stream gets restarted, log the new trigger on the timeline */
+	ctx->tl_restart = 1;
+	ctx->tl_start = ctx->tl_frames;
 	snd_pcm_status_alloca(&status);
-	if ((res = snd_pcm_status(handle, status))<0) {
+	if ((res = snd_pcm_status(ctx->handle, status))<0) {
 		error(_("status error: %s"), snd_strerror(res));
-		exit(EXIT_FAILURE);
+		fatal(ctx);
 	}
 	if (snd_pcm_status_get_state(status) == SND_PCM_STATE_XRUN) {
-		struct timeval now, diff, tstamp;
-		gettimeofday(&now, 0);
-		snd_pcm_status_get_trigger_tstamp(status, &tstamp);
-		timersub(&now, &tstamp, &diff);
+		snd_htimestamp_t now, tstamp;
+		/* the trigger time is on the clock of the PCM's timestamps */
+		clock_gettime(ctx->tstamp_clock == TIDX_CLOCK_MONOTONIC ?
+			      CLOCK_MONOTONIC : CLOCK_REALTIME, &now);
+		snd_pcm_status_get_trigger_htstamp(status, &tstamp);
 		fprintf(stderr, _("%s!!! (at least %.3f ms long)\n"),
-			stream == SND_PCM_STREAM_PLAYBACK ? _("underrun") : _("overrun"),
-			diff.tv_sec * 1000 + diff.tv_usec / 1000.0);
-		if (verbose) {
+			ctx->stream == SND_PCM_STREAM_PLAYBACK ? _("underrun") : _("overrun"),
+			(now.tv_sec - tstamp.tv_sec) * 1000.0 +
+			(now.tv_nsec - tstamp.tv_nsec) / 1000000.0);
+		if (ctx->verbose) {
 			fprintf(stderr, _("Status:\n"));
-			snd_pcm_status_dump(status, log);
+			snd_pcm_status_dump(status, ctx->log);
 		}
-		if ((res = snd_pcm_prepare(handle))<0) {
+		if ((res = snd_pcm_prepare(ctx->handle))<0) {
 			error(_("xrun: prepare error: %s"), snd_strerror(res));
-			exit(EXIT_FAILURE);
+			fatal(ctx);
 		}
 		return;		/* ok, data should be accepted again */
 	} if (snd_pcm_status_get_state(status) == SND_PCM_STATE_DRAINING) {
-		if (verbose) {
+		if (ctx->verbose) {
 			fprintf(stderr, _("Status(DRAINING):\n"));
-			snd_pcm_status_dump(status, log);
+			snd_pcm_status_dump(status, ctx->log);
 		}
-		if (stream == SND_PCM_STREAM_CAPTURE) {
+		if (ctx->stream == SND_PCM_STREAM_CAPTURE) {
 			fprintf(stderr, _("capture stream format change? attempting recover...\n"));
-			if ((res = snd_pcm_prepare(handle))<0) {
+			if ((res = snd_pcm_prepare(ctx->handle))<0) {
 				error(_("xrun(DRAINING): prepare error: %s"), snd_strerror(res));
-				exit(EXIT_FAILURE);
+				fatal(ctx);
 			}
 			return;
 		}
 	}
-	if (verbose) {
+	if (ctx->verbose) {
 		fprintf(stderr, _("Status(R/W):\n"));
-		snd_pcm_status_dump(status, log);
+		snd_pcm_status_dump(status, ctx->log);
 	}
 	error(_("read/write error, state = %s"), snd_pcm_state_name(snd_pcm_status_get_state(status)));
-	exit(EXIT_FAILURE);
+	fatal(ctx);
 }
 
 /* I/O suspend handler */
-static void suspend(void)
+static void suspend(struct capture_ctx *ctx)
 {
 	int res;
 
-	if (!quiet_mode)
+	ctx->tl_restart = 1;
+	ctx->tl_start = ctx->tl_frames;
+	if (!ctx->quiet_mode)
 		fprintf(stderr, _("Suspended. Trying resume. ")); fflush(stderr);
-	while ((res = snd_pcm_resume(handle)) == -EAGAIN)
+	while ((res = snd_pcm_resume(ctx->handle)) == -EAGAIN)
 		sleep(1);	/* wait until suspend flag is released */
 	if (res < 0) {
-		if (!quiet_mode)
+		if (!ctx->quiet_mode)
 			fprintf(stderr, _("Failed. Restarting stream. ")); fflush(stderr);
-		if ((res = snd_pcm_prepare(handle)) < 0) {
+		if ((res = snd_pcm_prepare(ctx->handle)) < 0) {
 			error(_("suspend: prepare error: %s"), snd_strerror(res));
-			exit(EXIT_FAILURE);
+			fatal(ctx);
 		}
 	}
-	if (!quiet_mode)
+	if (!ctx->quiet_mode)
 		fprintf(stderr, _("Done.\n"));
 }
 
@@ -615,134 +1496,91 @@ static void print_vu_meter_stereo(int *perc, int *maxperc)
 	fputs(line, stdout);
 }
 
-static void print_vu_meter(signed int *perc, signed int *maxperc)
+static void print_vu_meter(struct capture_ctx *ctx, signed int *perc, signed int *maxperc)
 {
-	if (vumeter == VUMETER_STEREO)
+	if (ctx->vumeter == VUMETER_STEREO)
 		print_vu_meter_stereo(perc, maxperc);
 	else
 		print_vu_meter_mono(*perc, *maxperc);
 }
 
+static void show_peak(struct capture_ctx *ctx, size_t count);
+
 /* peak handler */
-static void compute_max_peak(u_char *data, size_t count)
+static void compute_max_peak(struct capture_ctx *ctx, u_char *data, size_t count)
+{
+	unsigned int channels = ctx->hwparams.channels;
+
+	memset(ctx->meter_peak, 0, channels * sizeof(*ctx->meter_peak));
+	memset(ctx->meter_sumsq, 0, channels * sizeof(*ctx->meter_sumsq));
+	ctx->meter_frames = count / channels;
+	if (meter_peak_rms(ctx->meter_fmt, data, ctx->meter_frames, channels,
+			   ctx->meter_peak, ctx->meter_sumsq) < 0) {
+		if (!ctx->meter_warned) {
+			fprintf(stderr, _("Unsupported sample format %s.\n"),
+				snd_pcm_format_name(ctx->hwparams.format));
+			ctx->meter_warned = 1;
+		}
+		return;
+	}
+	show_peak(ctx, count);
+}
+
+/* the same for "frames" frames of planes "stride" bytes apart, every
+   channel metered as one contiguous run of samples */
+static void compute_planar_peak(struct capture_ctx *ctx, u_char *planes,
+				size_t stride, size_t frames)
+{
+	unsigned int c, channels = ctx->hwparams.channels;
+
+	memset(ctx->meter_peak, 0, channels * sizeof(*ctx->meter_peak));
+	memset(ctx->meter_sumsq, 0, channels * sizeof(*ctx->meter_sumsq));
+	ctx->meter_frames = frames;
+	for (c = 0; c < channels; c++)
+		if (meter_peak_rms(ctx->meter_fmt, planes + c * stride, frames,
+				   1, &ctx->meter_peak[c],
+				   &ctx->meter_sumsq[c]) < 0) {
+			if (!ctx->meter_warned) {
+				fprintf(stderr, _("Unsupported sample format %s.\n"),
+					snd_pcm_format_name(ctx->hwparams.format));
+				ctx->meter_warned = 1;
+			}
+			return;
+		}
+	show_peak(ctx, frames * channels);
+}
+
+/* the VU meter for the levels of count samples just measured */
+static void show_peak(struct capture_ctx *ctx, size_t count)
 {
-	signed int val, max, perc[2], max_peak[2];
-	static	int	run = 0;
+	signed int val, perc[2];
 	size_t ocount = count;
-	int	format_little_endian = snd_pcm_format_little_endian(hwparams.format);	
+	unsigned int channels = ctx->hwparams.channels;
 	int ichans, c;
 
-	if (vumeter == VUMETER_STEREO)
+	if (ctx->vumeter == VUMETER_STEREO)
 		ichans = 2;
 	else
 		ichans = 1;
 
-	memset(max_peak, 0, sizeof(max_peak));
-	switch (bits_per_sample) {
-	case 8: {
-		signed char *valp = (signed char *)data;
-		signed char mask = snd_pcm_format_silence(hwparams.format);
-		c = 0;
-		while (count-- > 0) {
-			val = *valp++ ^ mask;
-			val = abs(val);
-			if (max_peak[c] < val)
-				max_peak[c] = val;
-			if (vumeter == VUMETER_STEREO)
-				c = !c;
-		}
-		break;
-	}
-	case 16: {
-		signed short *valp = (signed short *)data;
-		signed short mask = snd_pcm_format_silence_16(hwparams.format);
-		signed short sval;
+	if (ctx->vumeter == VUMETER_NONE)
+		return;
 
-		count /= 2;
-		c = 0;
-		while (count-- > 0) {
-			if (format_little_endian)
-				sval = __le16_to_cpu(*valp);
-			else
-				sval = __be16_to_cpu(*valp);
-			sval = abs(sval) ^ mask;
-			if (max_peak[c] < sval)
-				max_peak[c] = sval;
-			valp++;
-			if (vumeter == VUMETER_STEREO)
-				c = !c;
-		}
-		break;
-	}
-	case 24: {
-		unsigned char *valp = data;
-		signed int mask = snd_pcm_format_silence_32(hwparams.format);
-
-		count /= 3;
-		c = 0;
-		while (count-- > 0) {
-			if (format_little_endian) {
-				val = valp[0] | (valp[1]<<8) | (valp[2]<<16);
-			} else {
-				val = (valp[0]<<16) | (valp[1]<<8) | valp[2];
-			}
-			/* Correct signed bit in 32-bit value */
-			if (val & (1<<(bits_per_sample-1))) {
-				val |= 0xff<<24;	/* Negate upper bits too */
-			}
-			val = abs(val) ^ mask;
-			if (max_peak[c] < val)
-				max_peak[c] = val;
-			valp += 3;
-			if (vumeter == VUMETER_STEREO)
-				c = !c;
-		}
-		break;
-	}
-	case 32: {
-		signed int *valp = (signed int *)data;
-		signed int mask = snd_pcm_format_silence_32(hwparams.format);
-
-		count /= 4;
-		c = 0;
-		while (count-- > 0) {
-			if (format_little_endian)
-				val = __le32_to_cpu(*valp);
-			else
-				val = __be32_to_cpu(*valp);
-			val = abs(val) ^ mask;
-			if (max_peak[c] < val)
-				max_peak[c] = val;
-			valp++;
-			if (vumeter == VUMETER_STEREO)
-				c = !c;
-		}
-		break;
-	}
-	default:
-		if (run == 0) {
-			fprintf(stderr, _("Unsupported bit size %d.\n"), (int)bits_per_sample);
-			run = 1;
-		}
-		return;
-	}
-	max = 1 << (bits_per_sample-1);
-	if (max <= 0)
-		max = 0x7fffffff;
-
-	for (c = 0; c < ichans; c++) {
-		if (bits_per_sample > 16)
-			perc[c] = max_peak[c] / (max / 100);
-		else
-			perc[c] = max_peak[c] * 100 / max;
+	/* the mono meter shows the loudest channel */
+	perc[0] = perc[1] = 0;
+	for (c = 0; c < (int)channels; c++) {
+		val = ctx->meter_peak[c] * 100;
+		if (ichans == 2 && c < 2)
+			perc[c] = val;
+		else if (ichans == 1 && val > perc[0])
+			perc[0] = val;
 	}
 
-	if (interleaved && verbose <= 2) {
-		static int maxperc[2];
-		static time_t t=0;
+	if (ctx->interleaved && ctx->verbose <= 2) {
+		int *maxperc = ctx->maxperc;
 		const time_t tt=time(NULL);
-		if(tt>t) {
-			t=tt;
+		if(tt>ctx->maxperc_time) {
+			ctx->maxperc_time=tt;
 			maxperc[0] = 0;
 			maxperc[1] = 0;
 		}
@@ -751,11 +1589,11 @@ static void compute_max_peak(u_char *data, size_t count)
 				maxperc[c] = perc[c];
 
 		putchar('\r');
-		print_vu_meter(perc, maxperc);
+		print_vu_meter(ctx, perc, maxperc);
 		fflush(stdout);
 	}
-	else if(verbose==3) {
-		printf(_("Max peak (%li samples): 0x%08x "), (long)ocount, max_peak[0]);
+	else if(ctx->verbose==3) {
+		printf(_("Max peak (%li samples): %8.6f "), (long)ocount, ctx->meter_peak[0]);
 		for (val = 0; val < 20; val++)
 			if (val <= perc[0] / 5)
 				putchar('#');
@@ -770,75 +1608,298 @@ static void compute_max_peak(u_char *data, size_t count)
  *  read function
  */
 
-static ssize_t pcm_read(u_char *data, size_t rcount)
+/*
+ * Sleep until the PCM has frames to read (or an error to report) or the
+ * capture is stopped, in one poll() on its descriptors and stop_fd.
+ * Returns 0 once stopped.
+ */
+static int pcm_wait(struct capture_ctx *ctx)
 {
-	ssize_t r;
-	size_t result = 0;
-	size_t count = rcount;
+	unsigned short revents;
+	int err;
 
-	if (count != chunk_size) {
-		count = chunk_size;
+	while (!capture_stopped(ctx)) {
+		err = poll(ctx->pfd, ctx->npfd + 1, 1000);
+		if (err < 0 && errno == EINTR)
+			continue;
+		if (err < 0) {
+			error(_("poll error: %s"), strerror(errno));
+			fatal(ctx);
+		}
+		if (err == 0)
+			return 1;	/* nothing for a second, ask the PCM */
+		if (ctx->pfd[ctx->npfd].revents)
+			break;
+		err = snd_pcm_poll_descriptors_revents(ctx->handle, ctx->pfd,
+						       ctx->npfd, &revents);
+		if (err < 0) {
+			error(_("poll revents error: %s"), snd_strerror(err));
+			fatal(ctx);
+		}
+		if (revents & (POLLIN | POLLERR))
+			return 1;
 	}
+	return 0;
+}
 
-	while (count > 0) {
-		r = readi_func(handle, data, count);
-		if (r == -EAGAIN || (r >= 0 && (size_t)r < count)) {
-			snd_pcm_wait(handle, 1000);
-		} else if (r == -EPIPE) {
-			xrun();
+/*
+ * Once stopped, the frames to read before giving up: what the PCM has, at
+ * most count.  Nonblocking reads of less than avail_min would only return
+ * -EAGAIN, so the last one asks for exactly that.
+ */
+static size_t pcm_left(struct capture_ctx *ctx, size_t count)
+{
+	snd_pcm_sframes_t avail = snd_pcm_avail_update(ctx->handle);
+
+	if (avail <= 0)
+		return 0;
+	return (size_t)avail < count ? (size_t)avail : count;
+}
+
+static ssize_t pcm_readn(struct capture_ctx *ctx, u_char *data, size_t rcount);
+
+/*
+ * Read rcount frames into data; fewer if the capture is stopped meanwhile,
+ * returns how many.
+ */
+static ssize_t pcm_read(struct capture_ctx *ctx, u_char *data, size_t rcount)
+{
+	ssize_t r;
+	size_t result = 0;
+	size_t count = rcount, want = rcount;
+	int stopped = 0;
+
+	if (!ctx->interleaved)
+		return pcm_readn(ctx, data, rcount);
+
+	/* no more than asked for, the frames after the end of a file begin
+	   the next one */
+	while (want > 0) {
+		r = ctx->readi_func(ctx->handle, data, want);
+		if (r == -EPIPE) {
+			xrun(ctx);
 		} else if (r == -ESTRPIPE) {
-			suspend();
-		} else if (r < 0) {
+			suspend(ctx);
+		} else if (r < 0 && r != -EAGAIN) {
 			error(_("read error: %s"), snd_strerror(r));
-			exit(EXIT_FAILURE);
+			fatal(ctx);
 		}
 		if (r > 0) {
-			if (vumeter)
-				compute_max_peak(data, r * hwparams.channels);
+			if (ctx->vumeter || ctx->meter)
+				compute_max_peak(ctx, data, r * ctx->hwparams.channels);
 			result += r;
+			ctx->tl_frames += r;
+			count -= r;
+			data += r * ctx->bits_per_frame / 8;
+		}
+		if (stopped)
+			break;
+		want = count;
+		/* the rest is not there yet */
+		if ((r == -EAGAIN || (r >= 0 && count > 0)) && !pcm_wait(ctx)) {
+			stopped = 1;
+			want = pcm_left(ctx, count);
+		}
+	}
+	return result;
+}
+
+/*
+ * Planar read of rcount frames into data, as per-channel planes of
+ * chunk_bytes / channels bytes for PLANAR_SPLIT, interleaved from
+ * ctx->planes for PLANAR_INTERLEAVE.
+ */
+static ssize_t pcm_readn(struct capture_ctx *ctx, u_char *data, size_t rcount)
+{
+	unsigned int c, channels = ctx->hwparams.channels;
+	size_t stride = ctx->chunk_bytes / channels;
+	size_t bytes = ctx->bits_per_sample / 8;
+	u_char *planes = ctx->planar == PLANAR_SPLIT ? data : ctx->planes;
+	size_t done = 0, count = rcount, want = rcount;
+	int stopped = 0;
+	ssize_t r;
+
+	while (want > 0) {
+		for (c = 0; c < channels; c++)
+			ctx->plane_bufs[c] = planes + c * stride + done * bytes;
+		r = ctx->readn_func(ctx->handle, ctx->plane_bufs, want);
+		if (r == -EPIPE) {
+			xrun(ctx);
+		} else if (r == -ESTRPIPE) {
+			suspend(ctx);
+		} else if (r < 0 && r != -EAGAIN) {
+			error(_("read error: %s"), snd_strerror(r));
+			fatal(ctx);
+		}
+		if (r > 0) {
+			done += r;
+			ctx->tl_frames += r;
 			count -= r;
-			data += r * bits_per_frame / 8;
+		}
+		if (stopped)
+			break;
+		want = count;
+		if ((r == -EAGAIN || (r >= 0 && count > 0)) && !pcm_wait(ctx)) {
+			stopped = 1;
+			want = pcm_left(ctx, count);
 		}
 	}
-	return rcount;
+	if (ctx->vumeter || ctx->meter)
+		compute_planar_peak(ctx, planes, stride, done);
+	if (ctx->planar == PLANAR_INTERLEAVE)
+		planar_interleave(data, planes, stride, done, channels, bytes);
+	return done;
+}
+
+/*
+ * Copies the frames just read, from "frame" on, into a slot of the tap; the
+ * tap drops them if the consumer holds every slot.  PLANAR_SPLIT's planes
+ * keep their stride.
+ */
+static void tap_copy(struct capture_ctx *ctx, u_char *data, size_t frames,
+		     off64_t frame)
+{
+	unsigned int channels = ctx->hwparams.channels;
+	size_t bytes = frames * ctx->bits_per_frame / 8;
+	u_char *slot;
+
+	if (ctx->tap == NULL || (slot = tap_slot(ctx->tap)) == NULL)
+		return;
+	if (ctx->planar == PLANAR_SPLIT)
+		bytes = (channels - 1) * (ctx->chunk_bytes / channels) +
+			bytes / channels;
+	memcpy(slot, data, bytes);
+	tap_push(ctx->tap, frames, frame);
+}
+
+/*
+ * mmap read: the period is metered and handed to the output straight from
+ * the mapped DMA area, either written to fd or (data != NULL) copied into a
+ * ring slot, which saves the copy into audiobuf that snd_pcm_readi() does.
+ * Like pcm_read(), returns fewer than rcount frames if stopped.
+ */
+static ssize_t pcm_mmap_read(struct capture_ctx *ctx, u_char *data, size_t rcount, char *name)
+{
+	const snd_pcm_channel_area_t *areas;
+	snd_pcm_uframes_t offset, frames;
+	snd_pcm_sframes_t avail, r;
+	size_t count = rcount, want;
+	size_t bytes;
+	u_char *p;
+	int err, stopped = 0;
+
+	while (count > 0) {
+		avail = snd_pcm_avail_update(ctx->handle);
+		if (avail == -EPIPE) {
+			xrun(ctx);
+			continue;
+		} else if (avail == -ESTRPIPE) {
+			suspend(ctx);
+			continue;
+		} else if (avail < 0) {
+			error(_("avail update error: %s"), snd_strerror(avail));
+			fatal(ctx);
+		}
+		want = count;
+		if ((size_t)avail < count && stopped) {
+			/* what there is, the capture ends with it */
+			if (avail == 0)
+				break;
+			want = avail;
+		} else if ((size_t)avail < count) {
+			/* mmap access is not started by a read */
+			if (snd_pcm_state(ctx->handle) == SND_PCM_STATE_PREPARED) {
+				err = snd_pcm_start(ctx->handle);
+				if (err < 0) {
+					error(_("start error: %s"), snd_strerror(err));
+					fatal(ctx);
+				}
+			}
+			stopped = !pcm_wait(ctx);
+			continue;
+		}
+		frames = want;
+		err = snd_pcm_mmap_begin(ctx->handle, &areas, &offset, &frames);
+		if (err == -EPIPE) {
+			xrun(ctx);
+			continue;
+		} else if (err == -ESTRPIPE) {
+			suspend(ctx);
+			continue;
+		} else if (err < 0) {
+			error(_("mmap begin error: %s"), snd_strerror(err));
+			fatal(ctx);
+		}
+		/* interleaved: every channel area shares one buffer */
+		p = (u_char *)areas[0].addr +
+		    (areas[0].first + offset * areas[0].step) / 8;
+		bytes = frames * ctx->bits_per_frame / 8;
+		if (ctx->vumeter || ctx->meter)
+			compute_max_peak(ctx, p, frames * ctx->hwparams.channels);
+		if (data) {
+			memcpy(data, p, bytes);
+			if (ctx->agc_dsp)
+				agc_process(ctx->agc_dsp, data, frames);
+			tap_copy(ctx, data, frames, ctx->tl_frames);
+			data += bytes;
+		} else if (ctx->agc_dsp) {
+			/* the DMA area stays as captured, level a copy */
+			memcpy(ctx->audiobuf, p, bytes);
+			agc_process(ctx->agc_dsp, ctx->audiobuf, frames);
+			tap_copy(ctx, ctx->audiobuf, frames, ctx->tl_frames);
+			sink_write(ctx, ctx->audiobuf, bytes, name);
+		} else {
+			tap_copy(ctx, p, frames, ctx->tl_frames);
+			sink_write(ctx, p, bytes, name);
+		}
+		r = snd_pcm_mmap_commit(ctx->handle, offset, frames);
+		if (r == -EPIPE || (r >= 0 && (snd_pcm_uframes_t)r != frames)) {
+			xrun(ctx);
+		} else if (r == -ESTRPIPE) {
+			suspend(ctx);
+		} else if (r < 0) {
+			error(_("mmap commit error: %s"), snd_strerror(r));
+			fatal(ctx);
+		}
+		ctx->tl_frames += frames;
+		count -= frames;
+	}
+	return rcount - count;
 }
 
 /* setting the globals for playing raw data */
-static void init_raw_data(void)
+static void init_raw_data(struct capture_ctx *ctx)
 {
-	hwparams = rhwparams;
+	ctx->hwparams = ctx->rhwparams;
 }
 
 /* calculate the data count to read from/to dsp */
-static off64_t calc_count(void)
+static off64_t calc_count(struct capture_ctx *ctx)
 {
 	off64_t count;
 
-	if (timelimit == 0) {
-		count = pbrec_count;
+	if (ctx->timelimit == 0) {
+		count = ctx->pbrec_count;
 	} else {
-		count = snd_pcm_format_size(hwparams.format, hwparams.rate * hwparams.channels);
-		count *= (off64_t)timelimit;
+		count = snd_pcm_format_size(ctx->hwparams.format, ctx->hwparams.rate * ctx->hwparams.channels);
+		count *= (off64_t)ctx->timelimit;
 	}
-	return count < pbrec_count ? count : pbrec_count;
+	return count < ctx->pbrec_count ? count : ctx->pbrec_count;
 }
 
-/* write a WAVE-header */
-static void begin_wave(int fd, size_t cnt)
+/*
+ * the fmt chunk body for hwparams, shared by the WAVE flavours; an
+ * unsupported format gives up on the first file, which is always set up
+ * on the capture thread
+ */
+static void wave_fmt(struct capture_ctx *ctx, WaveFmtBody *f)
 {
-	WaveHeader h;
-	WaveFmtBody f;
-	WaveChunkHeader cf, cd;
 	int bits;
 	u_int tmp;
 	u_short tmp2;
 
-	/* WAVE cannot handle greater than 32bit (signed?) int */
-	if (cnt == (size_t)-2)
-		cnt = 0x7fffff00;
-
 	bits = 8;
-	switch ((unsigned long) hwparams.format) {
+	switch ((unsigned long) ctx->hwparams.format) {
 	case SND_PCM_FORMAT_U8:
 		bits = 8;
 		break;
@@ -854,9 +1915,51 @@ static void begin_wave(int fd, size_t cnt)
 		bits = 24;
 		break;
 	default:
-		error(_("Wave doesn't support %s format..."), snd_pcm_format_name(hwparams.format));
-		exit(EXIT_FAILURE);
+		error(_("Wave doesn't support %s format..."), snd_pcm_format_name(ctx->hwparams.format));
+		fatal(ctx);
 	}
+
+        if (ctx->hwparams.format == SND_PCM_FORMAT_FLOAT_LE)
+                f->format = LE_SHORT(WAV_FMT_IEEE_FLOAT);
+        else
+                f->format = LE_SHORT(WAV_FMT_PCM);
+	f->channels = LE_SHORT(ctx->file_channels);
+	f->sample_fq = LE_INT(ctx->hwparams.rate);
+#if 0
+	tmp2 = (samplesize == 8) ? 1 : 2;
+	f->byte_p_spl = LE_SHORT(tmp2);
+	tmp = dsp_speed * ctx->hwparams.channels * (u_int) tmp2;
+#else
+	tmp2 = ctx->file_channels * snd_pcm_format_physical_width(ctx->hwparams.format) / 8;
+	f->byte_p_spl = LE_SHORT(tmp2);
+	tmp = (u_int) tmp2 * ctx->hwparams.rate;
+#endif
+	f->byte_p_sec = LE_INT(tmp);
+	f->bit_p_spl = LE_SHORT(bits);
+}
+
+static void end_raw(struct capture_ctx *ctx, int fd, off64_t bytes)
+{
+	if (fd != 1) {
+		/* drop whatever the batched sink preallocated past the data */
+		ftruncate64(fd, bytes);
+		close(fd);
+	}
+}
+
+/* write a WAVE-header */
+static int begin_wave(struct capture_ctx *ctx, int fd, size_t cnt)
+{
+	WaveHeader h;
+	WaveFmtBody f;
+	WaveChunkHeader cf, cd;
+	u_int tmp;
+
+	/* WAVE cannot handle greater than 32bit (signed?) int */
+	if (cnt == (size_t)-2)
+		cnt = 0x7fffff00;
+
+	wave_fmt(ctx, &f);
 	h.magic = WAV_RIFF;
 	tmp = cnt + sizeof(WaveHeader) + sizeof(WaveChunkHeader) + sizeof(WaveFmtBody) + sizeof(WaveChunkHeader) - 8;
 	h.length = LE_INT(tmp);
@@ -865,37 +1968,18 @@ static void begin_wave(int fd, size_t cnt)
 	cf.type = WAV_FMT;
 	cf.length = LE_INT(16);
 
-        if (hwparams.format == SND_PCM_FORMAT_FLOAT_LE)
-                f.format = LE_SHORT(WAV_FMT_IEEE_FLOAT);
-        else
-                f.format = LE_SHORT(WAV_FMT_PCM);
-	f.channels = LE_SHORT(hwparams.channels);
-	f.sample_fq = LE_INT(hwparams.rate);
-#if 0
-	tmp2 = (samplesize == 8) ? 1 : 2;
-	f.byte_p_spl = LE_SHORT(tmp2);
-	tmp = dsp_speed * hwparams.channels * (u_int) tmp2;
-#else
-	tmp2 = hwparams.channels * snd_pcm_format_physical_width(hwparams.format) / 8;
-	f.byte_p_spl = LE_SHORT(tmp2);
-	tmp = (u_int) tmp2 * hwparams.rate;
-#endif
-	f.byte_p_sec = LE_INT(tmp);
-	f.bit_p_spl = LE_SHORT(bits);
-
 	cd.type = WAV_DATA;
 	cd.length = LE_INT(cnt);
 
 	if (write(fd, &h, sizeof(WaveHeader)) != sizeof(WaveHeader) ||
 	    write(fd, &cf, sizeof(WaveChunkHeader)) != sizeof(WaveChunkHeader) ||
 	    write(fd, &f, sizeof(WaveFmtBody)) != sizeof(WaveFmtBody) ||
-	    write(fd, &cd, sizeof(WaveChunkHeader)) != sizeof(WaveChunkHeader)) {
-		error(_("write error"));
-		exit(EXIT_FAILURE);
-	}
+	    write(fd, &cd, sizeof(WaveChunkHeader)) != sizeof(WaveChunkHeader))
+		return -1;
+	return 0;
 }
 
-static void end_wave(int fd)
+static void end_wave(struct capture_ctx *ctx, int fd, off64_t bytes)
 {				/* only close output */
 	WaveChunkHeader cd;
 	off64_t length_seek;
@@ -906,19 +1990,925 @@ static void end_wave(int fd)
 		      sizeof(WaveChunkHeader) +
 		      sizeof(WaveFmtBody);
 	cd.type = WAV_DATA;
-	cd.length = fdcount > 0x7fffffff ? LE_INT(0x7fffffff) : LE_INT(fdcount);
-	filelen = fdcount + 2*sizeof(WaveChunkHeader) + sizeof(WaveFmtBody) + 4;
+	cd.length = bytes > 0x7fffffff ? LE_INT(0x7fffffff) : LE_INT(bytes);
+	filelen = bytes + 2*sizeof(WaveChunkHeader) + sizeof(WaveFmtBody) + 4;
 	rifflen = filelen > 0x7fffffff ? LE_INT(0x7fffffff) : LE_INT(filelen);
 	if (lseek64(fd, 4, SEEK_SET) == 4)
 		write(fd, &rifflen, 4);
 	if (lseek64(fd, length_seek, SEEK_SET) == length_seek)
 		write(fd, &cd, sizeof(WaveChunkHeader));
-	if (fd != 1)
+	if (fd != 1) {
+		/* drop whatever the batched sink preallocated past the data */
+		ftruncate64(fd, length_seek + sizeof(WaveChunkHeader) + bytes);
+		close(fd);
+	}
+}
+
+/* for "data" bytes, with the plain RIFF lengths if final and they fit */
+static void rf64_header(struct capture_ctx *ctx, Rf64Header *r, u_int64_t data,
+			int final)
+{
+	u_int64_t riff = sizeof(*r) - 8 + data;
+	int small = final && riff <= 0xffffffff;
+	WaveFmtBody f;
+
+	memset(r, 0, sizeof(*r));
+	wave_fmt(ctx, &f);
+	r->f = f;
+	r->h.magic = small ? WAV_RIFF : WAV_RF64;
+	r->h.length = small ? LE_INT(riff) : 0xffffffff;
+	r->h.type = WAV_WAVE;
+	r->ds.type = small ? WAV_JUNK : WAV_DS64;
+	r->ds.length = LE_INT(sizeof(r->ds) - 8);
+	r->ds.riff_length = LE_LONG(riff);
+	r->ds.data_length = LE_LONG(data);
+	r->ds.frames = LE_LONG(data / LE_SHORT(f.byte_p_spl));
+	r->cf.type = WAV_FMT;
+	r->cf.length = LE_INT(sizeof(r->f));
+	r->cd.type = WAV_DATA;
+	r->cd.length = small ? LE_INT(data) : 0xffffffff;
+}
+
+static int begin_rf64(struct capture_ctx *ctx, int fd, size_t cnt)
+{
+	Rf64Header r;
+
+	/* what a pipe gets, a file is brought up to date as it grows */
+	rf64_header(ctx, &r, cnt, 0);
+	if (write(fd, &r, sizeof(r)) != sizeof(r))
+		return -1;
+	return 0;
+}
+
+/* positional, the sink goes on appending at its own offset */
+static void update_rf64(struct capture_ctx *ctx, int fd, off64_t bytes)
+{
+	Rf64Header r;
+
+	rf64_header(ctx, &r, bytes, 0);
+	pwrite64(fd, &r, sizeof(r), 0);
+}
+
+static void end_rf64(struct capture_ctx *ctx, int fd, off64_t bytes)
+{
+	Rf64Header r;
+
+	rf64_header(ctx, &r, bytes, 1);
+	pwrite64(fd, &r, sizeof(r), 0);
+	if (fd != 1) {
+		/* drop whatever the batched sink preallocated past the data */
+		ftruncate64(fd, sizeof(r) + bytes);
+		close(fd);
+	}
+}
+
+/* for "data" bytes and "pad" more up to the 8 byte boundary */
+static void w64_header(struct capture_ctx *ctx, W64Header *w, u_int64_t data,
+		       u_int64_t pad)
+{
+	WaveFmtBody f;
+
+	memset(w, 0, sizeof(*w));
+	memcpy(w->riff.guid, w64_riff, 16);
+	w->riff.length = LE_LONG(sizeof(*w) + data + pad);
+	memcpy(w->wave, w64_wave, 16);
+	memcpy(w->cf.guid, w64_fmt, 16);
+	w->cf.length = LE_LONG(sizeof(w->cf) + sizeof(w->f));
+	wave_fmt(ctx, &f);
+	w->f = f;
+	memcpy(w->cd.guid, w64_data, 16);
+	w->cd.length = LE_LONG(sizeof(w->cd) + data);
+}
+
+static int begin_w64(struct capture_ctx *ctx, int fd, size_t cnt)
+{
+	W64Header w;
+
+	w64_header(ctx, &w, cnt, 0);
+	if (write(fd, &w, sizeof(w)) != sizeof(w))
+		return -1;
+	return 0;
+}
+
+static void update_w64(struct capture_ctx *ctx, int fd, off64_t bytes)
+{
+	W64Header w;
+
+	w64_header(ctx, &w, bytes, 0);
+	pwrite64(fd, &w, sizeof(w), 0);
+}
+
+static void end_w64(struct capture_ctx *ctx, int fd, off64_t bytes)
+{
+	static const u_char zero[8];
+	u_int64_t pad = -bytes & 7;
+	W64Header w;
+
+	w64_header(ctx, &w, bytes, pad);
+	pwrite64(fd, &w, sizeof(w), 0);
+	if (fd != 1) {
+		pwrite64(fd, zero, pad, sizeof(w) + bytes);
+		ftruncate64(fd, sizeof(w) + bytes + pad);
+		close(fd);
+	}
+}
+
+/* STREAMINFO without length and checksum, flac_sink_close() fills them in */
+static int begin_flac(struct capture_ctx *ctx, int fd, size_t cnt)
+{
+	int err = flac_start(fd, ctx->meter_fmt, ctx->hwparams.channels,
+			     ctx->hwparams.rate);
+
+	if (err == -EINVAL)
+		error(_("FLAC doesn't support %s samples or %d channels"),
+		      snd_pcm_format_name(ctx->hwparams.format),
+		      ctx->hwparams.channels);
+	if (err < 0) {
+		errno = -err;
+		return -1;
+	}
+	return 0;
+}
+
+/* "bytes" are those captured, the file ends where the encoder stopped */
+static void end_flac(struct capture_ctx *ctx, int fd, off64_t bytes)
+{
+	if (fd != 1) {
+		ftruncate64(fd, lseek64(fd, 0, SEEK_CUR));
 		close(fd);
+	}
+}
+
+/*
+ *  output sinks
+ */
+
+static int write_sink_write(struct capture_ctx *ctx, int fd, u_char *data, size_t count)
+{
+	return write(fd, data, count) == count ? 0 : -1;
+}
+
+#ifdef HAVE_IO_URING
+static int uring_setup(struct uring *r, unsigned entries)
+{
+	struct io_uring_params p;
+	u_char *sq, *cq;
+
+	memset(&p, 0, sizeof(p));
+	r->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (r->fd < 0)
+		return -1;
+	r->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (r->cq_size > r->sq_size)
+			r->sq_size = r->cq_size;
+		r->cq_size = r->sq_size;
+	}
+	r->sq_ptr = mmap(NULL, r->sq_size, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (r->sq_ptr == MAP_FAILED)
+		goto fail_fd;
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		r->cq_ptr = r->sq_ptr;
+	else {
+		r->cq_ptr = mmap(NULL, r->cq_size, PROT_READ | PROT_WRITE,
+				 MAP_SHARED | MAP_POPULATE, r->fd,
+				 IORING_OFF_CQ_RING);
+		if (r->cq_ptr == MAP_FAILED)
+			goto fail_sq;
+	}
+	r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED)
+		goto fail_cq;
+	sq = r->sq_ptr;
+	cq = r->cq_ptr;
+	r->sq_head = (unsigned *)(sq + p.sq_off.head);
+	r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	r->sq_array = (unsigned *)(sq + p.sq_off.array);
+	r->cq_head = (unsigned *)(cq + p.cq_off.head);
+	r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	return 0;
+
+ fail_cq:
+	if (r->cq_ptr != r->sq_ptr)
+		munmap(r->cq_ptr, r->cq_size);
+ fail_sq:
+	munmap(r->sq_ptr, r->sq_size);
+ fail_fd:
+	close(r->fd);
+	r->fd = -1;
+	return -1;
 }
 
-static int new_capture_file(char *name, char *namebuf, size_t namelen,
-			    int filecount)
+static void uring_exit(struct uring *r)
+{
+	munmap(r->sqes, r->sqes_size);
+	if (r->cq_ptr != r->sq_ptr)
+		munmap(r->cq_ptr, r->cq_size);
+	munmap(r->sq_ptr, r->sq_size);
+	close(r->fd);
+	r->fd = -1;
+}
+
+/* queue one write of iov at pos, tagged with user_data */
+static int uring_write(struct uring *r, int fd, struct iovec *iov,
+		       off64_t pos, unsigned long user_data)
+{
+	unsigned tail = *r->sq_tail;
+	unsigned idx = tail & *r->sq_mask;
+	struct io_uring_sqe *sqe = &r->sqes[idx];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_WRITEV;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long)iov;
+	sqe->len = 1;
+	sqe->off = pos;
+	sqe->user_data = user_data;
+	r->sq_array[idx] = idx;
+	__atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	if (syscall(__NR_io_uring_enter, r->fd, 1, 0, 0, NULL, 0) < 0)
+		return -1;
+	return 0;
+}
+
+/* wait for one completion, returns its result and user_data */
+static int uring_reap(struct uring *r, unsigned long *user_data)
+{
+	struct io_uring_cqe *cqe;
+	unsigned head;
+	int res;
+
+	for (;;) {
+		head = *r->cq_head;
+		if (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+			break;
+		if (syscall(__NR_io_uring_enter, r->fd, 0, 1,
+			    IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+		    errno != EINTR)
+			return -errno;
+	}
+	cqe = &r->cqes[head & *r->cq_mask];
+	res = cqe->res;
+	*user_data = cqe->user_data;
+	__atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+	return res;
+}
+#endif
+
+/* write len bytes of buf at pos synchronously */
+static int batch_pwrite(int fd, u_char *buf, size_t len, off64_t pos)
+{
+	struct iovec iov;
+	ssize_t r;
+
+	while (len > 0) {
+		iov.iov_base = buf;
+		iov.iov_len = len;
+		r = pwritev64(fd, &iov, 1, pos);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += r;
+		len -= r;
+		pos += r;
+	}
+	return 0;
+}
+
+#ifdef HAVE_IO_URING
+/* wait until buffer i is on disk (in the page cache, that is) */
+static int batch_wait(struct batch_sink *batch, int fd, int i)
+{
+	unsigned long done = 0;
+	int res;
+
+	while (batch->busy[i]) {
+		res = uring_reap(&batch->ring, &done);
+		if (res < 0) {
+			errno = -res;
+			return -1;
+		}
+		batch->busy[done] = 0;
+		/* finish a short write synchronously, it should not happen */
+		if ((size_t)res < batch->busy_len[done] &&
+		    batch_pwrite(fd, batch->buf[done] + res,
+				 batch->busy_len[done] - res,
+				 batch->busy_pos[done] + res) < 0)
+			return -1;
+	}
+	return 0;
+}
+#endif
+
+/*
+ * Extend the preallocation in PREALLOC_BYTES steps ahead of the data.  Only
+ * the blocks are reserved, the file size stays at the end of the data, so a
+ * crash leaves no zeros after the sound to be played back as silence.
+ */
+static void batch_prealloc(struct batch_sink *batch, int fd, off64_t end)
+{
+	if (batch->allocated < 0 || end <= batch->allocated)
+		return;
+	while (batch->allocated < end) {
+		if (fallocate64(fd, FALLOC_FL_KEEP_SIZE, batch->allocated,
+				PREALLOC_BYTES) < 0) {
+			batch->allocated = -1;	/* not supported here, don't retry */
+			return;
+		}
+		batch->allocated += PREALLOC_BYTES;
+	}
+}
+
+/* hand buf[cur] over to the kernel and continue in the next buffer */
+static int batch_submit(struct batch_sink *batch, int fd)
+{
+	int i = batch->cur;
+
+	if (batch->fill == 0)
+		return 0;
+	batch_prealloc(batch, fd, batch->pos + batch->fill);
+#ifdef HAVE_IO_URING
+	if (batch->have_ring) {
+		batch->iov[i].iov_base = batch->buf[i];
+		batch->iov[i].iov_len = batch->fill;
+		batch->busy[i] = 1;
+		batch->busy_len[i] = batch->fill;
+		batch->busy_pos[i] = batch->pos;
+		if (uring_write(&batch->ring, fd, &batch->iov[i], batch->pos, i) < 0)
+			return -1;
+		batch->cur = (i + 1) % BATCH_BUFFERS;
+		if (batch_wait(batch, fd, batch->cur) < 0)
+			return -1;
+	} else
+#endif
+	if (batch_pwrite(fd, batch->buf[i], batch->fill, batch->pos) < 0)
+		return -1;
+	batch->pos += batch->fill;
+	batch->fill = 0;
+	return 0;
+}
+
+static int batch_open(struct capture_ctx *ctx, int fd)
+{
+	struct batch_sink *batch = &ctx->batch;
+	int i;
+
+	if (batch->size != ctx->batch_periods * ctx->chunk_bytes) {
+		batch->size = ctx->batch_periods * ctx->chunk_bytes;
+		for (i = 0; i < BATCH_BUFFERS; i++) {
+			free(batch->buf[i]);
+			if (posix_memalign((void **)&batch->buf[i], 4096,
+					   batch->size) != 0) {
+				/* allocate them all again next time */
+				batch->buf[i] = NULL;
+				batch->size = 0;
+				errno = ENOMEM;
+				return -1;
+			}
+			memset(batch->buf[i], 0, batch->size);
+		}
+	}
+	batch->pos = batch->start = lseek64(fd, 0, SEEK_CUR);
+	batch->fill = 0;
+	batch->cur = 0;
+	batch->allocated = batch->pos;
+	memset(batch->busy, 0, sizeof(batch->busy));
+#ifdef HAVE_IO_URING
+	/* set up once per capture, not per file */
+	if (!batch->have_ring)
+		batch->have_ring = uring_setup(&batch->ring, BATCH_BUFFERS) == 0;
+#endif
+	return 0;
+}
+
+static int batch_write(struct capture_ctx *ctx, int fd, u_char *data, size_t count)
+{
+	struct batch_sink *batch = &ctx->batch;
+	size_t n;
+
+	while (count > 0) {
+		n = batch->size - batch->fill;
+		if (n > count)
+			n = count;
+		memcpy(batch->buf[batch->cur] + batch->fill, data, n);
+		batch->fill += n;
+		data += n;
+		count -= n;
+		if (batch->fill == batch->size && batch_submit(batch, fd) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+/* flush everything and leave the file offset at the end of the data */
+static int batch_close(struct capture_ctx *ctx, int fd)
+{
+	struct batch_sink *batch = &ctx->batch;
+	int err = batch_submit(batch, fd);
+#ifdef HAVE_IO_URING
+	int i;
+
+	if (batch->have_ring)
+		for (i = 0; i < BATCH_BUFFERS; i++)
+			if (batch_wait(batch, fd, i) < 0)
+				err = -1;
+#endif
+	if (lseek64(fd, batch->pos, SEEK_SET) < 0)
+		err = -1;
+	return err;
+}
+
+/* up to the first buffer still in flight, or all that was submitted */
+static off64_t batch_written(struct capture_ctx *ctx)
+{
+	struct batch_sink *batch = &ctx->batch;
+	off64_t end = batch->pos;
+	int i;
+
+	for (i = 0; i < BATCH_BUFFERS; i++)
+		if (batch->busy[i] && batch->busy_pos[i] < end)
+			end = batch->busy_pos[i];
+	return end - batch->start;
+}
+
+/* the end of the capture, batch_close() has waited for every write */
+static void batch_release(struct capture_ctx *ctx)
+{
+#ifdef HAVE_IO_URING
+	if (ctx->batch.have_ring) {
+		uring_exit(&ctx->batch.ring);
+		ctx->batch.have_ring = 0;
+	}
+#endif
+}
+
+static int flac_open(struct capture_ctx *ctx, int fd)
+{
+	ctx->flac = flac_new(fd, ctx->meter_fmt, ctx->hwparams.channels,
+			     ctx->hwparams.rate, 0);
+	if (ctx->flac == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	return 0;
+}
+
+static int flac_sink_write(struct capture_ctx *ctx, int fd, u_char *data, size_t count)
+{
+	int err;
+
+	err = flac_write(ctx->flac, data, count * 8 / ctx->bits_per_frame);
+	if (err < 0) {
+		errno = -err;
+		return -1;
+	}
+	return 0;
+}
+
+static int flac_sink_close(struct capture_ctx *ctx, int fd)
+{
+	struct flac_stats st;
+	int err;
+
+	if (ctx->flac == NULL)
+		return 0;
+	err = flac_close(ctx->flac, &st);
+	ctx->flac = NULL;
+	if (err < 0) {
+		errno = -err;
+		return -1;
+	}
+	if (st.raw)
+		fprintf(stderr, _("FLAC: %llu bytes, %.1f%% of the samples\n"),
+			(unsigned long long)st.bytes, 100.0 * st.bytes / st.raw);
+	return 0;
+}
+
+/* data holds a plane of count / channels bytes per channel, chunk_bytes /
+   channels apart, see pcm_readn() */
+static int split_write(struct capture_ctx *ctx, int fd, u_char *data, size_t count)
+{
+	unsigned int c, channels = ctx->hwparams.channels;
+	size_t stride = ctx->chunk_bytes / channels, n = count / channels;
+
+	for (c = 0; c < channels; c++)
+		if (write(ctx->split_fd[c], data + c * stride, n) != (ssize_t)n)
+			return -1;
+	return 0;
+}
+
+static int sink_open(struct capture_ctx *ctx, int fd)
+{
+	ctx->written = 0;
+	ctx->header_due = ctx->header_every;
+	if (sink_table[ctx->sink_type].open)
+		return sink_table[ctx->sink_type].open(ctx, fd);
+	return 0;
+}
+
+/*
+ * Brings the header up to date every HEADER_UPDATE_TIME with what is in
+ * the file by now, not what is still queued in the ring or in the sink's
+ * buffers, so that a crash leaves a header that promises no more than the
+ * file holds.  Called by the thread writing the file, after every write.
+ */
+static void header_update(struct capture_ctx *ctx, int fd, int *chfd)
+{
+	const struct sink *sink = &sink_table[ctx->sink_type];
+	struct fmt_capture *fmt = &fmt_rec_table[ctx->file_type];
+	off64_t done;
+	unsigned int i, n;
+
+	if (!ctx->header_every || !fmt->update)
+		return;
+	done = sink->written ? sink->written(ctx) : ctx->written;
+	if (done < ctx->header_due)
+		return;
+	if (chfd) {
+		n = file_count(ctx);
+		for (i = 0; i < n; i++)
+			fmt->update(ctx, chfd[i], done / n);
+	} else
+		fmt->update(ctx, fd, done);
+	ctx->header_due = done + ctx->header_every;
+}
+
+static void sink_write(struct capture_ctx *ctx, u_char *data, size_t count, char *name)
+{
+	if (ctx->write_hook)
+		ctx->write_hook(ctx->write_hook_arg, count);
+	if (sink_table[ctx->sink_type].write(ctx, ctx->fd, data, count) < 0) {
+		perror(name);
+		fatal(ctx);
+	}
+	ctx->written += count;
+	header_update(ctx, ctx->fd, ctx->chfd);
+}
+
+static void sink_close(struct capture_ctx *ctx, char *name)
+{
+	if (sink_table[ctx->sink_type].close &&
+	    sink_table[ctx->sink_type].close(ctx, ctx->fd) < 0) {
+		perror(name);
+		fatal(ctx);
+	}
+}
+
+/*
+ *  capture ring
+ */
+
+/*
+ * The writer thread must not end the capture with fatal(), which would jump
+ * across threads, so a failed open or write just stops the capture and the
+ * capture thread reports it once the ring is drained.
+ */
+static void ring_write_error(struct capture_ctx *ctx)
+{
+	/* a short write leaves errno alone */
+	if (!ctx->write_error)
+		ctx->write_error = errno ? errno : EIO;
+	capture_ctx_stop(ctx);
+}
+
+/*
+ * The writer has the sink open on the file of the slots it is writing,
+ * a slot of the next file or a drain closes it there.
+ */
+static void *ring_writer(void *arg)
+{
+	struct capture_ctx *ctx = arg;
+	struct capture_ring *ring = &ctx->ring;
+	const struct sink *sink = &sink_table[ctx->sink_type];
+	unsigned idx;
+	size_t len;
+	int fd = -1;
+
+	for (;;) {
+		while (sem_wait(&ring->filled) < 0 && errno == EINTR)
+			;
+		idx = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED) % ring->slots;
+		len = ring->len[idx];
+		if (fd != -1 && (len == RING_DRAIN || len == RING_QUIT ||
+				 ring->fd[idx] != fd)) {
+			if (sink->close && sink->close(ctx, fd) < 0)
+				ring_write_error(ctx);
+			/* all of it written, the rotation thread may finish it */
+			if (len != RING_DRAIN && len != RING_QUIT)
+				rotate_flushed(ctx);
+			fd = -1;
+		}
+		if (len != RING_DRAIN && len != RING_QUIT && fd == -1) {
+			fd = ring->fd[idx];
+			ctx->split_fd = ring->chfd[idx];
+			if (sink_open(ctx, fd) < 0)
+				ring_write_error(ctx);
+		}
+		if (len != RING_DRAIN && len != RING_QUIT && !ctx->write_error &&
+		    ctx->write_hook)
+			ctx->write_hook(ctx->write_hook_arg, len);
+		if (len != RING_DRAIN && len != RING_QUIT && !ctx->write_error) {
+			if (sink->write(ctx, fd, ring->buf + idx * ctx->chunk_bytes,
+					len) < 0)
+				ring_write_error(ctx);
+			else {
+				ctx->written += len;
+				header_update(ctx, fd, ring->chfd[idx]);
+			}
+		}
+		__atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+		sem_post(&ring->free);
+		if (len == RING_DRAIN || len == RING_QUIT)
+			sem_post(&ring->drained);
+		if (len == RING_QUIT)
+			break;
+	}
+	return NULL;
+}
+
+/* slot to capture the next chunk into, waits for the writer if the ring is full */
+static u_char *ring_slot(struct capture_ctx *ctx)
+{
+	struct capture_ring *ring = &ctx->ring;
+
+	if (!ring->reserved) {
+		if (sem_trywait(&ring->free) < 0) {
+			ring->stalls++;
+			while (sem_wait(&ring->free) < 0 && errno == EINTR)
+				;
+		}
+		ring->reserved = 1;
+	}
+	return ring->buf + (ring->head % ring->slots) * ctx->chunk_bytes;
+}
+
+/* hand the slot returned by ring_slot() with len bytes in it to the writer */
+static void ring_push(struct capture_ctx *ctx, size_t len)
+{
+	struct capture_ring *ring = &ctx->ring;
+	unsigned used;
+
+	ring->len[ring->head % ring->slots] = len;
+	ring->fd[ring->head % ring->slots] = ctx->fd;
+	ring->chfd[ring->head % ring->slots] = ctx->chfd;
+	used = ring->head + 1 - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	if (used > ring->high_water)
+		ring->high_water = used;
+	__atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+	ring->reserved = 0;
+	sem_post(&ring->filled);
+}
+
+/* wait until everything queued so far has been written to fd,
+ * mark RING_QUIT also ends the writer thread */
+static void ring_barrier(struct capture_ctx *ctx, size_t mark)
+{
+	ring_slot(ctx);
+	ring_push(ctx, mark);
+	while (sem_wait(&ctx->ring.drained) < 0 && errno == EINTR)
+		;
+}
+
+static void ring_start(struct capture_ctx *ctx)
+{
+	struct capture_ring *ring = &ctx->ring;
+	int err;
+
+	ring->head = ring->tail = 0;
+	ring->reserved = 0;
+	ring->high_water = 0;
+	ring->stalls = 0;
+	ctx->write_error = 0;
+	sem_init(&ring->filled, 0, 0);
+	sem_init(&ring->free, 0, ring->slots);
+	sem_init(&ring->drained, 0, 0);
+	if ((err = pthread_create(&ring->writer, NULL, ring_writer, ctx)) != 0) {
+		error(_("cannot start writer thread: %s"), strerror(err));
+		fatal(ctx);
+	}
+	ring->running = 1;
+}
+
+static void ring_stop(struct capture_ctx *ctx)
+{
+	struct capture_ring *ring = &ctx->ring;
+
+	ring->running = 0;
+	ring_barrier(ctx, RING_QUIT);
+	pthread_join(ring->writer, NULL);
+	sem_destroy(&ring->filled);
+	sem_destroy(&ring->free);
+	sem_destroy(&ring->drained);
+	printf("arecord: ring high-water mark: %u of %u chunks, %lu stalls\n",
+	       ring->high_water, ring->slots, ring->stalls);
+}
+
+/*
+ *  multi-device capture
+ */
+
+static void group_log(struct capture_ctx *ctx, const char *fmt, ...)
+{
+	struct capture_group *g = ctx->group;
+	va_list ap;
+
+	va_start(ap, fmt);
+	pthread_mutex_lock(&g->lock);
+	vfprintf(g->timeline, fmt, ap);
+	pthread_mutex_unlock(&g->lock);
+	va_end(ap);
+}
+
+/* link every member that is ready to the first one */
+static void group_link(struct capture_group *g)
+{
+	struct capture_ctx *first = NULL, *ctx;
+	int i, err;
+
+	for (i = 0; i < g->n; i++) {
+		ctx = g->ctx[i];
+		if (ctx->group_state != GROUP_READY)
+			continue;
+		if (first == NULL) {
+			first = ctx;
+			continue;
+		}
+		err = snd_pcm_link(first->handle, ctx->handle);
+		if (err < 0) {
+			fprintf(stderr, _("%s: cannot link to %s (%s), aligning by timestamps only\n"),
+				snd_pcm_name(ctx->handle),
+				snd_pcm_name(first->handle), snd_strerror(err));
+			continue;
+		}
+		first->group_linked = ctx->group_linked = 1;
+	}
+	for (i = 0; i < g->n; i++) {
+		ctx = g->ctx[i];
+		if (ctx->group_state != GROUP_READY)
+			continue;
+		group_log(ctx, "device %d %u %d %s\n", i,
+			  ctx->hwparams.rate, ctx->group_linked,
+			  snd_pcm_name(ctx->handle));
+		group_log(ctx, "clock %d %s\n", i,
+			  ctx->tstamp_clock == TIDX_CLOCK_MONOTONIC ?
+			  "monotonic" : "realtime");
+	}
+}
+
+/* meet the rest of the group, state is GROUP_READY or GROUP_FAILED */
+static void group_sync(struct capture_ctx *ctx, int state)
+{
+	struct capture_group *g = ctx->group;
+
+	if (g == NULL || ctx->group_state != GROUP_SETUP)
+		return;
+	ctx->group_state = state;
+	if (pthread_barrier_wait(&g->ready) == PTHREAD_BARRIER_SERIAL_THREAD)
+		group_link(g);
+	pthread_barrier_wait(&g->go);
+	if (state == GROUP_READY)
+		ctx->group_state = GROUP_SYNCED;
+}
+
+/*
+ *  timestamps
+ */
+
+/* "<name>.tidx" with its header, NULL with errno if it cannot be created */
+static FILE *tidx_create(struct capture_ctx *ctx, char *name)
+{
+	char path[PATH_MAX+sizeof(".tidx")];
+	TidxHeader h;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "%s.tidx", name);
+	if ((f = fopen(path, "w")) == NULL)
+		return NULL;
+	memset(&h, 0, sizeof(h));
+	h.magic = TIDX_MAGIC;
+	h.version = LE_INT(TIDX_VERSION);
+	h.rate = LE_INT(ctx->hwparams.rate);
+	h.channels = LE_INT(ctx->hwparams.channels);
+	h.clock = LE_INT(ctx->tstamp_clock);
+	h.record_size = LE_INT(sizeof(TidxRecord));
+	fwrite(&h, sizeof(h), 1, f);
+	return f;
+}
+
+static void tidx_write(struct capture_ctx *ctx, off64_t frame,
+		       snd_htimestamp_t *ts, snd_htimestamp_t *sts,
+		       snd_pcm_uframes_t avail, int flags)
+{
+	TidxRecord r;
+
+	r.frame = LE_LONG(frame - ctx->tl_file);
+	r.tstamp = LE_LONG(ts->tv_sec * 1000000000LL + ts->tv_nsec);
+	r.status_tstamp = LE_LONG(sts->tv_sec * 1000000000LL + sts->tv_nsec);
+	r.avail = LE_INT(avail);
+	r.flags = LE_INT(flags);
+	fwrite(&r, sizeof(r), 1, ctx->tidx);
+}
+
+/*
+ * the index and the gain curve are just by-products, don't give up the
+ * capture over them
+ */
+static void sidecar_close(FILE *f, char *name, char *ext, char *what)
+{
+	if (f == NULL)
+		return;
+	if (ferror(f) | fclose(f))
+		fprintf(stderr, _("%s%s: write error, %s incomplete\n"),
+			name, ext, what);
+}
+
+static void tidx_close(struct capture_ctx *ctx, char *name)
+{
+	sidecar_close(ctx->tidx, name, ".tidx", _("timestamps"));
+	ctx->tidx = NULL;
+}
+
+/*
+ *  AGC gain curve
+ */
+
+/* "<name>.gain", NULL with errno if it cannot be created */
+static FILE *gain_create(char *name)
+{
+	char path[PATH_MAX+sizeof(".gain")];
+
+	snprintf(path, sizeof(path), "%s.gain", name);
+	return fopen(path, "w");
+}
+
+static void gain_close(struct capture_ctx *ctx, char *name)
+{
+	if (ctx->agc_dsp)
+		agc_log(ctx->agc_dsp, NULL);
+	sidecar_close(ctx->agc_log, name, ".gain", _("gain curve"));
+	ctx->agc_log = NULL;
+}
+
+/*
+ * Note when the hardware had captured the frames read so far plus those
+ * still waiting in the buffer, and the trigger time after every (re)start,
+ * in the group's timeline and in the timestamp index.  Timeline lines are
+ * "<device> <frame> <seconds>", frames counted from the start of the
+ * capture across all the files of the device.  The AGC writes every frame
+ * agc_delay() frames later than it was captured, the frames are those of
+ * the files.
+ */
+static void capture_tstamp(struct capture_ctx *ctx)
+{
+	snd_pcm_status_t *status;
+	snd_pcm_uframes_t avail;
+	snd_htimestamp_t ts, sts;
+	off64_t late = ctx->agc_dsp ? agc_delay(ctx->agc_dsp) : 0;
+
+	snd_pcm_status_alloca(&status);
+	if (ctx->tl_restart && snd_pcm_status(ctx->handle, status) == 0) {
+		snd_pcm_status_get_trigger_htstamp(status, &ts);
+		if (ctx->group)
+			group_log(ctx, "start %d %lld %ld.%09ld\n",
+				  ctx->group_index,
+				  (long long)(ctx->tl_start + late),
+				  (long)ts.tv_sec, (long)ts.tv_nsec);
+		if (ctx->tidx && ctx->tl_start + late >= ctx->tl_file)
+			tidx_write(ctx, ctx->tl_start + late, &ts, &ts, 0,
+				   TIDX_START);
+		ctx->tl_restart = 0;
+	}
+	if (snd_pcm_htimestamp(ctx->handle, &avail, &ts) < 0)
+		return;
+	if (ctx->group)
+		group_log(ctx, "%d %lld %ld.%09ld\n", ctx->group_index,
+			  (long long)(ctx->tl_frames + late + avail),
+			  (long)ts.tv_sec, (long)ts.tv_nsec);
+	if (ctx->tidx) {
+		sts = ts;
+		if (snd_pcm_status(ctx->handle, status) == 0)
+			snd_pcm_status_get_htstamp(status, &sts);
+		tidx_write(ctx, ctx->tl_frames + late + avail, &ts, &sts,
+			   avail, 0);
+	}
+}
+
+/*
+ *  file rotation
+ */
+
+/* "name-tag.ext" */
+static void tagged_file_name(char *name, char *namebuf, size_t namelen,
+			     const char *tag)
 {
 	/* get a copy of the original filename */
 	char *s;
@@ -935,36 +2925,413 @@ static int new_capture_file(char *name, char *namebuf, size_t namelen,
 	else if (*s == '/')
 		s = buf + strlen(buf);
 
-	/* upon first jump to this if block rename the first file */
-	if (filecount == 1) {
-		if (*s)
-			snprintf(namebuf, namelen, "%s-01.%s", buf, s);
-		else
-			snprintf(namebuf, namelen, "%s-01", buf);
-		remove(namebuf);
-		rename(name, namebuf);
-		filecount = 2;
+	if (*s)
+		snprintf(namebuf, namelen, "%s-%s.%s", buf, tag, s);
+	else
+		snprintf(namebuf, namelen, "%s-%s", buf, tag);
+}
+
+/* "name-NN.ext", the name of file "index" of a capture split into files */
+static void capture_file_name(char *name, char *namebuf, size_t namelen,
+			      int index)
+{
+	char tag[16];
+
+	snprintf(tag, sizeof(tag), "%02i", index);
+	tagged_file_name(name, namebuf, namelen, tag);
+}
+
+/* "name-chNN.ext", channel "c" (from 0) of a PLANAR_SPLIT file */
+static void channel_file_name(char *name, char *namebuf, size_t namelen,
+			      unsigned int c)
+{
+	char tag[16];
+
+	snprintf(tag, sizeof(tag), "ch%02u", c + 1);
+	tagged_file_name(name, namebuf, namelen, tag);
+}
+
+/* the files a capture file is made of, one per channel with PLANAR_SPLIT */
+static unsigned int file_count(struct capture_ctx *ctx)
+{
+	return ctx->hwparams.channels / ctx->file_channels;
+}
+
+/* data bytes of a file that begins with count bytes left to capture */
+static off64_t file_rest(struct capture_ctx *ctx, off64_t count)
+{
+	off64_t frame = ctx->bits_per_frame / 8;
+	off64_t rest = fmt_rec_table[ctx->file_type].max_filesize;
+
+	/* that much in each of the channel files */
+	if (rest <= LLONG_MAX / file_count(ctx))
+		rest *= file_count(ctx);
+	if (ctx->rotate_time &&
+	    rest > (off64_t)ctx->rotate_time * ctx->hwparams.rate * frame)
+		rest = (off64_t)ctx->rotate_time * ctx->hwparams.rate * frame;
+	if (rest >= count)
+		return count;
+	/* so that the next file takes over at a frame boundary */
+	return rest - rest % frame;
+}
+
+/* name with its header written for rest bytes of data, -1 and errno if not */
+static int file_create(struct capture_ctx *ctx, char *name, off64_t rest)
+{
+	struct fmt_capture *fmt = &fmt_rec_table[ctx->file_type];
+	off64_t len = rest < ROTATE_PREALLOC ? rest : ROTATE_PREALLOC;
+	int fd;
+
+	remove(name);
+	if ((fd = open64(name, O_WRONLY | O_CREAT, 0644)) == -1)
+		return -1;
+	errno = 0;
+	if (fmt->start && fmt->start(ctx, fd, rest) < 0) {
+		/* a short header write leaves errno alone */
+		if (!errno)
+			errno = EIO;
+		close(fd);
+		return -1;
 	}
+	/* beyond the end of file, the batched sink takes over from there */
+	fallocate64(fd, FALLOC_FL_KEEP_SIZE, lseek64(fd, 0, SEEK_CUR), len);
+	return fd;
+}
 
-	/* name of the current file */
-	if (*s)
-		snprintf(namebuf, namelen, "%s-%02i.%s", buf, filecount, s);
+/* the channel files of f, f->fd being the first */
+static int split_create(struct capture_ctx *ctx, struct capture_file *f)
+{
+	unsigned int c, n = file_count(ctx);
+	char name[PATH_MAX+1];
+
+	if ((f->chfd = malloc(n * sizeof(*f->chfd))) == NULL)
+		return -1;
+	for (c = 0; c < n; c++) {
+		channel_file_name(f->name, name, sizeof(name), c);
+		if ((f->chfd[c] = file_create(ctx, name, f->rest / n)) == -1) {
+			while (c-- > 0)
+				close(f->chfd[c]);
+			free(f->chfd);
+			f->chfd = NULL;
+			return -1;
+		}
+	}
+	f->fd = f->chfd[0];
+	return 0;
+}
+
+/*
+ * Create file f->index for f->rest bytes of data: its header written and
+ * the first stretch preallocated, the index and the gain curve next to it.
+ * With PLANAR_SPLIT that is a file per channel, named after f->name.
+ * Every file but the first is set up on the rotation thread, so a failure
+ * only leaves its errno in f->err, for the capture thread to report.
+ */
+static int rotate_setup(struct capture_ctx *ctx, struct capture_file *f)
+{
+	f->tidx = f->gain = NULL;
+	f->chfd = NULL;
+	f->bytes = 0;
+	f->err = 0;
+	if (f->index == 1)
+		snprintf(f->name, sizeof(f->name), "%s", ctx->rot.orig_name);
 	else
-		snprintf(namebuf, namelen, "%s-%02i", buf, filecount);
+		capture_file_name(ctx->rot.orig_name, f->name,
+				  sizeof(f->name), f->index);
+	if (ctx->planar == PLANAR_SPLIT) {
+		if (split_create(ctx, f) < 0)
+			goto fail;
+	} else if ((f->fd = file_create(ctx, f->name, f->rest)) == -1)
+		goto fail;
+	if (ctx->tindex && (f->tidx = tidx_create(ctx, f->name)) == NULL)
+		goto fail;
+	if (ctx->agc_dsp && (f->gain = gain_create(f->name)) == NULL)
+		goto fail;
+	return 0;
+
+fail:
+	f->err = errno ? errno : EIO;
+	if (f->tidx)
+		fclose(f->tidx);
+	if (f->chfd) {
+		unsigned int c;
+
+		for (c = 0; c < file_count(ctx); c++)
+			close(f->chfd[c]);
+		free(f->chfd);
+		f->chfd = NULL;
+	} else if (f->fd != -1)
+		close(f->fd);
+	f->fd = -1;
+	return -1;
+}
+
+/*
+ * Complete the headers of a file bytes long, so many bytes in each of
+ * chfd's channel files if there are, and close it.
+ */
+static void file_end(struct capture_ctx *ctx, int fd, int *chfd, off64_t bytes)
+{
+	struct fmt_capture *fmt = &fmt_rec_table[ctx->file_type];
+	unsigned int c, n = chfd ? file_count(ctx) : 1;
+
+	for (c = 0; c < n; c++) {
+		if (chfd)
+			fd = chfd[c];
+		if (fmt->end)
+			fmt->end(ctx, fd, bytes / n);
+		else
+			close(fd);
+	}
+	free(chfd);
+}
+
+/* a file set up too late, the capture stopped before it got there */
+static void rotate_discard(struct capture_ctx *ctx, struct capture_file *f)
+{
+	char path[PATH_MAX+sizeof(".tidx")];
+	unsigned int c;
+
+	if (f->tidx) {
+		fclose(f->tidx);
+		snprintf(path, sizeof(path), "%s.tidx", f->name);
+		remove(path);
+	}
+	if (f->gain) {
+		fclose(f->gain);
+		snprintf(path, sizeof(path), "%s.gain", f->name);
+		remove(path);
+	}
+	if (!f->chfd) {
+		close(f->fd);
+		remove(f->name);
+		return;
+	}
+	for (c = 0; c < file_count(ctx); c++) {
+		close(f->chfd[c]);
+		channel_file_name(f->name, path, sizeof(path), c);
+		remove(path);
+	}
+	free(f->chfd);
+}
+
+/*
+ * Complete the header of a full file and close it, and rename the first
+ * file, which got the plain name when it was not known yet that the
+ * capture would be split, to "-01" like the rest.
+ */
+static void rotate_finish(struct capture_ctx *ctx, struct capture_file *f)
+{
+	static char *ext[] = { "", ".tidx", ".gain" };
+	char from[PATH_MAX+sizeof(".tidx")], to[PATH_MAX+sizeof(".tidx")];
+	char name[PATH_MAX+1];
+	unsigned int c;
+	int i, has[3];
+
+	has[0] = f->chfd == NULL;
+	has[1] = f->tidx != NULL;
+	has[2] = f->gain != NULL;
+	sidecar_close(f->tidx, f->name, ".tidx", _("timestamps"));
+	sidecar_close(f->gain, f->name, ".gain", _("gain curve"));
+	file_end(ctx, f->fd, f->chfd, f->bytes);
+	if (f->index != 1)
+		return;
+	capture_file_name(f->name, name, sizeof(name), 1);
+	for (i = 0; i < 3; i++) {
+		if (!has[i])
+			continue;
+		snprintf(from, sizeof(from), "%s%s", f->name, ext[i]);
+		snprintf(to, sizeof(to), "%s%s", name, ext[i]);
+		remove(to);
+		rename(from, to);
+	}
+	for (c = 0; !has[0] && c < file_count(ctx); c++) {
+		channel_file_name(f->name, from, sizeof(from), c);
+		channel_file_name(name, to, sizeof(to), c);
+		remove(to);
+		rename(from, to);
+	}
+	if (ctx->group)
+		group_log(ctx, "file %d %lld %s\n", ctx->group_index,
+			  (long long)f->tl_file, name);
+}
+
+/* sets up the next file when asked to and finishes the full ones */
+static void *rotate_thread(void *arg)
+{
+	struct capture_ctx *ctx = arg;
+	struct capture_rotation *rot = &ctx->rot;
+
+	pthread_mutex_lock(&rot->lock);
+	for (;;) {
+		if (rot->want && !rot->quit) {
+			rot->want = 0;
+			pthread_mutex_unlock(&rot->lock);
+			rotate_setup(ctx, &rot->next);
+			pthread_mutex_lock(&rot->lock);
+			rot->ready = 1;
+		} else if (rot->tail != rot->flushed) {
+			pthread_mutex_unlock(&rot->lock);
+			rotate_finish(ctx, &rot->done[rot->tail % ROTATE_FILES]);
+			pthread_mutex_lock(&rot->lock);
+			rot->tail++;
+		} else if (rot->quit) {
+			break;
+		} else {
+			pthread_cond_wait(&rot->cond, &rot->lock);
+			continue;
+		}
+		pthread_cond_broadcast(&rot->cond);
+	}
+	pthread_mutex_unlock(&rot->lock);
+	if (rot->ready && rot->next.fd != -1)
+		rotate_discard(ctx, &rot->next);
+	rot->ready = 0;
+	return NULL;
+}
+
+static void rotate_start(struct capture_ctx *ctx)
+{
+	struct capture_rotation *rot = &ctx->rot;
+	int err;
+
+	rot->head = rot->tail = rot->flushed = 0;
+	rot->want = rot->ready = rot->quit = 0;
+	rot->stalls = 0;
+	pthread_mutex_init(&rot->lock, NULL);
+	pthread_cond_init(&rot->cond, NULL);
+	if ((err = pthread_create(&rot->thread, NULL, rotate_thread, ctx)) != 0) {
+		error(_("cannot start rotation thread: %s"), strerror(err));
+		fatal(ctx);
+	}
+	rot->running = 1;
+}
+
+/* have the file after the current one set up, count bytes from its start */
+static void rotate_want(struct capture_ctx *ctx, off64_t count)
+{
+	struct capture_rotation *rot = &ctx->rot;
+
+	pthread_mutex_lock(&rot->lock);
+	rot->next.index = rot->cur.index + 1;
+	rot->next.rest = file_rest(ctx, count);
+	rot->want = 1;
+	pthread_cond_broadcast(&rot->cond);
+	pthread_mutex_unlock(&rot->lock);
+}
+
+/* the oldest full file is all written, by the ring writer */
+static void rotate_flushed(struct capture_ctx *ctx)
+{
+	struct capture_rotation *rot = &ctx->rot;
+
+	pthread_mutex_lock(&rot->lock);
+	rot->flushed++;
+	pthread_cond_broadcast(&rot->cond);
+	pthread_mutex_unlock(&rot->lock);
+}
 
-	return filecount;
+/* finishes the full files, everything has been written by now */
+static void rotate_stop(struct capture_ctx *ctx)
+{
+	struct capture_rotation *rot = &ctx->rot;
+
+	if (!rot->running)
+		return;
+	pthread_mutex_lock(&rot->lock);
+	rot->quit = 1;
+	rot->flushed = rot->head;
+	pthread_cond_broadcast(&rot->cond);
+	pthread_mutex_unlock(&rot->lock);
+	pthread_join(rot->thread, NULL);
+	pthread_cond_destroy(&rot->cond);
+	pthread_mutex_destroy(&rot->lock);
+	rot->running = 0;
+	if (rot->stalls)
+		printf("arecord: waited %lu times for the next file\n",
+		       rot->stalls);
 }
 
-static void capture(char *orig_name)
+/* the capture goes to rot->cur from the next frame on */
+static void file_begin(struct capture_ctx *ctx)
 {
+	struct capture_file *f = &ctx->rot.cur;
+
+	ctx->fd = f->fd;
+	ctx->chfd = f->chfd;
+	ctx->fdcount = 0;
+	ctx->tidx = f->tidx;
+	ctx->tl_file = f->tl_file = ctx->tl_frames;
+	ctx->agc_log = f->gain;
+	if (ctx->agc_dsp)
+		agc_log(ctx->agc_dsp, f->gain);
+	if (ctx->group)
+		group_log(ctx, "file %d %lld %s\n", ctx->group_index,
+			  (long long)ctx->tl_frames, f->name);
+	if (!ctx->ring_chunks) {
+		ctx->split_fd = f->chfd;
+		if (sink_open(ctx, ctx->fd) < 0) {
+			perror(f->name);
+			fatal(ctx);
+		}
+	}
+}
+
+/*
+ * The current file is full: go on in the next one, which the rotation
+ * thread has normally long set up, and leave this one to it.  Without a
+ * ring only the sink's last buffer is written here.
+ */
+static void rotate_switch(struct capture_ctx *ctx, off64_t count)
+{
+	struct capture_rotation *rot = &ctx->rot;
+	struct capture_file *old;
+
+	pthread_mutex_lock(&rot->lock);
+	if (!rot->ready || rot->head - rot->tail == ROTATE_FILES)
+		rot->stalls++;
+	while (!rot->ready || rot->head - rot->tail == ROTATE_FILES)
+		pthread_cond_wait(&rot->cond, &rot->lock);
+	pthread_mutex_unlock(&rot->lock);
+	if (rot->next.err) {
+		errno = rot->next.err;
+		perror(rot->next.name);
+		fatal(ctx);
+	}
+	if (!ctx->ring_chunks)
+		sink_close(ctx, rot->cur.name);
+
+	old = &rot->done[rot->head % ROTATE_FILES];
+	*old = rot->cur;
+	old->fd = ctx->fd;
+	old->chfd = ctx->chfd;
+	old->tidx = ctx->tidx;
+	old->gain = ctx->agc_log;
+	old->bytes = ctx->fdcount;
+	rot->cur = rot->next;
+	file_begin(ctx);
+
+	pthread_mutex_lock(&rot->lock);
+	rot->ready = 0;
+	rot->head++;
+	if (!ctx->ring_chunks)
+		rot->flushed = rot->head;
+	pthread_cond_broadcast(&rot->cond);
+	pthread_mutex_unlock(&rot->lock);
+	if (count > rot->cur.rest)
+		rotate_want(ctx, count - rot->cur.rest);
+}
+
+static void capture(struct capture_ctx *ctx, char *orig_name)
+{
+	struct capture_rotation *rot = &ctx->rot;
+	struct fmt_capture *fmt = &fmt_rec_table[ctx->file_type];
 	int tostdout=0;		/* boolean which describes output stream */
-	int filecount=0;	/* number of files written */
 	char *name = orig_name;	/* current filename */
-	char namebuf[PATH_MAX+1];
 	off64_t count, rest;		/* number of bytes to capture */
 
 	/* get number of bytes to capture */
-	count = calc_count();
+	count = calc_count(ctx);
 	if (count == 0)
 		count = LLONG_MAX;
 	/* WAVE-file should be even (I'm not sure), but wasting one byte
@@ -976,72 +3343,161 @@ static void capture(char *orig_name)
 
     printf("arecord: Recording audio to: %s\n", name);
 	/* setup sound hardware */
-	set_params();
+	set_params(ctx);
+	/* encoded on the way into the file, by whichever thread writes it */
+	if (ctx->file_type == FORMAT_FLAC)
+		ctx->sink_type = SINK_FLAC;
+	if (ctx->planar == PLANAR_SPLIT) {
+		if (!name || !strcmp(name, "-") || ctx->file_type == FORMAT_FLAC) {
+			error(_("per-channel files cannot go to stdout or be FLAC"));
+			fatal(ctx);
+		}
+		ctx->sink_type = SINK_SPLIT;
+	}
+	if (ctx->tap) {
+		struct tap_layout layout;
+		int err;
+
+		layout.channels = ctx->hwparams.channels;
+		layout.bytes = ctx->bits_per_sample / 8;
+		layout.stride = ctx->planar == PLANAR_SPLIT ?
+				ctx->chunk_bytes / ctx->hwparams.channels : 0;
+		layout.format = ctx->hwparams.format;
+		err = tap_begin(ctx->tap, ctx->chunk_bytes, &layout);
+		if (err < 0) {
+			error(_("tap error: %s"), strerror(-err));
+			fatal(ctx);
+		}
+	}
+	ctx->header_every = (off64_t)HEADER_UPDATE_TIME * ctx->hwparams.rate *
+		       ctx->bits_per_frame / 8;
 
+	rot->orig_name = orig_name;
+	rot->cur.index = 1;
 	/* write to stdout? */
 	if (!name || !strcmp(name, "-")) {
-		fd = fileno(stdout);
-		name = "stdout";
 		tostdout=1;
-		if (count > fmt_rec_table[file_type].max_filesize)
-			count = fmt_rec_table[file_type].max_filesize;
-	}
-
-	do {
-		/* open a file to write */
-		if(!tostdout) {
-			/* upon the second file we start the numbering scheme */
-			if (filecount) {
-				filecount = new_capture_file(orig_name, namebuf,
-							     sizeof(namebuf),
-							     filecount);
-				name = namebuf;
-			}
-
-			/* open a new file */
-			remove(name);
-			if ((fd = open64(name, O_WRONLY | O_CREAT, 0644)) == -1) {
-				perror(name);
-				exit(EXIT_FAILURE);
-			}
-			filecount++;
+		ctx->header_every = 0;
+		if (count > fmt->max_filesize)
+			count = fmt->max_filesize;
+		/* no positional writes into a pipe */
+		if (ctx->file_type != FORMAT_FLAC)
+			ctx->sink_type = SINK_WRITE;
+		ctx->fd = rot->cur.fd = fileno(stdout);
+		rot->cur.tidx = rot->cur.gain = NULL;
+		rot->cur.chfd = NULL;
+		rot->cur.rest = count;
+		strcpy(rot->cur.name, "stdout");
+		if (fmt->start && fmt->start(ctx, rot->cur.fd, count) < 0) {
+			error(_("write error"));
+			fatal(ctx);
+		}
+	} else {
+		/* the first file, those after it are set up in the background */
+		rot->cur.rest = file_rest(ctx, count);
+		if (rotate_setup(ctx, &rot->cur) < 0) {
+			errno = rot->cur.err;
+			perror(rot->cur.name);
+			fatal(ctx);
 		}
+		ctx->fd = rot->cur.fd;
+		ctx->chfd = rot->cur.chfd;
+		if (count > rot->cur.rest) {
+			rotate_start(ctx);
+			rotate_want(ctx, count - rot->cur.rest);
+		}
+	}
+	name = rot->cur.name;
 
-		rest = count;
-		if (rest > fmt_rec_table[file_type].max_filesize)
-			rest = fmt_rec_table[file_type].max_filesize;
-
-		/* setup sample header */
-		if (fmt_rec_table[file_type].start)
-			fmt_rec_table[file_type].start(fd, rest);
-
-		/* capture */
-		fdcount = 0;
-		while (rest > 0 && capture_stop == 0) {
-			size_t c = (rest <= (off64_t)chunk_bytes) ?
-				(size_t)rest : chunk_bytes;
-			size_t f = c * 8 / bits_per_frame;
-			if (pcm_read(audiobuf, f) != f)
+	if (ctx->ring_chunks)
+		ring_start(ctx);
+	group_sync(ctx, GROUP_READY);
+	file_begin(ctx);
+
+	/* capture */
+	rest = rot->cur.rest;
+	/* a stop still takes what the PCM has, until a read comes back short */
+	while (count > 0) {
+		size_t c = (rest <= (off64_t)ctx->chunk_bytes) ?
+			(size_t)rest : ctx->chunk_bytes;
+		size_t f = c * 8 / ctx->bits_per_frame;
+		u_char *buf = ctx->ring_chunks ? ring_slot(ctx) : ctx->audiobuf;
+		ssize_t got;
+		int last = 0;
+		if (ctx->mmap_flag && ctx->interleaved) {
+			/* goes to fd directly unless there is a ring */
+			got = pcm_mmap_read(ctx, ctx->ring_chunks ? buf : NULL,
+					    f, name);
+		} else
+			got = pcm_read(ctx, buf, f);
+		if ((size_t)got < f) {
+			/* stopped half way, what was read still goes out */
+			if (got == 0)
 				break;
-			if (write(fd, audiobuf, c) != c) {
-				perror(name);
-				exit(EXIT_FAILURE);
-			}
-			count -= c;
-			rest -= c;
-			fdcount += c;
+			f = got;
+			c = f * ctx->bits_per_frame / 8;
+			last = 1;
 		}
-
-		/* finish sample container */
-		if (fmt_rec_table[file_type].end && !tostdout) {
-			fmt_rec_table[file_type].end(fd);
-			fd = -1;
+		if (!ctx->mmap_flag || !ctx->interleaved) {
+			if (ctx->agc_dsp)
+				agc_process(ctx->agc_dsp, buf, f);
+			tap_copy(ctx, buf, f, ctx->tl_frames - f);
+			if (!ctx->ring_chunks)
+				sink_write(ctx, buf, c, name);
 		}
-
-		/* repeat the loop when format is raw without timelimit or
-		 * requested counts of data are recorded
-		 */
-	} while ( ((file_type == FORMAT_RAW && !timelimit) || count > 0) &&
-        capture_stop == 0);
+		if (ctx->ring_chunks)
+			ring_push(ctx, c);
+		if (ctx->group || ctx->tidx)
+			capture_tstamp(ctx);
+		count -= c;
+		rest -= c;
+		ctx->fdcount += c;
+		if (last || (rest == 0 && capture_stopped(ctx)))
+			break;
+		if (rest == 0 && count > 0) {
+			/* on in the next file, from the very next frame */
+			rotate_switch(ctx, count);
+			rest = rot->cur.rest;
+		}
+	}
+	/* the frames the AGC still holds back end the file, if it has room */
+	while (ctx->agc_dsp && rest > 0) {
+		size_t c = (rest <= (off64_t)ctx->chunk_bytes) ?
+			(size_t)rest : ctx->chunk_bytes;
+		size_t f = c * 8 / ctx->bits_per_frame;
+		u_char *buf = ctx->ring_chunks ? ring_slot(ctx) : ctx->audiobuf;
+		if ((f = agc_flush(ctx->agc_dsp, buf, f)) == 0)
+			break;
+		c = f * ctx->bits_per_frame / 8;
+		tap_copy(ctx, buf, f, ctx->tl_frames);
+		if (ctx->ring_chunks)
+			ring_push(ctx, c);
+		else
+			sink_write(ctx, buf, c, name);
+		rest -= c;
+		ctx->fdcount += c;
+	}
+	if (ctx->ring_chunks) {
+		ring_barrier(ctx, RING_DRAIN);
+		if (ctx->write_error) {
+			errno = ctx->write_error;
+			perror(name);
+			fatal(ctx);
+		}
+	} else
+		sink_close(ctx, name);
+	tidx_close(ctx, name);
+	gain_close(ctx, name);
+	rotate_stop(ctx);
+
+	/* finish sample container */
+	if ((fmt->end || ctx->chfd) && !tostdout) {
+		file_end(ctx, ctx->fd, ctx->chfd, ctx->fdcount);
+		ctx->chfd = NULL;
+		ctx->fd = -1;
+	}
+	if (ctx->ring_chunks)
+		ring_stop(ctx);
+	batch_release(ctx);
     printf("arecord: Stopping capturing audio.\n");
 }
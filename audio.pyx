@@ -1,10 +1,1451 @@
-cdef extern int run(char *filename) nogil
-cdef extern void stop() nogil
+cdef extern from *:
+    ctypedef struct capture_ctx "struct capture_ctx"
 
-def capture(filename):
+cdef extern capture_ctx *capture_ctx_create() nogil
+cdef extern void capture_ctx_destroy(capture_ctx *ctx) nogil
+cdef extern int capture_ctx_run(capture_ctx *ctx, char *filename) nogil
+cdef extern void capture_ctx_stop(capture_ctx *ctx) nogil
+cdef extern int capture_ctx_set_device(capture_ctx *ctx, char *name) nogil
+cdef extern void capture_ctx_set_ring_chunks(capture_ctx *ctx, int chunks) nogil
+cdef extern unsigned capture_ctx_ring_high_water(capture_ctx *ctx) nogil
+cdef extern void capture_ctx_set_mmap(capture_ctx *ctx, int enable) nogil
+cdef extern void capture_ctx_set_channels(capture_ctx *ctx, unsigned channels) nogil
+cdef extern void capture_ctx_set_planar(capture_ctx *ctx, int mode) nogil
+cdef extern void capture_ctx_set_sink(capture_ctx *ctx, int type,
+        int periods) nogil
+cdef extern void capture_ctx_set_meter(capture_ctx *ctx, int enable) nogil
+cdef extern void capture_ctx_set_tindex(capture_ctx *ctx, int enable) nogil
+cdef extern void capture_ctx_set_file_type(capture_ctx *ctx, int type) nogil
+cdef extern void capture_ctx_set_rotate(capture_ctx *ctx, unsigned seconds) nogil
+cdef extern void capture_ctx_set_agc(capture_ctx *ctx, int enable,
+        double target, double max_gain) nogil
+cdef extern int capture_ctx_get_levels(capture_ctx *ctx, float *peak,
+        float *rms, int n) nogil
+cdef extern int capture_multi_run(capture_ctx **ctx, char **filename, int n,
+        char *timeline) nogil
+
+cdef extern from "capture.h":
+    ctypedef struct capture_config_t "struct capture_config":
+        char *device
+        unsigned rate
+        int format
+        unsigned channels
+        unsigned period_time, buffer_time
+        unsigned long period_frames, buffer_frames
+        int avail_min, start_delay, stop_delay
+        unsigned long avail_min_frames, start_threshold, stop_threshold
+    void capture_config_preset(capture_config_t *cfg, int preset) nogil
+    int capture_ctx_set_config(capture_ctx *ctx, capture_config_t *cfg) nogil
+    int capture_ctx_get_config(capture_ctx *ctx, capture_config_t *cfg) nogil
+
+cdef extern from "tap.h":
+    ctypedef struct tap "struct tap"
+    cdef struct tap_layout:
+        unsigned channels
+        unsigned bytes
+        size_t stride
+        int format
+    cdef struct tap_slot:
+        unsigned char *data
+        size_t frames
+        long long frame
+        unsigned long skip
+        unsigned seq
+    tap *tap_new(unsigned slots)
+    void tap_free(tap *t)
+    void tap_end(tap *t)
+    int tap_next(tap *t, tap_slot *slot, unsigned max, int timeout_ms) nogil
+    int tap_release(tap *t, unsigned seq)
+    void tap_get_layout(tap *t, tap_layout *layout)
+    void tap_stats(tap *t, unsigned long *periods, unsigned long *dropped)
+
+cdef extern void capture_ctx_set_tap(capture_ctx *ctx, tap *t) nogil
+
+cdef extern from "alsa/asoundlib.h":
+    int snd_pcm_format_value(char *name) nogil
+    char *snd_pcm_format_name(int format) nogil
+    enum: SND_PCM_FORMAT_S8, SND_PCM_FORMAT_U8, SND_PCM_FORMAT_S16_LE
+    enum: SND_PCM_FORMAT_U16_LE, SND_PCM_FORMAT_S24_LE, SND_PCM_FORMAT_S32_LE
+    enum: SND_PCM_FORMAT_U32_LE, SND_PCM_FORMAT_FLOAT_LE
+    enum: SND_PCM_FORMAT_FLOAT64_LE
+
+cdef extern from "stdlib.h":
+    void *malloc(size_t size)
+    void free(void *ptr)
+
+cdef extern from "time.h":
+    ctypedef long time_t
+    cdef struct timespec:
+        time_t tv_sec
+        long tv_nsec
+    enum: CLOCK_MONOTONIC, CLOCK_REALTIME
+    int clock_gettime(int clk_id, timespec *tp) nogil
+
+cdef extern from "errno.h":
+    enum: EPIPE
+    enum: ENOMEM
+
+cdef extern from "Python.h":
+    int PyErr_CheckSignals() except -1
+    int PyObject_GetBuffer(object obj, Py_buffer *view, int flags) except -1
+    void PyBuffer_Release(Py_buffer *view)
+    enum: PyBUF_SIMPLE, PyBUF_WRITABLE, PyBUF_ND, PyBUF_STRIDES, PyBUF_FORMAT
+
+cdef extern from "pacer.h":
+    cdef struct pacer:
+        unsigned seq
+    cdef struct pacer_stats:
+        unsigned long ticks
+        unsigned long skipped
+        double late_mean
+        double late_max
+        double jitter
+    void pacer_init(pacer *s, int fps)
+    unsigned pacer_wait(pacer *s) nogil
+    void pacer_get_stats(pacer *s, pacer_stats *st)
+
+cdef extern from "screen.h":
+    ctypedef struct screen "struct screen"
+    cdef struct screen_frame:
+        unsigned char *data
+        long long tstamp
+        unsigned seq
+        unsigned skip
+    screen *screen_open(char *display, int x, int y, int width, int height,
+            int fps, int buffers)
+    void screen_close(screen *s)
+    int screen_start(screen *s)
+    void screen_stop(screen *s) nogil
+    int screen_next(screen *s, screen_frame *f, int timeout_ms) nogil
+    void screen_release(screen *s)
+    void screen_geometry(screen *s, int *width, int *height, int *stride)
+    void screen_stats(screen *s, unsigned long *frames,
+            unsigned long *skipped, unsigned long *dropped)
+    void screen_timing(screen *s, pacer_stats *st)
+
+cdef extern from "frames.h":
+    enum: TILE_KEY
+    ctypedef struct tile_coder "struct tile_coder"
+    tile_coder *tile_coder_new(int width, int height, int stride, int keyint)
+    void tile_coder_free(tile_coder *c)
+    size_t tile_encode(tile_coder *c, unsigned char *frame,
+            unsigned char **out) nogil
+    int tile_decode(tile_coder *c, unsigned char *data, size_t len,
+            unsigned char **frame) nogil
+    void tile_stats(tile_coder *c, unsigned long *keyframes,
+            unsigned long *tiles)
+
+cdef extern from "vidfile.h":
+    enum: VF_RAW, VF_TILES, VF_SCC, VF_KEY
+    cdef struct vf_frame:
+        unsigned char *data
+        size_t size
+        unsigned skip
+        unsigned flags
+        long long tstamp
+    ctypedef struct vf_writer "struct vf_writer"
+    ctypedef struct vf_reader "struct vf_reader"
+    vf_writer *vf_create(char *path, int width, int height, int stride,
+            int fps, int codec)
+    int vf_write(vf_writer *w, void *data, size_t size, unsigned skip,
+            long long tstamp, unsigned flags) nogil
+    int vf_finish(vf_writer *w) nogil
+    vf_reader *vf_open(char *path)
+    void vf_close(vf_reader *r)
+    void vf_geometry(vf_reader *r, int *width, int *height, int *stride,
+            int *fps, int *codec)
+    unsigned vf_frames(vf_reader *r)
+    int vf_get_frame(vf_reader *r, unsigned i, vf_frame *f)
+    int vf_pixels(vf_reader *r, unsigned i, unsigned char **pixels) nogil
+
+cdef extern from "export.h":
+    cdef struct export_stats:
+        unsigned images
+        unsigned encoded
+        unsigned linked
+        unsigned interpolated
+    int export_png_c "export_png" (char *video, char *pattern, int threads,
+            int level, int interp, export_stats *st) nogil
+
+cdef extern from "y4m.h":
+    ctypedef struct y4m "struct y4m"
+    y4m *y4m_open(char *path, int width, int height, int fps)
+    y4m *y4m_fdopen(int fd, int width, int height, int fps)
+    int y4m_close(y4m *y) nogil
+    int y4m_write(y4m *y, unsigned char *bgra, int stride,
+            unsigned skip) nogil
+    void y4m_stats(y4m *y, unsigned long *frames, unsigned long *repeated)
+
+cdef extern from "archive.h":
+    cdef struct archive_stats:
+        unsigned frames
+        unsigned keyframes
+        unsigned long long raw
+        unsigned long long bytes
+    int archive_video(char *video, char *archive, int threads, int level,
+            int keyint, archive_stats *st) nogil
+
+cdef extern from "normalize.h":
+    cdef struct norm_stats:
+        int bits
+        int is_float
+        unsigned channels
+        unsigned long long samples
+        double peak
+        double rms
+        double gain
+    int wav_normalize(char *input, char *output, double target, int threads,
+            norm_stats *st) nogil
+
+cdef extern from "interp.h":
+    enum: INTERP_NONE_C "INTERP_NONE"
+    enum: INTERP_BLEND_C "INTERP_BLEND"
+    enum: INTERP_MOTION_C "INTERP_MOTION"
+
+import struct
+
+DEF MAX_CHANNELS = 256
+
+SINK_WRITE = 0
+SINK_BATCH = 1
+
+# what capture() writes, see arecord.c FORMAT_*
+FILE_RAW = 0
+FILE_WAVE = 2
+FILE_RF64 = 4
+FILE_W64 = 5
+FILE_FLAC = 6
+
+# starting points of Capture.set_config(), see capture.h CAPTURE_PRESET_*
+PRESET_DEFAULT = 0
+PRESET_LOW_LATENCY = 1
+PRESET_LOW_WAKEUP = 2
+
+# how the channels are read and written, see arecord.c PLANAR_*
+PLANAR_OFF = 0
+PLANAR_INTERLEAVE = 1
+PLANAR_SPLIT = 2
+
+# the struct module types of the sample formats in a Stream's periods, the
+# machine is little endian; other formats come as bytes
+_SAMPLE_TYPES = {SND_PCM_FORMAT_S8: b"b", SND_PCM_FORMAT_U8: b"B",
+        SND_PCM_FORMAT_S16_LE: b"h", SND_PCM_FORMAT_U16_LE: b"H",
+        SND_PCM_FORMAT_S24_LE: b"i", SND_PCM_FORMAT_S32_LE: b"i",
+        SND_PCM_FORMAT_U32_LE: b"I", SND_PCM_FORMAT_FLOAT_LE: b"f",
+        SND_PCM_FORMAT_FLOAT64_LE: b"d"}
+
+cdef class Capture:
+    """
+    One audio capture.  Any number of them can record at the same time, each
+    run() from its own thread; stop() may be called from any thread.
+    """
+    cdef capture_ctx *ctx
+    cdef object live
+
+    def __cinit__(self):
+        self.ctx = capture_ctx_create()
+        if self.ctx is NULL:
+            raise MemoryError()
+
+    def __dealloc__(self):
+        if self.ctx is not NULL:
+            # a reader of the stream is told that it ends
+            if self.live is not None:
+                capture_ctx_set_tap(self.ctx, NULL)
+            capture_ctx_destroy(self.ctx)
+
+    def set_device(self, device):
+        """
+        Captures from the ALSA PCM "device" (e.g. "hw:1,0") instead of
+        "default".
+        """
+        if capture_ctx_set_device(self.ctx, device) < 0:
+            raise MemoryError()
+
+    def configure(self, ring_chunks=0, mmap=False, sink=SINK_WRITE,
+            batch_periods=16, meter=False, tindex=False, agc=False,
+            agc_target=-20.0, agc_max_gain=30.0, file_type=FILE_WAVE,
+            rotate=0, channels=0, planar=PLANAR_OFF):
+        """
+        Sets up the next run(), see capture() for the parameters.
+        """
+        capture_ctx_set_ring_chunks(self.ctx, ring_chunks)
+        capture_ctx_set_mmap(self.ctx, 1 if mmap else 0)
+        capture_ctx_set_sink(self.ctx, sink, batch_periods)
+        capture_ctx_set_meter(self.ctx, 1 if meter else 0)
+        capture_ctx_set_tindex(self.ctx, 1 if tindex else 0)
+        capture_ctx_set_agc(self.ctx, 1 if agc else 0, agc_target,
+                agc_max_gain)
+        capture_ctx_set_file_type(self.ctx, file_type)
+        capture_ctx_set_rotate(self.ctx, rotate)
+        capture_ctx_set_channels(self.ctx, channels)
+        capture_ctx_set_planar(self.ctx, planar)
+
+    def set_config(self, preset=PRESET_DEFAULT, device=None, rate=None,
+            format=None, channels=None, period_time=None, buffer_time=None,
+            period_frames=None, buffer_frames=None, avail_min=None,
+            start_delay=None, stop_delay=None):
+        """
+        Sets the device, sample format and latency of the next run(): the
+        preset (PRESET_*) with the arguments given changed, see capture.h.
+
+        PRESET_DEFAULT is 44.1 kHz S16_LE stereo with up to 500 ms of
+        buffer in 4 periods; PRESET_LOW_LATENCY wakes up every 5 ms with a
+        20 ms buffer, PRESET_LOW_WAKEUP twice a second with a 2 s buffer.
+        Times are in microseconds, sizes in frames; the period and the
+        buffer go by time if it is given, by size otherwise, and a size
+        given here replaces the preset's time.  avail_min
+        (-1 for a period) is when a read wakes up, start_delay and
+        stop_delay are arecord's -R and -T.  format is an ALSA name like
+        "S24_LE".  device None keeps the one of set_device().  Raises
+        ValueError for both a time and a size of the period or the buffer,
+        and for what no device could do.
+        """
+        cdef capture_config_t cfg
+        cdef int r
+        if period_time is not None and period_frames is not None:
+            raise ValueError("give the period as a time or as a size")
+        if buffer_time is not None and buffer_frames is not None:
+            raise ValueError("give the buffer as a time or as a size")
+        capture_config_preset(&cfg, preset)
+        if device is not None:
+            cfg.device = device
+        if rate is not None:
+            cfg.rate = rate
+        if format is not None:
+            cfg.format = snd_pcm_format_value(format)
+            if cfg.format < 0:
+                raise ValueError("unknown sample format %s" % format)
+        if channels is not None:
+            cfg.channels = channels
+        if period_time is not None:
+            cfg.period_time = period_time
+        if buffer_time is not None:
+            cfg.buffer_time = buffer_time
+        if period_frames is not None:
+            cfg.period_frames = period_frames
+            cfg.period_time = 0
+        if buffer_frames is not None:
+            cfg.buffer_frames = buffer_frames
+            cfg.buffer_time = 0
+        if avail_min is not None:
+            cfg.avail_min = avail_min
+        if start_delay is not None:
+            cfg.start_delay = start_delay
+        if stop_delay is not None:
+            cfg.stop_delay = stop_delay
+        r = capture_ctx_set_config(self.ctx, &cfg)
+        if r == -ENOMEM:
+            raise MemoryError()
+        if r < 0:
+            raise ValueError("invalid capture configuration")
+
+    def config(self):
+        """
+        Returns what the device came to in the current or last run(), a
+        dict with the keys of set_config() plus "avail_min_frames",
+        "start_threshold" and "stop_threshold" in frames and "wakeups", the
+        reads per second; None before the device was set up.
+        """
+        cdef capture_config_t cfg
+        if capture_ctx_get_config(self.ctx, &cfg) < 0:
+            return None
+        return {"device": cfg.device, "rate": cfg.rate,
+                "format": snd_pcm_format_name(cfg.format),
+                "channels": cfg.channels, "period_time": cfg.period_time,
+                "buffer_time": cfg.buffer_time,
+                "period_frames": cfg.period_frames,
+                "buffer_frames": cfg.buffer_frames,
+                "avail_min": cfg.avail_min, "start_delay": cfg.start_delay,
+                "stop_delay": cfg.stop_delay,
+                "avail_min_frames": cfg.avail_min_frames,
+                "start_threshold": cfg.start_threshold,
+                "stop_threshold": cfg.stop_threshold,
+                "wakeups": float(cfg.rate) / max(cfg.avail_min_frames,
+                    cfg.period_frames)}
+
+    def run(self, filename):
+        """
+        Records to the wav file "filename" until stop() is called, releasing
+        the GIL meanwhile.  Raises IOError if the capture fails.
+        """
+        cdef char *name = filename
+        cdef int r
+        with nogil:
+            r = capture_ctx_run(self.ctx, name)
+        if r != 0:
+            raise IOError("capture to %s failed" % filename)
+
+    def stop(self):
+        """
+        Ends run() within a millisecond or so, with the frames captured up
+        to now; may be called from any thread, also before run().
+        """
+        capture_ctx_stop(self.ctx)
+
+    def ring_high_water(self):
+        """
+        Returns the most chunks that were ever queued in the capture ring.
+        """
+        return capture_ctx_ring_high_water(self.ctx)
+
+    def stream(self, slots=16):
+        """
+        Returns the Stream of the periods this capture reads, live, with a
+        ring of "slots" periods.  Call it before run(); the same Stream
+        goes on over the following runs, unless it is asked for with
+        another number of slots, which ends the old one.
+        """
+        cdef Stream s
+        if self.live is None or self.live.slots != slots:
+            s = Stream(slots)
+            capture_ctx_set_tap(self.ctx, s.t)
+            self.live = s
+        return self.live
+
+    def levels(self):
+        """
+        Returns [(peak, rms), ...] for every channel of the last period, at
+        full scale 1.0 (needs configure(meter=True)).
+        """
+        cdef float peak[MAX_CHANNELS]
+        cdef float rms[MAX_CHANNELS]
+        cdef int n = capture_ctx_get_levels(self.ctx, peak, rms, MAX_CHANNELS)
+        return [(peak[i], rms[i]) for i in range(min(n, MAX_CHANNELS))]
+
+cdef class Period:
+    """
+    A slot of a Stream's ring, a period as it was captured, which exports
+    its samples in place through the buffer protocol (numpy.asarray(),
+    memoryview()).  Once Stream.release() has given it back it exports no
+    more, and its slot goes back to the capture when the last export so far
+    (a numpy array, a memoryview) is gone.
+    """
+    cdef object stream
+    cdef unsigned seq
+    cdef unsigned char *data
+    cdef Py_ssize_t shape_[2]
+    cdef Py_ssize_t strides[2]
+    cdef Py_ssize_t itemsize
+    cdef bytes format
+    cdef int exports, released, returned
+
+    def __dealloc__(self):
+        self.slot_back()
+
+    property shape:
+        """
+        (frames, channels), (channels, frames) with PLANAR_SPLIT.
+        """
+        def __get__(self):
+            return self.shape_[0], self.shape_[1]
+
+    def tobytes(self):
+        """
+        A copy of the samples, frame after frame (plane after plane).
+        """
+        cdef Py_ssize_t i, n = self.shape_[1] * self.itemsize
+        if self.released:
+            raise ValueError("the period was released")
+        return b"".join([(<char *>self.data + i * self.strides[0])[:n]
+                for i in range(self.shape_[0])])
+
+    def __getbuffer__(self, Py_buffer *buf, int flags):
+        if self.released:
+            raise BufferError("the period was released")
+        # only PLANAR_SPLIT's planes of a stop's short period have gaps
+        if (flags & PyBUF_STRIDES) != PyBUF_STRIDES and \
+                self.strides[0] != self.shape_[1] * self.itemsize:
+            raise BufferError("the channel planes are not contiguous")
+        buf.buf = self.data
+        buf.obj = self
+        buf.len = self.shape_[0] * self.shape_[1] * self.itemsize
+        buf.readonly = 0
+        buf.itemsize = self.itemsize
+        buf.format = NULL
+        if flags & PyBUF_FORMAT:
+            buf.format = self.format
+        buf.ndim = 2
+        buf.shape = NULL
+        if (flags & PyBUF_ND) == PyBUF_ND:
+            buf.shape = self.shape_
+        buf.strides = NULL
+        if (flags & PyBUF_STRIDES) == PyBUF_STRIDES:
+            buf.strides = self.strides
+        buf.suboffsets = NULL
+        buf.internal = NULL
+        self.exports += 1
+
+    def __releasebuffer__(self, Py_buffer *buf):
+        self.exports -= 1
+        if self.released and self.exports == 0:
+            self.slot_back()
+
+    cdef give_back(self):
+        self.released = 1
+        if self.exports == 0:
+            self.slot_back()
+
+    cdef slot_back(self):
+        if not self.returned and self.stream is not None:
+            self.returned = 1
+            tap_release((<Stream>self.stream).t, self.seq)
+
+cdef class Stream:
+    """
+    The periods of a capture as it reads them, see Capture.stream().  The
+    capture thread copies every period into a slot of a native ring and
+    read() hands a batch of them to Python as Period objects over the
+    slots, taking the GIL once per batch, so that numpy can look at the
+    sound as it comes in (numpy.asarray(period)) without another copy:
+
+    s = c.stream()
+    for batch in s:
+        for period, frame, skip in batch:
+            analyse(numpy.asarray(period))
+        s.release()
+
+    A slot is the caller's until release() gives it back and nothing uses
+    its samples any more.  The capture never waits for them: when every
+    slot is held, periods are dropped from the stream (not from the file),
+    see "skip".
+    """
+    cdef tap *t
+    cdef tap_slot *batch
+    cdef readonly unsigned slots
+    cdef list held
+
+    def __cinit__(self, slots=16):
+        if slots < 1:
+            raise ValueError("a stream needs at least one slot")
+        self.t = tap_new(slots)
+        self.batch = <tap_slot *>malloc(slots * sizeof(tap_slot))
+        if self.t is NULL or self.batch is NULL:
+            raise MemoryError()
+        self.slots = slots
+        self.held = []
+
+    def __dealloc__(self):
+        free(self.batch)
+        if self.t is not NULL:
+            tap_free(self.t)
+
+    cdef view(self, tap_slot *s, tap_layout *l):
+        cdef Period p = Period.__new__(Period)
+        cdef Py_ssize_t size = l.bytes
+        p.stream = self
+        p.seq = s.seq
+        p.data = s.data
+        p.format = _SAMPLE_TYPES.get(l.format)
+        if p.format is None or struct.calcsize(p.format) != l.bytes:
+            p.format = b"B"
+        else:
+            size = 1
+        p.itemsize = l.bytes // size
+        if l.stride:
+            # channel after channel
+            p.shape_[0] = l.channels
+            p.shape_[1] = s.frames * size
+            p.strides[0] = l.stride
+        else:
+            p.shape_[0] = s.frames
+            p.shape_[1] = l.channels * size
+            p.strides[0] = l.channels * l.bytes
+        p.strides[1] = p.itemsize
+        self.held.append(p)
+        return p, s.frame, s.skip
+
+    def read(self, count=0, timeout=None):
+        """
+        Waits for the next periods and returns up to "count" of them (as
+        many as there are if 0) as [(period, frame, skip), ...]: period is
+        a Period over its slot, frames x channels samples
+        (channels x frames with PLANAR_SPLIT) of the captured format
+        (S24_LE as 32 bit ints, formats that struct does not know as
+        bytes), frame is the number of its first frame since the start of
+        run() and skip the periods dropped right before it.  A stop may
+        leave a shorter period, mmap its periods in parts.
+
+        Returns [] after "timeout" seconds without a period, None once the
+        run has ended and every period of it was read.
+        """
+        cdef tap_layout layout
+        cdef unsigned n = self.slots
+        cdef int r, ms
+        if count > 0:
+            n = min(count, self.slots)
+        deadline = None if timeout is None else monotonic() + timeout
+        while 1:
+            # wake up now and then to let Python handle CTRL-C
+            ms = 200
+            if deadline is not None:
+                ms = max(0, min(ms, int((deadline - monotonic()) * 1000)))
+            with nogil:
+                r = tap_next(self.t, self.batch, n, ms)
+            if r or ms == 0:
+                break
+            PyErr_CheckSignals()
+        if r == -EPIPE:
+            return None
+        tap_get_layout(self.t, &layout)
+        return [self.view(&self.batch[i], &layout) for i in range(r)]
+
+    def release(self, periods=None):
+        """
+        Gives these Periods from read() (or a single one) back, all of them
+        if None.  They export no more, a slot still in use by a numpy array
+        or a memoryview goes back to the capture once that is gone.
+        """
+        if periods is None:
+            periods = self.held[:]
+        elif isinstance(periods, Period):
+            periods = [periods]
+        for p in periods:
+            for i, q in enumerate(self.held):
+                if q is p:
+                    break
+            else:
+                raise ValueError("not a period of this stream")
+            (<Period>p).give_back()
+            del self.held[i]
+
+    def stats(self):
+        """
+        Returns (periods, dropped): periods put into the ring in the current
+        (or last) run and those dropped for want of a free slot.
+        """
+        cdef unsigned long periods, dropped
+        tap_stats(self.t, &periods, &dropped)
+        return periods, dropped
+
+    def __iter__(self):
+        return self
+
+    def __next__(self):
+        batch = self.read()
+        if batch is None:
+            raise StopIteration
+        return batch
+
+cdef class MultiCapture:
+    """
+    Records several ALSA devices at once, every one to its own file from its
+    own thread.  The PCMs are linked to start together where the driver
+    allows it, and in any case every device logs hardware timestamps to a
+    shared timeline, see align().
+    """
+    cdef object captures
+
+    def __init__(self, devices):
+        self.captures = []
+        for device in devices:
+            c = Capture()
+            c.set_device(device)
+            self.captures.append(c)
+
+    def configure(self, **kwargs):
+        """
+        Sets up every device, takes the same arguments as Capture.configure().
+        """
+        for c in self.captures:
+            c.configure(**kwargs)
+
+    def set_config(self, **kwargs):
+        """
+        Sets the format and latency of every device, takes the same
+        arguments as Capture.set_config() but device.
+        """
+        for c in self.captures:
+            c.set_config(**kwargs)
+
+    def run(self, filenames, timeline):
+        """
+        Records device i to filenames[i] until stop() is called and writes
+        the shared time index to "timeline".  Raises IOError if any of the
+        captures failed.
+        """
+        cdef int n = len(self.captures)
+        cdef capture_ctx **ctx
+        cdef char **names
+        cdef char *tl = timeline
+        cdef int i, failed
+        if len(filenames) != n:
+            raise ValueError("need one filename per device")
+        ctx = <capture_ctx **>malloc(n * sizeof(capture_ctx *))
+        names = <char **>malloc(n * sizeof(char *))
+        if ctx is NULL or names is NULL:
+            free(ctx)
+            free(names)
+            raise MemoryError()
+        for i in range(n):
+            ctx[i] = (<Capture>self.captures[i]).ctx
+            names[i] = filenames[i]
+        with nogil:
+            failed = capture_multi_run(ctx, names, n, tl)
+        free(ctx)
+        free(names)
+        if failed:
+            raise IOError("%d of %d captures failed" % (failed, n))
+
+    def stop(self):
+        for c in self.captures:
+            c.stop()
+
+    def streams(self, slots=16):
+        """
+        Returns the Stream of every device, see Capture.stream().
+        """
+        return [c.stream(slots) for c in self.captures]
+
+    def levels(self):
+        return [c.levels() for c in self.captures]
+
+cdef class Scheduler:
+    """
+    Generates consecutive integers with the given "fps".
+
+    Iterating over it gives (i, skip) at the i-th frame tick, sleeping in
+    between without the GIL.  If a tick came too late the ones missed are
+    skipped, "skip" says how many.  The ticks start when it is created.
+    """
+    cdef pacer s
+    cdef readonly int fps
+
+    def __cinit__(self, fps=2):
+        pacer_init(&self.s, fps)
+        self.fps = fps
+
+    def __iter__(self):
+        return self
+
+    def __next__(self):
+        cdef unsigned skip
+        with nogil:
+            skip = pacer_wait(&self.s)
+        return self.s.seq - 1, skip
+
+    def stats(self):
+        """
+        Returns (ticks, skipped, late_mean, late_max, jitter): frame ticks
+        served and missed, the mean and worst lateness of the wake ups and
+        its standard deviation, in seconds.
+        """
+        cdef pacer_stats st
+        pacer_get_stats(&self.s, &st)
+        return st.ticks, st.skipped, st.late_mean, st.late_max, st.jitter
+
+cdef class Screen:
+    """
+    Grabs a rectangle of the X screen "fps" times a second from a native
+    thread, through MIT-SHM (XGetImage on a remote display, which cannot
+    share memory with us).  Iterating over it after start() gives
+
+    (pixels, seconds, skip)
+
+    for every frame: the raw BGRA pixels ("stride" bytes per row), the
+    monotonic() time it was grabbed at and how many frame ticks were missed
+    right before it, until stop() is called, or IOError once a grab failed
+    (the rectangle left a resized screen).  The rectangle is clipped to the
+    screen, see width and height.
+    """
+    cdef screen *s
+    cdef readonly int width, height, stride, fps
+
+    def __cinit__(self, x, y, width, height, fps=15, buffers=4,
+            display=None):
+        cdef char *d = NULL
+        if display is not None:
+            d = display
+        self.s = screen_open(d, x, y, width, height, fps, buffers)
+        if self.s is NULL:
+            raise IOError("cannot grab the screen")
+        screen_geometry(self.s, &self.width, &self.height, &self.stride)
+        self.fps = fps
+
+    def __dealloc__(self):
+        if self.s is not NULL:
+            with nogil:
+                screen_stop(self.s)
+            screen_close(self.s)
+
+    def start(self):
+        if screen_start(self.s) < 0:
+            raise IOError("cannot start the grabber thread")
+
+    def stop(self):
+        """
+        Ends the grabbing, the frames grabbed so far are still returned.
+        """
+        with nogil:
+            screen_stop(self.s)
+
+    def stats(self):
+        """
+        Returns (frames, skipped, dropped): frames grabbed, frame ticks
+        missed and how many of those the consumer was too slow for.
+        """
+        cdef unsigned long frames, skipped, dropped
+        screen_stats(self.s, &frames, &skipped, &dropped)
+        return frames, skipped, dropped
+
+    def timing(self):
+        """
+        Returns (late_mean, late_max, jitter) of the grab thread's wake ups
+        on its frame ticks, in seconds, see Scheduler.stats().
+        """
+        cdef pacer_stats st
+        screen_timing(self.s, &st)
+        return st.late_mean, st.late_max, st.jitter
+
+    def __iter__(self):
+        return self
+
+    def __next__(self):
+        cdef screen_frame f
+        cdef int r
+        while 1:
+            # wake up now and then to let Python handle CTRL-C
+            with nogil:
+                r = screen_next(self.s, &f, 200)
+            if r:
+                break
+            PyErr_CheckSignals()
+        if r == -EPIPE:
+            raise StopIteration
+        if r < 0:
+            raise IOError("grabbing the screen failed")
+        pixels = (<char *>f.data)[:self.stride * self.height]
+        screen_release(self.s)
+        return pixels, f.tstamp * 1e-9, f.skip
+
+cdef class TileEncoder:
+    """
+    Encodes width x height BGRA frames ("stride" bytes per row, as Screen
+    gives them) to just the 32x32 tiles that changed since the previous
+    frame, with a full key frame every "keyint" frames.  TileDecoder
+    restores them.
+    """
+    cdef tile_coder *c
+    cdef int size
+    cdef readonly int key
+
+    def __cinit__(self, width, height, stride, keyint=150):
+        self.c = tile_coder_new(width, height, stride, keyint)
+        if self.c is NULL:
+            raise MemoryError()
+        self.size = stride * height
+
+    def __dealloc__(self):
+        tile_coder_free(self.c)
+
+    def encode(self, pixels):
+        cdef Py_buffer b
+        cdef unsigned char *out
+        cdef size_t n
+        PyObject_GetBuffer(pixels, &b, PyBUF_SIMPLE)
+        try:
+            if b.len < self.size:
+                raise ValueError("short frame")
+            with nogil:
+                n = tile_encode(self.c, <unsigned char *>b.buf, &out)
+        finally:
+            PyBuffer_Release(&b)
+        # whether this was a key frame
+        self.key = out[0] == TILE_KEY
+        return (<char *>out)[:n]
+
+    def stats(self):
+        """
+        Returns (keyframes, tiles): key frames and tiles stored so far.
+        """
+        cdef unsigned long keyframes, tiles
+        tile_stats(self.c, &keyframes, &tiles)
+        return keyframes, tiles
+
+cdef class TileDecoder:
+    """
+    Decodes what TileEncoder encoded, frame by frame and in order, starting
+    from a key frame.
+    """
+    cdef tile_coder *c
+    cdef int size
+
+    def __cinit__(self, width, height, stride):
+        self.c = tile_coder_new(width, height, stride, 1)
+        if self.c is NULL:
+            raise MemoryError()
+        self.size = stride * height
+
+    def __dealloc__(self):
+        tile_coder_free(self.c)
+
+    def decode(self, data):
+        """
+        Returns the whole frame, "stride" bytes per row.
+        """
+        cdef Py_buffer b
+        cdef unsigned char *frame
+        cdef int r
+        PyObject_GetBuffer(data, &b, PyBUF_SIMPLE)
+        with nogil:
+            r = tile_decode(self.c, <unsigned char *>b.buf, b.len, &frame)
+        PyBuffer_Release(&b)
+        if r < 0:
+            raise ValueError("damaged frame or no key frame yet")
+        return (<char *>frame)[:self.size]
+
+CODEC_RAW = VF_RAW
+CODEC_TILES = VF_TILES
+CODEC_SCC = VF_SCC
+
+cdef class VideoWriter:
+    """
+    Writes frames to an indexed capture file, see VideoReader.  codec is
+    CODEC_RAW for whole frames or CODEC_TILES for TileEncoder output.
+    """
+    cdef vf_writer *w
+
+    def __cinit__(self, filename, width, height, stride, fps,
+            codec=CODEC_TILES):
+        self.w = vf_create(filename, width, height, stride, fps, codec)
+        if self.w is NULL:
+            raise IOError("cannot create %s" % filename)
+
+    def __dealloc__(self):
+        if self.w is not NULL:
+            vf_finish(self.w)
+
+    def write(self, data, skip, seconds, key):
+        """
+        Appends a frame grabbed at "seconds" (monotonic()) after "skip"
+        missed frame ticks, "key" if it decodes on its own.
+        """
+        cdef Py_buffer b
+        cdef long long t = int(seconds * 1e9)
+        cdef unsigned sk = skip
+        cdef unsigned flags = VF_KEY if key else 0
+        cdef int r
+        if self.w is NULL:
+            raise ValueError("the file is closed")
+        PyObject_GetBuffer(data, &b, PyBUF_SIMPLE)
+        with nogil:
+            r = vf_write(self.w, b.buf, b.len, sk, t, flags)
+        PyBuffer_Release(&b)
+        if r < 0:
+            raise IOError("writing the frame failed")
+
+    def close(self):
+        """
+        Writes the frame index at the end of the file and closes it.
+        """
+        cdef int r
+        if self.w is NULL:
+            return
+        with nogil:
+            r = vf_finish(self.w)
+        self.w = NULL
+        if r < 0:
+            raise IOError("writing the frame index failed")
+
+cdef class FrameData:
+    """
+    Read-only bytes of a VideoReader's frame, exported in place through the
+    buffer protocol (memoryview(), numpy.frombuffer(), the writers and
+    coders of this module); bytes() or tobytes() copy them.  They keep the
+    reader and its mapping alive.
+    """
+    cdef object reader
+    cdef unsigned char *data
+    cdef Py_ssize_t size
+
+    def __len__(self):
+        return self.size
+
+    def tobytes(self):
+        return (<char *>self.data)[:self.size]
+
+    def __getbuffer__(self, Py_buffer *buf, int flags):
+        if flags & PyBUF_WRITABLE:
+            raise BufferError("the frame is read-only")
+        buf.buf = self.data
+        buf.obj = self
+        buf.len = self.size
+        buf.readonly = 1
+        buf.itemsize = 1
+        buf.format = NULL
+        if flags & PyBUF_FORMAT:
+            buf.format = b"B"
+        buf.ndim = 1
+        buf.shape = NULL
+        if (flags & PyBUF_ND) == PyBUF_ND:
+            buf.shape = &self.size
+        buf.strides = NULL
+        buf.suboffsets = NULL
+        buf.internal = NULL
+
+    def __releasebuffer__(self, Py_buffer *buf):
+        pass
+
+cdef FrameData frame_data(reader, unsigned char *data, size_t size):
+    cdef FrameData d = FrameData.__new__(FrameData)
+    d.reader = reader
+    d.data = data
+    d.size = size
+    return d
+
+cdef class VideoReader:
+    """
+    Reads a file written by VideoWriter.  The file is mapped into memory and
+    has an index, so any frame can be read directly, and several readers can
+    work on different ranges at once.  A file whose recording was killed
+    before close() is still read, up to its last complete frame.
+    """
+    cdef vf_reader *r
+    cdef readonly int width, height, stride, fps, codec
+
+    def __cinit__(self, filename):
+        self.r = vf_open(filename)
+        if self.r is NULL:
+            raise IOError("cannot read %s" % filename)
+        vf_geometry(self.r, &self.width, &self.height, &self.stride,
+                &self.fps, &self.codec)
+
+    def __dealloc__(self):
+        if self.r is not NULL:
+            vf_close(self.r)
+
+    def __len__(self):
+        return vf_frames(self.r)
+
+    def info(self, i):
+        """
+        Returns (seconds, skip, key) of frame i.
+        """
+        cdef vf_frame f
+        if i < 0 or vf_get_frame(self.r, i, &f) < 0:
+            raise IndexError(i)
+        return f.tstamp * 1e-9, f.skip, bool(f.flags & VF_KEY)
+
+    def data(self, i):
+        """
+        Returns frame i as it is stored, a FrameData over the mapped file.
+        """
+        cdef vf_frame f
+        if i < 0 or vf_get_frame(self.r, i, &f) < 0:
+            raise IndexError(i)
+        return frame_data(self, f.data, f.size)
+
+    def pixels(self, i):
+        """
+        Returns frame i decoded, "stride" bytes per row, as a FrameData.
+        Going through the frames in order decodes each only once.  A raw
+        frame is the mapped file itself; an encoded one is the reader's
+        decoding buffer, which the next pixels() call overwrites, so copy it
+        (bytes()) to keep it longer.
+        """
+        cdef unsigned char *p
+        cdef unsigned n
+        cdef int r
+        if i < 0 or i >= vf_frames(self.r):
+            raise IndexError(i)
+        n = i
+        with nogil:
+            r = vf_pixels(self.r, n, &p)
+        if r < 0:
+            raise ValueError("frame %d does not decode" % i)
+        return frame_data(self, p, self.stride * self.height)
+
+INTERP_NONE = INTERP_NONE_C
+INTERP_BLEND = INTERP_BLEND_C
+INTERP_MOTION = INTERP_MOTION_C
+
+cdef class Y4MWriter:
+    """
+    Streams frames as YUV4MPEG2 (4:2:0, BT.601) to "target", a file name or
+    an open file such as the stdin of an encoder run with subprocess.  The
+    BGRA frames from Screen are converted as they are written; a frame
+    after "skip" missed ticks is preceded by that many repeats of the one
+    before, so the stream keeps its constant frame rate.
+    """
+    cdef y4m *y
+    cdef object target
+    cdef readonly int width, height, stride, fps
+
+    def __cinit__(self, target, width, height, stride, fps):
+        if hasattr(target, "fileno"):
+            target.flush()
+            self.y = y4m_fdopen(target.fileno(), width, height, fps)
+            self.target = target
+        else:
+            self.y = y4m_open(target, width, height, fps)
+        if self.y is NULL:
+            raise IOError("cannot start the Y4M stream on %s" % target)
+        self.width = width
+        self.height = height
+        self.stride = stride
+        self.fps = fps
+
+    def __dealloc__(self):
+        if self.y is not NULL:
+            y4m_close(self.y)
+
+    def write(self, pixels, skip=0):
+        cdef Py_buffer b
+        cdef unsigned sk = skip
+        cdef int r
+        if self.y is NULL:
+            raise ValueError("the stream is closed")
+        PyObject_GetBuffer(pixels, &b, PyBUF_SIMPLE)
+        try:
+            if b.len < self.stride * self.height:
+                raise ValueError("need %d bytes of pixels" %
+                        (self.stride * self.height))
+            with nogil:
+                r = y4m_write(self.y, <unsigned char *>b.buf, self.stride,
+                        sk)
+        finally:
+            PyBuffer_Release(&b)
+        if r < 0:
+            raise IOError(-r, "writing the Y4M stream failed")
+
+    def stats(self):
+        """
+        Returns (frames, repeated): frames written and repeats for missed
+        frame ticks.
+        """
+        cdef unsigned long frames, repeated
+        if self.y is NULL:
+            return 0, 0
+        y4m_stats(self.y, &frames, &repeated)
+        return frames, repeated
+
+    def close(self):
+        """
+        Ends the stream; a file given by name is closed, an open file is
+        left to the caller.
+        """
+        cdef int r
+        if self.y is NULL:
+            return
+        with nogil:
+            r = y4m_close(self.y)
+        self.y = NULL
+        self.target = None
+        if r < 0:
+            raise IOError(-r, "closing the Y4M stream failed")
+
+def export_png(video, pattern, threads=0, level=6, interpolate=INTERP_NONE):
+    """
+    Writes every frame of the capture file "video" (see VideoWriter) as a
+    png file named pattern % i, e.g. "dir/screen%04d.png" (one "%d", with
+    an optional width, and "%%" otherwise, or IOError EINVAL), with the
+    frame ticks missed before a frame filled in:
+
+    INTERP_NONE ... by repeating the frame before
+    INTERP_BLEND ... by cross fading from the frame before to the one after
+    INTERP_MOTION ... likewise, but what scrolled is moved along instead
+
+    "threads" threads (0 for one per CPU) encode the frames at zlib level
+    "level" while the files are written in order.  A frame identical to one
+    already written becomes a hard link to it instead of being encoded
+    again.  Returns (images, encoded, linked, interpolated).
+    """
+    cdef export_stats st
+    cdef char *v = video
+    cdef char *p = pattern
+    cdef int t = threads, l = level, i = interpolate, r
     with nogil:
-        run(filename)
+        r = export_png_c(v, p, t, l, i, &st)
+    if r < 0:
+        raise IOError(-r, "exporting %s failed" % video)
+    return st.images, st.encoded, st.linked, st.interpolated
 
-def capture_stop():
+def archive(video, output, threads=0, level=1, keyint=0):
+    """
+    Writes the capture file "video" losslessly to the capture file "output"
+    in the screen codec (CODEC_SCC): runs of pixels as in the frame before,
+    as the pixel before or the one above, recent colours from a cache, the
+    rest deflated at zlib "level".  There is a key frame every "keyint"
+    frames, 0 for every 10 seconds.  "threads" threads (0 for one per CPU)
+    encode a frame each.  VideoReader and export_png() read the output
+    like any capture file and give back the very same pixels.
+
+    Returns (frames, keyframes, raw, bytes), the last two the size of the
+    pixels and of what they were encoded to.
+    """
+    cdef archive_stats st
+    cdef char *v = video
+    cdef char *o = output
+    cdef int t = threads, l = level, k = keyint, r
     with nogil:
-        stop()
+        r = archive_video(v, o, t, l, k, &st)
+    if r < 0:
+        raise IOError(-r, "archiving %s failed" % video)
+    return st.frames, st.keyframes, st.raw, st.bytes
+
+def normalize(filename, output=None, peak=1.0, threads=0):
+    """
+    Scales the wav file "filename" so that its loudest sample is at "peak"
+    of full scale, in place, or into the new file "output" if given.  The
+    file is mapped a few megabytes at a time by "threads" threads (0 for one
+    per CPU), once to find the peak and once to apply the gain, so files of
+    any size take the same memory.  8, 16, 24, 32 bit and float wav files
+    are understood; a silent one is left alone.
+
+    Returns (peak, rms, gain): the peak and RMS before, at full scale 1.0,
+    and the gain applied.
+    """
+    cdef norm_stats st
+    cdef char *i = filename
+    cdef char *o = NULL
+    cdef double p = peak
+    cdef int t = threads, r
+    if output is not None:
+        o = output
+    with nogil:
+        r = wav_normalize(i, o, p, t, &st)
+    if r < 0:
+        raise IOError(-r, "normalizing %s failed" % filename)
+    return st.peak, st.rms, st.gain
+
+def read_timeline(filename):
+    """
+    Parses a timeline written by MultiCapture.run().  Returns a dict
+    {device: info}, where info is a dict with
+
+    pcm, rate, linked ... the device, its rate and whether it was started
+            by the group's trigger
+    clock ... "monotonic" or "realtime", the clock of its timestamps
+    files ... [(frame, filename), ...] where every file begins, under its
+            final name
+    starts ... [(frame, seconds), ...] when the stream was (re)started
+    tstamps ... [(frame, seconds), ...] when the hardware captured "frame",
+            once per period
+
+    Frames are counted from the start of the device's capture, across all
+    its files.
+    """
+    devices = {}
+    def dev(i):
+        return devices.setdefault(i, {"pcm": None, "rate": None,
+            "linked": False, "clock": None, "files": [], "starts": [],
+            "tstamps": []})
+    for line in open(filename):
+        if line.startswith("#"):
+            continue
+        w = line.split(None, 3)
+        if w[0] == "device":
+            d = dev(int(w[1]))
+            d["rate"] = int(w[2])
+            d["linked"] = w[3].split(None, 1)[0] == "1"
+            d["pcm"] = w[3].split(None, 1)[1].strip()
+        elif w[0] == "clock":
+            dev(int(w[1]))["clock"] = w[2].strip()
+        elif w[0] == "file":
+            # a file renamed once the capture was split is logged again
+            files = dev(int(w[1]))["files"]
+            f = (int(w[2]), w[3].rstrip("\n"))
+            files[:] = [x for x in files if x[0] != f[0]] + [f]
+            files.sort()
+        elif w[0] == "start":
+            dev(int(w[1]))["starts"].append((int(w[2]), float(w[3])))
+        else:
+            dev(int(w[0]))["tstamps"].append((int(w[1]), float(w[2])))
+    return devices
+
+def _fit(info):
+    # least squares t = t0 + frame / rate over the hardware timestamps up
+    # to the first restart, an xrun loses frames
+    pts = info["tstamps"]
+    if len(info["starts"]) > 1:
+        pts = [p for p in pts if p[0] < info["starts"][1][0]]
+    if len(pts) < 2:
+        f, t = (info["starts"] or pts or [(0, 0.0)])[0]
+        return t - float(f) / info["rate"], float(info["rate"])
+    n = float(len(pts))
+    mf = sum(p[0] for p in pts) / n
+    mt = sum(p[1] for p in pts) / n
+    sff = sum((p[0] - mf) ** 2 for p in pts)
+    sft = sum((p[0] - mf) * (p[1] - mt) for p in pts)
+    k = sft / sff
+    return mt - k * mf, 1 / k
+
+def align(timeline):
+    """
+    Returns [(filename, frames), ...], one entry per device: how many frames
+    to drop from the beginning of its first file so that all the files start
+    at the same instant.  The time of frame 0 and the real sample rate of
+    every device are fitted over all its timestamps, so this stays sample
+    accurate when the devices drift apart.  Raises ValueError if the
+    devices did not all timestamp on the same clock.
+    """
+    devices = read_timeline(timeline)
+    if len(set(d["clock"] for d in devices.values() if d["rate"])) > 1:
+        raise ValueError("the devices of %s timestamp on different clocks"
+                % timeline)
+    fits = dict((i, _fit(d)) for i, d in devices.items() if d["rate"])
+    start = max(t0 for t0, rate in fits.values())
+    r = []
+    for i in sorted(fits):
+        t0, rate = fits[i]
+        files = devices[i]["files"]
+        r.append((files[0][1] if files else None,
+            int(round((start - t0) * rate))))
+    return r
+
+def monotonic():
+    """
+    Returns the CLOCK_MONOTONIC time in seconds, the clock of the audio
+    timestamps where the driver has it (see read_tindex()).
+    """
+    cdef timespec ts
+    clock_gettime(CLOCK_MONOTONIC, &ts)
+    return ts.tv_sec + ts.tv_nsec * 1e-9
+
+TIDX_CLOCK_REALTIME = 0
+TIDX_CLOCK_MONOTONIC = 1
+TIDX_START = 1
+
+def read_tindex(filename):
+    """
+    Reads the timestamp index "filename" (the wav file name plus ".tidx").
+    Returns (header, records), where header is a dict with the rate,
+    channels and clock (TIDX_CLOCK_*) and records is a list of
+
+    (frame, seconds, status_seconds, avail, flags)
+
+    one per period: the hardware captured frame "frame" of the wav file at
+    "seconds" (snd_pcm_htimestamp()), "status_seconds" is the status time
+    of the same period and "avail" the frames that were waiting in the
+    buffer.  A record with TIDX_START in flags gives the time the stream was
+    (re)started at.
+    """
+    f = open(filename, "rb")
+    magic, version, rate, channels, clock, size = struct.unpack("<4s5I8x",
+            f.read(32))
+    if magic != b"TIDX" or version != 1:
+        raise ValueError("%s is not a timestamp index" % filename)
+    header = {"rate": rate, "channels": channels, "clock": clock}
+    records = []
+    while 1:
+        r = f.read(size)
+        if len(r) < size:
+            break
+        frame, t, st, avail, flags = struct.unpack("<Qqq2I", r[:32])
+        records.append((frame, t * 1e-9, st * 1e-9, avail, flags))
+    return header, records
+
+def audio_clock(wavfile):
+    """
+    Returns (t0, rate) from the timestamp index of "wavfile": the time at
+    which its first frame was captured and the rate at which the sound card
+    really ran, both fitted over the timestamps of all the periods.  The
+    time is on the clock of monotonic(), an index on the wall clock is
+    moved over to it by their current offset.
+    """
+    cdef timespec mono, real
+    header, records = read_tindex(wavfile + ".tidx")
+    info = {"rate": header["rate"],
+            "starts": [(r[0], r[1]) for r in records if r[4] & TIDX_START],
+            "tstamps": [(r[0], r[1]) for r in records
+                if not r[4] & TIDX_START]}
+    t0, rate = _fit(info)
+    if header["clock"] == TIDX_CLOCK_REALTIME:
+        clock_gettime(CLOCK_REALTIME, &real)
+        clock_gettime(CLOCK_MONOTONIC, &mono)
+        t0 -= (real.tv_sec - mono.tv_sec) + (real.tv_nsec - mono.tv_nsec) * 1e-9
+    return t0, rate
+
+# the capture driven by the module level functions below
+_default = Capture()
+
+def capture(filename, ring_chunks=0, mmap=False, sink=SINK_WRITE,
+        batch_periods=16, meter=False, tindex=False, agc=False,
+        agc_target=-20.0, agc_max_gain=30.0, file_type=FILE_WAVE, rotate=0,
+        channels=0, planar=PLANAR_OFF, config=None):
+    """
+    Records to the wav file "filename" until capture_stop() is called.
+
+    ring_chunks ... if > 0, decouples the ALSA reads from the disk writes:
+            periods go into a ring of that many chunks which a separate
+            writer thread drains to the file
+    mmap ... if True, reads the periods straight out of the mmap'ed DMA
+            buffer (MMAP_INTERLEAVED access) instead of copying them with
+            snd_pcm_readi() first
+    sink ... SINK_WRITE writes every period with its own write(),
+            SINK_BATCH preallocates the file in large extents and writes
+            "batch_periods" periods at a time (io_uring if the kernel has
+            it, pwritev otherwise)
+    meter ... if True, measures the peak and RMS of every channel as it is
+            captured, see levels()
+    tindex ... if True, writes the hardware timestamp of every period to
+            "filename.tidx", see read_tindex()
+    agc ... if True, levels the sound before it is written: an automatic
+            gain control brings it to "agc_target" dBFS RMS with at most
+            "agc_max_gain" dB, a limiter with 5 ms look-ahead keeps the
+            peaks at -1 dBFS.  The sound comes out 5 ms late (the index
+            and timeline account for it) and the gain curve goes to
+            "filename.gain", a line "frame agc_db gain_db peak_dbfs" every
+            100 ms
+    file_type ... FILE_WAVE stops at 2 GiB and goes on in "name-02.wav"
+            and so on; FILE_RF64 (a WAVE file with 64 bit lengths, plain
+            WAVE again if it stays under 4 GiB) and FILE_W64 (Sony Wave64)
+            keep it all in one file, their header updated every 10 s so
+            that what was written is readable even after a crash;
+            FILE_FLAC compresses it losslessly on worker threads as it is
+            captured, whatever the sink (U8, S16_LE and 24 bit samples, up
+            to 8 channels), and a crash leaves a playable file without its
+            length; FILE_RAW writes just the samples
+    rotate ... if > 0, starts a new file every "rotate" seconds, numbered
+            like the 2 GiB ones.  The next file is always set up and the
+            last one finished in the background, so that no frame is lost
+            between them; when it is split, the first file is renamed to
+            "name-01.wav"
+    channels ... how many channels to capture, if not 2 or as in config
+    planar ... PLANAR_INTERLEAVE reads every channel into its own buffer
+            with snd_pcm_readn() (RW_NONINTERLEAVED access, for the 8 to
+            64 channel interfaces that only offer that), meters each one
+            on its own and interleaves them into the file as it is written;
+            PLANAR_SPLIT writes every channel to a mono file of its own,
+            "name-ch01.wav" and so on, without AGC and not to stdout or
+            FLAC.  Either ignores mmap
+    config ... a dict of Capture.set_config() arguments: the device, rate,
+            sample format and latency, e.g. {"preset": PRESET_LOW_WAKEUP}
+            for a long recording that should cost as few wakeups as can
+            be; capture_config() tells what the device came to
+
+    Use Capture objects to record several files at once.
+    """
+    _default.set_config(**(config or {}))
+    _default.configure(ring_chunks, mmap, sink, batch_periods, meter, tindex,
+            agc, agc_target, agc_max_gain, file_type, rotate, channels,
+            planar)
+    _default.run(filename)
+
+def capture_stop():
+    _default.stop()
+
+def stream(slots=16):
+    """
+    Returns the Stream of capture(), see Capture.stream().
+    """
+    return _default.stream(slots)
+
+def capture_config():
+    """
+    Returns what the device of capture() came to, see Capture.config().
+    """
+    return _default.config()
+
+def ring_high_water():
+    """
+    Returns the most chunks that were ever queued in the capture ring.
+    """
+    return _default.ring_high_water()
+
+def levels():
+    """
+    Returns [(peak, rms), ...] for every channel of the last period, at
+    full scale 1.0 (needs capture(..., meter=True)).
+    """
+    return _default.levels()
@@ -0,0 +1,512 @@
+/*
+   Benchmark of the capture path.
+
+   Runs capture_ctx_run() on ALSA's "null" PCM, which takes any setup and
+   needs no sound card, with snd_pcm_readi() replaced by a synthetic source
+   (capture_ctx_set_readi()): one second of sine and noise, over and over,
+   so that every run captures the same frames.  Flat out, the source has a
+   period ready whenever it is asked for one, which measures how many
+   periods a second the capture path and the writer can take at most.  With
+   -r it has them ready at the sample rate like a sound card, in a buffer of
+   -b periods that overruns when the capture thread does not come back in
+   time, and -S stalls the writes (capture_ctx_set_write_hook()) the way a
+   busy disk does, to see which writer rides that out.
+
+   Every period size (-p) runs with every writer (-w):
+
+	write		a write() per period from the capture thread
+	batch		SINK_BATCH, from the capture thread
+	ring		a ring of RING_CHUNKS periods drained by a writer thread
+	ring-batch	the ring, the writer thread using SINK_BATCH
+
+   and prints a line with the periods read per second, the CPU time of the
+   whole process per second of audio, what the writer wrote per second,
+   the overruns with the sound they lost, the stalls and the ring's
+   high-water mark.  The peak/RMS kernels that compute_max_peak() runs are
+   timed on their own first, on the same periods, for every ISA the CPU
+   has; -m meters in the capture loop as well.
+
+	./bench -s 60 -p 256,1024,4096
+	./bench -r -s 20 -S 300:5 -w write,ring
+	./bench -d hw:0 -s 10 -o b.wav
+
+   The last one records 10 s from a real card instead.
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <alsa/asoundlib.h>
+
+#include "capture.h"
+#include "cpu.h"
+#include "meter.h"
+
+/* the capture context's interface, see arecord.c */
+struct capture_ctx *capture_ctx_create(void);
+void capture_ctx_destroy(struct capture_ctx *ctx);
+int capture_ctx_run(struct capture_ctx *ctx, char *filename);
+void capture_ctx_stop(struct capture_ctx *ctx);
+void capture_ctx_set_ring_chunks(struct capture_ctx *ctx, int chunks);
+unsigned capture_ctx_ring_high_water(struct capture_ctx *ctx);
+void capture_ctx_set_sink(struct capture_ctx *ctx, int type, int periods);
+void capture_ctx_set_file_type(struct capture_ctx *ctx, int type);
+void capture_ctx_set_meter(struct capture_ctx *ctx, int enable);
+void capture_ctx_set_readi(struct capture_ctx *ctx,
+			   snd_pcm_sframes_t (*fn)(snd_pcm_t *handle,
+						   void *buffer,
+						   snd_pcm_uframes_t size));
+void capture_ctx_set_write_hook(struct capture_ctx *ctx,
+				void (*hook)(void *arg, size_t count), void *arg);
+
+/* see arecord.c SINK_* and FORMAT_* */
+#define SINK_WRITE	0
+#define SINK_BATCH	1
+
+#define RING_CHUNKS	16
+#define BATCH_PERIODS	16
+#define MAX_RUNS	16
+
+static const struct writer {
+	const char *name;
+	int sink;
+	int ring;
+} writers[] = {
+	{ "write",	SINK_WRITE,	0 },
+	{ "batch",	SINK_BATCH,	0 },
+	{ "ring",	SINK_WRITE,	RING_CHUNKS },
+	{ "ring-batch",	SINK_BATCH,	RING_CHUNKS },
+};
+
+static const struct file_type {
+	const char *name;
+	int type;
+} file_types[] = {
+	{ "raw",	0 },
+	{ "wave",	2 },
+	{ "rf64",	4 },
+	{ "w64",	5 },
+	{ "flac",	6 },
+};
+
+static const struct sample_format {
+	const char *name;
+	snd_pcm_format_t format;
+	int meter;
+	unsigned bytes;
+	double scale;		/* of full scale */
+} formats[] = {
+	{ "S16_LE",	SND_PCM_FORMAT_S16_LE,	METER_S16_LE,	2, 32767.0 },
+	{ "S24_LE",	SND_PCM_FORMAT_S24_LE,	METER_S24_LE,	4, 8388607.0 },
+	{ "S32_LE",	SND_PCM_FORMAT_S32_LE,	METER_S32_LE,	4, 2147483647.0 },
+	{ "FLOAT_LE",	SND_PCM_FORMAT_FLOAT_LE, METER_FLOAT_LE, 4, 1.0 },
+};
+
+static struct {
+	double seconds;
+	int realtime;
+	unsigned rate, channels, buffer_periods;
+	const struct sample_format *format;
+	int file_type;
+	int meter;
+	double stall_ms, stall_every;	/* -S, every that many seconds of audio */
+	const char *device;		/* a real card, no synthetic source */
+	const char *output;
+} opt = {
+	30.0, 0, 44100, 2, 4, &formats[0], 2, 0, 0.0, 0.0, NULL, NULL,
+};
+
+/*
+ * The synthetic source, a sound card that is started by the first read.
+ * Only the capture thread calls it.
+ */
+static struct {
+	struct capture_ctx *ctx;
+	unsigned char *pattern;	/* a second of frames */
+	size_t frame_bytes;
+	int64_t total;		/* frames to hand out */
+	int64_t frames;		/* handed out */
+	int64_t lost;		/* in overruns */
+	int64_t start;		/* ns of the first read */
+	snd_pcm_uframes_t buffer;
+	unsigned long chunks, xruns;
+} src;
+
+/* what reached the sink, from whichever thread writes */
+static struct {
+	int64_t bytes;
+	int64_t stall_at;	/* bytes */
+	int64_t stall_bytes;
+	unsigned long stalls;
+} wr;
+
+static int64_t now_ns(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void sleep_until(int64_t ns)
+{
+	struct timespec ts;
+
+	ts.tv_sec = ns / 1000000000;
+	ts.tv_nsec = ns % 1000000000;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+}
+
+/* sine and a little noise, each channel its own phase */
+static int make_pattern(void)
+{
+	const struct sample_format *f = opt.format;
+	unsigned i, c;
+	uint32_t seed = 1;
+	double v;
+
+	src.frame_bytes = (size_t)opt.channels * f->bytes;
+	src.pattern = malloc(opt.rate * src.frame_bytes);
+	if (src.pattern == NULL)
+		return -ENOMEM;
+	for (i = 0; i < opt.rate; i++)
+		for (c = 0; c < opt.channels; c++) {
+			unsigned char *p = src.pattern + i * src.frame_bytes +
+					   c * f->bytes;
+			int16_t s16;
+			int32_t s32;
+			float fl;
+
+			seed = seed * 1103515245 + 12345;
+			v = 0.5 * sin(2 * M_PI * 440.0 * i / opt.rate + c) +
+			    0.05 * ((seed >> 16) / 32768.0 - 1.0);
+			if (f->format == SND_PCM_FORMAT_S16_LE) {
+				s16 = (int16_t)lrint(v * f->scale);
+				memcpy(p, &s16, 2);
+			} else if (f->format == SND_PCM_FORMAT_FLOAT_LE) {
+				fl = (float)v;
+				memcpy(p, &fl, 4);
+			} else {
+				s32 = (int32_t)lrint(v * f->scale);
+				memcpy(p, &s32, 4);
+			}
+		}
+	return 0;
+}
+
+static snd_pcm_sframes_t source_readi(snd_pcm_t *handle, void *buffer,
+				      snd_pcm_uframes_t size)
+{
+	struct capture_config cfg;
+	unsigned char *p = buffer;
+	int64_t now, avail;
+	size_t n, at, len;
+
+	if (src.frames >= src.total)
+		return -EAGAIN;
+	if ((int64_t)size > src.total - src.frames)
+		size = src.total - src.frames;
+	if (opt.realtime) {
+		now = now_ns(CLOCK_MONOTONIC);
+		if (src.chunks == 0) {
+			src.start = now;
+			if (capture_ctx_get_config(src.ctx, &cfg) == 0)
+				src.buffer = cfg.buffer_frames;
+		}
+		avail = (now - src.start) * opt.rate / 1000000000 -
+			src.frames - src.lost;
+		if (src.buffer && avail > (int64_t)src.buffer) {
+			/* the card ran out of buffer, it starts over empty */
+			src.xruns++;
+			src.lost += avail;
+			avail = 0;
+		}
+		if (avail < (int64_t)size)
+			sleep_until(src.start + (src.frames + src.lost + size) *
+				    1000000000 / opt.rate);
+	}
+	for (n = 0; n < size; n += len) {
+		at = (src.frames + n) % opt.rate;
+		len = opt.rate - at < size - n ? opt.rate - at : size - n;
+		memcpy(p + n * src.frame_bytes, src.pattern +
+		       at * src.frame_bytes, len * src.frame_bytes);
+	}
+	src.frames += size;
+	src.chunks++;
+	/* that was all, the capture ends with it instead of waiting */
+	if (src.frames >= src.total)
+		capture_ctx_stop(src.ctx);
+	return size;
+}
+
+static void write_hook(void *arg, size_t count)
+{
+	int64_t ns = (int64_t)(opt.stall_ms * 1000000);
+
+	wr.bytes += count;
+	if (wr.stall_bytes && wr.bytes >= wr.stall_at) {
+		sleep_until(now_ns(CLOCK_MONOTONIC) + ns);
+		wr.stalls++;
+		wr.stall_at += wr.stall_bytes;
+	}
+}
+
+/* stops a capture from a real card after opt.seconds */
+static void *stop_thread(void *arg)
+{
+	sleep_until(now_ns(CLOCK_MONOTONIC) + (int64_t)(opt.seconds * 1e9));
+	capture_ctx_stop(arg);
+	return NULL;
+}
+
+/* the cost of compute_max_peak()'s kernels on periods of the source */
+static void bench_meter(const unsigned long *periods, int n)
+{
+	const char *name, *last = NULL;
+	float peak[256];
+	double sumsq[256];
+	int64_t t, calls;
+	unsigned long p;
+	size_t at;
+	int isa, i;
+
+	for (isa = CPU_C; isa <= CPU_AVX512; isa++) {
+		meter_force_isa(isa);
+		name = meter_isa();
+		if (last && !strcmp(name, last))
+			break;	/* the CPU has no more */
+		last = name;
+		for (i = 0; i < n; i++) {
+			p = periods[i] < opt.rate ? periods[i] : opt.rate;
+			t = now_ns(CLOCK_THREAD_CPUTIME_ID);
+			/* 60 seconds of audio */
+			for (calls = 0, at = 0; calls * p < 60 * opt.rate; calls++) {
+				if (at + p > opt.rate)
+					at = 0;
+				memset(peak, 0, sizeof(peak));
+				memset(sumsq, 0, sizeof(sumsq));
+				meter_peak_rms(opt.format->meter, src.pattern +
+					       at * src.frame_bytes, p,
+					       opt.channels, peak, sumsq);
+				at += p;
+			}
+			t = now_ns(CLOCK_THREAD_CPUTIME_ID) - t;
+			printf("peak %-7s %7lu %10.2f us/period %8.3f ms/s\n",
+			       name, p, t / 1e3 / calls, t / 1e6 / 60);
+		}
+	}
+	meter_force_isa(-1);
+}
+
+static int bench_run(unsigned long period, const struct writer *w)
+{
+	struct capture_config cfg;
+	struct capture_ctx *ctx;
+	char *name = opt.output ? (char *)opt.output : "bench.out";
+	int64_t wall, cpu;
+	pthread_t stopper;
+	double audio;
+	int err;
+
+	if ((ctx = capture_ctx_create()) == NULL)
+		return -ENOMEM;
+	capture_config_preset(&cfg, CAPTURE_PRESET_DEFAULT);
+	cfg.device = opt.device ? opt.device : "null";
+	cfg.rate = opt.rate;
+	cfg.format = opt.format->format;
+	cfg.channels = opt.channels;
+	cfg.period_frames = period;
+	cfg.buffer_frames = period * opt.buffer_periods;
+	if ((err = capture_ctx_set_config(ctx, &cfg)) < 0) {
+		capture_ctx_destroy(ctx);
+		return err;
+	}
+	capture_ctx_set_sink(ctx, w->sink, BATCH_PERIODS);
+	capture_ctx_set_ring_chunks(ctx, w->ring);
+	capture_ctx_set_file_type(ctx, opt.file_type);
+	capture_ctx_set_meter(ctx, opt.meter);
+	capture_ctx_set_write_hook(ctx, write_hook, NULL);
+	if (!opt.device)
+		capture_ctx_set_readi(ctx, source_readi);
+
+	src.ctx = ctx;
+	src.total = (int64_t)(opt.seconds * opt.rate);
+	src.frames = src.lost = 0;
+	src.chunks = src.xruns = 0;
+	src.buffer = 0;
+	memset(&wr, 0, sizeof(wr));
+	wr.stall_bytes = (int64_t)(opt.stall_every * opt.rate) *
+			 src.frame_bytes;
+	wr.stall_at = wr.stall_bytes;
+
+	if (opt.device && pthread_create(&stopper, NULL, stop_thread, ctx)) {
+		capture_ctx_destroy(ctx);
+		return -EAGAIN;
+	}
+	wall = now_ns(CLOCK_MONOTONIC);
+	cpu = now_ns(CLOCK_PROCESS_CPUTIME_ID);
+	err = capture_ctx_run(ctx, name);
+	cpu = now_ns(CLOCK_PROCESS_CPUTIME_ID) - cpu;
+	wall = now_ns(CLOCK_MONOTONIC) - wall;
+	if (opt.device) {
+		pthread_join(stopper, NULL);
+		/* what the card gave, as far as the file tells */
+		src.frames = wr.bytes / src.frame_bytes;
+		if (capture_ctx_get_config(ctx, &cfg) == 0)
+			period = cfg.period_frames;
+		src.chunks = src.frames / (period ? period : 1);
+	}
+	audio = (double)src.frames / opt.rate;
+	if (err)
+		printf("%7lu %-10s failed\n", period, w->name);
+	else
+		printf("%7lu %-10s %10.0f %9.2f %8.2f %6lu %8.1f %7lu %4u\n",
+		       period, w->name, src.chunks / (wall / 1e9),
+		       audio > 0 ? cpu / 1e6 / audio : 0.0,
+		       wr.bytes / (wall / 1e9) / 1e6, src.xruns,
+		       src.lost * 1e3 / opt.rate, wr.stalls,
+		       capture_ctx_ring_high_water(ctx));
+	fflush(stdout);
+	capture_ctx_destroy(ctx);
+	if (!opt.output)
+		unlink(name);
+	return err ? -EIO : 0;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+"Usage: bench [OPTION]...\n"
+"  -s SECONDS      of audio per run (30)\n"
+"  -r              hand out the periods in real time, not flat out\n"
+"  -p FRAMES,...   period sizes (256,1024,4096)\n"
+"  -b PERIODS      in the buffer (4)\n"
+"  -w WRITER,...   write, batch, ring, ring-batch (all)\n"
+"  -t TYPE         raw, wave, rf64, w64 or flac (wave)\n"
+"  -f FORMAT       S16_LE, S24_LE, S32_LE or FLOAT_LE (S16_LE)\n"
+"  -c CHANNELS     (2)\n"
+"  -R RATE         (44100)\n"
+"  -m              meter in the capture loop\n"
+"  -S MS:SECONDS   stall a write for MS every SECONDS of audio\n"
+"  -d DEVICE       capture from this ALSA device instead\n"
+"  -o FILE         keep the capture in FILE\n");
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long periods[MAX_RUNS] = { 256, 1024, 4096 };
+	const struct writer *run[MAX_RUNS];
+	int nperiods = 3, nwriters = 0, c, i, j, failed = 0;
+	char *s, *tok;
+
+	while ((c = getopt(argc, argv, "s:rp:b:w:t:f:c:R:mS:d:o:h")) != -1) {
+		switch (c) {
+		case 's':
+			opt.seconds = atof(optarg);
+			break;
+		case 'r':
+			opt.realtime = 1;
+			break;
+		case 'p':
+			nperiods = 0;
+			for (s = optarg; (tok = strtok(s, ",")); s = NULL)
+				if (nperiods < MAX_RUNS)
+					periods[nperiods++] = strtoul(tok, NULL, 0);
+			break;
+		case 'b':
+			opt.buffer_periods = atoi(optarg);
+			break;
+		case 'w':
+			for (s = optarg; (tok = strtok(s, ",")); s = NULL) {
+				for (i = 0; i < (int)(sizeof(writers) /
+						      sizeof(writers[0])); i++)
+					if (!strcmp(tok, writers[i].name))
+						break;
+				if (i == sizeof(writers) / sizeof(writers[0]))
+					usage();
+				if (nwriters < MAX_RUNS)
+					run[nwriters++] = &writers[i];
+			}
+			break;
+		case 't':
+			for (i = 0; i < (int)(sizeof(file_types) /
+					      sizeof(file_types[0])); i++)
+				if (!strcmp(optarg, file_types[i].name))
+					break;
+			if (i == sizeof(file_types) / sizeof(file_types[0]))
+				usage();
+			opt.file_type = file_types[i].type;
+			break;
+		case 'f':
+			for (i = 0; i < (int)(sizeof(formats) /
+					      sizeof(formats[0])); i++)
+				if (!strcasecmp(optarg, formats[i].name))
+					break;
+			if (i == sizeof(formats) / sizeof(formats[0]))
+				usage();
+			opt.format = &formats[i];
+			break;
+		case 'c':
+			opt.channels = atoi(optarg);
+			break;
+		case 'R':
+			opt.rate = atoi(optarg);
+			break;
+		case 'm':
+			opt.meter = 1;
+			break;
+		case 'S':
+			if (sscanf(optarg, "%lf:%lf", &opt.stall_ms,
+				   &opt.stall_every) != 2)
+				usage();
+			break;
+		case 'd':
+			opt.device = optarg;
+			break;
+		case 'o':
+			opt.output = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (opt.seconds <= 0 || opt.rate == 0 || opt.channels == 0 ||
+	    opt.channels > 256 || opt.buffer_periods < 2 || nperiods == 0)
+		usage();
+	for (i = 0; i < nperiods; i++)
+		if (periods[i] == 0)
+			usage();
+	if (nwriters == 0)
+		for (; nwriters < (int)(sizeof(writers) / sizeof(writers[0]));
+		     nwriters++)
+			run[nwriters] = &writers[nwriters];
+	if (make_pattern() < 0) {
+		fprintf(stderr, "bench: not enough memory\n");
+		return EXIT_FAILURE;
+	}
+
+	printf("%s, %u Hz, %u channels, %.0f s of audio per run, %s\n",
+	       opt.format->name, opt.rate, opt.channels, opt.seconds,
+	       opt.device ? opt.device : opt.realtime ? "real time" :
+	       "flat out");
+	if (!opt.device)
+		bench_meter(periods, nperiods);
+	printf("%7s %-10s %10s %9s %8s %6s %8s %7s %4s\n", "period",
+	       "writer", "chunks/s", "cpu ms/s", "MB/s", "xruns", "lost ms",
+	       "stalls", "ring");
+	for (i = 0; i < nperiods; i++)
+		for (j = 0; j < nwriters; j++)
+			if (bench_run(periods[i], run[j]) < 0)
+				failed++;
+	free(src.pattern);
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
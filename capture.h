@@ -0,0 +1,40 @@
+/*
+   Device and latency configuration of a capture, see arecord.c.
+*/
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+/* starting points for capture_config_preset() */
+#define CAPTURE_PRESET_DEFAULT		0	/* up to 500 ms in 4 periods */
+#define CAPTURE_PRESET_LOW_LATENCY	1	/* 5 ms periods, 20 ms buffer */
+#define CAPTURE_PRESET_LOW_WAKEUP	2	/* 2 s buffer, woken twice a second */
+
+struct capture_ctx;
+
+/*
+ * Times are in microseconds, frames per channel.  The period and the
+ * buffer are asked for by time if it is set, else by size; both 0 leaves
+ * them to the device, at most 500 ms of buffer in 4 periods.  The start
+ * and stop delays are arecord's -R and -T: counted from an empty buffer
+ * when > 0, back from a full one when <= 0.
+ */
+struct capture_config {
+	const char *device;		/* ALSA PCM, NULL for "default" */
+	unsigned int rate;
+	int format;			/* snd_pcm_format_t */
+	unsigned int channels;
+	unsigned int period_time, buffer_time;
+	unsigned long period_frames, buffer_frames;
+	int avail_min;			/* wake up with this much to read, -1 a period */
+	int start_delay;		/* start with this much in the buffer */
+	int stop_delay;			/* overrun with this much */
+	/* what they came to, by capture_ctx_get_config() */
+	unsigned long avail_min_frames, start_threshold, stop_threshold;
+};
+
+void capture_config_preset(struct capture_config *cfg, int preset);
+int capture_ctx_set_config(struct capture_ctx *ctx,
+			   const struct capture_config *cfg);
+int capture_ctx_get_config(struct capture_ctx *ctx, struct capture_config *cfg);
+
+#endif
@@ -0,0 +1,61 @@
+/*
+   Run time choice of the SIMD kernels.
+
+   Every module with vector kernels keeps them in a table with one row per
+   instruction set, in CPU_* order and only as far as it was built with
+   them, and a pointer to the row it uses.  cpu_resolve() picks the row on
+   first use.  Threads running in parallel can all get there at once, so
+   the choice is published as a single pointer; they all come to the same
+   answer anyway.
+*/
+#include "cpu.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CPU_X86 1
+#endif
+
+/* the best of CPU_* this CPU runs */
+int cpu_isa(void)
+{
+	static int best = -1;
+	int isa = __atomic_load_n(&best, __ATOMIC_RELAXED);
+
+	if (isa >= 0)
+		return isa;
+	isa = CPU_C;
+#ifdef CPU_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2"))
+		isa = CPU_SSE2;
+	if (__builtin_cpu_supports("avx2"))
+		isa = CPU_AVX2;
+	if (__builtin_cpu_supports("avx512f"))
+		isa = CPU_AVX512;
+#endif
+	__atomic_store_n(&best, isa, __ATOMIC_RELAXED);
+	return isa;
+}
+
+/*
+ * The row of "table" ("rows" rows of "size" bytes) to use: *impl once it is
+ * set, else the best one this CPU runs, no better than "forced" if that is
+ * not -1, which is then published in *impl.
+ */
+const void *cpu_resolve(const void **impl, const void *table, size_t size,
+			unsigned rows, int forced)
+{
+	const void *row;
+	int isa;
+
+	row = __atomic_load_n(impl, __ATOMIC_ACQUIRE);
+	if (row)
+		return row;
+	isa = cpu_isa();
+	if (isa >= (int)rows)
+		isa = rows - 1;
+	if (forced >= 0 && forced < isa)
+		isa = forced;
+	row = (const char *)table + isa * size;
+	__atomic_store_n(impl, row, __ATOMIC_RELEASE);
+	return row;
+}
@@ -0,0 +1,21 @@
+/*
+   Run time choice of the SIMD kernels, see cpu.c.
+*/
+#ifndef CPU_H
+#define CPU_H
+
+#include <stddef.h>
+
+/* the rows of a kernel table, in this order, as far as the build has them */
+enum {
+	CPU_C,
+	CPU_SSE2,
+	CPU_AVX2,
+	CPU_AVX512
+};
+
+int cpu_isa(void);
+const void *cpu_resolve(const void **impl, const void *table, size_t size,
+			unsigned rows, int forced);
+
+#endif
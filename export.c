@@ -0,0 +1,649 @@
+/*
+   Parallel png export of a capture file.
+
+   The calling thread decodes the frames of a vidfile.c file in order (tile
+   frames depend on the one before) and queues a copy of every image into
+   a ring of jobs.  A pool of worker threads png encodes the jobs, each with
+   its own deflate stream, and one writer thread writes the finished files
+   in image order, so at most the ring's worth of images is in memory.
+
+   Every image is hashed first.  An image that was already exported (a
+   frame tick that was skipped and repeats the frame before it, or a screen
+   that went back to what it showed earlier) is not encoded again but made
+   a hard link to the first file with the same content, or a copy of it if
+   the file system has no hard links.
+
+   With interpolation on, the images for the frame ticks that were missed
+   before a frame are made up from the frames on either side of the gap
+   (see interp.c) instead of repeating the one before.
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#include "frames.h"
+#include "vidfile.h"
+#include "interp.h"
+#include "export.h"
+
+#define MAX_THREADS	64
+
+#define JOB_FREE	0	/* the producer may fill it */
+#define JOB_QUEUED	1	/* waits for or is with a worker */
+#define JOB_DONE	2	/* waits for the writer */
+
+struct export_job {
+	unsigned index;		/* image number */
+	int state;
+	long link;		/* image this one repeats, -1 to encode it */
+	unsigned char *pixels;	/* stride bytes per row */
+	unsigned char *png;
+	size_t png_len;
+	int error;		/* errno the encoding failed with */
+};
+
+struct export {
+	const char *pattern;
+	int width, height, stride, level;
+	unsigned char *last;	/* the frame before, to interpolate from */
+	struct export_job *jobs;
+	unsigned njobs;
+	size_t png_max;		/* most bytes one png can take */
+	unsigned head;		/* next image the producer queues */
+	unsigned next;		/* next image a worker takes */
+	unsigned tail;		/* next image the writer writes */
+	int quit;		/* nothing more will be queued */
+	int error;		/* first errno the writer hit, ends the export */
+	pthread_mutex_t lock;
+	pthread_cond_t work, done, free;
+	struct export_stats *st;
+};
+
+/* seen images by content hash, open addressing */
+struct seen {
+	uint64_t (*key)[2];
+	unsigned *index;
+	size_t size, used;
+};
+
+/*
+ *  hashing
+ */
+
+#define P1	0x9e3779b97f4a7c15ULL
+#define P2	0xc2b2ae3d27d4eb4fULL
+
+static inline uint64_t rotl(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t mix(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	return h ^ (h >> 33);
+}
+
+/* two independent 64 bit hashes of the visible pixels */
+static void image_hash(const unsigned char *p, int width, int height,
+		       int stride, uint64_t h[2])
+{
+	size_t row = (size_t)width * FRAME_BPP, i;
+	uint64_t a = P1, b = P2, w;
+	uint32_t t;
+	int y;
+
+	for (y = 0; y < height; y++, p += stride) {
+		for (i = 0; i + 8 <= row; i += 8) {
+			memcpy(&w, p + i, 8);
+			a = rotl(a ^ (w * P2), 31) * P1;
+			b = rotl(b + (w * P1), 27) * P2 + 0x52dce729;
+		}
+		if (i < row) {
+			memcpy(&t, p + i, 4);
+			a = rotl(a ^ (t * P2), 31) * P1;
+			b = rotl(b + (t * P1), 27) * P2 + 0x52dce729;
+		}
+	}
+	h[0] = mix(a ^ ((uint64_t)height << 32 | width));
+	h[1] = mix(b + a);
+}
+
+static long seen_find(struct seen *s, const uint64_t h[2])
+{
+	size_t i;
+
+	if (s->size == 0)
+		return -1;
+	for (i = h[0] & (s->size - 1); s->key[i][0] | s->key[i][1];
+	     i = (i + 1) & (s->size - 1))
+		if (s->key[i][0] == h[0] && s->key[i][1] == h[1])
+			return s->index[i];
+	return -1;
+}
+
+static int seen_add(struct seen *s, const uint64_t h[2], unsigned index)
+{
+	struct seen n;
+	size_t i;
+
+	if (2 * (s->used + 1) > s->size) {
+		n.size = s->size ? s->size * 2 : 1024;
+		n.used = 0;
+		n.key = calloc(n.size, sizeof(*n.key));
+		n.index = malloc(n.size * sizeof(*n.index));
+		if (n.key == NULL || n.index == NULL) {
+			free(n.key);
+			free(n.index);
+			return -1;
+		}
+		for (i = 0; i < s->size; i++)
+			if (s->key[i][0] | s->key[i][1])
+				seen_add(&n, s->key[i], s->index[i]);
+		free(s->key);
+		free(s->index);
+		*s = n;
+	}
+	for (i = h[0] & (s->size - 1); s->key[i][0] | s->key[i][1];
+	     i = (i + 1) & (s->size - 1))
+		;
+	s->key[i][0] = h[0] | (h[0] == 0 && h[1] == 0);	/* 0 marks empty */
+	s->key[i][1] = h[1];
+	s->index[i] = index;
+	s->used++;
+	return 0;
+}
+
+/*
+ *  png encoding
+ */
+
+static void put32be(unsigned char *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+/* wraps len bytes of chunk data at p + 8 into a png chunk */
+static size_t png_chunk(unsigned char *p, const char *type, size_t len)
+{
+	put32be(p, len);
+	memcpy(p + 4, type, 4);
+	put32be(p + 8 + len, crc32(0, p + 4, len + 4));
+	return len + 12;
+}
+
+/*
+ * Filters one BGRX row into RGB png scanline "out" (filter byte first),
+ * with whichever of None, Sub and Up gives the smallest sum of absolute
+ * differences, the usual guess at what deflates best.  rgb and prev are
+ * the unfiltered RGB of this row and the one above (NULL for the first).
+ */
+static void png_row(const unsigned char *bgrx, unsigned char *rgb,
+		    const unsigned char *prev, unsigned char *out, int width,
+		    unsigned char *sub, unsigned char *up)
+{
+	size_t n = (size_t)width * 3, i;
+	unsigned long s0 = 0, s1 = 0, s2 = ULONG_MAX;
+	int x;
+
+	for (x = 0; x < width; x++) {
+		rgb[3 * x] = bgrx[4 * x + 2];
+		rgb[3 * x + 1] = bgrx[4 * x + 1];
+		rgb[3 * x + 2] = bgrx[4 * x];
+	}
+	for (i = 0; i < n; i++) {
+		sub[i] = rgb[i] - (i >= 3 ? rgb[i - 3] : 0);
+		s0 += rgb[i] < 128 ? rgb[i] : 256 - rgb[i];
+		s1 += sub[i] < 128 ? sub[i] : 256 - sub[i];
+	}
+	if (prev) {
+		s2 = 0;
+		for (i = 0; i < n; i++) {
+			up[i] = rgb[i] - prev[i];
+			s2 += up[i] < 128 ? up[i] : 256 - up[i];
+		}
+	}
+	if (s2 <= s1 && s2 <= s0) {
+		out[0] = 2;
+		memcpy(out + 1, up, n);
+	} else if (s1 <= s0) {
+		out[0] = 1;
+		memcpy(out + 1, sub, n);
+	} else {
+		out[0] = 0;
+		memcpy(out + 1, rgb, n);
+	}
+}
+
+/* scratch memory of one worker */
+struct png_scratch {
+	unsigned char *raw;	/* filtered scanlines */
+	unsigned char *rgb[2];	/* this row and the one above */
+	unsigned char *sub, *up;
+};
+
+static int png_encode(struct export *e, struct png_scratch *s,
+		      struct export_job *j)
+{
+	size_t line = 1 + (size_t)e->width * 3;
+	unsigned char *p = j->png, *cur, *prev = NULL;
+	uLongf zlen;
+	int y;
+
+	for (y = 0; y < e->height; y++) {
+		cur = s->rgb[y & 1];
+		png_row(j->pixels + (size_t)y * e->stride, cur, prev,
+			s->raw + y * line, e->width, s->sub, s->up);
+		prev = cur;
+	}
+	memcpy(p, "\211PNG\r\n\032\n", 8);
+	p += 8;
+	put32be(p + 8, e->width);
+	put32be(p + 12, e->height);
+	p[16] = 8;		/* bit depth */
+	p[17] = 2;		/* truecolor */
+	p[18] = p[19] = p[20] = 0;
+	p += png_chunk(p, "IHDR", 13);
+	zlen = e->png_max - (p - j->png) - 12 - 12;
+	switch (compress2(p + 8, &zlen, s->raw, line * e->height, e->level)) {
+	case Z_OK:
+		break;
+	case Z_MEM_ERROR:
+		return -ENOMEM;
+	default:
+		/* png_max is compressBound(), the output always fits */
+		return -EIO;
+	}
+	p += png_chunk(p, "IDAT", zlen);
+	p += png_chunk(p, "IEND", 0);
+	j->png_len = p - j->png;
+	return 0;
+}
+
+static void *export_worker(void *arg)
+{
+	struct export *e = arg;
+	size_t line = 1 + (size_t)e->width * 3;
+	struct png_scratch s;
+	struct export_job *j;
+	int err = 0;
+
+	s.raw = malloc(line * e->height);
+	s.rgb[0] = malloc(line);
+	s.rgb[1] = malloc(line);
+	s.sub = malloc(line);
+	s.up = malloc(line);
+	if (!s.raw || !s.rgb[0] || !s.rgb[1] || !s.sub || !s.up)
+		err = ENOMEM;
+	pthread_mutex_lock(&e->lock);
+	for (;;) {
+		while (e->next == e->head && !e->quit)
+			pthread_cond_wait(&e->work, &e->lock);
+		if (e->next == e->head)
+			break;
+		j = &e->jobs[e->next++ % e->njobs];
+		pthread_mutex_unlock(&e->lock);
+		j->error = err;
+		if (j->link < 0 && !err)
+			j->error = -png_encode(e, &s, j);
+		pthread_mutex_lock(&e->lock);
+		j->state = JOB_DONE;
+		pthread_cond_broadcast(&e->done);
+	}
+	pthread_mutex_unlock(&e->lock);
+	free(s.raw);
+	free(s.rgb[0]);
+	free(s.rgb[1]);
+	free(s.sub);
+	free(s.up);
+	return NULL;
+}
+
+/*
+ *  writing
+ */
+
+/*
+ * The pattern is the format of snprintf(), so it must take the image
+ * number and nothing else: one "%d" conversion, with an optional width
+ * ("%04d"), and any number of "%%".
+ */
+static int pattern_check(const char *pattern)
+{
+	const char *p;
+	int n = 0;
+
+	for (p = pattern; *p; p++) {
+		if (*p != '%')
+			continue;
+		if (*++p == '%')
+			continue;
+		while (*p >= '0' && *p <= '9')
+			p++;
+		if (*p != 'd' || n++ > 0)
+			return -EINVAL;
+	}
+	return n == 1 ? 0 : -EINVAL;
+}
+
+static int write_all(int fd, const unsigned char *data, size_t len)
+{
+	ssize_t r;
+
+	while (len > 0) {
+		r = write(fd, data, len);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		data += r;
+		len -= r;
+	}
+	return 0;
+}
+
+static int write_file(const char *path, const unsigned char *data, size_t len)
+{
+	int fd, err;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return -errno;
+	err = write_all(fd, data, len);
+	if (close(fd) < 0 && err == 0)
+		err = -errno;
+	return err;
+}
+
+/* for file systems without hard links */
+static int copy_file(const char *from, const char *to)
+{
+	unsigned char buf[65536];
+	ssize_t r;
+	int in, out, err = 0;
+
+	in = open(from, O_RDONLY);
+	if (in < 0)
+		return -errno;
+	out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (out < 0) {
+		err = -errno;
+		close(in);
+		return err;
+	}
+	while (err == 0 && (r = read(in, buf, sizeof(buf))) != 0) {
+		if (r < 0)
+			err = errno == EINTR ? 0 : -errno;
+		else
+			err = write_all(out, buf, r);
+	}
+	close(in);
+	if (close(out) < 0 && err == 0)
+		err = -errno;
+	return err;
+}
+
+static int export_write(struct export *e, struct export_job *j)
+{
+	char path[PATH_MAX], target[PATH_MAX];
+	int err;
+
+	snprintf(path, sizeof(path), e->pattern, (int)j->index);
+	if (j->error)
+		return -j->error;
+	if (j->link < 0) {
+		e->st->encoded++;
+		return write_file(path, j->png, j->png_len);
+	}
+	snprintf(target, sizeof(target), e->pattern, (int)j->link);
+	unlink(path);
+	e->st->linked++;
+	if (link(target, path) == 0)
+		return 0;
+	err = -errno;
+	if (err == -EPERM || err == -EXDEV || err == -EMLINK || err == -ENOTSUP)
+		err = copy_file(target, path);
+	return err;
+}
+
+static void *export_writer(void *arg)
+{
+	struct export *e = arg;
+	struct export_job *j;
+	int err;
+
+	pthread_mutex_lock(&e->lock);
+	for (;;) {
+		j = &e->jobs[e->tail % e->njobs];
+		while (e->tail != e->head && j->state != JOB_DONE)
+			pthread_cond_wait(&e->done, &e->lock);
+		if (e->tail == e->head) {
+			if (e->quit)
+				break;
+			pthread_cond_wait(&e->done, &e->lock);
+			continue;
+		}
+		pthread_mutex_unlock(&e->lock);
+		err = e->error ? 0 : export_write(e, j);
+		pthread_mutex_lock(&e->lock);
+		if (err < 0 && !e->error)
+			e->error = -err;
+		j->state = JOB_FREE;
+		e->tail++;
+		pthread_cond_broadcast(&e->free);
+	}
+	pthread_mutex_unlock(&e->lock);
+	return NULL;
+}
+
+/* the job for the next image, waits for the writer if the ring is full */
+static struct export_job *export_reserve(struct export *e, unsigned index,
+					 long repeat)
+{
+	struct export_job *j;
+
+	pthread_mutex_lock(&e->lock);
+	while (e->head - e->tail == e->njobs && !e->error)
+		pthread_cond_wait(&e->free, &e->lock);
+	j = e->error ? NULL : &e->jobs[e->head % e->njobs];
+	pthread_mutex_unlock(&e->lock);
+	if (j) {
+		j->index = index;
+		j->link = repeat;
+		j->error = 0;
+	}
+	return j;
+}
+
+/* hands the job from export_reserve() to the workers */
+static void export_submit(struct export *e, struct export_job *j)
+{
+	pthread_mutex_lock(&e->lock);
+	j->state = JOB_QUEUED;
+	e->head++;
+	pthread_cond_signal(&e->work);
+	pthread_cond_broadcast(&e->done);
+	pthread_mutex_unlock(&e->lock);
+}
+
+/* queues image "index", a repeat of image "repeat" if that is >= 0 */
+static int export_queue(struct export *e, unsigned index, long repeat,
+			const unsigned char *pixels)
+{
+	struct export_job *j = export_reserve(e, index, repeat);
+
+	if (j == NULL)
+		return -e->error;
+	if (repeat < 0)
+		memcpy(j->pixels, pixels, (size_t)e->stride * e->height);
+	export_submit(e, j);
+	return 0;
+}
+
+/* queues image "index" made up "weight" / 256 of the way from e->last to b */
+static int export_tween(struct export *e, unsigned index,
+			const unsigned char *b, unsigned weight, int dy)
+{
+	struct export_job *j = export_reserve(e, index, -1);
+
+	if (j == NULL)
+		return -e->error;
+	interp_frame(e->last, b, j->pixels, e->width, e->height, e->stride,
+		     weight, dy);
+	e->st->interpolated++;
+	export_submit(e, j);
+	return 0;
+}
+
+/*
+ * Writes every frame of the capture file "video" as a png named by
+ * printf'ing its number into "pattern" (e.g. "dir/screen%04d.png"), with
+ * "skip" extra images for the frame ticks missed before a frame, repeating
+ * the one before, or made up from the frames around them as "interp"
+ * (INTERP_*) says.  "threads" workers encode at zlib "level", 0 threads
+ * for one per CPU.  Returns 0 or -errno (-EINVAL for a pattern without
+ * exactly one "%d"), and how it went in *st.
+ */
+int export_png(const char *video, const char *pattern, int threads,
+	       int level, int interp, struct export_stats *st)
+{
+	struct export e;
+	struct vf_reader *r;
+	struct vf_frame f;
+	struct seen seen = { NULL, NULL, 0, 0 };
+	pthread_t worker[MAX_THREADS], writer;
+	const unsigned char *pixels;
+	uint64_t h[2], last_h[2] = { 0, 0 };
+	long prev = -1, same;
+	unsigned i, k, n = 0, started = 0;
+	int codec, fps, dy, tween, err = 0;
+
+	memset(st, 0, sizeof(*st));
+	if (pattern_check(pattern) < 0 || level < Z_DEFAULT_COMPRESSION ||
+	    level > Z_BEST_COMPRESSION)
+		return -EINVAL;
+	r = vf_open(video);
+	if (r == NULL)
+		return -errno;
+	memset(&e, 0, sizeof(e));
+	e.pattern = pattern;
+	e.level = level;
+	e.st = st;
+	vf_geometry(r, &e.width, &e.height, &e.stride, &fps, &codec);
+	if (threads <= 0)
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads <= 0)
+		threads = 1;
+	if (threads > MAX_THREADS)
+		threads = MAX_THREADS;
+	e.njobs = 2 * threads + 2;
+	e.png_max = 8 + 25 + 12 + 12 +
+		compressBound((1 + (uLong)e.width * 3) * e.height);
+	e.jobs = calloc(e.njobs, sizeof(*e.jobs));
+	if (e.jobs == NULL) {
+		vf_close(r);
+		return -ENOMEM;
+	}
+	if (interp != INTERP_NONE &&
+	    (e.last = malloc((size_t)e.stride * e.height)) == NULL) {
+		err = -ENOMEM;
+		goto __free;
+	}
+	for (k = 0; k < e.njobs; k++) {
+		e.jobs[k].pixels = malloc((size_t)e.stride * e.height);
+		e.jobs[k].png = malloc(e.png_max);
+		if (!e.jobs[k].pixels || !e.jobs[k].png) {
+			err = -ENOMEM;
+			goto __free;
+		}
+	}
+	pthread_mutex_init(&e.lock, NULL);
+	pthread_cond_init(&e.work, NULL);
+	pthread_cond_init(&e.done, NULL);
+	pthread_cond_init(&e.free, NULL);
+	if ((err = -pthread_create(&writer, NULL, export_writer, &e)) < 0)
+		goto __destroy;
+	for (started = 0; started < (unsigned)threads; started++)
+		if ((err = -pthread_create(&worker[started], NULL,
+					   export_worker, &e)) < 0)
+			break;
+
+	for (i = 0; i < vf_frames(r) && err == 0; i++) {
+		vf_get_frame(r, i, &f);
+		if (vf_pixels(r, i, &pixels) < 0) {
+			err = -EINVAL;
+			break;
+		}
+		image_hash(pixels, e.width, e.height, e.stride, h);
+		/* nothing to interpolate if the frame did not change */
+		tween = interp != INTERP_NONE && f.skip && prev >= 0 &&
+			(h[0] != last_h[0] || h[1] != last_h[1]);
+		dy = tween && interp == INTERP_MOTION ?
+			interp_motion(e.last, pixels, e.width, e.height,
+				      e.stride) : 0;
+		/* a skip before the first frame has nothing to repeat */
+		for (k = 0; prev >= 0 && k < f.skip && err == 0; k++)
+			err = tween ? export_tween(&e, n++, pixels,
+						   256 * (k + 1) / (f.skip + 1), dy) :
+				export_queue(&e, n++, prev, NULL);
+		if (err < 0)
+			break;
+		same = seen_find(&seen, h);
+		if (same < 0 && seen_add(&seen, h, n) < 0) {
+			err = -ENOMEM;
+			break;
+		}
+		/* the first file with this content, if it is not this one */
+		prev = same >= 0 ? same : n;
+		err = export_queue(&e, n++, same, pixels);
+		if (e.last) {
+			memcpy(e.last, pixels, (size_t)e.stride * e.height);
+			last_h[0] = h[0];
+			last_h[1] = h[1];
+		}
+	}
+
+	pthread_mutex_lock(&e.lock);
+	e.quit = 1;
+	pthread_cond_broadcast(&e.work);
+	pthread_cond_broadcast(&e.done);
+	pthread_mutex_unlock(&e.lock);
+	for (k = 0; k < started; k++)
+		pthread_join(worker[k], NULL);
+	pthread_join(writer, NULL);
+	if (err == 0 && e.error)
+		err = -e.error;
+	st->images = e.tail;
+
+      __destroy:
+	pthread_mutex_destroy(&e.lock);
+	pthread_cond_destroy(&e.work);
+	pthread_cond_destroy(&e.done);
+	pthread_cond_destroy(&e.free);
+      __free:
+	for (k = 0; k < e.njobs; k++) {
+		free(e.jobs[k].pixels);
+		free(e.jobs[k].png);
+	}
+	free(e.jobs);
+	free(e.last);
+	free(seen.key);
+	free(seen.index);
+	vf_close(r);
+	return err;
+}
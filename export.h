@@ -0,0 +1,17 @@
+/*
+   Parallel png export of a capture file, see export.c.
+*/
+#ifndef EXPORT_H
+#define EXPORT_H
+
+struct export_stats {
+	unsigned images;	/* files made */
+	unsigned encoded;	/* of those, png encoded */
+	unsigned linked;	/* of those, hard links to an identical one */
+	unsigned interpolated;	/* of those, made up for missed frame ticks */
+};
+
+int export_png(const char *video, const char *pattern, int threads,
+	       int level, int interp, struct export_stats *st);
+
+#endif
@@ -0,0 +1,1185 @@
+/*
+   Real-time FLAC encoding of a capture.
+
+   flac_start() writes the "fLaC" marker and a STREAMINFO block that leaves
+   the length and the checksum open, which is all a decoder needs to play
+   the frames that follow.  flac_write() is called from the thread that
+   writes the capture (the capture thread itself or the ring writer) and
+   only copies the samples into jobs of BLOCK frames.  A pool of worker
+   threads encodes one job each into a FLAC frame, and one writer thread
+   appends the frames in order, keeping the MD5 of the samples and the
+   smallest and largest frame; flac_close() rewrites STREAMINFO with those,
+   so that the file ends up a standard FLAC stream that "flac -t" verifies.
+
+   Every channel of a frame is coded as a constant, with the best of the
+   fixed polynomial predictors of order 0-4, with an LPC filter of order 2,
+   4 or 8 from the Levinson-Durbin recursion on the Welch windowed
+   autocorrelation, or verbatim, whichever takes fewest bits.  Stereo is
+   coded as left/right, left/side, side/right or mid/side, again whichever
+   is smallest, and the residual is Rice coded in up to 2^MAX_PARTITION
+   partitions with their own parameters.  That stays within the streamable
+   subset, so hardware players take the files as well.
+
+   8, 16 and 24 bit integer samples are supported (U8, S16_LE, S24_LE and
+   S24_3LE of meter.h), up to MAX_CHANNELS of them.
+*/
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <math.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "meter.h"
+#include "flac.h"
+
+#define BLOCK		4096	/* frames per FLAC frame */
+#define MAX_CHANNELS	8
+#define MAX_THREADS	4
+#define MAX_LPC		8	/* LPC order */
+#define MAX_PARTITION	8	/* Rice partition order */
+#define STREAMINFO_AT	8	/* after "fLaC" and the block header */
+#define STREAMINFO_LEN	34
+
+#define JOB_FREE	0	/* flac_write() may fill it */
+#define JOB_QUEUED	1	/* waits for or is with a worker */
+#define JOB_DONE	2	/* waits for the writer */
+
+/* subframe types */
+#define SUB_CONSTANT	0
+#define SUB_VERBATIM	1
+#define SUB_FIXED	8	/* | order */
+#define SUB_LPC		32	/* | order - 1 */
+
+struct flac_job {
+	int state;
+	unsigned frames;
+	uint64_t number;	/* of the FLAC frame */
+	unsigned char *pcm;	/* frames as captured */
+	unsigned char *data;	/* the encoded frame */
+	size_t len;
+};
+
+struct flac_encoder {
+	int fd;
+	int fmt;
+	unsigned channels, rate, bps;
+	unsigned sample_bytes;	/* in the capture */
+	size_t data_max;	/* bound of an encoded frame */
+	struct flac_job *jobs;
+	unsigned njobs;
+	unsigned head;		/* next job flac_write() fills */
+	unsigned next;		/* next job a worker takes */
+	unsigned tail;		/* next job the writer writes */
+	unsigned fill;		/* frames in jobs[head] */
+	uint64_t number;	/* FLAC frames queued */
+	int quit;		/* nothing more will be queued */
+	int error;		/* first errno the writer hit */
+	pthread_mutex_t lock;
+	pthread_cond_t work, done, free;
+	pthread_t worker[MAX_THREADS], writer;
+	unsigned threads;
+
+	/* the writer's */
+	struct md5 {
+		uint32_t h[4];
+		uint64_t len;
+		unsigned char buf[64];
+	} md5;
+	unsigned char *md5_buf;	/* a job's samples as FLAC checksums them */
+	unsigned min_frame, max_frame;
+	struct flac_stats st;
+};
+
+/* a subframe as it will be written */
+struct subframe {
+	int type;
+	unsigned order;
+	int32_t qlp[MAX_LPC];
+	unsigned precision;
+	int shift;
+	unsigned porder;	/* partition order */
+	unsigned pbits;		/* 4 or 5, Rice parameter bits */
+	unsigned k[1 << MAX_PARTITION];
+	uint64_t bits;
+	uint32_t *res;		/* folded residual, from sample "order" on */
+};
+
+/* a worker's scratch space */
+struct coder {
+	int32_t *x[MAX_CHANNELS + 2];	/* + side and mid */
+	uint32_t *res[2 * (MAX_CHANNELS + 2)];	/* best and trial */
+	double *w;		/* window */
+	double *wx;
+	struct subframe sub[MAX_CHANNELS + 2];
+};
+
+/*
+ *  bits
+ */
+
+struct bits {
+	unsigned char *p;
+	uint64_t acc;
+	unsigned n;		/* bits pending in acc, < 8 between calls */
+};
+
+/* the low n <= 32 bits of v, most significant first */
+static inline void put(struct bits *b, uint32_t v, unsigned n)
+{
+	if (n == 0)
+		return;
+	b->acc = b->acc << n | (v & (uint32_t)(((uint64_t)1 << n) - 1));
+	b->n += n;
+	while (b->n >= 8) {
+		b->n -= 8;
+		*b->p++ = b->acc >> b->n;
+	}
+}
+
+static void put_align(struct bits *b)
+{
+	if (b->n)
+		put(b, 0, 8 - b->n);
+}
+
+static inline void put_rice(struct bits *b, uint32_t u, unsigned k)
+{
+	uint32_t q = u >> k;
+
+	if (q + 1 + k <= 32) {
+		put(b, (uint32_t)1 << k | (u & (((uint32_t)1 << k) - 1)),
+		    q + 1 + k);
+		return;
+	}
+	for (; q >= 32; q -= 32)
+		put(b, 0, 32);
+	put(b, 1, q + 1);
+	put(b, u & (((uint32_t)1 << k) - 1), k);
+}
+
+/* the frame number, coded like UTF-8 of up to 36 bits */
+static void put_utf8(struct bits *b, uint64_t v)
+{
+	unsigned n, i;
+
+	if (v < 0x80) {
+		put(b, v, 8);
+		return;
+	}
+	for (n = 2; n < 7 && v >= (uint64_t)1 << (5 * n + 1); n++)
+		;
+	put(b, (0xff00 >> n) | (uint32_t)(v >> (6 * (n - 1))), 8);
+	for (i = n - 1; i-- > 0;)
+		put(b, 0x80 | ((v >> (6 * i)) & 0x3f), 8);
+}
+
+static uint8_t crc8(const unsigned char *p, size_t len)
+{
+	uint8_t c = 0;
+	int i;
+
+	while (len--) {
+		c ^= *p++;
+		for (i = 0; i < 8; i++)
+			c = c & 0x80 ? (c << 1) ^ 0x07 : c << 1;
+	}
+	return c;
+}
+
+static uint16_t crc16_table[256];
+
+static void crc16_init(void)
+{
+	unsigned i, j;
+	uint16_t c;
+
+	for (i = 0; i < 256; i++) {
+		c = i << 8;
+		for (j = 0; j < 8; j++)
+			c = c & 0x8000 ? (c << 1) ^ 0x8005 : c << 1;
+		crc16_table[i] = c;
+	}
+}
+
+static uint16_t crc16(const unsigned char *p, size_t len)
+{
+	uint16_t c = 0;
+
+	while (len--)
+		c = (c << 8) ^ crc16_table[(c >> 8) ^ *p++];
+	return c;
+}
+
+/*
+ *  MD5 (RFC 1321) of the samples, for STREAMINFO
+ */
+
+static const uint32_t md5_k[64] = {
+	0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a,
+	0xa8304613, 0xfd469501, 0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
+	0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821, 0xf61e2562, 0xc040b340,
+	0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+	0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8,
+	0x676f02d9, 0x8d2a4c8a, 0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c,
+	0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70, 0x289b7ec6, 0xeaa127fa,
+	0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+	0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92,
+	0xffeff47d, 0x85845dd1, 0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+	0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+};
+
+static const unsigned char md5_r[16] = {
+	7, 12, 17, 22, 5, 9, 14, 20, 4, 11, 16, 23, 6, 10, 15, 21,
+};
+
+static void md5_block(uint32_t *h, const unsigned char *p)
+{
+	uint32_t m[16], a = h[0], b = h[1], c = h[2], d = h[3], f, t;
+	unsigned i, g;
+
+	for (i = 0; i < 16; i++)
+		m[i] = p[4 * i] | p[4 * i + 1] << 8 | p[4 * i + 2] << 16 |
+		       (uint32_t)p[4 * i + 3] << 24;
+	for (i = 0; i < 64; i++) {
+		switch (i / 16) {
+		case 0:
+			f = (b & c) | (~b & d);
+			g = i;
+			break;
+		case 1:
+			f = (d & b) | (~d & c);
+			g = (5 * i + 1) % 16;
+			break;
+		case 2:
+			f = b ^ c ^ d;
+			g = (3 * i + 5) % 16;
+			break;
+		default:
+			f = c ^ (b | ~d);
+			g = (7 * i) % 16;
+		}
+		t = d;
+		d = c;
+		c = b;
+		f += a + md5_k[i] + m[g];
+		b += f << md5_r[i / 16 * 4 + i % 4] |
+		     f >> (32 - md5_r[i / 16 * 4 + i % 4]);
+		a = t;
+	}
+	h[0] += a;
+	h[1] += b;
+	h[2] += c;
+	h[3] += d;
+}
+
+static void md5_init(struct md5 *m)
+{
+	m->h[0] = 0x67452301;
+	m->h[1] = 0xefcdab89;
+	m->h[2] = 0x98badcfe;
+	m->h[3] = 0x10325476;
+	m->len = 0;
+}
+
+static void md5_update(struct md5 *m, const unsigned char *p, size_t len)
+{
+	unsigned have = m->len % 64, n;
+
+	m->len += len;
+	if (have) {
+		n = 64 - have < len ? 64 - have : len;
+		memcpy(m->buf + have, p, n);
+		p += n;
+		len -= n;
+		if (have + n < 64)
+			return;
+		md5_block(m->h, m->buf);
+	}
+	for (; len >= 64; p += 64, len -= 64)
+		md5_block(m->h, p);
+	memcpy(m->buf, p, len);
+}
+
+static void md5_final(struct md5 *m, unsigned char *out)
+{
+	static const unsigned char pad[64] = { 0x80 };
+	unsigned char len[8];
+	uint64_t bits = m->len * 8;
+	int i;
+
+	for (i = 0; i < 8; i++)
+		len[i] = bits >> (8 * i);
+	md5_update(m, pad, 1 + (119 - m->len % 64) % 64);
+	md5_update(m, len, 8);
+	for (i = 0; i < 16; i++)
+		out[i] = m->h[i / 4] >> (8 * (i % 4));
+}
+
+/*
+ *  samples
+ */
+
+static unsigned format_bps(int fmt)
+{
+	switch (fmt) {
+	case METER_U8:
+		return 8;
+	case METER_S16_LE:
+		return 16;
+	case METER_S24_LE:
+	case METER_S24_3LE:
+		return 24;
+	default:
+		return 0;
+	}
+}
+
+/* deinterleave n frames of the capture */
+static void load(const struct flac_encoder *e, const unsigned char *p,
+		 unsigned n, int32_t **x)
+{
+	unsigned i, c, ch = e->channels;
+
+	for (i = 0; i < n; i++)
+		for (c = 0; c < ch; c++, p += e->sample_bytes)
+			switch (e->fmt) {
+			case METER_U8:
+				x[c][i] = (int32_t)p[0] - 128;
+				break;
+			case METER_S16_LE:
+				x[c][i] = (int16_t)(p[0] | p[1] << 8);
+				break;
+			default:
+				/* the low 3 bytes of S24_LE as well */
+				x[c][i] = (int32_t)((uint32_t)p[0] << 8 |
+						    (uint32_t)p[1] << 16 |
+						    (uint32_t)p[2] << 24) >> 8;
+			}
+}
+
+/* the samples as the MD5 of STREAMINFO takes them: signed, little endian,
+   bps / 8 bytes each */
+static const unsigned char *md5_samples(struct flac_encoder *e,
+					const unsigned char *p, unsigned n,
+					size_t *len)
+{
+	size_t i, samples = (size_t)n * e->channels;
+	unsigned char *q = e->md5_buf;
+
+	switch (e->fmt) {
+	case METER_U8:
+		for (i = 0; i < samples; i++)
+			q[i] = p[i] ^ 0x80;
+		break;
+	case METER_S24_LE:
+		for (i = 0; i < samples; i++)
+			memcpy(q + 3 * i, p + 4 * i, 3);
+		break;
+	default:
+		*len = samples * e->sample_bytes;
+		return p;
+	}
+	*len = samples * (e->bps / 8);
+	return q;
+}
+
+/*
+ *  residual coding
+ */
+
+static inline uint32_t fold(int32_t r)
+{
+	return (uint32_t)r << 1 ^ (uint32_t)(r >> 31);
+}
+
+/* Rice parameter for cnt residuals that sum to sum, and its bits */
+static unsigned rice_param(uint64_t sum, unsigned cnt, uint64_t *bits)
+{
+	uint64_t best = ~(uint64_t)0, b;
+	unsigned k, k0 = 0, kb = 0;
+
+	if (cnt == 0) {
+		*bits = 0;
+		return 0;
+	}
+	while (k0 < 30 && ((uint64_t)cnt << (k0 + 1)) < sum)
+		k0++;
+	for (k = k0 ? k0 - 1 : 0; k <= k0 + 1 && k <= 30; k++) {
+		b = (uint64_t)cnt * (k + 1) + (sum >> k);
+		if (b < best) {
+			best = b;
+			kb = k;
+		}
+	}
+	*bits = best;
+	return kb;
+}
+
+/*
+ * Partitions and parameters for the residual of s, n samples in the
+ * block with s->order warm-up samples before it, and its exact size.
+ */
+static void rice_plan(struct subframe *s, unsigned n)
+{
+	uint64_t sum[1 << MAX_PARTITION], bits, best = ~(uint64_t)0, b;
+	unsigned k[1 << MAX_PARTITION], cnt, i, p, P, parts, kmax;
+	const uint32_t *u = s->res;
+	unsigned j, end, start;
+
+	for (P = 0; P < MAX_PARTITION && n % (2u << P) == 0 &&
+	     (n >> (P + 1)) > s->order; P++)
+		;
+	/* the sums of the finest partitions, merged pairwise below */
+	parts = 1 << P;
+	for (i = 0, j = 0; i < parts; i++) {
+		end = (i + 1) * (n >> P) - s->order;
+		for (sum[i] = 0; j < end; j++)
+			sum[i] += u[j];
+	}
+	for (p = P + 1; p-- > 0;) {
+		parts = 1 << p;
+		if (p < P)
+			for (i = 0; i < parts; i++)
+				sum[i] = sum[2 * i] + sum[2 * i + 1];
+		b = 2 + 4;
+		kmax = 0;
+		for (i = 0; i < parts; i++) {
+			cnt = (n >> p) - (i ? 0 : s->order);
+			k[i] = rice_param(sum[i], cnt, &bits);
+			b += 4 + bits;
+			if (k[i] > kmax)
+				kmax = k[i];
+		}
+		if (kmax > 14)
+			b += parts;
+		if (b < best) {
+			best = b;
+			s->porder = p;
+			s->pbits = kmax > 14 ? 5 : 4;
+			memcpy(s->k, k, parts * sizeof(*k));
+		}
+	}
+	/* exact, the estimate above rounds sum >> k */
+	parts = 1 << s->porder;
+	s->bits = 2 + 4;
+	for (i = 0, start = 0; i < parts; i++) {
+		end = (i + 1) * (n >> s->porder) - s->order;
+		s->bits += s->pbits + (uint64_t)(end - start) * (s->k[i] + 1);
+		for (; start < end; start++)
+			s->bits += u[start] >> s->k[i];
+	}
+}
+
+static void put_residual(struct bits *b, const struct subframe *s, unsigned n)
+{
+	unsigned i, parts = 1 << s->porder, j = 0, end;
+
+	put(b, s->pbits == 5 ? 1 : 0, 2);
+	put(b, s->porder, 4);
+	for (i = 0; i < parts; i++) {
+		put(b, s->k[i], s->pbits);
+		end = (i + 1) * (n >> s->porder) - s->order;
+		for (; j < end; j++)
+			put_rice(b, s->res[j], s->k[i]);
+	}
+}
+
+/*
+ *  prediction
+ */
+
+/* the fixed predictor of order 0-4 with the smallest residual */
+static unsigned fixed_order(const int32_t *x, unsigned n)
+{
+	uint64_t e[5] = { 0, 0, 0, 0, 0 };
+	int32_t d0, d1, d2, d3, d4, p0, p1, p2, p3;
+	unsigned i, o, best = 0;
+
+	if (n < 5)
+		return 0;
+	p0 = x[3];
+	p1 = x[3] - x[2];
+	p2 = p1 - (x[2] - x[1]);
+	p3 = p2 - (x[2] - x[1] - (x[1] - x[0]));
+	for (i = 4; i < n; i++) {
+		d0 = x[i];
+		d1 = d0 - p0;
+		d2 = d1 - p1;
+		d3 = d2 - p2;
+		d4 = d3 - p3;
+		e[0] += d0 < 0 ? -(int64_t)d0 : d0;
+		e[1] += d1 < 0 ? -(int64_t)d1 : d1;
+		e[2] += d2 < 0 ? -(int64_t)d2 : d2;
+		e[3] += d3 < 0 ? -(int64_t)d3 : d3;
+		e[4] += d4 < 0 ? -(int64_t)d4 : d4;
+		p0 = d0;
+		p1 = d1;
+		p2 = d2;
+		p3 = d3;
+	}
+	for (o = 1; o < 5; o++)
+		if (e[o] < e[best])
+			best = o;
+	return best;
+}
+
+static void fixed_residual(const int32_t *x, unsigned n, unsigned order,
+			   uint32_t *u)
+{
+	unsigned i;
+
+	for (i = order; i < n; i++)
+		switch (order) {
+		case 0:
+			*u++ = fold(x[i]);
+			break;
+		case 1:
+			*u++ = fold(x[i] - x[i - 1]);
+			break;
+		case 2:
+			*u++ = fold(x[i] - 2 * x[i - 1] + x[i - 2]);
+			break;
+		case 3:
+			*u++ = fold(x[i] - 3 * x[i - 1] + 3 * x[i - 2] -
+				    x[i - 3]);
+			break;
+		default:
+			*u++ = fold(x[i] - 4 * x[i - 1] + 6 * x[i - 2] -
+				    4 * x[i - 3] + x[i - 4]);
+		}
+}
+
+/*
+ * LPC coefficients of every order up to MAX_LPC, lp[o - 1][j] weighing the
+ * sample j + 1 before.  Returns the highest order it got to.
+ */
+static unsigned lpc_coefs(struct coder *c, const int32_t *x, unsigned n,
+			  double lp[MAX_LPC][MAX_LPC])
+{
+	double r[MAX_LPC + 1], a[MAX_LPC], t[MAX_LPC], err, acc, k;
+	unsigned i, j, o;
+
+	for (i = 0; i < n; i++)
+		c->wx[i] = x[i] * c->w[i];
+	for (o = 0; o <= MAX_LPC; o++) {
+		for (acc = 0, i = o; i < n; i++)
+			acc += c->wx[i] * c->wx[i - o];
+		r[o] = acc;
+	}
+	err = r[0];
+	if (err <= 0)
+		return 0;
+	for (o = 0; o < MAX_LPC; o++) {
+		for (acc = r[o + 1], j = 0; j < o; j++)
+			acc -= a[j] * r[o - j];
+		k = acc / err;
+		for (j = 0; j < o; j++)
+			t[j] = a[j] - k * a[o - 1 - j];
+		memcpy(a, t, o * sizeof(*a));
+		a[o] = k;
+		memcpy(lp[o], a, (o + 1) * sizeof(*a));
+		err *= 1 - k * k;
+		if (err <= 0)
+			return o + 1;
+	}
+	return MAX_LPC;
+}
+
+/* quantize lp to s->precision bits, returns -1 if it cannot be */
+static int lpc_quantize(struct subframe *s, const double *lp)
+{
+	double cmax = 0, e = 0;
+	int32_t qmax = (1 << (s->precision - 1)) - 1;
+	unsigned j;
+	int exp;
+	long q;
+
+	for (j = 0; j < s->order; j++)
+		if (fabs(lp[j]) > cmax)
+			cmax = fabs(lp[j]);
+	if (cmax <= 0)
+		return -1;
+	frexp(cmax, &exp);
+	s->shift = (int)s->precision - 1 - exp;
+	if (s->shift > 15)
+		s->shift = 15;
+	if (s->shift < 0)
+		return -1;
+	for (j = 0; j < s->order; j++) {
+		/* carry the rounding error over to the next coefficient */
+		e += lp[j] * (1 << s->shift);
+		q = lround(e);
+		if (q > qmax)
+			q = qmax;
+		else if (q < -qmax - 1)
+			q = -qmax - 1;
+		s->qlp[j] = q;
+		e -= q;
+	}
+	return 0;
+}
+
+/* returns -1 if a residual does not fit 31 bits */
+static int lpc_residual(const struct subframe *s, const int32_t *x,
+			unsigned n, uint32_t *u)
+{
+	int64_t sum, r;
+	unsigned i, j;
+
+	for (i = s->order; i < n; i++) {
+		for (sum = 0, j = 0; j < s->order; j++)
+			sum += (int64_t)s->qlp[j] * x[i - j - 1];
+		r = x[i] - (sum >> s->shift);
+		if (r > 0x3fffffff || r < -0x40000000)
+			return -1;
+		*u++ = fold((int32_t)r);
+	}
+	return 0;
+}
+
+/*
+ * The smallest subframe for the n samples x of bps bits.  res[0] and res[1]
+ * are the residual buffers, s->res ends up pointing to the one used.
+ */
+static void plan_subframe(struct coder *c, struct subframe *s,
+			  const int32_t *x, unsigned n, unsigned bps,
+			  uint32_t **res)
+{
+	static const unsigned lpc_orders[] = { 2, 4, 8 };
+	double lp[MAX_LPC][MAX_LPC];
+	struct subframe t;
+	unsigned i, max;
+
+	for (i = 1; i < n && x[i] == x[0]; i++)
+		;
+	if (i == n) {
+		s->type = SUB_CONSTANT;
+		s->order = 0;
+		s->bits = 8 + bps;
+		return;
+	}
+	s->type = SUB_VERBATIM;
+	s->order = 0;
+	s->bits = 8 + (uint64_t)n * bps;
+
+	t.order = fixed_order(x, n);
+	t.type = SUB_FIXED | t.order;
+	t.res = res[0];
+	fixed_residual(x, n, t.order, t.res);
+	rice_plan(&t, n);
+	t.bits += 8 + t.order * bps;
+	if (t.bits < s->bits)
+		*s = t;
+
+	max = n > MAX_LPC * 4 ? lpc_coefs(c, x, n, lp) : 0;
+	for (i = 0; i < sizeof(lpc_orders) / sizeof(*lpc_orders); i++) {
+		t.order = lpc_orders[i];
+		if (t.order > max)
+			break;
+		t.type = SUB_LPC | (t.order - 1);
+		t.precision = bps <= 16 ? 13 : 15;
+		t.res = s->res == res[0] ? res[1] : res[0];
+		if (lpc_quantize(&t, lp[t.order - 1]) < 0 ||
+		    lpc_residual(&t, x, n, t.res) < 0)
+			continue;
+		rice_plan(&t, n);
+		t.bits += 8 + t.order * bps + 4 + 5 + t.order * t.precision;
+		if (t.bits < s->bits)
+			*s = t;
+	}
+}
+
+static void put_subframe(struct bits *b, const struct subframe *s,
+			 const int32_t *x, unsigned n, unsigned bps)
+{
+	unsigned i;
+
+	put(b, s->type << 1, 8);
+	switch (s->type) {
+	case SUB_CONSTANT:
+		put(b, x[0], bps);
+		return;
+	case SUB_VERBATIM:
+		for (i = 0; i < n; i++)
+			put(b, x[i], bps);
+		return;
+	}
+	for (i = 0; i < s->order; i++)
+		put(b, x[i], bps);
+	if (s->type & SUB_LPC) {
+		put(b, s->precision - 1, 4);
+		put(b, s->shift, 5);
+		for (i = 0; i < s->order; i++)
+			put(b, s->qlp[i], s->precision);
+	}
+	put_residual(b, s, n);
+}
+
+/*
+ *  frames
+ */
+
+static unsigned rate_code(unsigned rate)
+{
+	static const unsigned rates[] = {
+		0, 88200, 176400, 192000, 8000, 16000, 22050, 24000,
+		32000, 44100, 48000, 96000,
+	};
+	unsigned i;
+
+	for (i = 1; i < sizeof(rates) / sizeof(*rates); i++)
+		if (rates[i] == rate)
+			return i;
+	return 0;	/* the one in STREAMINFO */
+}
+
+/* encode job j with the scratch space of c, returns its length */
+static size_t encode_frame(const struct flac_encoder *e, struct coder *c,
+			   const struct flac_job *j)
+{
+	/* which two of left, right, side, mid, and their channel code */
+	static const unsigned pairs[4][3] = {
+		{ 0, 1, 1 }, { 0, 2, 8 }, { 2, 1, 9 }, { 3, 2, 10 },
+	};
+	struct bits b = { j->data, 0, 0 };
+	unsigned n = j->frames, ch = e->channels, bps = e->bps;
+	unsigned i, s, best = 0, assign;
+	uint64_t bits, min = ~(uint64_t)0;
+	size_t head;
+
+	load(e, j->pcm, n, c->x);
+	for (i = 0; i < ch; i++)
+		plan_subframe(c, &c->sub[i], c->x[i], n, bps, &c->res[2 * i]);
+	assign = ch - 1;
+	if (ch == 2) {
+		for (i = 0; i < n; i++) {
+			c->x[2][i] = c->x[0][i] - c->x[1][i];
+			c->x[3][i] = (c->x[0][i] + c->x[1][i]) >> 1;
+		}
+		plan_subframe(c, &c->sub[2], c->x[2], n, bps + 1, &c->res[4]);
+		plan_subframe(c, &c->sub[3], c->x[3], n, bps, &c->res[6]);
+		for (i = 0; i < 4; i++) {
+			bits = c->sub[pairs[i][0]].bits + c->sub[pairs[i][1]].bits;
+			if (bits < min) {
+				min = bits;
+				best = i;
+			}
+		}
+		assign = pairs[best][2];
+	}
+
+	put(&b, 0xfff8, 16);
+	put(&b, n == BLOCK ? 12 : 7, 4);
+	put(&b, rate_code(e->rate), 4);
+	put(&b, assign, 4);
+	put(&b, bps == 8 ? 1 : bps == 16 ? 4 : 6, 3);
+	put(&b, 0, 1);
+	put_utf8(&b, j->number);
+	if (n != BLOCK)
+		put(&b, n - 1, 16);
+	head = b.p - j->data;
+	put(&b, crc8(j->data, head), 8);
+
+	for (i = 0; i < ch; i++) {
+		s = ch == 2 ? pairs[best][i] : i;
+		/* the side channel takes a bit more */
+		put_subframe(&b, &c->sub[s], c->x[s], n, bps + (s == 2 && ch == 2));
+	}
+	put_align(&b);
+	put(&b, crc16(j->data, b.p - j->data), 16);
+	return b.p - j->data;
+}
+
+static struct coder *coder_new(void)
+{
+	struct coder *c = calloc(1, sizeof(*c));
+	unsigned i;
+
+	if (c == NULL)
+		return NULL;
+	for (i = 0; i < MAX_CHANNELS + 2; i++)
+		if ((c->x[i] = malloc(BLOCK * sizeof(int32_t))) == NULL)
+			goto fail;
+	for (i = 0; i < 2 * (MAX_CHANNELS + 2); i++)
+		if ((c->res[i] = malloc(BLOCK * sizeof(uint32_t))) == NULL)
+			goto fail;
+	c->w = malloc(BLOCK * sizeof(double));
+	c->wx = malloc(BLOCK * sizeof(double));
+	if (c->w == NULL || c->wx == NULL)
+		goto fail;
+	return c;
+
+fail:
+	for (i = 0; i < MAX_CHANNELS + 2; i++)
+		free(c->x[i]);
+	for (i = 0; i < 2 * (MAX_CHANNELS + 2); i++)
+		free(c->res[i]);
+	free(c->w);
+	free(c->wx);
+	free(c);
+	return NULL;
+}
+
+static void coder_free(struct coder *c)
+{
+	unsigned i;
+
+	if (c == NULL)
+		return;
+	for (i = 0; i < MAX_CHANNELS + 2; i++)
+		free(c->x[i]);
+	for (i = 0; i < 2 * (MAX_CHANNELS + 2); i++)
+		free(c->res[i]);
+	free(c->w);
+	free(c->wx);
+	free(c);
+}
+
+/* Welch window over n samples */
+static void coder_window(struct coder *c, unsigned n)
+{
+	double h = (n - 1) / 2.0, d;
+	unsigned i;
+
+	for (i = 0; i < n; i++) {
+		d = (i - h) / (h + 1);
+		c->w[i] = 1 - d * d;
+	}
+}
+
+/*
+ *  threads
+ */
+
+static void *flac_worker(void *arg)
+{
+	struct flac_encoder *e = arg;
+	struct coder *c = coder_new();
+	struct flac_job *j;
+	unsigned window = 0;
+
+	pthread_mutex_lock(&e->lock);
+	for (;;) {
+		while (e->next == e->head && !e->quit)
+			pthread_cond_wait(&e->work, &e->lock);
+		if (e->next == e->head)
+			break;
+		j = &e->jobs[e->next++ % e->njobs];
+		pthread_mutex_unlock(&e->lock);
+		if (c == NULL) {
+			j->len = 0;
+		} else {
+			if (window != j->frames)
+				coder_window(c, window = j->frames);
+			j->len = encode_frame(e, c, j);
+		}
+		pthread_mutex_lock(&e->lock);
+		j->state = JOB_DONE;
+		pthread_cond_broadcast(&e->done);
+	}
+	pthread_mutex_unlock(&e->lock);
+	coder_free(c);
+	return NULL;
+}
+
+static int write_all(int fd, const unsigned char *p, size_t len)
+{
+	ssize_t r;
+
+	while (len > 0) {
+		r = write(fd, p, len);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		p += r;
+		len -= r;
+	}
+	return 0;
+}
+
+static int flac_put(struct flac_encoder *e, struct flac_job *j)
+{
+	const unsigned char *p;
+	size_t len;
+	int err;
+
+	if (j->len == 0)
+		return -ENOMEM;
+	if ((err = write_all(e->fd, j->data, j->len)) < 0)
+		return err;
+	p = md5_samples(e, j->pcm, j->frames, &len);
+	md5_update(&e->md5, p, len);
+	if (j->frames == BLOCK || e->min_frame == 0) {
+		if (e->min_frame == 0 || j->len < e->min_frame)
+			e->min_frame = j->len;
+	}
+	if (j->len > e->max_frame)
+		e->max_frame = j->len;
+	e->st.samples += j->frames;
+	e->st.raw += (uint64_t)j->frames * e->channels * e->sample_bytes;
+	e->st.bytes += j->len;
+	return 0;
+}
+
+static void *flac_writer(void *arg)
+{
+	struct flac_encoder *e = arg;
+	struct flac_job *j;
+	int err;
+
+	pthread_mutex_lock(&e->lock);
+	for (;;) {
+		j = &e->jobs[e->tail % e->njobs];
+		while (e->tail != e->head && j->state != JOB_DONE)
+			pthread_cond_wait(&e->done, &e->lock);
+		if (e->tail == e->head) {
+			if (e->quit)
+				break;
+			pthread_cond_wait(&e->done, &e->lock);
+			continue;
+		}
+		pthread_mutex_unlock(&e->lock);
+		err = e->error ? 0 : flac_put(e, j);
+		pthread_mutex_lock(&e->lock);
+		if (err < 0 && !e->error)
+			e->error = -err;
+		j->state = JOB_FREE;
+		e->tail++;
+		pthread_cond_broadcast(&e->free);
+	}
+	pthread_mutex_unlock(&e->lock);
+	return NULL;
+}
+
+/* hands jobs[head] with e->fill frames to the workers */
+static void flac_submit(struct flac_encoder *e)
+{
+	struct flac_job *j = &e->jobs[e->head % e->njobs];
+
+	j->frames = e->fill;
+	j->number = e->number++;
+	e->fill = 0;
+	pthread_mutex_lock(&e->lock);
+	j->state = JOB_QUEUED;
+	e->head++;
+	pthread_cond_signal(&e->work);
+	pthread_cond_broadcast(&e->done);
+	pthread_mutex_unlock(&e->lock);
+}
+
+/*
+ *  stream
+ */
+
+static void streaminfo(unsigned char *p, unsigned channels, unsigned rate,
+		       unsigned bps, unsigned min_frame, unsigned max_frame,
+		       uint64_t samples, const unsigned char *md5)
+{
+	struct bits b = { p, 0, 0 };
+
+	put(&b, BLOCK, 16);
+	put(&b, BLOCK, 16);
+	put(&b, min_frame, 24);
+	put(&b, max_frame, 24);
+	put(&b, rate, 20);
+	put(&b, channels - 1, 3);
+	put(&b, bps - 1, 5);
+	put(&b, samples >> 32, 4);
+	put(&b, samples, 32);
+	if (md5)
+		memcpy(b.p, md5, 16);
+	else
+		memset(b.p, 0, 16);
+}
+
+/*
+ * Writes the stream header for fmt (METER_*) samples to fd, the length
+ * and checksum left for flac_close() to fill in.  Returns 0, -EINVAL for a
+ * format FLAC does not take, or -errno.
+ */
+int flac_start(int fd, int fmt, unsigned channels, unsigned rate)
+{
+	unsigned char h[STREAMINFO_AT + STREAMINFO_LEN] = {
+		'f', 'L', 'a', 'C', 0x80, 0, 0, STREAMINFO_LEN,
+	};
+	unsigned bps = format_bps(fmt);
+
+	if (bps == 0 || channels == 0 || channels > MAX_CHANNELS ||
+	    rate == 0 || rate > 655350)
+		return -EINVAL;
+	streaminfo(h + STREAMINFO_AT, channels, rate, bps, 0, 0, 0, NULL);
+	return write_all(fd, h, sizeof(h));
+}
+
+/*
+ * An encoder for the frames that follow the header flac_start() wrote to
+ * fd, with "threads" workers (0 for one per CPU, up to MAX_THREADS).
+ * Returns NULL with errno set if it cannot be set up.
+ */
+struct flac_encoder *flac_new(int fd, int fmt, unsigned channels,
+			      unsigned rate, int threads)
+{
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+	struct flac_encoder *e;
+	unsigned k, bps = format_bps(fmt);
+	int err;
+
+	if (bps == 0 || channels == 0 || channels > MAX_CHANNELS) {
+		errno = EINVAL;
+		return NULL;
+	}
+	pthread_once(&once, crc16_init);
+	if (threads <= 0)
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads <= 0)
+		threads = 1;
+	if (threads > MAX_THREADS)
+		threads = MAX_THREADS;
+	if ((e = calloc(1, sizeof(*e))) == NULL)
+		return NULL;
+	e->fd = fd;
+	e->fmt = fmt;
+	e->channels = channels;
+	e->rate = rate;
+	e->bps = bps;
+	e->sample_bytes = meter_sample_bytes(fmt);
+	/* verbatim, side channel included, never takes more */
+	e->data_max = 32 + channels * (2 + (size_t)BLOCK * (bps + 1) / 8);
+	e->njobs = 2 * threads + 2;
+	e->jobs = calloc(e->njobs, sizeof(*e->jobs));
+	e->md5_buf = malloc((size_t)BLOCK * channels * 3);
+	if (e->jobs == NULL || e->md5_buf == NULL)
+		goto fail;
+	for (k = 0; k < e->njobs; k++) {
+		e->jobs[k].pcm = malloc((size_t)BLOCK * channels *
+					e->sample_bytes);
+		e->jobs[k].data = malloc(e->data_max);
+		if (!e->jobs[k].pcm || !e->jobs[k].data)
+			goto fail;
+	}
+	md5_init(&e->md5);
+	pthread_mutex_init(&e->lock, NULL);
+	pthread_cond_init(&e->work, NULL);
+	pthread_cond_init(&e->done, NULL);
+	pthread_cond_init(&e->free, NULL);
+	if ((err = pthread_create(&e->writer, NULL, flac_writer, e)) != 0) {
+		errno = err;
+		goto destroy;
+	}
+	for (e->threads = 0; e->threads < (unsigned)threads; e->threads++)
+		if (pthread_create(&e->worker[e->threads], NULL, flac_worker,
+				   e) != 0)
+			break;
+	if (e->threads == 0) {
+		flac_close(e, NULL);
+		errno = EAGAIN;
+		return NULL;
+	}
+	return e;
+
+destroy:
+	pthread_cond_destroy(&e->free);
+	pthread_cond_destroy(&e->done);
+	pthread_cond_destroy(&e->work);
+	pthread_mutex_destroy(&e->lock);
+fail:
+	if (e->jobs)
+		for (k = 0; k < e->njobs; k++) {
+			free(e->jobs[k].pcm);
+			free(e->jobs[k].data);
+		}
+	free(e->jobs);
+	free(e->md5_buf);
+	free(e);
+	if (errno == 0)
+		errno = ENOMEM;
+	return NULL;
+}
+
+/*
+ * Encodes frames of interleaved samples.  Only waits when the workers fall
+ * behind by all the jobs.  Returns 0 or -errno of a failed write.
+ */
+int flac_write(struct flac_encoder *e, const void *data, size_t frames)
+{
+	const unsigned char *p = data;
+	size_t frame = (size_t)e->channels * e->sample_bytes;
+	unsigned n;
+	int err;
+
+	while (frames > 0) {
+		if (e->fill == 0) {
+			/* the job comes free once the writer is done with it */
+			pthread_mutex_lock(&e->lock);
+			while (e->head - e->tail >= e->njobs && !e->error)
+				pthread_cond_wait(&e->free, &e->lock);
+			err = e->error;
+			pthread_mutex_unlock(&e->lock);
+			if (err)
+				return -err;
+		}
+		n = BLOCK - e->fill;
+		if (n > frames)
+			n = frames;
+		memcpy(e->jobs[e->head % e->njobs].pcm + e->fill * frame, p,
+		       n * frame);
+		e->fill += n;
+		p += n * frame;
+		frames -= n;
+		if (e->fill == BLOCK)
+			flac_submit(e);
+	}
+	return 0;
+}
+
+/*
+ * Encodes what is left, completes STREAMINFO if fd can seek and frees the
+ * encoder, fd stays open.  Returns 0 or -errno of the first failed write,
+ * and the totals in *st if not NULL.
+ */
+int flac_close(struct flac_encoder *e, struct flac_stats *st)
+{
+	unsigned char si[STREAMINFO_LEN], md5[16];
+	unsigned k;
+	int err;
+
+	if (e->fill)
+		flac_submit(e);
+	pthread_mutex_lock(&e->lock);
+	e->quit = 1;
+	pthread_cond_broadcast(&e->work);
+	pthread_cond_broadcast(&e->done);
+	pthread_mutex_unlock(&e->lock);
+	for (k = 0; k < e->threads; k++)
+		pthread_join(e->worker[k], NULL);
+	pthread_join(e->writer, NULL);
+	err = e->error;
+	if (!err) {
+		md5_final(&e->md5, md5);
+		streaminfo(si, e->channels, e->rate, e->bps, e->min_frame,
+			   e->max_frame, e->st.samples, md5);
+		/* a pipe keeps the open header, which is fine for decoders */
+		pwrite(e->fd, si, sizeof(si), STREAMINFO_AT);
+	}
+	if (st) {
+		*st = e->st;
+		st->bytes += STREAMINFO_AT + STREAMINFO_LEN;
+	}
+	pthread_cond_destroy(&e->free);
+	pthread_cond_destroy(&e->done);
+	pthread_cond_destroy(&e->work);
+	pthread_mutex_destroy(&e->lock);
+	for (k = 0; k < e->njobs; k++) {
+		free(e->jobs[k].pcm);
+		free(e->jobs[k].data);
+	}
+	free(e->jobs);
+	free(e->md5_buf);
+	free(e);
+	return -err;
+}
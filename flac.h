@@ -0,0 +1,24 @@
+/*
+   Real-time FLAC encoding of a capture, see flac.c.
+*/
+#ifndef FLAC_H
+#define FLAC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct flac_stats {
+	uint64_t samples;	/* frames encoded, per channel */
+	uint64_t raw;		/* bytes of PCM they came in */
+	uint64_t bytes;		/* bytes of FLAC, headers included */
+};
+
+struct flac_encoder;
+
+int flac_start(int fd, int fmt, unsigned channels, unsigned rate);
+struct flac_encoder *flac_new(int fd, int fmt, unsigned channels,
+			      unsigned rate, int threads);
+int flac_write(struct flac_encoder *e, const void *data, size_t frames);
+int flac_close(struct flac_encoder *e, struct flac_stats *st);
+
+#endif
@@ -0,0 +1,312 @@
+/*
+   Tile delta coding of screen frames.
+
+   A frame is cut into TILE x TILE pixel tiles (narrower and shorter ones at
+   the right and bottom edges) and every tile is compared with the same tile
+   of the previous frame.  Only the tiles that differ are stored, after a
+   bitmap of which ones they are, so a screen where just the cursor blinks
+   costs a tile or two instead of the whole frame.  Every keyint-th frame is
+   a key frame with all the tiles, so a stream can be decoded from there.
+
+   An encoded frame is
+
+     u8 type (TILE_KEY or TILE_DELTA), u8 TILE, u16 0, u32 tiles stored
+     (little endian), bitmap of ceil(tiles_x * tiles_y / 8) bytes, tile i
+     in bit i % 8 of byte i / 8, tiles row by row, then the pixel rows of
+     every stored tile in tile order, without the stride padding.
+
+   The compare walks the frame one pixel row at a time and checks every
+   full width tile of the row that has not been found changed yet; there
+   are plain C, SSE2 and AVX2 versions of that, picked at runtime.
+*/
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu.h"
+#include "frames.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FRAMES_X86 1
+#endif
+
+#define TILE_BYTES	(TILE * FRAME_BPP)	/* one row of a full tile */
+#define HEADER_BYTES	8
+
+struct tile_coder {
+	int width, height, stride;
+	int tiles_x, tiles_y, ntiles;
+	int full_x;		/* tiles of full TILE width in a row */
+	int keyint;		/* frames from one key frame to the next */
+	unsigned count;		/* frames encoded */
+	int have_key;		/* decoder: prev holds a whole frame */
+	unsigned char *prev;	/* the last frame, stride bytes per row */
+	unsigned char *changed;	/* one flag per tile */
+	unsigned char *out;	/* the encoded frame */
+	unsigned long keyframes, tiles;
+};
+
+/* marks every full tile of one pixel row in which a differs from b */
+typedef void (*tile_row_t)(const uint8_t *a, const uint8_t *b,
+			   unsigned tiles, uint8_t *changed);
+
+static void tile_row_c(const uint8_t *a, const uint8_t *b, unsigned tiles,
+		       uint8_t *changed)
+{
+	unsigned t;
+
+	for (t = 0; t < tiles; t++)
+		if (!changed[t] &&
+		    memcmp(a + t * TILE_BYTES, b + t * TILE_BYTES, TILE_BYTES))
+			changed[t] = 1;
+}
+
+#ifdef FRAMES_X86
+
+#pragma GCC push_options
+#pragma GCC target("sse2")
+
+static void tile_row_sse2(const uint8_t *a, const uint8_t *b, unsigned tiles,
+			  uint8_t *changed)
+{
+	unsigned t, i;
+	__m128i acc;
+
+	for (t = 0; t < tiles; t++, a += TILE_BYTES, b += TILE_BYTES) {
+		if (changed[t])
+			continue;
+		acc = _mm_setzero_si128();
+		for (i = 0; i < TILE_BYTES; i += 16)
+			acc = _mm_or_si128(acc, _mm_xor_si128(
+				_mm_loadu_si128((const __m128i *)(a + i)),
+				_mm_loadu_si128((const __m128i *)(b + i))));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) != 0xffff)
+			changed[t] = 1;
+	}
+}
+
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx2")
+
+static void tile_row_avx2(const uint8_t *a, const uint8_t *b, unsigned tiles,
+			  uint8_t *changed)
+{
+	unsigned t, i;
+	__m256i acc;
+
+	for (t = 0; t < tiles; t++, a += TILE_BYTES, b += TILE_BYTES) {
+		if (changed[t])
+			continue;
+		acc = _mm256_setzero_si256();
+		for (i = 0; i < TILE_BYTES; i += 32)
+			acc = _mm256_or_si256(acc, _mm256_xor_si256(
+				_mm256_loadu_si256((const __m256i *)(a + i)),
+				_mm256_loadu_si256((const __m256i *)(b + i))));
+		if (!_mm256_testz_si256(acc, acc))
+			changed[t] = 1;
+	}
+}
+
+#pragma GCC pop_options
+
+#endif /* FRAMES_X86 */
+
+/* one row per CPU_*, see cpu.c */
+static const struct tile_impl {
+	tile_row_t row;
+} tile_impls[] = {
+	{ tile_row_c },
+#ifdef FRAMES_X86
+	{ tile_row_sse2 },
+	{ tile_row_avx2 },
+#endif
+};
+
+static const void *impl;
+
+static const struct tile_impl *tile_dispatch(void)
+{
+	return cpu_resolve(&impl, tile_impls, sizeof(tile_impls[0]),
+			   sizeof(tile_impls) / sizeof(tile_impls[0]), -1);
+}
+
+/*
+ * A coder for width x height BGRA frames of "stride" bytes per row, which
+ * either encodes (with a key frame every keyint frames) or decodes, not
+ * both.
+ */
+struct tile_coder *tile_coder_new(int width, int height, int stride,
+				  int keyint)
+{
+	struct tile_coder *c;
+
+	if (width <= 0 || height <= 0 || stride < width * FRAME_BPP ||
+	    keyint <= 0)
+		return NULL;
+	c = calloc(1, sizeof(*c));
+	if (c == NULL)
+		return NULL;
+	c->width = width;
+	c->height = height;
+	c->stride = stride;
+	c->keyint = keyint;
+	c->tiles_x = (width + TILE - 1) / TILE;
+	c->tiles_y = (height + TILE - 1) / TILE;
+	c->ntiles = c->tiles_x * c->tiles_y;
+	c->full_x = width / TILE;
+	c->prev = calloc(height, stride);
+	c->changed = malloc(c->ntiles);
+	c->out = malloc(HEADER_BYTES + (c->ntiles + 7) / 8 +
+			(size_t)width * FRAME_BPP * height);
+	if (c->prev == NULL || c->changed == NULL || c->out == NULL) {
+		tile_coder_free(c);
+		return NULL;
+	}
+	return c;
+}
+
+void tile_coder_free(struct tile_coder *c)
+{
+	if (c == NULL)
+		return;
+	free(c->prev);
+	free(c->changed);
+	free(c->out);
+	free(c);
+}
+
+/* bytes in one row of tile column tx, and rows in tile row ty */
+static inline size_t tile_w(struct tile_coder *c, int tx)
+{
+	return (size_t)(tx < c->full_x ? TILE : c->width - tx * TILE) * FRAME_BPP;
+}
+
+static inline int tile_h(struct tile_coder *c, int ty)
+{
+	return ty < c->tiles_y - 1 ? TILE : c->height - ty * TILE;
+}
+
+static void find_changed(struct tile_coder *c, const unsigned char *frame)
+{
+	tile_row_t row = tile_dispatch()->row;
+	const unsigned char *a, *b;
+	uint8_t *changed;
+	size_t edge;
+	int y;
+
+	memset(c->changed, 0, c->ntiles);
+	for (y = 0; y < c->height; y++) {
+		a = frame + (size_t)y * c->stride;
+		b = c->prev + (size_t)y * c->stride;
+		changed = c->changed + (y / TILE) * c->tiles_x;
+		row(a, b, c->full_x, changed);
+		if (c->full_x < c->tiles_x && !changed[c->full_x]) {
+			edge = (size_t)c->full_x * TILE_BYTES;
+			if (memcmp(a + edge, b + edge, tile_w(c, c->full_x)))
+				changed[c->full_x] = 1;
+		}
+	}
+}
+
+/*
+ * Encodes "frame" against the previous one, *out points to the result
+ * until the next call.  Returns its size in bytes.
+ */
+size_t tile_encode(struct tile_coder *c, const unsigned char *frame,
+		   const unsigned char **out)
+{
+	unsigned char *p = c->out, *bitmap;
+	int key = c->count++ % c->keyint == 0;
+	int tx, ty, i, y, h;
+	uint32_t stored = 0;
+	size_t w, off;
+
+	if (key)
+		memset(c->changed, 1, c->ntiles);
+	else
+		find_changed(c, frame);
+	p[0] = key ? TILE_KEY : TILE_DELTA;
+	p[1] = TILE;
+	p[2] = p[3] = 0;
+	bitmap = p + HEADER_BYTES;
+	memset(bitmap, 0, (c->ntiles + 7) / 8);
+	p = bitmap + (c->ntiles + 7) / 8;
+	for (ty = 0, i = 0; ty < c->tiles_y; ty++) {
+		h = tile_h(c, ty);
+		for (tx = 0; tx < c->tiles_x; tx++, i++) {
+			if (!c->changed[i])
+				continue;
+			bitmap[i / 8] |= 1 << (i % 8);
+			stored++;
+			w = tile_w(c, tx);
+			off = (size_t)ty * TILE * c->stride + (size_t)tx * TILE_BYTES;
+			for (y = 0; y < h; y++, off += c->stride) {
+				memcpy(p, frame + off, w);
+				memcpy(c->prev + off, frame + off, w);
+				p += w;
+			}
+		}
+	}
+	c->out[4] = stored;
+	c->out[5] = stored >> 8;
+	c->out[6] = stored >> 16;
+	c->out[7] = stored >> 24;
+	if (key)
+		c->keyframes++;
+	c->tiles += stored;
+	*out = c->out;
+	return p - c->out;
+}
+
+/*
+ * Applies an encoded frame to the last decoded one, *frame points to the
+ * result (stride bytes per row) until the next call.  Returns -1 if the
+ * data is damaged or is a delta with no key frame before it.
+ */
+int tile_decode(struct tile_coder *c, const unsigned char *data, size_t len,
+		const unsigned char **frame)
+{
+	const unsigned char *bitmap, *p, *end = data + len;
+	int tx, ty, i, y, h;
+	size_t w, off;
+
+	if (len < HEADER_BYTES + (size_t)(c->ntiles + 7) / 8 || data[1] != TILE)
+		return -1;
+	if (data[0] == TILE_KEY)
+		c->have_key = 1;
+	else if (data[0] != TILE_DELTA || !c->have_key)
+		return -1;
+	bitmap = data + HEADER_BYTES;
+	p = bitmap + (c->ntiles + 7) / 8;
+	for (ty = 0, i = 0; ty < c->tiles_y; ty++) {
+		h = tile_h(c, ty);
+		for (tx = 0; tx < c->tiles_x; tx++, i++) {
+			if (!(bitmap[i / 8] & (1 << (i % 8))))
+				continue;
+			w = tile_w(c, tx);
+			if ((size_t)(end - p) < w * h) {
+				c->have_key = 0;
+				return -1;
+			}
+			off = (size_t)ty * TILE * c->stride + (size_t)tx * TILE_BYTES;
+			for (y = 0; y < h; y++, off += c->stride) {
+				memcpy(c->prev + off, p, w);
+				p += w;
+			}
+		}
+	}
+	*frame = c->prev;
+	return 0;
+}
+
+/* key frames and tiles stored so far */
+void tile_stats(struct tile_coder *c, unsigned long *keyframes,
+		unsigned long *tiles)
+{
+	*keyframes = c->keyframes;
+	*tiles = c->tiles;
+}
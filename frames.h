@@ -0,0 +1,27 @@
+/*
+   Tile delta coding of screen frames, see frames.c.
+*/
+#ifndef FRAMES_H
+#define FRAMES_H
+
+#include <stddef.h>
+
+#define FRAME_BPP	4	/* BGRA, as screen.c hands them out */
+#define TILE		32	/* tile width and height in pixels */
+
+#define TILE_KEY	0	/* every tile follows */
+#define TILE_DELTA	1	/* only the tiles that changed follow */
+
+struct tile_coder;
+
+struct tile_coder *tile_coder_new(int width, int height, int stride,
+				  int keyint);
+void tile_coder_free(struct tile_coder *c);
+size_t tile_encode(struct tile_coder *c, const unsigned char *frame,
+		   const unsigned char **out);
+int tile_decode(struct tile_coder *c, const unsigned char *data, size_t len,
+		const unsigned char **frame);
+void tile_stats(struct tile_coder *c, unsigned long *keyframes,
+		unsigned long *tiles);
+
+#endif
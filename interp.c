@@ -0,0 +1,303 @@
+/*
+   Frame interpolation for skipped frame ticks.
+
+   When the grabber misses frame ticks, the frames for them are made up
+   from the frame before (a) and the one after (b) instead of repeating a:
+   interp_frame() cross fades the two with the weight the tick has between
+   them.  Scrolling, the usual big motion on a screen, would cross fade
+   into a ghosted double image, so interp_motion() first looks for a
+   vertical shift that explains most of the rows that changed from a to b,
+   and interp_frame() then moves the TILE x TILE blocks that follow that
+   shift along it, while the blocks that do not (a fixed toolbar, a
+   cursor) are still just cross faded in place.
+
+   The blend and the sum of absolute differences that decides between the
+   two have plain C, SSE2 and AVX2 versions, picked at runtime.
+*/
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu.h"
+#include "frames.h"
+#include "interp.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define INTERP_X86 1
+#endif
+
+#define MAX_SHIFT	512	/* most rows searched for a scroll */
+
+/* out = a + (b - a) * w / 256, w in [0, 256] */
+typedef void (*blend_t)(const uint8_t *a, const uint8_t *b, uint8_t *out,
+			size_t n, unsigned w);
+typedef unsigned long (*sad_t)(const uint8_t *a, const uint8_t *b, size_t n);
+
+static void blend_c(const uint8_t *a, const uint8_t *b, uint8_t *out,
+		    size_t n, unsigned w)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		out[i] = (a[i] * (256 - w) + b[i] * w + 128) >> 8;
+}
+
+static unsigned long sad_c(const uint8_t *a, const uint8_t *b, size_t n)
+{
+	unsigned long s = 0;
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		s += a[i] > b[i] ? a[i] - b[i] : b[i] - a[i];
+	return s;
+}
+
+#ifdef INTERP_X86
+
+#pragma GCC push_options
+#pragma GCC target("sse2")
+
+/* both products fit 16 bits unsigned, and so does their sum plus 128 */
+static inline __m128i sse_blend16(__m128i a, __m128i b, __m128i wa,
+				  __m128i wb)
+{
+	return _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(
+		_mm_mullo_epi16(a, wa), _mm_mullo_epi16(b, wb)),
+		_mm_set1_epi16(128)), 8);
+}
+
+static void blend_sse2(const uint8_t *a, const uint8_t *b, uint8_t *out,
+		       size_t n, unsigned w)
+{
+	__m128i wa = _mm_set1_epi16(256 - w), wb = _mm_set1_epi16(w);
+	__m128i z = _mm_setzero_si128(), x, y;
+	size_t i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		x = _mm_loadu_si128((const __m128i *)(a + i));
+		y = _mm_loadu_si128((const __m128i *)(b + i));
+		_mm_storeu_si128((__m128i *)(out + i), _mm_packus_epi16(
+			sse_blend16(_mm_unpacklo_epi8(x, z),
+				    _mm_unpacklo_epi8(y, z), wa, wb),
+			sse_blend16(_mm_unpackhi_epi8(x, z),
+				    _mm_unpackhi_epi8(y, z), wa, wb)));
+	}
+	blend_c(a + i, b + i, out + i, n - i, w);
+}
+
+static unsigned long sad_sse2(const uint8_t *a, const uint8_t *b, size_t n)
+{
+	__m128i acc = _mm_setzero_si128();
+	size_t i;
+
+	for (i = 0; i + 16 <= n; i += 16)
+		acc = _mm_add_epi64(acc, _mm_sad_epu8(
+			_mm_loadu_si128((const __m128i *)(a + i)),
+			_mm_loadu_si128((const __m128i *)(b + i))));
+	return _mm_cvtsi128_si32(acc) +
+	       _mm_cvtsi128_si32(_mm_srli_si128(acc, 8)) +
+	       sad_c(a + i, b + i, n - i);
+}
+
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx2")
+
+static inline __m256i avx_blend16(__m256i a, __m256i b, __m256i wa,
+				  __m256i wb)
+{
+	return _mm256_srli_epi16(_mm256_add_epi16(_mm256_add_epi16(
+		_mm256_mullo_epi16(a, wa), _mm256_mullo_epi16(b, wb)),
+		_mm256_set1_epi16(128)), 8);
+}
+
+/* unpack and pack both work within 128 bit lanes, so the order holds */
+static void blend_avx2(const uint8_t *a, const uint8_t *b, uint8_t *out,
+		       size_t n, unsigned w)
+{
+	__m256i wa = _mm256_set1_epi16(256 - w), wb = _mm256_set1_epi16(w);
+	__m256i z = _mm256_setzero_si256(), x, y;
+	size_t i;
+
+	for (i = 0; i + 32 <= n; i += 32) {
+		x = _mm256_loadu_si256((const __m256i *)(a + i));
+		y = _mm256_loadu_si256((const __m256i *)(b + i));
+		_mm256_storeu_si256((__m256i *)(out + i), _mm256_packus_epi16(
+			avx_blend16(_mm256_unpacklo_epi8(x, z),
+				    _mm256_unpacklo_epi8(y, z), wa, wb),
+			avx_blend16(_mm256_unpackhi_epi8(x, z),
+				    _mm256_unpackhi_epi8(y, z), wa, wb)));
+	}
+	blend_c(a + i, b + i, out + i, n - i, w);
+}
+
+static unsigned long sad_avx2(const uint8_t *a, const uint8_t *b, size_t n)
+{
+	__m256i acc = _mm256_setzero_si256();
+	__m128i s;
+	size_t i;
+
+	for (i = 0; i + 32 <= n; i += 32)
+		acc = _mm256_add_epi64(acc, _mm256_sad_epu8(
+			_mm256_loadu_si256((const __m256i *)(a + i)),
+			_mm256_loadu_si256((const __m256i *)(b + i))));
+	s = _mm_add_epi64(_mm256_castsi256_si128(acc),
+			  _mm256_extracti128_si256(acc, 1));
+	return _mm_cvtsi128_si32(s) + _mm_cvtsi128_si32(_mm_srli_si128(s, 8)) +
+	       sad_c(a + i, b + i, n - i);
+}
+
+#pragma GCC pop_options
+
+#endif /* INTERP_X86 */
+
+/* one row per CPU_*, see cpu.c */
+static const struct interp_impl {
+	blend_t blend;
+	sad_t sad;
+} interp_impls[] = {
+	{ blend_c,	sad_c },
+#ifdef INTERP_X86
+	{ blend_sse2,	sad_sse2 },
+	{ blend_avx2,	sad_avx2 },
+#endif
+};
+
+static const void *impl;
+
+static const struct interp_impl *interp_dispatch(void)
+{
+	return cpu_resolve(&impl, interp_impls, sizeof(interp_impls[0]),
+			   sizeof(interp_impls) / sizeof(interp_impls[0]), -1);
+}
+
+static uint64_t row_hash(const unsigned char *p, size_t n)
+{
+	uint64_t h = 0x9e3779b97f4a7c15ULL, w;
+	size_t i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		memcpy(&w, p + i, 8);
+		h = (h ^ w) * 0xff51afd7ed558ccdULL;
+		h ^= h >> 32;
+	}
+	for (; i < n; i++)
+		h = (h ^ p[i]) * 0x100000001b3ULL;
+	return h;
+}
+
+/*
+ * Returns the number of rows the picture scrolled down from a to b (up if
+ * negative): the shift under which most of the rows that changed reappear
+ * unchanged, if that is at least half of them, else 0.
+ */
+int interp_motion(const unsigned char *a, const unsigned char *b, int width,
+		  int height, int stride)
+{
+	size_t row = (size_t)width * FRAME_BPP;
+	uint64_t *ha, *hb;
+	int y, d, n, changed = 0, best = 0, best_n = 0;
+	int max = height / 2 < MAX_SHIFT ? height / 2 : MAX_SHIFT;
+
+	ha = malloc(2 * height * sizeof(*ha));
+	if (ha == NULL)
+		return 0;
+	hb = ha + height;
+	for (y = 0; y < height; y++) {
+		ha[y] = row_hash(a + (size_t)y * stride, row);
+		hb[y] = row_hash(b + (size_t)y * stride, row);
+		changed += ha[y] != hb[y];
+	}
+	for (d = -max; changed && d <= max; d++) {
+		if (d == 0)
+			continue;
+		n = 0;
+		for (y = d < 0 ? -d : 0; y < height && y + d < height; y++)
+			n += ha[y] != hb[y] && ha[y] == hb[y + d];
+		if (n > best_n) {
+			best_n = n;
+			best = d;
+		}
+	}
+	free(ha);
+	return 2 * best_n >= changed && best_n >= 4 ? best : 0;
+}
+
+static void blend_rows(const struct interp_impl *k, const unsigned char *a,
+		       const unsigned char *b, unsigned char *out, int rows,
+		       int stride, size_t n, unsigned w)
+{
+	int y;
+
+	for (y = 0; y < rows; y++)
+		k->blend(a + (size_t)y * stride, b + (size_t)y * stride,
+			 out + (size_t)y * stride, n, w);
+}
+
+/*
+ * Makes the frame "weight" / 256 of the way from a to b in out (all three
+ * stride bytes per row), moving the blocks that scrolled by dy rows (see
+ * interp_motion()) along with it.
+ */
+void interp_frame(const unsigned char *a, const unsigned char *b,
+		  unsigned char *out, int width, int height, int stride,
+		  unsigned weight, int dy)
+{
+	const struct interp_impl *k = interp_dispatch();
+	int s = (dy * (int)weight + (dy < 0 ? -128 : 128)) / 256;
+	int bx, by, x0, y0, y, h, ya, yb, moved;
+	unsigned long still, scrolled;
+	size_t w, off;
+
+	if (dy == 0) {
+		blend_rows(k, a, b, out, height, stride,
+			   (size_t)width * FRAME_BPP, weight);
+		return;
+	}
+	for (by = 0; by * TILE < height; by++) {
+		y0 = by * TILE;
+		h = height - y0 < TILE ? height - y0 : TILE;
+		for (bx = 0; bx * TILE < width; bx++) {
+			x0 = bx * TILE;
+			w = (size_t)(width - x0 < TILE ? width - x0 : TILE) *
+			    FRAME_BPP;
+			off = (size_t)y0 * stride + (size_t)x0 * FRAME_BPP;
+			/* does the block follow the scroll better than not? */
+			moved = y0 + dy >= 0 && y0 + h + dy <= height;
+			still = scrolled = 0;
+			for (y = 0; moved && y < h; y++) {
+				still += k->sad(a + off + (size_t)y * stride,
+						b + off + (size_t)y * stride, w);
+				scrolled += k->sad(a + off + (size_t)y * stride,
+						   b + off + ((ptrdiff_t)y + dy) * stride,
+						   w);
+			}
+			if (!moved || scrolled >= still) {
+				blend_rows(k, a + off, b + off, out + off, h,
+					   stride, w, weight);
+				continue;
+			}
+			for (y = y0; y < y0 + h; y++) {
+				off = (size_t)y * stride + (size_t)x0 * FRAME_BPP;
+				ya = y - s;
+				yb = y - s + dy;
+				if (ya >= 0 && ya < height && yb >= 0 && yb < height)
+					k->blend(a + (ptrdiff_t)(ya - y) * stride + off,
+						 b + (ptrdiff_t)(yb - y) * stride + off,
+						 out + off, w, weight);
+				else if (yb >= 0 && yb < height)
+					memcpy(out + off,
+					       b + (ptrdiff_t)(yb - y) * stride + off, w);
+				else if (ya >= 0 && ya < height)
+					memcpy(out + off,
+					       a + (ptrdiff_t)(ya - y) * stride + off, w);
+				else
+					k->blend(a + off, b + off, out + off, w,
+						 weight);
+			}
+		}
+	}
+}
@@ -0,0 +1,17 @@
+/*
+   Frame interpolation for skipped frame ticks, see interp.c.
+*/
+#ifndef INTERP_H
+#define INTERP_H
+
+#define INTERP_NONE	0	/* repeat the frame before */
+#define INTERP_BLEND	1	/* cross fade between the frames around */
+#define INTERP_MOTION	2	/* follow scrolling, cross fade the rest */
+
+int interp_motion(const unsigned char *a, const unsigned char *b, int width,
+		  int height, int stride);
+void interp_frame(const unsigned char *a, const unsigned char *b,
+		  unsigned char *out, int width, int height, int stride,
+		  unsigned weight, int dy);
+
+#endif
@@ -0,0 +1,537 @@
+/*
+   Peak/RMS metering kernels.
+
+   meter_peak_rms() walks interleaved samples once and gathers, for every
+   channel, the absolute peak and the sum of squares, both normalized to full
+   scale (1.0).  There is a plain C version for every format and SSE2, AVX2
+   and AVX-512 versions for the little endian ones, picked at runtime from
+   what the CPU supports.
+
+   The vector kernels keep one accumulator per vector lane.  Lane l of the
+   g-th vector in a group always sees channel (g * lanes + l) % channels as
+   long as the loop steps over lcm(lanes, channels) samples at a time, so the
+   lanes can be folded back into channels at the end, whatever the channel
+   count is.
+*/
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#include "cpu.h"
+#include "meter.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define METER_X86 1
+#endif
+
+/* most vectors in one lcm(lanes, channels) group, else use plain C */
+#define METER_MAX_GROUP		64
+
+static const int sample_bytes[METER_FORMATS] = {
+	1, 1, 2, 2, 3, 3, 4, 4, 4, 4, 4, 4
+};
+
+int meter_sample_bytes(int fmt)
+{
+	return (fmt >= 0 && fmt < METER_FORMATS) ? sample_bytes[fmt] : 0;
+}
+
+/* one sample as a float in [-1, 1) */
+static inline float sample_value(int fmt, const uint8_t *p)
+{
+	int32_t v;
+	uint32_t u;
+	float f;
+
+	switch (fmt) {
+	case METER_S8:
+		return (int8_t)p[0] / 128.0f;
+	case METER_U8:
+		return (p[0] - 128) / 128.0f;
+	case METER_S16_LE:
+		return (int16_t)(p[0] | (p[1] << 8)) / 32768.0f;
+	case METER_S16_BE:
+		return (int16_t)((p[0] << 8) | p[1]) / 32768.0f;
+	case METER_S24_3LE:
+		v = (int32_t)(((uint32_t)p[0] << 8) | ((uint32_t)p[1] << 16) |
+			      ((uint32_t)p[2] << 24)) >> 8;
+		return v / 8388608.0f;
+	case METER_S24_3BE:
+		v = (int32_t)(((uint32_t)p[2] << 8) | ((uint32_t)p[1] << 16) |
+			      ((uint32_t)p[0] << 24)) >> 8;
+		return v / 8388608.0f;
+	case METER_S24_LE:
+		v = (int32_t)(((uint32_t)p[0] << 8) | ((uint32_t)p[1] << 16) |
+			      ((uint32_t)p[2] << 24)) >> 8;
+		return v / 8388608.0f;
+	case METER_S24_BE:
+		v = (int32_t)(((uint32_t)p[3] << 8) | ((uint32_t)p[2] << 16) |
+			      ((uint32_t)p[1] << 24)) >> 8;
+		return v / 8388608.0f;
+	case METER_S32_LE:
+		v = (int32_t)(p[0] | (p[1] << 8) | (p[2] << 16) |
+			      ((uint32_t)p[3] << 24));
+		return v / 2147483648.0f;
+	case METER_S32_BE:
+		v = (int32_t)(p[3] | (p[2] << 8) | (p[1] << 16) |
+			      ((uint32_t)p[0] << 24));
+		return v / 2147483648.0f;
+	case METER_FLOAT_LE:
+		u = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+		memcpy(&f, &u, 4);
+		return f;
+	case METER_FLOAT_BE:
+		u = p[3] | (p[2] << 8) | (p[1] << 16) | ((uint32_t)p[0] << 24);
+		memcpy(&f, &u, 4);
+		return f;
+	}
+	return 0;
+}
+
+/* samples [from, to) of an interleaved buffer, first one is channel c */
+static void meter_scalar(int fmt, const uint8_t *data, size_t from, size_t to,
+			 unsigned channels, float *peak, double *sumsq)
+{
+	int bytes = sample_bytes[fmt];
+	unsigned c = from % channels;
+	size_t i;
+	float v;
+
+	for (i = from; i < to; i++) {
+		v = sample_value(fmt, data + i * bytes);
+		sumsq[c] += (double)v * v;
+		v = fabsf(v);
+		if (v > peak[c])
+			peak[c] = v;
+		if (++c == channels)
+			c = 0;
+	}
+}
+
+static unsigned gcd(unsigned a, unsigned b)
+{
+	unsigned t;
+
+	while (b) {
+		t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+/* fold per-lane accumulators back into channels */
+static void meter_fold(const float *lane_peak, const float *lane_sq,
+		       unsigned lanes, unsigned channels, float *peak,
+		       double *sumsq)
+{
+	unsigned i, c;
+
+	for (i = 0; i < lanes; i++) {
+		c = i % channels;
+		if (lane_peak[i] > peak[c])
+			peak[c] = lane_peak[i];
+		sumsq[c] += lane_sq[i];
+	}
+}
+
+#ifdef METER_X86
+
+/*
+ * Every ISA below has a load function per format that returns V samples as
+ * floats at full scale, METER_KERNEL stamps out the loop around it.  Sums of squares are kept in
+ * single precision per call, callers should meter at most a few million
+ * samples at a time.
+ */
+#define METER_KERNEL(isa, V, vec, setzero, load, abs, max, add, mul, store, tail) \
+static size_t meter_##isa##_##load(const uint8_t *data, size_t n,	\
+				   unsigned channels, unsigned groups,	\
+				   float *peak, double *sumsq)		\
+{									\
+	vec mx[METER_MAX_GROUP], sq[METER_MAX_GROUP], x;		\
+	float lp[METER_MAX_GROUP * V], ls[METER_MAX_GROUP * V];		\
+	size_t step = (size_t)groups * V, i;				\
+	unsigned g;							\
+									\
+	for (g = 0; g < groups; g++)					\
+		mx[g] = sq[g] = setzero();				\
+	for (i = 0; i + step + (tail) <= n; i += step) {		\
+		for (g = 0; g < groups; g++) {				\
+			x = load(data, i + g * V);			\
+			sq[g] = add(sq[g], mul(x, x));			\
+			mx[g] = max(mx[g], abs(x));			\
+		}							\
+	}								\
+	for (g = 0; g < groups; g++) {					\
+		store(lp + g * V, mx[g]);				\
+		store(ls + g * V, sq[g]);				\
+	}								\
+	meter_fold(lp, ls, step, channels, peak, sumsq);		\
+	return i;							\
+}
+
+/* SSE2, 4 lanes */
+
+#pragma GCC push_options
+#pragma GCC target("sse2")
+
+#define SSE_ABS(x)	_mm_andnot_ps(_mm_set1_ps(-0.0f), x)
+
+static inline __m128 sse_s8(const uint8_t *d, size_t i)
+{
+	int32_t w;
+	__m128i x;
+
+	memcpy(&w, d + i, 4);
+	x = _mm_cvtsi32_si128(w);
+	x = _mm_unpacklo_epi8(x, x);
+	x = _mm_unpacklo_epi16(x, x);
+	return _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(x, 24)),
+			  _mm_set1_ps(1.0f / 128));
+}
+
+static inline __m128 sse_u8(const uint8_t *d, size_t i)
+{
+	int32_t w;
+	__m128i x;
+
+	memcpy(&w, d + i, 4);
+	x = _mm_xor_si128(_mm_cvtsi32_si128(w), _mm_set1_epi8((char)0x80));
+	x = _mm_unpacklo_epi8(x, x);
+	x = _mm_unpacklo_epi16(x, x);
+	return _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(x, 24)),
+			  _mm_set1_ps(1.0f / 128));
+}
+
+static inline __m128 sse_s16(const uint8_t *d, size_t i)
+{
+	__m128i x = _mm_loadl_epi64((const __m128i *)(d + i * 2));
+
+	x = _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16);
+	return _mm_mul_ps(_mm_cvtepi32_ps(x), _mm_set1_ps(1.0f / 32768));
+}
+
+static inline __m128 sse_s24(const uint8_t *d, size_t i)
+{
+	__m128i x = _mm_loadu_si128((const __m128i *)(d + i * 4));
+
+	x = _mm_srai_epi32(_mm_slli_epi32(x, 8), 8);
+	return _mm_mul_ps(_mm_cvtepi32_ps(x), _mm_set1_ps(1.0f / 8388608));
+}
+
+static inline __m128 sse_s32(const uint8_t *d, size_t i)
+{
+	__m128i x = _mm_loadu_si128((const __m128i *)(d + i * 4));
+
+	return _mm_mul_ps(_mm_cvtepi32_ps(x), _mm_set1_ps(1.0f / 2147483648.0f));
+}
+
+static inline __m128 sse_float(const uint8_t *d, size_t i)
+{
+	return _mm_loadu_ps((const float *)(d + i * 4));
+}
+
+METER_KERNEL(sse2, 4, __m128, _mm_setzero_ps, sse_s8, SSE_ABS, _mm_max_ps, _mm_add_ps, _mm_mul_ps, _mm_storeu_ps, 0)
+METER_KERNEL(sse2, 4, __m128, _mm_setzero_ps, sse_u8, SSE_ABS, _mm_max_ps, _mm_add_ps, _mm_mul_ps, _mm_storeu_ps, 0)
+METER_KERNEL(sse2, 4, __m128, _mm_setzero_ps, sse_s16, SSE_ABS, _mm_max_ps, _mm_add_ps, _mm_mul_ps, _mm_storeu_ps, 0)
+METER_KERNEL(sse2, 4, __m128, _mm_setzero_ps, sse_s24, SSE_ABS, _mm_max_ps, _mm_add_ps, _mm_mul_ps, _mm_storeu_ps, 0)
+METER_KERNEL(sse2, 4, __m128, _mm_setzero_ps, sse_s32, SSE_ABS, _mm_max_ps, _mm_add_ps, _mm_mul_ps, _mm_storeu_ps, 0)
+METER_KERNEL(sse2, 4, __m128, _mm_setzero_ps, sse_float, SSE_ABS, _mm_max_ps, _mm_add_ps, _mm_mul_ps, _mm_storeu_ps, 0)
+
+static size_t meter_sse2(int fmt, const uint8_t *data, size_t n,
+			 unsigned channels, unsigned groups, float *peak,
+			 double *sumsq)
+{
+	switch (fmt) {
+	case METER_S8:
+		return meter_sse2_sse_s8(data, n, channels, groups, peak, sumsq);
+	case METER_U8:
+		return meter_sse2_sse_u8(data, n, channels, groups, peak, sumsq);
+	case METER_S16_LE:
+		return meter_sse2_sse_s16(data, n, channels, groups, peak, sumsq);
+	case METER_S24_LE:
+		return meter_sse2_sse_s24(data, n, channels, groups, peak, sumsq);
+	case METER_S32_LE:
+		return meter_sse2_sse_s32(data, n, channels, groups, peak, sumsq);
+	case METER_FLOAT_LE:
+		return meter_sse2_sse_float(data, n, channels, groups, peak, sumsq);
+	}
+	return 0;
+}
+
+#pragma GCC pop_options
+
+/* AVX2, 8 lanes */
+
+#pragma GCC push_options
+#pragma GCC target("avx2")
+
+#define AVX_ABS(x)	_mm256_andnot_ps(_mm256_set1_ps(-0.0f), x)
+
+static inline __m256 avx_s8(const uint8_t *d, size_t i)
+{
+	__m256i x = _mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i *)(d + i)));
+
+	return _mm256_mul_ps(_mm256_cvtepi32_ps(x), _mm256_set1_ps(1.0f / 128));
+}
+
+static inline __m256 avx_u8(const uint8_t *d, size_t i)
+{
+	__m256i x = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(d + i)));
+
+	x = _mm256_sub_epi32(x, _mm256_set1_epi32(128));
+	return _mm256_mul_ps(_mm256_cvtepi32_ps(x), _mm256_set1_ps(1.0f / 128));
+}
+
+static inline __m256 avx_s16(const uint8_t *d, size_t i)
+{
+	__m256i x = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)(d + i * 2)));
+
+	return _mm256_mul_ps(_mm256_cvtepi32_ps(x), _mm256_set1_ps(1.0f / 32768));
+}
+
+/* 4 packed 24 bit samples into the top of 4 dwords */
+static inline __m128i s24_3_to_hi(__m128i x)
+{
+	return _mm_shuffle_epi8(x, _mm_setr_epi8(-1, 0, 1, 2, -1, 3, 4, 5,
+						 -1, 6, 7, 8, -1, 9, 10, 11));
+}
+
+/* reads 4 bytes past the 8 samples, hence the tail of 2 samples */
+static inline __m256 avx_s24_3(const uint8_t *d, size_t i)
+{
+	const uint8_t *p = d + i * 3;
+	__m128i lo = s24_3_to_hi(_mm_loadu_si128((const __m128i *)p));
+	__m128i hi = s24_3_to_hi(_mm_loadu_si128((const __m128i *)(p + 12)));
+	__m256i x = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+
+	x = _mm256_srai_epi32(x, 8);
+	return _mm256_mul_ps(_mm256_cvtepi32_ps(x), _mm256_set1_ps(1.0f / 8388608));
+}
+
+static inline __m256 avx_s24(const uint8_t *d, size_t i)
+{
+	__m256i x = _mm256_loadu_si256((const __m256i *)(d + i * 4));
+
+	x = _mm256_srai_epi32(_mm256_slli_epi32(x, 8), 8);
+	return _mm256_mul_ps(_mm256_cvtepi32_ps(x), _mm256_set1_ps(1.0f / 8388608));
+}
+
+static inline __m256 avx_s32(const uint8_t *d, size_t i)
+{
+	__m256i x = _mm256_loadu_si256((const __m256i *)(d + i * 4));
+
+	return _mm256_mul_ps(_mm256_cvtepi32_ps(x), _mm256_set1_ps(1.0f / 2147483648.0f));
+}
+
+static inline __m256 avx_float(const uint8_t *d, size_t i)
+{
+	return _mm256_loadu_ps((const float *)(d + i * 4));
+}
+
+METER_KERNEL(avx2, 8, __m256, _mm256_setzero_ps, avx_s8, AVX_ABS, _mm256_max_ps, _mm256_add_ps, _mm256_mul_ps, _mm256_storeu_ps, 0)
+METER_KERNEL(avx2, 8, __m256, _mm256_setzero_ps, avx_u8, AVX_ABS, _mm256_max_ps, _mm256_add_ps, _mm256_mul_ps, _mm256_storeu_ps, 0)
+METER_KERNEL(avx2, 8, __m256, _mm256_setzero_ps, avx_s16, AVX_ABS, _mm256_max_ps, _mm256_add_ps, _mm256_mul_ps, _mm256_storeu_ps, 0)
+METER_KERNEL(avx2, 8, __m256, _mm256_setzero_ps, avx_s24_3, AVX_ABS, _mm256_max_ps, _mm256_add_ps, _mm256_mul_ps, _mm256_storeu_ps, 2)
+METER_KERNEL(avx2, 8, __m256, _mm256_setzero_ps, avx_s24, AVX_ABS, _mm256_max_ps, _mm256_add_ps, _mm256_mul_ps, _mm256_storeu_ps, 0)
+METER_KERNEL(avx2, 8, __m256, _mm256_setzero_ps, avx_s32, AVX_ABS, _mm256_max_ps, _mm256_add_ps, _mm256_mul_ps, _mm256_storeu_ps, 0)
+METER_KERNEL(avx2, 8, __m256, _mm256_setzero_ps, avx_float, AVX_ABS, _mm256_max_ps, _mm256_add_ps, _mm256_mul_ps, _mm256_storeu_ps, 0)
+
+static size_t meter_avx2(int fmt, const uint8_t *data, size_t n,
+			 unsigned channels, unsigned groups, float *peak,
+			 double *sumsq)
+{
+	switch (fmt) {
+	case METER_S8:
+		return meter_avx2_avx_s8(data, n, channels, groups, peak, sumsq);
+	case METER_U8:
+		return meter_avx2_avx_u8(data, n, channels, groups, peak, sumsq);
+	case METER_S16_LE:
+		return meter_avx2_avx_s16(data, n, channels, groups, peak, sumsq);
+	case METER_S24_3LE:
+		return meter_avx2_avx_s24_3(data, n, channels, groups, peak, sumsq);
+	case METER_S24_LE:
+		return meter_avx2_avx_s24(data, n, channels, groups, peak, sumsq);
+	case METER_S32_LE:
+		return meter_avx2_avx_s32(data, n, channels, groups, peak, sumsq);
+	case METER_FLOAT_LE:
+		return meter_avx2_avx_float(data, n, channels, groups, peak, sumsq);
+	}
+	return 0;
+}
+
+#pragma GCC pop_options
+
+/* AVX-512, 16 lanes */
+
+#pragma GCC push_options
+#pragma GCC target("avx512f,avx2")
+
+#define AVX512_ABS(x)	_mm512_abs_ps(x)
+
+static inline __m512 avx512_s8(const uint8_t *d, size_t i)
+{
+	__m512i x = _mm512_cvtepi8_epi32(_mm_loadu_si128((const __m128i *)(d + i)));
+
+	return _mm512_mul_ps(_mm512_cvtepi32_ps(x), _mm512_set1_ps(1.0f / 128));
+}
+
+static inline __m512 avx512_u8(const uint8_t *d, size_t i)
+{
+	__m512i x = _mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i *)(d + i)));
+
+	x = _mm512_sub_epi32(x, _mm512_set1_epi32(128));
+	return _mm512_mul_ps(_mm512_cvtepi32_ps(x), _mm512_set1_ps(1.0f / 128));
+}
+
+static inline __m512 avx512_s16(const uint8_t *d, size_t i)
+{
+	__m512i x = _mm512_cvtepi16_epi32(_mm256_loadu_si256((const __m256i *)(d + i * 2)));
+
+	return _mm512_mul_ps(_mm512_cvtepi32_ps(x), _mm512_set1_ps(1.0f / 32768));
+}
+
+static inline __m512 avx512_s24_3(const uint8_t *d, size_t i)
+{
+	const uint8_t *p = d + i * 3;
+	__m512i x = _mm512_castsi128_si512(s24_3_to_hi(_mm_loadu_si128((const __m128i *)p)));
+
+	x = _mm512_inserti32x4(x, s24_3_to_hi(_mm_loadu_si128((const __m128i *)(p + 12))), 1);
+	x = _mm512_inserti32x4(x, s24_3_to_hi(_mm_loadu_si128((const __m128i *)(p + 24))), 2);
+	x = _mm512_inserti32x4(x, s24_3_to_hi(_mm_loadu_si128((const __m128i *)(p + 36))), 3);
+	x = _mm512_srai_epi32(x, 8);
+	return _mm512_mul_ps(_mm512_cvtepi32_ps(x), _mm512_set1_ps(1.0f / 8388608));
+}
+
+static inline __m512 avx512_s24(const uint8_t *d, size_t i)
+{
+	__m512i x = _mm512_loadu_si512((const void *)(d + i * 4));
+
+	x = _mm512_srai_epi32(_mm512_slli_epi32(x, 8), 8);
+	return _mm512_mul_ps(_mm512_cvtepi32_ps(x), _mm512_set1_ps(1.0f / 8388608));
+}
+
+static inline __m512 avx512_s32(const uint8_t *d, size_t i)
+{
+	__m512i x = _mm512_loadu_si512((const void *)(d + i * 4));
+
+	return _mm512_mul_ps(_mm512_cvtepi32_ps(x), _mm512_set1_ps(1.0f / 2147483648.0f));
+}
+
+static inline __m512 avx512_float(const uint8_t *d, size_t i)
+{
+	return _mm512_loadu_ps((const float *)(d + i * 4));
+}
+
+METER_KERNEL(avx512, 16, __m512, _mm512_setzero_ps, avx512_s8, AVX512_ABS, _mm512_max_ps, _mm512_add_ps, _mm512_mul_ps, _mm512_storeu_ps, 0)
+METER_KERNEL(avx512, 16, __m512, _mm512_setzero_ps, avx512_u8, AVX512_ABS, _mm512_max_ps, _mm512_add_ps, _mm512_mul_ps, _mm512_storeu_ps, 0)
+METER_KERNEL(avx512, 16, __m512, _mm512_setzero_ps, avx512_s16, AVX512_ABS, _mm512_max_ps, _mm512_add_ps, _mm512_mul_ps, _mm512_storeu_ps, 0)
+METER_KERNEL(avx512, 16, __m512, _mm512_setzero_ps, avx512_s24_3, AVX512_ABS, _mm512_max_ps, _mm512_add_ps, _mm512_mul_ps, _mm512_storeu_ps, 2)
+METER_KERNEL(avx512, 16, __m512, _mm512_setzero_ps, avx512_s24, AVX512_ABS, _mm512_max_ps, _mm512_add_ps, _mm512_mul_ps, _mm512_storeu_ps, 0)
+METER_KERNEL(avx512, 16, __m512, _mm512_setzero_ps, avx512_s32, AVX512_ABS, _mm512_max_ps, _mm512_add_ps, _mm512_mul_ps, _mm512_storeu_ps, 0)
+METER_KERNEL(avx512, 16, __m512, _mm512_setzero_ps, avx512_float, AVX512_ABS, _mm512_max_ps, _mm512_add_ps, _mm512_mul_ps, _mm512_storeu_ps, 0)
+
+static size_t meter_avx512(int fmt, const uint8_t *data, size_t n,
+			   unsigned channels, unsigned groups, float *peak,
+			   double *sumsq)
+{
+	switch (fmt) {
+	case METER_S8:
+		return meter_avx512_avx512_s8(data, n, channels, groups, peak, sumsq);
+	case METER_U8:
+		return meter_avx512_avx512_u8(data, n, channels, groups, peak, sumsq);
+	case METER_S16_LE:
+		return meter_avx512_avx512_s16(data, n, channels, groups, peak, sumsq);
+	case METER_S24_3LE:
+		return meter_avx512_avx512_s24_3(data, n, channels, groups, peak, sumsq);
+	case METER_S24_LE:
+		return meter_avx512_avx512_s24(data, n, channels, groups, peak, sumsq);
+	case METER_S32_LE:
+		return meter_avx512_avx512_s32(data, n, channels, groups, peak, sumsq);
+	case METER_FLOAT_LE:
+		return meter_avx512_avx512_float(data, n, channels, groups, peak, sumsq);
+	}
+	return 0;
+}
+
+#pragma GCC pop_options
+
+#endif /* METER_X86 */
+
+typedef size_t (*meter_kernel_t)(int fmt, const uint8_t *data, size_t n,
+				 unsigned channels, unsigned groups,
+				 float *peak, double *sumsq);
+
+/* one row per CPU_*, see cpu.c */
+static const struct meter_impl {
+	meter_kernel_t kernel;
+	unsigned lanes;
+	const char *name;
+} meter_impls[] = {
+	{ NULL,		0,	"c" },
+#ifdef METER_X86
+	{ meter_sse2,	4,	"sse2" },
+	{ meter_avx2,	8,	"avx2" },
+	{ meter_avx512,	16,	"avx512" },
+#endif
+};
+
+static const void *impl;
+static int kernel_forced = -1;
+
+/* CPU_*, or -1 for whatever the CPU does best */
+void meter_force_isa(int isa)
+{
+	__atomic_store_n(&kernel_forced, isa, __ATOMIC_RELAXED);
+	__atomic_store_n(&impl, NULL, __ATOMIC_RELEASE);
+}
+
+static const struct meter_impl *meter_dispatch(void)
+{
+	return cpu_resolve(&impl, meter_impls, sizeof(meter_impls[0]),
+			   sizeof(meter_impls) / sizeof(meter_impls[0]),
+			   __atomic_load_n(&kernel_forced, __ATOMIC_RELAXED));
+}
+
+/* name of the kernel meter_peak_rms() uses, for benchmarks */
+const char *meter_isa(void)
+{
+	return meter_dispatch()->name;
+}
+
+/*
+ * Accumulates the peak (max |x|) and sum of squares of every channel of
+ * "frames" interleaved frames into peak[] and sumsq[], which the caller
+ * zeroes.  Returns -1 for an unknown format.
+ */
+int meter_peak_rms(int fmt, const void *data, size_t frames,
+		   unsigned channels, float *peak, double *sumsq)
+{
+	const struct meter_impl *m;
+	size_t n = frames * channels, done = 0;
+	unsigned groups;
+
+	if (fmt < 0 || fmt >= METER_FORMATS || channels == 0)
+		return -1;
+	m = meter_dispatch();
+	if (m->kernel) {
+		groups = channels / gcd(m->lanes, channels);
+		if (groups <= METER_MAX_GROUP)
+			done = m->kernel(fmt, data, n, channels, groups, peak,
+					 sumsq);
+	}
+	meter_scalar(fmt, data, done, n, channels, peak, sumsq);
+	return 0;
+}
+
+/* RMS of every channel from the sums of squares of "frames" frames */
+void meter_rms(const double *sumsq, size_t frames, unsigned channels,
+	       float *rms)
+{
+	unsigned c;
+
+	for (c = 0; c < channels; c++)
+		rms[c] = frames ? sqrt(sumsq[c] / frames) : 0;
+}
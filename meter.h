@@ -0,0 +1,34 @@
+/*
+   Peak/RMS metering kernels, see meter.c.
+*/
+#ifndef METER_H
+#define METER_H
+
+#include <stddef.h>
+
+/* sample formats understood by meter_peak_rms() */
+enum {
+	METER_S8,
+	METER_U8,
+	METER_S16_LE,
+	METER_S16_BE,
+	METER_S24_3LE,		/* 3 bytes per sample */
+	METER_S24_3BE,
+	METER_S24_LE,		/* 24 bits in the low end of 4 bytes */
+	METER_S24_BE,
+	METER_S32_LE,
+	METER_S32_BE,
+	METER_FLOAT_LE,
+	METER_FLOAT_BE,
+	METER_FORMATS
+};
+
+int meter_peak_rms(int fmt, const void *data, size_t frames,
+		   unsigned channels, float *peak, double *sumsq);
+void meter_rms(const double *sumsq, size_t frames, unsigned channels,
+	       float *rms);
+int meter_sample_bytes(int fmt);
+void meter_force_isa(int isa);
+const char *meter_isa(void);
+
+#endif
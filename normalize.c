@@ -0,0 +1,575 @@
+/*
+   WAV normalizer.
+
+   wav_normalize() scales a WAV file so that its loudest sample reaches
+   "target" of full scale, in two passes over the samples: the first finds
+   the peak with meter.c's kernels, the second multiplies every sample by
+   the gain, saturating at full scale.  The samples are never read in as a
+   whole: the worker threads take CHUNK_BYTES of them at a time, map just
+   that window of the file and unmap it when done, so the memory used stays
+   the same whatever the size of the file.
+
+   Without an output file the samples are changed in place.  Otherwise the
+   output gets a copy of everything around the samples and the scaled
+   samples themselves, its space reserved up front so a full disk is an
+   error and not a SIGBUS.
+
+   8 bit unsigned, 16, 24 (in 3 bytes) and 32 bit signed and 32 bit float
+   samples are understood, from a plain or WAVE_FORMAT_EXTENSIBLE fmt
+   chunk.  The gain kernels for 16 bit and float have SSE2 and AVX2
+   versions picked at runtime like in meter.c, the rest are plain C; all of
+   them round the same way, so they give the same samples.
+*/
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "cpu.h"
+#include "meter.h"
+#include "normalize.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define NORM_X86 1
+#endif
+
+#define CHUNK_BYTES	(8 << 20)	/* mapped by one thread at a time */
+#define MAX_THREADS	64
+
+#define WAVE_PCM	1
+#define WAVE_FLOAT	3
+#define WAVE_EXTENSIBLE	0xfffe
+
+/* n samples from in to out (which may be the same) times gain */
+typedef void (*gain_t)(const uint8_t *in, uint8_t *out, size_t n,
+		       double gain);
+
+struct norm {
+	int in, out;		/* fds, the same one when in place */
+	int fmt;		/* METER_* */
+	int bytes;		/* per sample */
+	unsigned channels;
+	off_t data;		/* where the samples start */
+	uint64_t len;		/* bytes of them */
+	size_t chunk;		/* bytes per window, whole frames */
+	unsigned chunks;
+	unsigned next;		/* next chunk a worker takes */
+	int pass;		/* 0 finds the peak, 1 applies the gain */
+	double gain;
+	gain_t kernel;
+	int error;		/* first errno a worker hit */
+};
+
+struct norm_worker {
+	struct norm *n;
+	pthread_t thread;
+	float peak;
+	double sumsq;
+};
+
+/*
+ *  gain kernels
+ */
+
+static void gain_u8_c(const uint8_t *in, uint8_t *out, size_t n, double gain)
+{
+	float g = gain, v;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		v = (in[i] - 128) * g;
+		v = v < -128.0f ? -128.0f : v > 127.0f ? 127.0f : v;
+		out[i] = lrintf(v) + 128;
+	}
+}
+
+static void gain_s16_c(const uint8_t *in, uint8_t *out, size_t n,
+		       double gain)
+{
+	float g = gain, v;
+	long r;
+	size_t i;
+
+	for (i = 0; i < n; i++, in += 2, out += 2) {
+		v = (int16_t)(in[0] | in[1] << 8) * g;
+		v = v < -32768.0f ? -32768.0f : v > 32767.0f ? 32767.0f : v;
+		r = lrintf(v);
+		out[0] = r;
+		out[1] = r >> 8;
+	}
+}
+
+static void gain_s24_c(const uint8_t *in, uint8_t *out, size_t n,
+		       double gain)
+{
+	double v;
+	int32_t x;
+	long r;
+	size_t i;
+
+	for (i = 0; i < n; i++, in += 3, out += 3) {
+		x = (int32_t)((uint32_t)in[0] << 8 | (uint32_t)in[1] << 16 |
+			      (uint32_t)in[2] << 24) >> 8;
+		v = x * gain;
+		v = v < -8388608.0 ? -8388608.0 : v > 8388607.0 ? 8388607.0 : v;
+		r = lrint(v);
+		out[0] = r;
+		out[1] = r >> 8;
+		out[2] = r >> 16;
+	}
+}
+
+static void gain_s32_c(const uint8_t *in, uint8_t *out, size_t n,
+		       double gain)
+{
+	double v;
+	int32_t x;
+	long long r;
+	size_t i;
+
+	for (i = 0; i < n; i++, in += 4, out += 4) {
+		x = (int32_t)(in[0] | in[1] << 8 | in[2] << 16 |
+			      (uint32_t)in[3] << 24);
+		v = x * gain;
+		v = v < -2147483648.0 ? -2147483648.0 :
+			v > 2147483647.0 ? 2147483647.0 : v;
+		r = llrint(v);
+		out[0] = r;
+		out[1] = r >> 8;
+		out[2] = r >> 16;
+		out[3] = r >> 24;
+	}
+}
+
+static void gain_float_c(const uint8_t *in, uint8_t *out, size_t n,
+			 double gain)
+{
+	float g = gain, v;
+	size_t i;
+
+	for (i = 0; i < n; i++, in += 4, out += 4) {
+		memcpy(&v, in, 4);
+		v *= g;
+		memcpy(out, &v, 4);
+	}
+}
+
+#ifdef NORM_X86
+
+#pragma GCC push_options
+#pragma GCC target("sse2")
+
+static inline __m128i scale_sse2(__m128i x, __m128 g)
+{
+	__m128 v = _mm_mul_ps(_mm_cvtepi32_ps(x), g);
+
+	v = _mm_min_ps(_mm_max_ps(v, _mm_set1_ps(-32768.0f)),
+		       _mm_set1_ps(32767.0f));
+	return _mm_cvtps_epi32(v);
+}
+
+static void gain_s16_sse2(const uint8_t *in, uint8_t *out, size_t n,
+			  double gain)
+{
+	__m128 g = _mm_set1_ps((float)gain);
+	__m128i x, lo, hi;
+	size_t i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		x = _mm_loadu_si128((const __m128i *)(in + 2 * i));
+		lo = _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16);
+		hi = _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16);
+		_mm_storeu_si128((__m128i *)(out + 2 * i),
+				 _mm_packs_epi32(scale_sse2(lo, g),
+						 scale_sse2(hi, g)));
+	}
+	gain_s16_c(in + 2 * i, out + 2 * i, n - i, gain);
+}
+
+static void gain_float_sse2(const uint8_t *in, uint8_t *out, size_t n,
+			    double gain)
+{
+	__m128 g = _mm_set1_ps((float)gain);
+	size_t i;
+
+	for (i = 0; i + 4 <= n; i += 4)
+		_mm_storeu_ps((float *)(out + 4 * i),
+			      _mm_mul_ps(_mm_loadu_ps((const float *)(in + 4 * i)), g));
+	gain_float_c(in + 4 * i, out + 4 * i, n - i, gain);
+}
+
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx2")
+
+static inline __m256i scale_avx2(__m256i x, __m256 g)
+{
+	__m256 v = _mm256_mul_ps(_mm256_cvtepi32_ps(x), g);
+
+	v = _mm256_min_ps(_mm256_max_ps(v, _mm256_set1_ps(-32768.0f)),
+			  _mm256_set1_ps(32767.0f));
+	return _mm256_cvtps_epi32(v);
+}
+
+static void gain_s16_avx2(const uint8_t *in, uint8_t *out, size_t n,
+			  double gain)
+{
+	__m256 g = _mm256_set1_ps((float)gain);
+	__m256i lo, hi;
+	size_t i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		lo = _mm256_cvtepi16_epi32(
+			_mm_loadu_si128((const __m128i *)(in + 2 * i)));
+		hi = _mm256_cvtepi16_epi32(
+			_mm_loadu_si128((const __m128i *)(in + 2 * i + 16)));
+		/* the pack works per 128 bit lane, the permute undoes that */
+		_mm256_storeu_si256((__m256i *)(out + 2 * i),
+			_mm256_permute4x64_epi64(_mm256_packs_epi32(
+				scale_avx2(lo, g), scale_avx2(hi, g)), 0xd8));
+	}
+	gain_s16_c(in + 2 * i, out + 2 * i, n - i, gain);
+}
+
+static void gain_float_avx2(const uint8_t *in, uint8_t *out, size_t n,
+			    double gain)
+{
+	__m256 g = _mm256_set1_ps((float)gain);
+	size_t i;
+
+	for (i = 0; i + 8 <= n; i += 8)
+		_mm256_storeu_ps((float *)(out + 4 * i),
+				 _mm256_mul_ps(_mm256_loadu_ps((const float *)(in + 4 * i)), g));
+	gain_float_c(in + 4 * i, out + 4 * i, n - i, gain);
+}
+
+#pragma GCC pop_options
+
+#endif /* NORM_X86 */
+
+/* one row per CPU_*, see cpu.c */
+static const struct norm_impl {
+	gain_t s16;
+	gain_t f32;
+} norm_impls[] = {
+	{ gain_s16_c,		gain_float_c },
+#ifdef NORM_X86
+	{ gain_s16_sse2,	gain_float_sse2 },
+	{ gain_s16_avx2,	gain_float_avx2 },
+#endif
+};
+
+static const void *impl;
+
+static const struct norm_impl *norm_dispatch(void)
+{
+	return cpu_resolve(&impl, norm_impls, sizeof(norm_impls[0]),
+			   sizeof(norm_impls) / sizeof(norm_impls[0]), -1);
+}
+
+static gain_t norm_kernel(int fmt)
+{
+	switch (fmt) {
+	case METER_U8:
+		return gain_u8_c;
+	case METER_S16_LE:
+		return norm_dispatch()->s16;
+	case METER_S24_3LE:
+		return gain_s24_c;
+	case METER_S32_LE:
+		return gain_s32_c;
+	default:
+		return norm_dispatch()->f32;
+	}
+}
+
+/*
+ *  the file
+ */
+
+static uint32_t get16(const unsigned char *p)
+{
+	return p[0] | p[1] << 8;
+}
+
+static uint32_t get32(const unsigned char *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static int read_at(int fd, void *buf, size_t len, off_t off)
+{
+	ssize_t r;
+
+	while (len > 0) {
+		r = pread(fd, buf, len, off);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0)
+			return -errno;
+		if (r == 0)
+			return -EINVAL;
+		buf = (char *)buf + r;
+		len -= r;
+		off += r;
+	}
+	return 0;
+}
+
+/* finds the format and the samples of the WAV file of "size" bytes */
+static int wav_parse(struct norm *n, off_t size)
+{
+	unsigned char h[40];
+	off_t off = 12;
+	uint32_t len;
+	uint64_t len64 = 0;
+	int tag = -1, bits = 0, align = 0;
+
+	/* RF64 is RIFF with the long lengths in a ds64 chunk */
+	if (read_at(n->in, h, 12, 0) < 0 ||
+	    (memcmp(h, "RIFF", 4) && memcmp(h, "RF64", 4)) ||
+	    memcmp(h + 8, "WAVE", 4))
+		return -EINVAL;
+	while (off + 8 <= size) {
+		if (read_at(n->in, h, 8, off) < 0)
+			return -EINVAL;
+		len = get32(h + 4);
+		if (!memcmp(h, "ds64", 4)) {
+			if (len < 16 || read_at(n->in, h, 16, off + 8) < 0)
+				return -EINVAL;
+			len64 = get32(h + 8) | (uint64_t)get32(h + 12) << 32;
+		} else if (!memcmp(h, "fmt ", 4)) {
+			if (len < 16 ||
+			    read_at(n->in, h, len < 40 ? len : 40, off + 8) < 0)
+				return -EINVAL;
+			tag = get16(h);
+			n->channels = get16(h + 2);
+			align = get16(h + 12);
+			bits = get16(h + 14);
+			if (tag == WAVE_EXTENSIBLE && len >= 40)
+				tag = get16(h + 24);
+		} else if (!memcmp(h, "data", 4)) {
+			if (tag < 0)
+				return -EINVAL;
+			n->data = off + 8;
+			if (len == 0xffffffff && len64)
+				n->len = len64;
+			else
+				n->len = len;
+			/* a capture killed before it could write the length */
+			if (n->len == 0 || n->len > (uint64_t)(size - n->data))
+				n->len = size - n->data;
+			break;
+		}
+		off += 8 + (off_t)len + (len & 1);
+	}
+	if (n->data == 0)
+		return -EINVAL;
+	if (tag == WAVE_PCM && bits == 8)
+		n->fmt = METER_U8;
+	else if (tag == WAVE_PCM && bits == 16)
+		n->fmt = METER_S16_LE;
+	else if (tag == WAVE_PCM && bits == 24)
+		n->fmt = METER_S24_3LE;
+	else if (tag == WAVE_PCM && bits == 32)
+		n->fmt = METER_S32_LE;
+	else if (tag == WAVE_FLOAT && bits == 32)
+		n->fmt = METER_FLOAT_LE;
+	else
+		return -EINVAL;
+	n->bytes = meter_sample_bytes(n->fmt);
+	if (n->channels == 0 || align != n->bytes * (int)n->channels)
+		return -EINVAL;
+	n->len -= n->len % align;
+	return 0;
+}
+
+/* gives "path" everything of the input but the samples, at full size */
+static int wav_prepare(struct norm *n, const char *path, off_t size)
+{
+	unsigned char buf[65536];
+	off_t off, end;
+	size_t len;
+	int err;
+
+	n->out = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (n->out < 0)
+		return -errno;
+	if (ftruncate(n->out, size) < 0)
+		return -errno;
+	if ((err = posix_fallocate(n->out, n->data, n->len)) != 0 &&
+	    err != EOPNOTSUPP && err != EINVAL)
+		return -err;
+	for (off = 0; off < size; off += len) {
+		if (off == n->data)
+			off += n->len;
+		end = off < n->data ? n->data : size;
+		if (off >= end)
+			break;
+		len = end - off < (off_t)sizeof(buf) ? (size_t)(end - off) :
+		      sizeof(buf);
+		if ((err = read_at(n->in, buf, len, off)) < 0)
+			return err;
+		if (pwrite(n->out, buf, len, off) != (ssize_t)len)
+			return errno ? -errno : -EIO;
+	}
+	return 0;
+}
+
+static void norm_fail(struct norm *n, int err)
+{
+	int zero = 0;
+
+	__atomic_compare_exchange_n(&n->error, &zero, err, 0,
+				    __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+static void *norm_worker(void *arg)
+{
+	struct norm_worker *w = arg;
+	struct norm *n = w->n;
+	off_t off, start;
+	size_t len, head, page = sysconf(_SC_PAGESIZE);
+	unsigned char *in, *out;
+	void *mi, *mo;
+	unsigned c;
+	int prot;
+
+	prot = n->pass && n->out == n->in ? PROT_READ | PROT_WRITE : PROT_READ;
+	while ((c = __atomic_fetch_add(&n->next, 1, __ATOMIC_RELAXED)) <
+	       n->chunks && !__atomic_load_n(&n->error, __ATOMIC_RELAXED)) {
+		off = n->data + (off_t)c * n->chunk;
+		len = n->len - (uint64_t)c * n->chunk;
+		if (len > n->chunk)
+			len = n->chunk;
+		start = off - off % page;
+		head = off - start;
+		mi = mmap(NULL, head + len, prot, MAP_SHARED, n->in, start);
+		if (mi == MAP_FAILED) {
+			norm_fail(n, errno);
+			break;
+		}
+		madvise(mi, head + len, MADV_SEQUENTIAL);
+		in = (unsigned char *)mi + head;
+		if (n->pass == 0) {
+			meter_peak_rms(n->fmt, in, len / n->bytes, 1, &w->peak,
+				       &w->sumsq);
+		} else if (n->out == n->in) {
+			n->kernel(in, in, len / n->bytes, n->gain);
+		} else {
+			mo = mmap(NULL, head + len, PROT_READ | PROT_WRITE,
+				  MAP_SHARED, n->out, start);
+			if (mo == MAP_FAILED) {
+				norm_fail(n, errno);
+				munmap(mi, head + len);
+				break;
+			}
+			out = (unsigned char *)mo + head;
+			n->kernel(in, out, len / n->bytes, n->gain);
+			munmap(mo, head + len);
+		}
+		munmap(mi, head + len);
+	}
+	return NULL;
+}
+
+/* runs one pass over every chunk on "threads" threads */
+static int norm_pass(struct norm *n, struct norm_worker *w, int threads)
+{
+	int i, started, err = 0;
+
+	n->next = 0;
+	for (started = 0; started < threads; started++) {
+		w[started].n = n;
+		if ((err = pthread_create(&w[started].thread, NULL,
+					  norm_worker, &w[started])) != 0) {
+			norm_fail(n, err);
+			break;
+		}
+	}
+	for (i = 0; i < started; i++)
+		pthread_join(w[i].thread, NULL);
+	return -n->error;
+}
+
+/*
+ * Scales the samples of the WAV file "in" so the peak is "target" of full
+ * scale, in place if "out" is NULL, else into the new file "out".
+ * "threads" threads (0 for one per CPU) do the work.  A silent file is
+ * left as it is.  Returns 0 or -errno (-EINVAL for what is not a WAV file
+ * this understands), and what it did in *st.
+ */
+int wav_normalize(const char *in, const char *out, double target,
+		  int threads, struct norm_stats *st)
+{
+	struct norm n;
+	struct norm_worker w[MAX_THREADS];
+	struct stat sb;
+	double sumsq = 0;
+	float peak = 0;
+	int i, err;
+
+	memset(st, 0, sizeof(*st));
+	memset(&n, 0, sizeof(n));
+	memset(w, 0, sizeof(w));
+	if (!(target > 0))
+		return -EINVAL;
+	n.in = open(in, out ? O_RDONLY : O_RDWR);
+	if (n.in < 0)
+		return -errno;
+	n.out = n.in;
+	if (fstat(n.in, &sb) < 0) {
+		err = -errno;
+		goto __close;
+	}
+	if ((err = wav_parse(&n, sb.st_size)) < 0)
+		goto __close;
+	st->bits = n.bytes * 8;
+	st->is_float = n.fmt == METER_FLOAT_LE;
+	st->channels = n.channels;
+	st->samples = n.len / n.bytes;
+	if (threads <= 0)
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads <= 0)
+		threads = 1;
+	if (threads > MAX_THREADS)
+		threads = MAX_THREADS;
+	n.chunk = CHUNK_BYTES - CHUNK_BYTES % (n.bytes * n.channels);
+	n.chunks = (n.len + n.chunk - 1) / n.chunk;
+	if (threads > (int)n.chunks)
+		threads = n.chunks ? n.chunks : 1;
+
+	if ((err = norm_pass(&n, w, threads)) < 0)
+		goto __close;
+	for (i = 0; i < threads; i++) {
+		if (w[i].peak > peak)
+			peak = w[i].peak;
+		sumsq += w[i].sumsq;
+	}
+	st->peak = peak;
+	st->rms = st->samples ? sqrt(sumsq / st->samples) : 0;
+	n.gain = peak > 0 ? target / peak : 1;
+	st->gain = n.gain;
+	if (out && (err = wav_prepare(&n, out, sb.st_size)) < 0)
+		goto __close;
+	if (out || n.gain != 1) {
+		n.pass = 1;
+		n.kernel = norm_kernel(n.fmt);
+		err = norm_pass(&n, w, threads);
+	}
+
+      __close:
+	if (n.out != n.in && n.out >= 0 && close(n.out) < 0 && err == 0)
+		err = -errno;
+	close(n.in);
+	return err;
+}
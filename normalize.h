@@ -0,0 +1,22 @@
+/*
+   In place or copying WAV normalizer, see normalize.c.
+*/
+#ifndef NORMALIZE_H
+#define NORMALIZE_H
+
+#include <stdint.h>
+
+struct norm_stats {
+	int bits;		/* per sample */
+	int is_float;
+	unsigned channels;
+	uint64_t samples;	/* all channels */
+	double peak;		/* before, of full scale */
+	double rms;
+	double gain;		/* applied */
+};
+
+int wav_normalize(const char *in, const char *out, double target,
+		  int threads, struct norm_stats *st);
+
+#endif
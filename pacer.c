@@ -0,0 +1,99 @@
+/*
+   Fixed rate frame scheduler.
+
+   pacer_wait() sleeps with clock_nanosleep() until the absolute time of the
+   next tick, so the thread uses no CPU between frames and the ticks do not
+   drift: tick n is due at start + n / fps, whenever the one before was
+   served.  A wake up a whole period or more late skips the ticks that have
+   passed meanwhile and says how many, the same skip the old busy waiting
+   Video.wait() reported.
+
+   The timer slack of the waiting thread is cut to PACER_SLACK for the
+   sleep, the kernel would otherwise let the wake ups run up to 50 us late,
+   and put back after it, so whatever else the thread does (the Python
+   thread of audio.Scheduler) keeps its own.  How late they really were is
+   kept track of, see pacer_get_stats().
+*/
+#define _GNU_SOURCE
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <sys/prctl.h>
+
+#include "pacer.h"
+
+#define PACER_SLACK	1000	/* ns */
+
+int64_t pacer_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int64_t deadline(struct pacer *s, unsigned seq)
+{
+	return s->start + (int64_t)seq * 1000000000 / s->fps;
+}
+
+/* starts the ticks from now, any thread may wait for them */
+void pacer_init(struct pacer *s, int fps)
+{
+	s->fps = fps > 0 ? fps : 1;
+	s->seq = 0;
+	s->ticks = s->skipped = 0;
+	s->late_max = 0;
+	s->late_sum = s->late_sq = 0;
+	s->start = pacer_now();
+}
+
+/* sleeps until the next tick, returns how many were missed before it */
+unsigned pacer_wait(struct pacer *s)
+{
+	struct timespec ts;
+	int64_t due, now, late;
+	unsigned skip = 0;
+#ifdef PR_SET_TIMERSLACK
+	int slack = prctl(PR_GET_TIMERSLACK, 0, 0, 0, 0);
+
+	if (slack > PACER_SLACK)
+		prctl(PR_SET_TIMERSLACK, PACER_SLACK, 0, 0, 0);
+#endif
+
+	due = deadline(s, ++s->seq);
+	ts.tv_sec = due / 1000000000;
+	ts.tv_nsec = due % 1000000000;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+	now = pacer_now();
+#ifdef PR_SET_TIMERSLACK
+	if (slack > PACER_SLACK)
+		prctl(PR_SET_TIMERSLACK, slack, 0, 0, 0);
+#endif
+	late = now > due ? now - due : 0;
+	if (late > s->late_max)
+		s->late_max = late;
+	s->late_sum += late;
+	s->late_sq += (double)late * late;
+	/* woke up a whole period late: those ticks are gone */
+	while (now >= deadline(s, s->seq + 1)) {
+		s->seq++;
+		skip++;
+	}
+	s->ticks++;
+	s->skipped += skip;
+	return skip;
+}
+
+void pacer_get_stats(struct pacer *s, struct pacer_stats *st)
+{
+	double mean = s->ticks ? s->late_sum / s->ticks : 0;
+	double var = s->ticks ? s->late_sq / s->ticks - mean * mean : 0;
+
+	st->ticks = s->ticks;
+	st->skipped = s->skipped;
+	st->late_mean = mean * 1e-9;
+	st->late_max = s->late_max * 1e-9;
+	st->jitter = var > 0 ? sqrt(var) * 1e-9 : 0;
+}
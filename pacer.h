@@ -0,0 +1,31 @@
+/*
+   Fixed rate frame scheduler, see pacer.c.
+*/
+#ifndef PACER_H
+#define PACER_H
+
+#include <stdint.h>
+
+struct pacer {
+	int64_t start;		/* CLOCK_MONOTONIC ns of tick 0 */
+	int fps;
+	unsigned seq;		/* the tick last waited for */
+	unsigned long ticks, skipped;
+	int64_t late_max;	/* ns */
+	double late_sum, late_sq;
+};
+
+struct pacer_stats {
+	unsigned long ticks;	/* ticks served */
+	unsigned long skipped;	/* ticks missed */
+	double late_mean;	/* how late the wake ups were, seconds */
+	double late_max;
+	double jitter;		/* standard deviation of the lateness */
+};
+
+int64_t pacer_now(void);
+void pacer_init(struct pacer *s, int fps);
+unsigned pacer_wait(struct pacer *s);
+void pacer_get_stats(struct pacer *s, struct pacer_stats *st);
+
+#endif
@@ -0,0 +1,238 @@
+/*
+   Interleaving of planar (per-channel) sample buffers.
+
+   snd_pcm_readn() delivers every channel into its own buffer, which is
+   what metering and per-channel files want, while a multichannel file
+   wants the frames interleaved.  planar_interleave() does that transpose
+   in square tiles: the vector kernels load the same few frames of as many
+   channels as there are lanes, transpose the tile in registers and store
+   every frame of it with one write, so a 64 channel period is read and
+   written in whole vectors.  16 bit samples go in 8x8 tiles (SSE2), 32 bit
+   ones (S24_LE, S32_LE, FLOAT_LE) in 4x4 (SSE2) or 8x8 tiles (AVX2); the
+   channels and frames left over, and 8 and packed 24 bit samples, are
+   copied in plain C.
+*/
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <string.h>
+
+#include "cpu.h"
+#include "planar.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PLANAR_X86 1
+#endif
+
+/* frames [from, to) of channels [c0, c1) */
+static void interleave_c(uint8_t *dst, const uint8_t *src, size_t stride,
+			 size_t from, size_t to, unsigned c0, unsigned c1,
+			 unsigned channels, unsigned bytes)
+{
+	size_t frame = (size_t)channels * bytes, i;
+	const uint8_t *s;
+	uint8_t *d;
+	unsigned c;
+
+	for (c = c0; c < c1; c++) {
+		s = src + c * stride + from * bytes;
+		d = dst + from * frame + c * bytes;
+		switch (bytes) {
+		case 1:
+			for (i = from; i < to; i++, d += frame)
+				*d = *s++;
+			break;
+		case 2:
+			for (i = from; i < to; i++, s += 2, d += frame)
+				memcpy(d, s, 2);
+			break;
+		case 4:
+			for (i = from; i < to; i++, s += 4, d += frame)
+				memcpy(d, s, 4);
+			break;
+		default:
+			for (i = from; i < to; i++, s += bytes, d += frame)
+				memcpy(d, s, bytes);
+		}
+	}
+}
+
+#ifdef PLANAR_X86
+
+/*
+ * The kernels transpose the tiles of the first "frames" frames (a multiple
+ * of the tile) and return how many channels that covered, a multiple of
+ * the tile as well.
+ */
+
+#pragma GCC push_options
+#pragma GCC target("sse2")
+
+static unsigned interleave16_sse2(uint8_t *dst, const uint8_t *src,
+				  size_t stride, size_t frames,
+				  unsigned channels)
+{
+	__m128i a[8], t[8], u[8];
+	size_t frame = (size_t)channels * 2, i;
+	unsigned c, k;
+
+	for (c = 0; c + 8 <= channels; c += 8) {
+		for (i = 0; i < frames; i += 8) {
+			for (k = 0; k < 8; k++)
+				a[k] = _mm_loadu_si128((const __m128i *)
+					(src + (c + k) * stride + i * 2));
+			for (k = 0; k < 8; k += 2) {
+				t[k] = _mm_unpacklo_epi16(a[k], a[k + 1]);
+				t[k + 1] = _mm_unpackhi_epi16(a[k], a[k + 1]);
+			}
+			/* u[0..3]: frames 0-1, 2-3, 4-5, 6-7 of channels
+			   c..c+3, u[4..7] those of c+4..c+7 */
+			for (k = 0; k < 8; k += 4) {
+				u[k] = _mm_unpacklo_epi32(t[k], t[k + 2]);
+				u[k + 1] = _mm_unpackhi_epi32(t[k], t[k + 2]);
+				u[k + 2] = _mm_unpacklo_epi32(t[k + 1], t[k + 3]);
+				u[k + 3] = _mm_unpackhi_epi32(t[k + 1], t[k + 3]);
+			}
+			for (k = 0; k < 4; k++) {
+				_mm_storeu_si128((__m128i *)(dst + (i + 2 * k) *
+					frame + c * 2),
+					_mm_unpacklo_epi64(u[k], u[k + 4]));
+				_mm_storeu_si128((__m128i *)(dst + (i + 2 * k + 1) *
+					frame + c * 2),
+					_mm_unpackhi_epi64(u[k], u[k + 4]));
+			}
+		}
+	}
+	return c;
+}
+
+static unsigned interleave32_sse2(uint8_t *dst, const uint8_t *src,
+				  size_t stride, size_t frames,
+				  unsigned channels)
+{
+	__m128i a[4], t[4];
+	size_t frame = (size_t)channels * 4, i;
+	unsigned c, k;
+
+	for (c = 0; c + 4 <= channels; c += 4) {
+		for (i = 0; i < frames; i += 4) {
+			for (k = 0; k < 4; k++)
+				a[k] = _mm_loadu_si128((const __m128i *)
+					(src + (c + k) * stride + i * 4));
+			t[0] = _mm_unpacklo_epi32(a[0], a[1]);
+			t[1] = _mm_unpackhi_epi32(a[0], a[1]);
+			t[2] = _mm_unpacklo_epi32(a[2], a[3]);
+			t[3] = _mm_unpackhi_epi32(a[2], a[3]);
+			_mm_storeu_si128((__m128i *)(dst + i * frame + c * 4),
+					 _mm_unpacklo_epi64(t[0], t[2]));
+			_mm_storeu_si128((__m128i *)(dst + (i + 1) * frame + c * 4),
+					 _mm_unpackhi_epi64(t[0], t[2]));
+			_mm_storeu_si128((__m128i *)(dst + (i + 2) * frame + c * 4),
+					 _mm_unpacklo_epi64(t[1], t[3]));
+			_mm_storeu_si128((__m128i *)(dst + (i + 3) * frame + c * 4),
+					 _mm_unpackhi_epi64(t[1], t[3]));
+		}
+	}
+	return c;
+}
+
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx2")
+
+static unsigned interleave32_avx2(uint8_t *dst, const uint8_t *src,
+				  size_t stride, size_t frames,
+				  unsigned channels)
+{
+	__m256i a[8], t[8], u[8];
+	size_t frame = (size_t)channels * 4, i;
+	unsigned c, k;
+
+	for (c = 0; c + 8 <= channels; c += 8) {
+		for (i = 0; i < frames; i += 8) {
+			for (k = 0; k < 8; k++)
+				a[k] = _mm256_loadu_si256((const __m256i *)
+					(src + (c + k) * stride + i * 4));
+			for (k = 0; k < 8; k += 2) {
+				t[k] = _mm256_unpacklo_epi32(a[k], a[k + 1]);
+				t[k + 1] = _mm256_unpackhi_epi32(a[k], a[k + 1]);
+			}
+			/* in both halves: u[0..3] frames 0, 1, 2, 3 (4, 5, 6,
+			   7) of channels c..c+3, u[4..7] of c+4..c+7 */
+			for (k = 0; k < 8; k += 4) {
+				u[k] = _mm256_unpacklo_epi64(t[k], t[k + 2]);
+				u[k + 1] = _mm256_unpackhi_epi64(t[k], t[k + 2]);
+				u[k + 2] = _mm256_unpacklo_epi64(t[k + 1], t[k + 3]);
+				u[k + 3] = _mm256_unpackhi_epi64(t[k + 1], t[k + 3]);
+			}
+			for (k = 0; k < 4; k++) {
+				_mm256_storeu_si256((__m256i *)(dst + (i + k) *
+					frame + c * 4),
+					_mm256_permute2x128_si256(u[k], u[k + 4], 0x20));
+				_mm256_storeu_si256((__m256i *)(dst + (i + k + 4) *
+					frame + c * 4),
+					_mm256_permute2x128_si256(u[k], u[k + 4], 0x31));
+			}
+		}
+	}
+	return c;
+}
+
+#pragma GCC pop_options
+
+#endif /* PLANAR_X86 */
+
+typedef unsigned (*planar_kernel_t)(uint8_t *dst, const uint8_t *src,
+				    size_t stride, size_t frames,
+				    unsigned channels);
+
+/* one row per CPU_*, see cpu.c */
+static const struct planar_impl {
+	planar_kernel_t k16, k32;
+	unsigned tile16, tile32;	/* frames per tile */
+} planar_impls[] = {
+	{ NULL,			NULL,			0, 0 },
+#ifdef PLANAR_X86
+	{ interleave16_sse2,	interleave32_sse2,	8, 4 },
+	{ interleave16_sse2,	interleave32_avx2,	8, 8 },
+#endif
+};
+
+static const void *impl;
+
+static const struct planar_impl *planar_dispatch(void)
+{
+	return cpu_resolve(&impl, planar_impls, sizeof(planar_impls[0]),
+			   sizeof(planar_impls) / sizeof(planar_impls[0]), -1);
+}
+
+/*
+ * Interleaves "frames" frames of "channels" planes of "bytes" byte samples,
+ * plane c at src + c * stride, into dst.
+ */
+void planar_interleave(void *dst, const void *src, size_t stride,
+		       size_t frames, unsigned channels, unsigned bytes)
+{
+	const struct planar_impl *p = planar_dispatch();
+	planar_kernel_t kernel = NULL;
+	size_t done = 0;
+	unsigned tile = 0, c = 0;
+
+	if (bytes == 2) {
+		kernel = p->k16;
+		tile = p->tile16;
+	} else if (bytes == 4) {
+		kernel = p->k32;
+		tile = p->tile32;
+	}
+	if (kernel) {
+		done = frames - frames % tile;
+		c = kernel(dst, src, stride, done, channels);
+		/* what the tiles left, at the end of every plane */
+		interleave_c(dst, src, stride, done, frames, 0, c, channels,
+			     bytes);
+	}
+	interleave_c(dst, src, stride, 0, frames, c, channels, channels,
+		     bytes);
+}
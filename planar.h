@@ -0,0 +1,12 @@
+/*
+   Interleaving of planar (per-channel) sample buffers, see planar.c.
+*/
+#ifndef PLANAR_H
+#define PLANAR_H
+
+#include <stddef.h>
+
+void planar_interleave(void *dst, const void *src, size_t stride,
+		       size_t frames, unsigned channels, unsigned bytes);
+
+#endif
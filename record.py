@@ -20,90 +20,104 @@ import sys
 import os
 import re
 from time import sleep
-from timeit import default_timer as clock
 from subprocess import Popen, PIPE, check_call, STDOUT
 from tempfile import mkdtemp
 from select import select
-from cPickle import dump, load
 from optparse import OptionParser
 from threading import Thread
 
 import gtk
-from PIL import Image
 
-from audio import capture, capture_stop
+from audio import capture, capture_stop, monotonic, audio_clock, Screen, \
+        TileEncoder, VideoWriter, VideoReader, Y4MWriter, export_png, \
+        archive, INTERP_MOTION, FILE_WAVE, FILE_FLAC, PRESET_DEFAULT, \
+        PRESET_LOW_LATENCY, PRESET_LOW_WAKEUP
+
+# record.py --latency
+PRESETS = {"default": PRESET_DEFAULT, "low": PRESET_LOW_LATENCY,
+        "batch": PRESET_LOW_WAKEUP}
 
 class Audio(Thread):
 
-    def __init__(self, filename):
+    def __init__(self, filename, agc=False, flac=False,
+            preset=PRESET_DEFAULT):
         Thread.__init__(self)
         self._filename = filename
+        self._agc = agc
+        self._file_type = FILE_FLAC if flac else FILE_WAVE
+        self._preset = preset
 
     def run(self):
-        capture(self._filename)
+        capture(self._filename, tindex=True, agc=self._agc,
+                file_type=self._file_type, config={"preset": self._preset})
 
     def stop(self):
         capture_stop()
 
 class Video(object):
 
-    def __init__(self, tmpdir, win_id=None, fps=15):
+    def __init__(self, tmpdir, win_id=None, fps=15, y4m=None):
         """
         Starts capturing the video and saves it to a file 'filename'.
 
         win_id ... the window id to capture, if None, it automatically runs
                 xwininfo and parses the output to capture the windows id
+        y4m ... if given, the video is streamed as Y4M to this file, or to
+                the stdin of the command after a leading "|", instead
         """
         x, y, w, h = self.get_active_window_pos()
-        self.x = x
-        self.y = y
-        self.width = w
-        self.height = h
         self.fps = fps
         self.tmpdir = tmpdir
-        self.screengrab = gtk.gdk.Pixbuf(gtk.gdk.COLORSPACE_RGB, False, 8, w, h)
-        self._datafile = open(tmpdir+"/data", "w")
-        headers = (w, h, self.screengrab.get_rowstride(), fps)
-        dump(headers, self._datafile)
-
-    def wait(self, fps=2):
-        """
-        Generates consecutive integers with the given "fps".
-
-        It maintains the constant fps, and if necessary, it skips frames (in this
-        case the "skip" variable returns the number of skipped frames).
-        """
-        i = 1
-        t = clock()
-        while 1:
-            free_count = 0
-            skip = 0
-            while free_count == 0:
-                while clock()-t < float(i)/fps:
-                    free_count += 1
-                if free_count == 0:
-                    i += 1
-                    skip += 1
-            yield i-1, skip
-            i += 1
+        # grabs BGRA frames in its own thread, clipped to the screen
+        self.screen = Screen(x, y, w, h, fps)
+        self.x = x
+        self.y = y
+        self.width = self.screen.width
+        self.height = self.screen.height
+        # monotonic() of the first and last frame, None until one is grabbed
+        self.t0 = self.t_last = None
+        self._y4m = self._pipe = None
+        if y4m is not None:
+            if y4m.startswith("|"):
+                self._pipe = Popen(y4m[1:], shell=True, stdin=PIPE)
+                y4m = self._pipe.stdin
+            # converted to YUV 4:2:0 as it comes, no png files at all
+            self._y4m = Y4MWriter(y4m, self.width, self.height,
+                    self.screen.stride, fps)
+            return
+        # only the tiles that changed get written, a key frame every 10 s
+        self.encoder = TileEncoder(self.width, self.height, self.screen.stride,
+                10*fps)
+        self._datafile = VideoWriter(tmpdir+"/data", self.width, self.height,
+                self.screen.stride, fps)
 
     def start(self):
-        t = clock()
-        t_start = t
-        for i, skip in self.wait(fps=self.fps):
-            t_new = clock()
-            self.screengrab.get_from_drawable(gtk.gdk.get_default_root_window(),
-                    gtk.gdk.colormap_get_system(),
-                    self.x, self.y, 0, 0, self.width, self.height)
-            img = self.screengrab.get_pixels()
-            frame_header = (len(img), skip)
-            dump(frame_header, self._datafile)
-            self._datafile.write(img)
-            i += 1
-            print "time: %.3f, frame: %04d, current fps: %6.3f, skip: %d, " \
-                    "lag: %.6f" % ( t_new-t_start, i, 1/(t_new-t), skip,
-                            t_new-t_start - float(i)/self.fps)
-            t = t_new
+        self.screen.start()
+        i = 0
+        t = t_start = monotonic()
+        try:
+            for img, t_frame, skip in self.screen:
+                if self._y4m is not None:
+                    self._y4m.write(img, skip)
+                    if i == 0:
+                        self.t0 = t_frame
+                    self.t_last = t_frame
+                else:
+                    img = self.encoder.encode(img)
+                    self._datafile.write(img, skip, t_frame,
+                            self.encoder.key)
+                i += 1 + skip
+                print "time: %.3f, frame: %04d, current fps: %6.3f, " \
+                        "skip: %d, lag: %.6f" % (t_frame-t_start, i,
+                        1/(t_frame-t), skip,
+                        t_frame-t_start - float(i)/self.fps)
+                t = t_frame
+        except IOError, e:
+            # the grab failed (see Screen), keep what was grabbed so far
+            print "screen grab stopped: %s" % e
+
+    def stop(self):
+        self.screen.stop()
 
     def get_window_pos(self, win_id, dX=0, dY=-17, dw=2, dh=16):
         """
@@ -152,28 +166,29 @@ class Video(object):
         return id
 
     def convert(self):
+        if self._y4m is not None:
+            frames, repeated = self._y4m.stats()
+            self._y4m.close()
+            if self._pipe is not None:
+                self._pipe.stdin.close()
+                self._pipe.wait()
+            print "%d frames streamed, %d repeated" % (frames, repeated)
+            self.frames = frames + repeated
+            return
         self._datafile.close()
-        f = open(self.tmpdir+"/data")
-        data = load(f)
-        img_width, img_height, stride, fps = data
-        print img_width, img_height, stride, fps
-        i = 0
-        while 1:
-            try:
-                frame_headers = load(f)
-            except EOFError:
-                break
-            n, skip = frame_headers
-            for j in range(skip):
-                # ideally this should be interpolated with the next image
-                img.save(self.tmpdir + "/screen%04d.png" % i)
-                i += 1
-            pixels = f.read(n)
-            img = Image.frombuffer("RGB", (img_width, img_height),
-                    pixels, "raw", "RGB", stride, 1)
-            img.save(self.tmpdir + "/screen%04d.png" % i)
-            print i
-            i += 1
+        f = VideoReader(self.tmpdir+"/data")
+        print f.width, f.height, f.stride, f.fps
+        if len(f) > 0:
+            self.t0 = f.info(0)[0]
+            self.t_last = f.info(len(f)-1)[0]
+        # encoded on every core, repeated frames become hard links and
+        # skipped ones are interpolated
+        images, encoded, linked, interpolated = export_png(
+                self.tmpdir+"/data", self.tmpdir+"/screen%04d.png",
+                interpolate=INTERP_MOTION)
+        print "%d images, %d encoded, %d repeated, %d interpolated" % \
+                (images, encoded, linked, interpolated)
+        self.frames = images
         print "images saved to: %s" % self.tmpdir
 
 
@@ -190,17 +205,33 @@ if __name__ == "__main__":
             help="save to FILE [default: %default]", metavar="FILE")
     parser.add_option("-w", "--window", dest="window",
             help="window id to capture", default=None)
+    parser.add_option("-y", "--y4m", dest="y4m", default=None,
+            help="stream the video as Y4M to FILE, or to the stdin of the "
+            "command after a '|', instead of saving png images",
+            metavar="FILE")
+    parser.add_option("-a", "--agc", dest="agc", action="store_true",
+            default=False, help="level the sound while recording, "
+            "no normalizing needed afterwards")
+    parser.add_option("-l", "--flac", dest="flac", action="store_true",
+            default=False, help="compress the sound losslessly to FLAC "
+            "while recording")
+    parser.add_option("-L", "--latency", dest="latency", default="default",
+            choices=sorted(PRESETS.keys()), help="audio buffering: 'low' "
+            "wakes up every 5 ms, 'batch' twice a second [default: "
+            "%default]")
     options, args = parser.parse_args()
 
     tmp_dir = mkdtemp()
     video_file = os.path.join(tmp_dir, "video.ogv")
-    audio_file = os.path.join(tmp_dir, "audio.wav")
+    audio_file = os.path.join(tmp_dir,
+            "audio.flac" if options.flac else "audio.wav")
     print "work dir:", tmp_dir
     print "select a window to capture (2s sleep)"
     sleep(2)
     print "active window selected"
-    v = Video(tmp_dir, options.window)
-    a = Audio(audio_file)
+    v = Video(tmp_dir, options.window, y4m=options.y4m)
+    a = Audio(audio_file, options.agc, options.flac,
+            PRESETS[options.latency])
     print "Capturing audio and video. Press CTRL-C to stop."
     try:
         try:
@@ -209,10 +240,37 @@ if __name__ == "__main__":
         except KeyboardInterrupt:
             pass
     finally:
+        v.stop()
         a.stop()
     print "stopped."
-    print "converting to png images"
+    print "frame ticks: %.3f ms late on average, %.3f ms at worst, " \
+            "%.3f ms jitter" % tuple(1e3*x for x in v.screen.timing())
+    a.join()
+    if options.y4m is None:
+        print "converting to png images"
     v.convert()
+    t0, rate = audio_clock(audio_file)
+    if v.t0 is not None:
+        print "audio starts %.6f s after the video, runs at %.2f Hz" % \
+                (t0 - v.t0, rate)
+    else:
+        print "no video frames, audio runs at %.2f Hz" % rate
+    if v.frames > 1 and v.t_last > v.t0:
+        print "video ran at %.3f fps" % \
+                ((v.frames - 1) / (v.t_last - v.t0))
+    if options.y4m is not None:
+        if not options.y4m.startswith("|"):
+            print "To encode the stream together with the audio:"
+            print "-"*80
+            print "ffmpeg -i %s -i %s -c:v libtheora -c:a libvorbis v.ogv" % \
+                    (options.y4m, audio_file)
+            print "-"*80
+        sys.exit(0)
+    # on every core, in a fraction of the png files' size
+    archive_file = os.path.join(tmp_dir, "video.rvid")
+    frames, keyframes, raw, size = archive(tmp_dir+"/data", archive_file)
+    print "archived %d frames losslessly: %.1f MB of pixels in %.1f MB" % \
+            (frames, raw / 1e6, size / 1e6)
     print "To encode using mencoder:"
     print "-"*80
     print "mencoder mf://%s/*.png -mf fps=%d -audiofile %s -oac lavc " \
@@ -224,14 +282,19 @@ if __name__ == "__main__":
     print "-"*80
     print "ffmpeg2theora -F %d -v 10 %s/screen%%04d.png -o tmp.ogv" % \
             (v.fps, tmp_dir)
-    print "normalize-audio %s  # beware: normalizes *in place*" % audio_file
+    if not options.agc and not options.flac:
+        print "./amplify.py %s  # beware: amplifies *in place*" % audio_file
     print "oggenc %s" % audio_file
-    print "oggz-merge -o v.ogv tmp.ogv %sogg" % audio_file[:-3]
+    print "oggz-merge -o v.ogv tmp.ogv %s.ogg" % os.path.splitext(audio_file)[0]
     print "-"*80
     print
     print "To just archive audio and video in a lossless format for later processing:"
     print "-"*80
-    print "advmng -v -a %d video.mng %s/screen*.png" % (v.fps, tmp_dir)
-    print "flac -o audio.flac %s" % audio_file
+    print "keep %s" % archive_file
+    if options.flac:
+        print "keep %s" % audio_file
+    else:
+        print "flac -o audio.flac %s" % audio_file
     print "-"*80
-    print "(Use 'advmng -x video.mng' to extract the png images)"
+    print "(Use audio.export_png('%s', 'screen%%04d.png') to get the png " \
+            "images back)" % archive_file
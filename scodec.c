@@ -0,0 +1,353 @@
+/*
+   Lossless screen codec.
+
+   A screen recording is mostly pixels that did not change since the frame
+   before, flat areas and a handful of colours (text, icons, borders), none
+   of which png's per image filters know about.  A frame is turned, row by
+   row, into a byte stream of
+
+     01nnnnnn  n + 1 pixels as in the frame before
+     10nnnnnn  n + 1 copies of the pixel before
+     110nnnnn  n + 1 pixels as in the row above
+     00iiiiii  the colour in slot i of a cache of recent colours
+     111nnnnn  n + 1 new colours (n < 30) of b, g, r, with the alpha of
+               the pixel before
+     11111110  b, g, r: one such new colour
+     11111111  b, g, r, a: a new colour
+
+   where a run field of all ones (11101 for new colours) is followed by the
+   rest of the length as a LEB128 number, and the longest run that fits
+   wins.  New colours go into cache slot hash(colour) % CACHE, which the
+   decoder keeps the same way.  The byte stream is then deflated, which
+   picks up what repeats in it (glyphs, patterns) and does the entropy
+   coding.
+
+   An encoded frame is
+
+     u8 type (SC_KEY or SC_DELTA), u8 0, u16 0, u32 length of the byte
+     stream (little endian), then the deflated byte stream.
+
+   A key frame uses no other frame, a delta frame the one before it.  As
+   the codec is lossless the encoder predicts from the original frames, so
+   a coder keeps nothing from one frame to the next and any number of
+   frames can be encoded at once, each with its own coder (see archive.c).
+*/
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "scodec.h"
+
+#define OP_INDEX	0x00
+#define OP_PREV		0x40
+#define OP_LEFT		0x80
+#define OP_UP		0xc0
+#define OP_RAW		0xe0
+#define OP_RGB		0xfe
+#define OP_RGBA		0xff
+
+#define RUN6		63	/* run field of OP_PREV and OP_LEFT */
+#define RUN5		31	/* of OP_UP */
+#define RUN_RAW		29	/* of OP_RAW, which ends below OP_RGB */
+#define CACHE		64
+#define HEADER_BYTES	8
+
+struct sc_coder {
+	int width, height, stride;
+	unsigned char *bytes;	/* the byte stream before deflate */
+	size_t bytes_max;
+};
+
+static void put32(unsigned char *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static uint32_t get32(const unsigned char *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline unsigned cache_slot(uint32_t px)
+{
+	return ((px & 0xff) * 3 + (px >> 8 & 0xff) * 5 +
+		(px >> 16 & 0xff) * 7 + (px >> 24) * 11) % CACHE;
+}
+
+/* a frame of width x height BGRA pixels, stride bytes per row */
+struct sc_coder *sc_coder_new(int width, int height, int stride)
+{
+	struct sc_coder *c;
+
+	if (width <= 0 || height <= 0 || stride < width * 4)
+		return NULL;
+	c = calloc(1, sizeof(*c));
+	if (c == NULL)
+		return NULL;
+	c->width = width;
+	c->height = height;
+	c->stride = stride;
+	/* every pixel a new colour */
+	c->bytes_max = 5 * (size_t)width * height;
+	c->bytes = malloc(c->bytes_max);
+	if (c->bytes == NULL) {
+		free(c);
+		return NULL;
+	}
+	return c;
+}
+
+void sc_coder_free(struct sc_coder *c)
+{
+	if (c == NULL)
+		return;
+	free(c->bytes);
+	free(c);
+}
+
+/* most bytes sc_encode() can put out */
+size_t sc_bound(struct sc_coder *c)
+{
+	return HEADER_BYTES + compressBound(c->bytes_max);
+}
+
+static unsigned char *put_run(unsigned char *p, unsigned op, unsigned max,
+			      unsigned run)
+{
+	run--;
+	if (run < max) {
+		*p++ = op | run;
+		return p;
+	}
+	*p++ = op | max;
+	for (run -= max; run >= 0x80; run >>= 7)
+		*p++ = run | 0x80;
+	*p++ = run;
+	return p;
+}
+
+/* the "n" new colours of one alpha ending before cur[x] */
+static unsigned char *put_raw(unsigned char *p, const uint32_t *cur,
+			      unsigned x, unsigned n)
+{
+	if (n == 0)
+		return p;
+	if (n == 1)
+		*p++ = OP_RGB;
+	else
+		p = put_run(p, OP_RAW, RUN_RAW, n);
+	for (x -= n; n > 0; n--, x++) {
+		*p++ = cur[x];
+		*p++ = cur[x] >> 8;
+		*p++ = cur[x] >> 16;
+	}
+	return p;
+}
+
+static size_t sc_bytes(struct sc_coder *c, const unsigned char *frame,
+		       const unsigned char *prev)
+{
+	uint32_t cache[CACHE] = { 0 };
+	const uint32_t *cur, *up = NULL, *old = NULL;
+	uint32_t px, left = 0;
+	unsigned char *p = c->bytes;
+	unsigned w = c->width, x, run, best, op = 0, max = 0, slot, raw;
+	int y;
+
+	for (y = 0; y < c->height; y++, up = cur) {
+		raw = 0;
+		cur = (const uint32_t *)(frame + (size_t)y * c->stride);
+		if (prev)
+			old = (const uint32_t *)(prev + (size_t)y * c->stride);
+		for (x = 0; x < w; x += best) {
+			px = cur[x];
+			best = 0;
+			if (old && px == old[x]) {
+				for (run = 1; x + run < w &&
+				     cur[x + run] == old[x + run]; run++)
+					;
+				best = run;
+				op = OP_PREV;
+				max = RUN6;
+			}
+			if (px == left && best < w - x) {
+				for (run = 1; x + run < w && cur[x + run] == left;
+				     run++)
+					;
+				if (run > best) {
+					best = run;
+					op = OP_LEFT;
+					max = RUN6;
+				}
+			}
+			if (up && px == up[x] && best < w - x) {
+				for (run = 1; x + run < w &&
+				     cur[x + run] == up[x + run]; run++)
+					;
+				if (run > best) {
+					best = run;
+					op = OP_UP;
+					max = RUN5;
+				}
+			}
+			if (best) {
+				p = put_raw(p, cur, x, raw);
+				raw = 0;
+				p = put_run(p, op, max, best);
+				left = cur[x + best - 1];
+				continue;
+			}
+			best = 1;
+			slot = cache_slot(px);
+			if (cache[slot] == px) {
+				p = put_raw(p, cur, x, raw);
+				raw = 0;
+				*p++ = OP_INDEX | slot;
+			} else if ((px ^ left) >> 24) {
+				p = put_raw(p, cur, x, raw);
+				raw = 0;
+				cache[slot] = px;
+				*p++ = OP_RGBA;
+				*p++ = px;
+				*p++ = px >> 8;
+				*p++ = px >> 16;
+				*p++ = px >> 24;
+			} else {
+				/* goes out with the ones after it */
+				cache[slot] = px;
+				raw++;
+			}
+			left = px;
+		}
+		p = put_raw(p, cur, x, raw);
+	}
+	return p - c->bytes;
+}
+
+/*
+ * Encodes "frame" as a delta to "prev", or as a key frame if prev is NULL,
+ * deflated at zlib "level", into "out" of sc_bound() bytes.  Returns the
+ * encoded size, 0 if deflate failed.
+ */
+size_t sc_encode(struct sc_coder *c, const unsigned char *frame,
+		 const unsigned char *prev, int level, unsigned char *out)
+{
+	size_t n = sc_bytes(c, frame, prev);
+	uLongf zlen = sc_bound(c) - HEADER_BYTES;
+
+	out[0] = prev ? SC_DELTA : SC_KEY;
+	out[1] = out[2] = out[3] = 0;
+	put32(out + 4, n);
+	if (compress2(out + HEADER_BYTES, &zlen, c->bytes, n, level) != Z_OK)
+		return 0;
+	return HEADER_BYTES + zlen;
+}
+
+/*
+ * Decodes into "frame" (stride bytes per row, the padding is left alone),
+ * "prev" being the frame before or NULL.  Returns 0, or -1 if the data is
+ * corrupt or a delta frame came without prev.
+ */
+int sc_decode(struct sc_coder *c, const unsigned char *data, size_t len,
+	      const unsigned char *prev, unsigned char *frame)
+{
+	uint32_t cache[CACHE] = { 0 };
+	const uint32_t *up = NULL, *old = NULL;
+	uint32_t *cur, px, left = 0;
+	const unsigned char *p, *end;
+	unsigned w = c->width, x, run, max, op, shift, b, k;
+	uLongf n;
+	int y;
+
+	if (len < HEADER_BYTES || data[0] > SC_DELTA ||
+	    (data[0] == SC_DELTA && prev == NULL))
+		return -1;
+	n = get32(data + 4);
+	if (n > c->bytes_max)
+		return -1;
+	if (uncompress(c->bytes, &n, data + HEADER_BYTES,
+		       len - HEADER_BYTES) != Z_OK || n != get32(data + 4))
+		return -1;
+	if (data[0] == SC_KEY)
+		prev = NULL;
+	p = c->bytes;
+	end = p + n;
+	for (y = 0; y < c->height; y++, up = cur) {
+		cur = (uint32_t *)(frame + (size_t)y * c->stride);
+		if (prev)
+			old = (const uint32_t *)(prev + (size_t)y * c->stride);
+		for (x = 0; x < w; x += run, left = cur[x - 1]) {
+			if (p == end)
+				return -1;
+			b = *p++;
+			run = 1;
+			if (b == OP_RGBA) {
+				if (end - p < 4)
+					return -1;
+				px = p[0] | p[1] << 8 | p[2] << 16 |
+					(uint32_t)p[3] << 24;
+				p += 4;
+				cache[cache_slot(px)] = px;
+				cur[x] = px;
+				continue;
+			}
+			if (b < OP_PREV) {
+				cur[x] = cache[b];
+				continue;
+			}
+			if (b == OP_RGB) {
+				op = OP_RAW;
+				max = 0;
+			} else if (b >= OP_RAW) {
+				op = OP_RAW;
+				max = RUN_RAW;
+			} else if (b >= OP_UP) {
+				op = OP_UP;
+				max = RUN5;
+			} else {
+				op = b & 0xc0;
+				max = RUN6;
+			}
+			run = max ? b - op : 0;
+			if (max && run == max) {
+				for (shift = 0;; shift += 7) {
+					if (p == end || shift > 21)
+						return -1;
+					run += (*p & 0x7f) << shift;
+					if (!(*p++ & 0x80))
+						break;
+				}
+			}
+			run++;
+			if (run > w - x)
+				return -1;
+			if (op == OP_RAW) {
+				if ((size_t)(end - p) < 3 * (size_t)run)
+					return -1;
+				for (k = 0; k < run; k++, p += 3) {
+					px = p[0] | p[1] << 8 | p[2] << 16 |
+						(left & 0xff000000);
+					cache[cache_slot(px)] = px;
+					cur[x + k] = left = px;
+				}
+			} else if (op == OP_PREV) {
+				if (old == NULL)
+					return -1;
+				memcpy(cur + x, old + x, run * 4);
+			} else if (op == OP_UP) {
+				if (up == NULL)
+					return -1;
+				memcpy(cur + x, up + x, run * 4);
+			} else {
+				for (k = 0; k < run; k++)
+					cur[x + k] = left;
+			}
+		}
+	}
+	return p == end ? 0 : -1;
+}
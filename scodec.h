@@ -0,0 +1,22 @@
+/*
+   Lossless screen codec, see scodec.c.
+*/
+#ifndef SCODEC_H
+#define SCODEC_H
+
+#include <stddef.h>
+
+#define SC_KEY		0	/* decodes on its own */
+#define SC_DELTA	1	/* needs the frame before */
+
+struct sc_coder;
+
+struct sc_coder *sc_coder_new(int width, int height, int stride);
+void sc_coder_free(struct sc_coder *c);
+size_t sc_bound(struct sc_coder *c);
+size_t sc_encode(struct sc_coder *c, const unsigned char *frame,
+		 const unsigned char *prev, int level, unsigned char *out);
+int sc_decode(struct sc_coder *c, const unsigned char *data, size_t len,
+	      const unsigned char *prev, unsigned char *frame);
+
+#endif
@@ -0,0 +1,440 @@
+/*
+   MIT-SHM screen grabber.
+
+   screen_open() attaches a few shared memory XImages to the X server and
+   screen_start() runs a thread that copies the capture rectangle of the
+   root window into them with XShmGetImage() at a fixed frame rate.  The
+   pixels are handed out as the server stores them (BGRA on the usual 24
+   and 32 bit little endian displays), there is no conversion.
+
+   The buffers form a ring between the grab thread and one consumer:
+   screen_next() waits for the oldest grabbed frame, screen_release() gives
+   it back.  A frame tick that comes too late, or finds every buffer still
+   held by the consumer, is skipped and counted in the "skip" of the next
+   frame that does get grabbed, so the frame numbers stay on the time grid.
+
+   The frame ticks come from pacer.c, the grab thread sleeps between them.
+
+   The Display is opened for the grabber alone and only the grab thread uses
+   it while it runs, so Xlib does not need XInitThreads().
+
+   Where the server cannot share memory with us (no MIT-SHM, or a remote or
+   forwarded DISPLAY, where XShmAttach() fails with BadAccess) the frames
+   are fetched with XGetSubImage() into plain buffers instead, slower but
+   the same to the consumer.
+
+   Xlib's default error handler exits the process, so while the grabber
+   talks to the server (the attach, the grab thread's frames) its own
+   handler takes the errors of the grabber's Display and passes those of
+   any other Display on to the handler it replaced.  A grab that fails
+   (BadMatch once the capture area has left a resized screen) ends the
+   grab thread like a stop, with an error.
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/extensions/XShm.h>
+
+#include "screen.h"
+#include "pacer.h"
+
+struct screen {
+	Display *dpy;
+	int use_shm;		/* the images are shared with the server */
+	int xerror;		/* X error code of the last request, 0 if none */
+	Window root;
+	int x, y, width, height, fps;
+	XImage *img[SCREEN_MAX_BUFFERS];
+	XShmSegmentInfo shm[SCREEN_MAX_BUFFERS];
+	struct screen_frame frame[SCREEN_MAX_BUFFERS];
+	unsigned buffers;
+	unsigned head;		/* next buffer to grab into, owned by the grab thread */
+	unsigned tail;		/* next buffer to hand out, owned by the consumer */
+	sem_t free, filled;
+	pthread_t thread;
+	int sems;		/* free and filled are initialized */
+	int running;		/* grab thread is up */
+	int stop;		/* asks the grab thread to end */
+	int error;		/* errno the grab thread ended with, 0 if stopped */
+	struct pacer pacer;	/* the frame ticks, owned by the grab thread */
+	unsigned long frames, dropped;
+};
+
+static pthread_mutex_t x_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned x_users;
+static int (*x_prev)(Display *dpy, XErrorEvent *ev);
+static __thread struct screen *x_screen;	/* whose requests this thread makes */
+
+static int x_error(Display *dpy, XErrorEvent *ev)
+{
+	struct screen *s = x_screen;
+
+	if (s != NULL && s->dpy == dpy) {
+		if (!s->xerror)
+			s->xerror = ev->error_code;
+		return 0;
+	}
+	return x_prev ? x_prev(dpy, ev) : 0;
+}
+
+/* the errors of s->dpy on this thread go to s->xerror until x_release() */
+static void x_catch(struct screen *s)
+{
+	pthread_mutex_lock(&x_lock);
+	if (x_users++ == 0)
+		x_prev = XSetErrorHandler(x_error);
+	pthread_mutex_unlock(&x_lock);
+	x_screen = s;
+	s->xerror = 0;
+}
+
+static void x_release(void)
+{
+	int (*h)(Display *dpy, XErrorEvent *ev);
+
+	x_screen = NULL;
+	pthread_mutex_lock(&x_lock);
+	/* unless someone else has put in a handler of their own since */
+	if (--x_users == 0 && (h = XSetErrorHandler(x_prev)) != x_error)
+		XSetErrorHandler(h);
+	pthread_mutex_unlock(&x_lock);
+}
+
+static void x_report(struct screen *s, const char *what)
+{
+	char text[128];
+
+	XGetErrorText(s->dpy, s->xerror, text, sizeof(text));
+	fprintf(stderr, "screen: %s: %s\n", what, text);
+}
+
+static void image_free(struct screen *s, unsigned i)
+{
+	if (s->img[i] == NULL)
+		return;
+	if (!s->use_shm)
+		free(s->img[i]->data);
+	else if (s->shm[i].shmaddr != NULL && s->shm[i].shmaddr != (char *)-1) {
+		XShmDetach(s->dpy, &s->shm[i]);
+		shmdt(s->shm[i].shmaddr);
+	}
+	s->img[i]->data = NULL;
+	XDestroyImage(s->img[i]);
+	s->img[i] = NULL;
+}
+
+/* 0, 1 if the server cannot attach the segment, -1 */
+static int shm_alloc(struct screen *s, unsigned i)
+{
+	int scr = DefaultScreen(s->dpy);
+	XImage *img;
+
+	img = XShmCreateImage(s->dpy, DefaultVisual(s->dpy, scr),
+			      DefaultDepth(s->dpy, scr), ZPixmap, NULL,
+			      &s->shm[i], s->width, s->height);
+	if (img == NULL)
+		return -1;
+	s->img[i] = img;
+	if (img->bits_per_pixel != 32) {
+		fprintf(stderr, "screen: %d bits per pixel, need a 24 or 32 bit display\n",
+			img->bits_per_pixel);
+		return -1;
+	}
+	s->shm[i].shmid = shmget(IPC_PRIVATE, img->bytes_per_line * img->height,
+				 IPC_CREAT | 0600);
+	if (s->shm[i].shmid < 0) {
+		perror("screen: shmget");
+		return -1;
+	}
+	s->shm[i].shmaddr = img->data = shmat(s->shm[i].shmid, NULL, 0);
+	if (s->shm[i].shmaddr == (char *)-1) {
+		perror("screen: shmat");
+		shmctl(s->shm[i].shmid, IPC_RMID, NULL);
+		return -1;
+	}
+	s->shm[i].readOnly = False;
+	s->xerror = 0;
+	/* a refused attach only shows up as an error, the XSync() waits for it */
+	if (!XShmAttach(s->dpy, &s->shm[i]) ||
+	    (XSync(s->dpy, False), s->xerror)) {
+		shmdt(s->shm[i].shmaddr);
+		s->shm[i].shmaddr = NULL;
+		shmctl(s->shm[i].shmid, IPC_RMID, NULL);
+		return 1;
+	}
+	/* once the server has attached it the segment can go away with us */
+	shmctl(s->shm[i].shmid, IPC_RMID, NULL);
+	s->frame[i].data = (unsigned char *)img->data;
+	return 0;
+}
+
+/* a buffer of our own for XGetSubImage() */
+static int plain_alloc(struct screen *s, unsigned i)
+{
+	int scr = DefaultScreen(s->dpy);
+	XImage *img;
+
+	img = XCreateImage(s->dpy, DefaultVisual(s->dpy, scr),
+			   DefaultDepth(s->dpy, scr), ZPixmap, 0, NULL,
+			   s->width, s->height, 32, 0);
+	if (img == NULL)
+		return -1;
+	s->img[i] = img;
+	if (img->bits_per_pixel != 32) {
+		fprintf(stderr, "screen: %d bits per pixel, need a 24 or 32 bit display\n",
+			img->bits_per_pixel);
+		return -1;
+	}
+	img->data = malloc((size_t)img->bytes_per_line * img->height);
+	if (img->data == NULL)
+		return -1;
+	s->frame[i].data = (unsigned char *)img->data;
+	return 0;
+}
+
+/*
+ * Grabs width x height at x, y of the root window (clipped to the screen)
+ * fps times a second into "buffers" shared memory images, or plain ones
+ * if the server cannot share memory with us, on "display" (NULL for
+ * $DISPLAY).  Returns NULL if the display cannot be grabbed.
+ */
+struct screen *screen_open(const char *display, int x, int y, int width,
+			   int height, int fps, int buffers)
+{
+	struct screen *s;
+	XWindowAttributes root;
+	unsigned i;
+	int r;
+
+	if (fps <= 0 || buffers < 2 || buffers > SCREEN_MAX_BUFFERS) {
+		errno = EINVAL;
+		return NULL;
+	}
+	s = calloc(1, sizeof(*s));
+	if (s == NULL)
+		return NULL;
+	s->dpy = XOpenDisplay(display);
+	if (s->dpy == NULL) {
+		fprintf(stderr, "screen: cannot open display %s\n",
+			XDisplayName(display));
+		free(s);
+		return NULL;
+	}
+	s->root = DefaultRootWindow(s->dpy);
+	XGetWindowAttributes(s->dpy, s->root, &root);
+	if (x < 0) {
+		width += x;
+		x = 0;
+	}
+	if (y < 0) {
+		height += y;
+		y = 0;
+	}
+	if (width > root.width - x)
+		width = root.width - x;
+	if (height > root.height - y)
+		height = root.height - y;
+	if (width <= 0 || height <= 0) {
+		fprintf(stderr, "screen: capture area is off the screen\n");
+		goto __fail;
+	}
+	s->x = x;
+	s->y = y;
+	s->width = width;
+	s->height = height;
+	s->fps = fps;
+	s->buffers = buffers;
+	s->use_shm = XShmQueryExtension(s->dpy);
+	x_catch(s);
+	for (i = 0, r = 0; i < s->buffers && r == 0; i++)
+		r = s->use_shm ? shm_alloc(s, i) : plain_alloc(s, i);
+	if (r > 0) {
+		/* refused, a remote display: start over without it */
+		x_report(s, "cannot attach shared memory");
+		for (i = 0; i < s->buffers; i++)
+			image_free(s, i);
+		s->use_shm = 0;
+		for (i = 0, r = 0; i < s->buffers && r == 0; i++)
+			r = plain_alloc(s, i);
+	}
+	x_release();
+	if (r < 0)
+		goto __fail;
+	if (!s->use_shm)
+		fprintf(stderr, "screen: no shared memory with %s, using XGetImage\n",
+			XDisplayName(display));
+	return s;
+
+      __fail:
+	screen_close(s);
+	errno = EIO;
+	return NULL;
+}
+
+void screen_close(struct screen *s)
+{
+	unsigned i;
+
+	if (s == NULL)
+		return;
+	screen_stop(s);
+	if (s->sems) {
+		sem_destroy(&s->free);
+		sem_destroy(&s->filled);
+	}
+	for (i = 0; i < s->buffers; i++)
+		image_free(s, i);
+	XCloseDisplay(s->dpy);
+	free(s);
+}
+
+static void *grab_thread(void *arg)
+{
+	struct screen *s = arg;
+	unsigned skip = 0, idx;
+	int ok;
+
+	x_catch(s);
+	pacer_init(&s->pacer, s->fps);
+	while (!__atomic_load_n(&s->stop, __ATOMIC_ACQUIRE)) {
+		skip += pacer_wait(&s->pacer);
+		if (sem_trywait(&s->free) < 0) {
+			/* the consumer still holds every buffer */
+			skip++;
+			s->dropped++;
+			continue;
+		}
+		idx = s->head % s->buffers;
+		if (s->use_shm)
+			ok = XShmGetImage(s->dpy, s->root, s->img[idx], s->x,
+					  s->y, AllPlanes);
+		else
+			ok = XGetSubImage(s->dpy, s->root, s->x, s->y, s->width,
+					  s->height, AllPlanes, ZPixmap,
+					  s->img[idx], 0, 0) != NULL;
+		if (!ok || s->xerror) {
+			if (s->xerror)
+				x_report(s, "grab failed");
+			s->error = EIO;
+			sem_post(&s->free);
+			break;
+		}
+		s->frame[idx].tstamp = pacer_now();
+		s->frame[idx].seq = s->pacer.seq;
+		s->frame[idx].skip = skip;
+		skip = 0;
+		s->frames++;
+		__atomic_store_n(&s->head, s->head + 1, __ATOMIC_RELEASE);
+		sem_post(&s->filled);
+	}
+	x_release();
+	/* the end mark */
+	sem_post(&s->filled);
+	return NULL;
+}
+
+int screen_start(struct screen *s)
+{
+	int err;
+
+	if (s->running)
+		return -EBUSY;
+	if (s->sems) {
+		sem_destroy(&s->free);
+		sem_destroy(&s->filled);
+	}
+	s->head = s->tail = 0;
+	s->stop = s->error = 0;
+	s->frames = s->dropped = 0;
+	memset(&s->pacer, 0, sizeof(s->pacer));
+	sem_init(&s->free, 0, s->buffers);
+	sem_init(&s->filled, 0, 0);
+	s->sems = 1;
+	if ((err = pthread_create(&s->thread, NULL, grab_thread, s)) != 0)
+		return -err;
+	s->running = 1;
+	return 0;
+}
+
+/* ends the grab thread, frames already grabbed can still be read */
+void screen_stop(struct screen *s)
+{
+	if (!s->running)
+		return;
+	__atomic_store_n(&s->stop, 1, __ATOMIC_RELEASE);
+	pthread_join(s->thread, NULL);
+	s->running = 0;
+}
+
+/*
+ * Waits up to timeout_ms (< 0 forever) for the oldest grabbed frame, which
+ * stays valid until screen_release().  Returns 1 with it in *f, 0 on
+ * timeout, -errno when the grabber has stopped (-EPIPE) or failed and
+ * there are no frames left.
+ */
+int screen_next(struct screen *s, struct screen_frame *f, int timeout_ms)
+{
+	struct timespec ts;
+	int err;
+
+	if (timeout_ms < 0) {
+		while ((err = sem_wait(&s->filled)) < 0 && errno == EINTR)
+			;
+	} else {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += timeout_ms / 1000;
+		ts.tv_nsec += (timeout_ms % 1000) * 1000000L;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		while ((err = sem_timedwait(&s->filled, &ts)) < 0 && errno == EINTR)
+			;
+	}
+	if (err < 0)
+		return 0;
+	if (s->tail == __atomic_load_n(&s->head, __ATOMIC_ACQUIRE)) {
+		/* the end mark, leave it for the next call */
+		sem_post(&s->filled);
+		return s->error ? -s->error : -EPIPE;
+	}
+	*f = s->frame[s->tail % s->buffers];
+	return 1;
+}
+
+/* gives the frame from screen_next() back to the grab thread */
+void screen_release(struct screen *s)
+{
+	s->tail++;
+	sem_post(&s->free);
+}
+
+void screen_geometry(struct screen *s, int *width, int *height, int *stride)
+{
+	*width = s->width;
+	*height = s->height;
+	*stride = s->img[0]->bytes_per_line;
+}
+
+void screen_stats(struct screen *s, unsigned long *frames,
+		  unsigned long *skipped, unsigned long *dropped)
+{
+	*frames = s->frames;
+	*skipped = s->pacer.skipped + s->dropped;
+	*dropped = s->dropped;
+}
+
+/* how well the grab thread kept to its frame ticks */
+void screen_timing(struct screen *s, struct pacer_stats *st)
+{
+	pacer_get_stats(&s->pacer, st);
+}
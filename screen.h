@@ -0,0 +1,35 @@
+/*
+   MIT-SHM screen grabber, see screen.c.
+*/
+#ifndef SCREEN_H
+#define SCREEN_H
+
+#include <stdint.h>
+
+#include "pacer.h"
+
+#define SCREEN_MAX_BUFFERS	16
+
+struct screen;
+
+/* one grabbed frame, BGRA (BGRX on 24 bit displays) rows of stride bytes */
+struct screen_frame {
+	unsigned char *data;
+	int64_t tstamp;		/* CLOCK_MONOTONIC ns when it was grabbed */
+	unsigned seq;		/* frame tick since screen_start() */
+	unsigned skip;		/* ticks missed right before this one */
+};
+
+struct screen *screen_open(const char *display, int x, int y, int width,
+			   int height, int fps, int buffers);
+void screen_close(struct screen *s);
+int screen_start(struct screen *s);
+void screen_stop(struct screen *s);
+int screen_next(struct screen *s, struct screen_frame *f, int timeout_ms);
+void screen_release(struct screen *s);
+void screen_geometry(struct screen *s, int *width, int *height, int *stride);
+void screen_stats(struct screen *s, unsigned long *frames,
+		  unsigned long *skipped, unsigned long *dropped);
+void screen_timing(struct screen *s, struct pacer_stats *st);
+
+#endif
@@ -0,0 +1,232 @@
+/*
+   Live tap of the captured periods.
+
+   The capture thread copies every period it reads into a slot of a ring
+   preallocated for the run, next to writing it to the file, and a consumer
+   (audio.Stream, for live analysis in Python) takes the filled slots out in
+   batches with tap_next() and reads them in place, without another copy.
+   Every slot handed out stays the consumer's until tap_release() gives it
+   back; they may come back in any order, a slot is reused once it and all
+   those before it are back.
+
+   The capture never waits for the consumer: a period that finds every slot
+   filled or held is dropped from the tap (not from the file) and counted in
+   the "skip" of the next one that does get a slot.
+
+   One lock guards the indices, taken once per period by the capture thread
+   and once per batch by the consumer.
+*/
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "tap.h"
+
+struct tap {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;	/* a slot was filled or the run ended */
+	unsigned char *buf;	/* slots * size bytes */
+	size_t size;
+	unsigned slots;
+	struct tap_slot *slot;
+	unsigned char *done;	/* released, but not yet reusable */
+	unsigned head;		/* next slot to fill, capture thread */
+	unsigned next;		/* next slot to hand out, consumer */
+	unsigned tail;		/* oldest slot not yet released */
+	int ended;		/* the run is over, head is final */
+	struct tap_layout layout;
+	unsigned long periods, dropped, skip;
+};
+
+struct tap *tap_new(unsigned slots)
+{
+	pthread_condattr_t attr;
+	struct tap *t;
+
+	if (slots == 0 || (t = calloc(1, sizeof(*t))) == NULL)
+		return NULL;
+	t->slots = slots;
+	t->slot = calloc(slots, sizeof(*t->slot));
+	t->done = calloc(slots, 1);
+	if (t->slot == NULL || t->done == NULL) {
+		free(t->slot);
+		free(t->done);
+		free(t);
+		return NULL;
+	}
+	pthread_mutex_init(&t->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&t->cond, &attr);
+	pthread_condattr_destroy(&attr);
+	return t;
+}
+
+void tap_free(struct tap *t)
+{
+	if (t == NULL)
+		return;
+	pthread_cond_destroy(&t->cond);
+	pthread_mutex_destroy(&t->lock);
+	free(t->buf);
+	free(t->slot);
+	free(t->done);
+	free(t);
+}
+
+/*
+ * Sets the tap up for a run with periods of up to "size" bytes.  Returns
+ * -EBUSY if the slots would have to grow while the consumer still holds
+ * some of the last run, -ENOMEM.
+ */
+int tap_begin(struct tap *t, size_t size, const struct tap_layout *layout)
+{
+	unsigned char *buf;
+	int err = 0;
+
+	pthread_mutex_lock(&t->lock);
+	if (size > t->size) {
+		if (t->tail != t->head) {
+			err = -EBUSY;
+			goto out;
+		}
+		if ((buf = malloc(size * t->slots)) == NULL) {
+			err = -ENOMEM;
+			goto out;
+		}
+		free(t->buf);
+		t->buf = buf;
+		t->size = size;
+	}
+	t->layout = *layout;
+	t->periods = t->dropped = t->skip = 0;
+	t->ended = 0;
+out:
+	pthread_mutex_unlock(&t->lock);
+	return err;
+}
+
+/*
+ * The slot to copy the next period into, then tap_push() it; NULL if the
+ * consumer has not given any back, the period is dropped.
+ */
+unsigned char *tap_slot(struct tap *t)
+{
+	unsigned char *p = NULL;
+
+	pthread_mutex_lock(&t->lock);
+	if (t->head - t->tail < t->slots)
+		p = t->buf + (size_t)(t->head % t->slots) * t->size;
+	else {
+		t->dropped++;
+		t->skip++;
+	}
+	pthread_mutex_unlock(&t->lock);
+	return p;
+}
+
+/* the slot from tap_slot() holds "frames" frames from "frame" on */
+void tap_push(struct tap *t, size_t frames, int64_t frame)
+{
+	struct tap_slot *s;
+
+	pthread_mutex_lock(&t->lock);
+	s = &t->slot[t->head % t->slots];
+	s->data = t->buf + (size_t)(t->head % t->slots) * t->size;
+	s->frames = frames;
+	s->frame = frame;
+	s->skip = t->skip;
+	s->seq = t->head;
+	t->skip = 0;
+	t->periods++;
+	t->head++;
+	pthread_cond_broadcast(&t->cond);
+	pthread_mutex_unlock(&t->lock);
+}
+
+/* the run is over, the consumer gets what was filled and then -EPIPE */
+void tap_end(struct tap *t)
+{
+	pthread_mutex_lock(&t->lock);
+	t->ended = 1;
+	pthread_cond_broadcast(&t->cond);
+	pthread_mutex_unlock(&t->lock);
+}
+
+/*
+ * Waits up to timeout_ms (< 0 forever) for filled slots and hands out the
+ * oldest of them, up to max, in slot[].  Returns how many, 0 on timeout,
+ * -EPIPE once the run has ended and every slot of it was handed out.
+ */
+int tap_next(struct tap *t, struct tap_slot *slot, unsigned max,
+	     int timeout_ms)
+{
+	struct timespec ts;
+	unsigned n = 0;
+	int ret;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	if (timeout_ms > 0) {
+		ts.tv_sec += timeout_ms / 1000;
+		ts.tv_nsec += (timeout_ms % 1000) * 1000000L;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+	}
+	pthread_mutex_lock(&t->lock);
+	while (t->next == t->head && !t->ended && timeout_ms != 0) {
+		if (timeout_ms < 0)
+			pthread_cond_wait(&t->cond, &t->lock);
+		else if (pthread_cond_timedwait(&t->cond, &t->lock,
+						&ts) == ETIMEDOUT)
+			break;
+	}
+	while (n < max && t->next != t->head)
+		slot[n++] = t->slot[t->next++ % t->slots];
+	ret = (n == 0 && t->ended) ? -EPIPE : (int)n;
+	pthread_mutex_unlock(&t->lock);
+	return ret;
+}
+
+/*
+ * Gives the slot of tap_next() with this seq back.  Returns -EINVAL if it
+ * was not handed out.
+ */
+int tap_release(struct tap *t, unsigned seq)
+{
+	int err = 0;
+
+	pthread_mutex_lock(&t->lock);
+	if (seq - t->tail >= t->next - t->tail ||
+	    t->done[seq % t->slots]) {
+		err = -EINVAL;
+		goto out;
+	}
+	t->done[seq % t->slots] = 1;
+	while (t->tail != t->next && t->done[t->tail % t->slots])
+		t->done[t->tail++ % t->slots] = 0;
+out:
+	pthread_mutex_unlock(&t->lock);
+	return err;
+}
+
+/* the layout of the current (or last) run */
+void tap_get_layout(struct tap *t, struct tap_layout *layout)
+{
+	pthread_mutex_lock(&t->lock);
+	*layout = t->layout;
+	pthread_mutex_unlock(&t->lock);
+}
+
+/* periods put into slots and dropped for want of one, in this run */
+void tap_stats(struct tap *t, unsigned long *periods, unsigned long *dropped)
+{
+	pthread_mutex_lock(&t->lock);
+	*periods = t->periods;
+	*dropped = t->dropped;
+	pthread_mutex_unlock(&t->lock);
+}
@@ -0,0 +1,41 @@
+/*
+   Live tap of the captured periods, see tap.c.
+*/
+#ifndef TAP_H
+#define TAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct tap;
+
+/* how the frames lie in a slot */
+struct tap_layout {
+	unsigned channels;
+	unsigned bytes;		/* per sample */
+	size_t stride;		/* between the channel planes, 0 if interleaved */
+	int format;		/* snd_pcm_format_t, for the consumer */
+};
+
+/* one captured period (or the part of one a stop left), see tap_next() */
+struct tap_slot {
+	unsigned char *data;
+	size_t frames;
+	int64_t frame;		/* of its first frame, since the start of the run */
+	unsigned long skip;	/* periods dropped right before it */
+	unsigned seq;		/* for tap_release() */
+};
+
+struct tap *tap_new(unsigned slots);
+void tap_free(struct tap *t);
+int tap_begin(struct tap *t, size_t size, const struct tap_layout *layout);
+unsigned char *tap_slot(struct tap *t);
+void tap_push(struct tap *t, size_t frames, int64_t frame);
+void tap_end(struct tap *t);
+int tap_next(struct tap *t, struct tap_slot *slot, unsigned max,
+	     int timeout_ms);
+int tap_release(struct tap *t, unsigned seq);
+void tap_get_layout(struct tap *t, struct tap_layout *layout);
+void tap_stats(struct tap *t, unsigned long *periods, unsigned long *dropped);
+
+#endif
@@ -0,0 +1,454 @@
+/*
+   Indexed screen capture file.
+
+   Everything is little endian:
+
+     header   "RVID", u32 version, width, height, stride, fps, codec, 0
+     frames   "FRM0", u32 size, skip, flags, i64 tstamp, then size bytes of
+              frame padded to a multiple of 8
+     index    per frame: u64 offset of its data, i64 tstamp, u32 size,
+              skip, flags, 0
+     footer   u64 offset of the index, u32 frames, "VIDX"
+
+   The writer only ever appends, and puts the index and footer at the end
+   when it is finished.  The reader maps the whole file, so a frame is just
+   a pointer into it and any frame can be reached without reading the ones
+   before it.  If the footer is missing (the recording was killed) the
+   reader rebuilds the index by walking the frame headers.
+
+   vf_pixels() also decodes VF_TILES and VF_SCC frames, from the last key
+   frame before the one asked for, or from the frame decoded last if that
+   is closer.
+*/
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "frames.h"
+#include "scodec.h"
+#include "vidfile.h"
+
+#define VF_VERSION	1
+#define HEADER_BYTES	32
+#define FRAME_BYTES	24	/* frame header */
+#define INDEX_BYTES	32	/* one index entry */
+#define FOOTER_BYTES	16
+
+struct vf_index {
+	uint64_t offset;
+	int64_t tstamp;
+	uint32_t size, skip, flags;
+};
+
+struct vf_writer {
+	int fd;
+	uint64_t offset;	/* where the next frame goes */
+	struct vf_index *index;
+	unsigned frames, alloc;
+};
+
+struct vf_reader {
+	const unsigned char *map;
+	size_t len;
+	int width, height, stride, fps, codec;
+	struct vf_index *index;
+	unsigned frames;
+	struct tile_coder *dec;
+	struct sc_coder *sc;
+	unsigned char *buf[2];	/* VF_SCC frames, the last and the one before */
+	long decoded;		/* frame in dec, -1 if none */
+	const unsigned char *pixels;	/* of that frame */
+};
+
+static void put32(unsigned char *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static void put64(unsigned char *p, uint64_t v)
+{
+	put32(p, v);
+	put32(p + 4, v >> 32);
+}
+
+static uint32_t get32(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t get64(const unsigned char *p)
+{
+	return get32(p) | ((uint64_t)get32(p + 4) << 32);
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	ssize_t r;
+
+	while (len > 0) {
+		r = write(fd, p, len);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		p += r;
+		len -= r;
+	}
+	return 0;
+}
+
+/*
+ * Creates "path" for width x height frames of stride bytes per row,
+ * recorded at fps and stored as "codec" (VF_RAW or VF_TILES).  Returns
+ * NULL with errno set on failure.
+ */
+struct vf_writer *vf_create(const char *path, int width, int height,
+			    int stride, int fps, int codec)
+{
+	struct vf_writer *w;
+	unsigned char h[HEADER_BYTES];
+	int err;
+
+	w = calloc(1, sizeof(*w));
+	if (w == NULL)
+		return NULL;
+	w->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (w->fd < 0) {
+		free(w);
+		return NULL;
+	}
+	memcpy(h, "RVID", 4);
+	put32(h + 4, VF_VERSION);
+	put32(h + 8, width);
+	put32(h + 12, height);
+	put32(h + 16, stride);
+	put32(h + 20, fps);
+	put32(h + 24, codec);
+	put32(h + 28, 0);
+	if ((err = write_all(w->fd, h, sizeof(h))) < 0) {
+		close(w->fd);
+		free(w);
+		errno = -err;
+		return NULL;
+	}
+	w->offset = HEADER_BYTES;
+	return w;
+}
+
+/* appends one frame, returns 0 or -errno */
+int vf_write(struct vf_writer *w, const void *data, size_t size,
+	     unsigned skip, int64_t tstamp, unsigned flags)
+{
+	static const unsigned char pad[8];
+	unsigned char h[FRAME_BYTES];
+	struct vf_index *x;
+	size_t padding = -size & 7;
+	int err;
+
+	if (w->frames == w->alloc) {
+		x = realloc(w->index, (w->alloc ? w->alloc * 2 : 1024) *
+			    sizeof(*x));
+		if (x == NULL)
+			return -ENOMEM;
+		w->index = x;
+		w->alloc = w->alloc ? w->alloc * 2 : 1024;
+	}
+	memcpy(h, "FRM0", 4);
+	put32(h + 4, size);
+	put32(h + 8, skip);
+	put32(h + 12, flags);
+	put64(h + 16, tstamp);
+	if ((err = write_all(w->fd, h, sizeof(h))) < 0 ||
+	    (err = write_all(w->fd, data, size)) < 0 ||
+	    (err = write_all(w->fd, pad, padding)) < 0)
+		return err;
+	x = &w->index[w->frames++];
+	x->offset = w->offset + FRAME_BYTES;
+	x->tstamp = tstamp;
+	x->size = size;
+	x->skip = skip;
+	x->flags = flags;
+	w->offset += FRAME_BYTES + size + padding;
+	return 0;
+}
+
+/* writes the index, closes the file and frees w, returns 0 or -errno */
+int vf_finish(struct vf_writer *w)
+{
+	unsigned char e[INDEX_BYTES], f[FOOTER_BYTES];
+	unsigned i;
+	int err = 0;
+
+	for (i = 0; i < w->frames && err == 0; i++) {
+		put64(e, w->index[i].offset);
+		put64(e + 8, w->index[i].tstamp);
+		put32(e + 16, w->index[i].size);
+		put32(e + 20, w->index[i].skip);
+		put32(e + 24, w->index[i].flags);
+		put32(e + 28, 0);
+		err = write_all(w->fd, e, sizeof(e));
+	}
+	if (err == 0) {
+		put64(f, w->offset);
+		put32(f + 8, w->frames);
+		memcpy(f + 12, "VIDX", 4);
+		err = write_all(w->fd, f, sizeof(f));
+	}
+	if (close(w->fd) < 0 && err == 0)
+		err = -errno;
+	free(w->index);
+	free(w);
+	return err;
+}
+
+/* the index from the footer, 0 if there is no valid one */
+static int read_index(struct vf_reader *r)
+{
+	const unsigned char *f, *e;
+	uint64_t at;
+	unsigned i, n;
+
+	if (r->len < HEADER_BYTES + FOOTER_BYTES)
+		return 0;
+	f = r->map + r->len - FOOTER_BYTES;
+	if (memcmp(f + 12, "VIDX", 4))
+		return 0;
+	at = get64(f);
+	n = get32(f + 8);
+	if (at < HEADER_BYTES || at > r->len - FOOTER_BYTES ||
+	    (r->len - FOOTER_BYTES - at) / INDEX_BYTES != n)
+		return 0;
+	r->index = malloc((n ? n : 1) * sizeof(*r->index));
+	if (r->index == NULL)
+		return -1;
+	for (i = 0, e = r->map + at; i < n; i++, e += INDEX_BYTES) {
+		r->index[i].offset = get64(e);
+		r->index[i].tstamp = get64(e + 8);
+		r->index[i].size = get32(e + 16);
+		r->index[i].skip = get32(e + 20);
+		r->index[i].flags = get32(e + 24);
+		if (r->index[i].offset > at ||
+		    r->index[i].size > at - r->index[i].offset) {
+			free(r->index);
+			r->index = NULL;
+			return 0;
+		}
+	}
+	r->frames = n;
+	return 1;
+}
+
+/* walks the frame headers of a file that was never finished */
+static int scan_index(struct vf_reader *r)
+{
+	uint64_t at = HEADER_BYTES, size;
+	const unsigned char *h;
+	struct vf_index *x;
+	unsigned alloc = 0;
+
+	while (at + FRAME_BYTES <= r->len) {
+		h = r->map + at;
+		if (memcmp(h, "FRM0", 4))
+			break;
+		size = get32(h + 4);
+		if (size > r->len - at - FRAME_BYTES)
+			break;
+		if (r->frames == alloc) {
+			x = realloc(r->index, (alloc ? alloc * 2 : 1024) *
+				    sizeof(*x));
+			if (x == NULL)
+				return -1;
+			r->index = x;
+			alloc = alloc ? alloc * 2 : 1024;
+		}
+		x = &r->index[r->frames++];
+		x->offset = at + FRAME_BYTES;
+		x->size = size;
+		x->skip = get32(h + 8);
+		x->flags = get32(h + 12);
+		x->tstamp = get64(h + 16);
+		/* the file may end inside the padding of its last frame */
+		at += FRAME_BYTES + size;
+		if ((-size & 7) > r->len - at)
+			break;
+		at += -size & 7;
+	}
+	return 0;
+}
+
+/* maps "path", returns NULL with errno set if it is not a capture file */
+struct vf_reader *vf_open(const char *path)
+{
+	struct vf_reader *r;
+	struct stat st;
+	void *map;
+	int fd, err;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) < 0) {
+		err = errno;
+		close(fd);
+		errno = err;
+		return NULL;
+	}
+	if (st.st_size < HEADER_BYTES) {
+		close(fd);
+		errno = EINVAL;
+		return NULL;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	err = errno;
+	close(fd);
+	if (map == MAP_FAILED) {
+		errno = err;
+		return NULL;
+	}
+	r = calloc(1, sizeof(*r));
+	if (r == NULL) {
+		munmap(map, st.st_size);
+		errno = ENOMEM;
+		return NULL;
+	}
+	r->map = map;
+	r->len = st.st_size;
+	r->decoded = -1;
+	if (memcmp(r->map, "RVID", 4) || get32(r->map + 4) != VF_VERSION) {
+		vf_close(r);
+		errno = EINVAL;
+		return NULL;
+	}
+	r->width = get32(r->map + 8);
+	r->height = get32(r->map + 12);
+	r->stride = get32(r->map + 16);
+	r->fps = get32(r->map + 20);
+	r->codec = get32(r->map + 24);
+	if (r->codec == VF_TILES) {
+		r->dec = tile_coder_new(r->width, r->height, r->stride, 1);
+		if (r->dec == NULL) {
+			vf_close(r);
+			errno = EINVAL;
+			return NULL;
+		}
+	}
+	if (r->codec == VF_SCC) {
+		r->sc = sc_coder_new(r->width, r->height, r->stride);
+		r->buf[0] = calloc(r->height, r->stride);
+		r->buf[1] = calloc(r->height, r->stride);
+		if (r->sc == NULL || !r->buf[0] || !r->buf[1]) {
+			vf_close(r);
+			errno = EINVAL;
+			return NULL;
+		}
+	}
+	if ((err = read_index(r)) == 0)
+		err = scan_index(r);
+	if (err < 0) {
+		vf_close(r);
+		errno = ENOMEM;
+		return NULL;
+	}
+	return r;
+}
+
+void vf_close(struct vf_reader *r)
+{
+	if (r == NULL)
+		return;
+	tile_coder_free(r->dec);
+	sc_coder_free(r->sc);
+	free(r->buf[0]);
+	free(r->buf[1]);
+	free(r->index);
+	munmap((void *)r->map, r->len);
+	free(r);
+}
+
+void vf_geometry(struct vf_reader *r, int *width, int *height, int *stride,
+		 int *fps, int *codec)
+{
+	*width = r->width;
+	*height = r->height;
+	*stride = r->stride;
+	*fps = r->fps;
+	*codec = r->codec;
+}
+
+unsigned vf_frames(struct vf_reader *r)
+{
+	return r->frames;
+}
+
+/* frame i as stored, returns -1 if there is no such frame */
+int vf_get_frame(struct vf_reader *r, unsigned i, struct vf_frame *f)
+{
+	if (i >= r->frames)
+		return -1;
+	f->data = r->map + r->index[i].offset;
+	f->size = r->index[i].size;
+	f->skip = r->index[i].skip;
+	f->flags = r->index[i].flags;
+	f->tstamp = r->index[i].tstamp;
+	return 0;
+}
+
+/* decodes frame k over the one decoded last */
+static int vf_decode(struct vf_reader *r, unsigned k)
+{
+	const unsigned char *data = r->map + r->index[k].offset;
+	unsigned char *out;
+
+	if (r->codec == VF_TILES)
+		return tile_decode(r->dec, data, r->index[k].size, &r->pixels);
+	/* the two buffers take turns, the other one holds the frame before */
+	out = r->buf[r->pixels == r->buf[0]];
+	if (sc_decode(r->sc, data, r->index[k].size,
+		      r->decoded >= 0 ? r->pixels : NULL, out) < 0)
+		return -1;
+	r->pixels = out;
+	return 0;
+}
+
+/*
+ * Frame i decoded, stride bytes per row.  *pixels stays valid until the
+ * next call.  Returns -1 if there is no such frame or it does not decode.
+ */
+int vf_pixels(struct vf_reader *r, unsigned i, const unsigned char **pixels)
+{
+	unsigned k;
+
+	if (i >= r->frames)
+		return -1;
+	if (r->codec == VF_RAW) {
+		if (r->index[i].size < (size_t)r->stride * r->height)
+			return -1;
+		*pixels = r->map + r->index[i].offset;
+		return 0;
+	}
+	if (r->codec != VF_TILES && r->codec != VF_SCC)
+		return -1;
+	for (k = i; k > 0 && !(r->index[k].flags & VF_KEY); k--)
+		;
+	if (r->decoded >= (long)k && r->decoded <= (long)i)
+		k = r->decoded + 1;
+	for (; k <= i; k++) {
+		if (vf_decode(r, k) < 0) {
+			r->decoded = -1;
+			return -1;
+		}
+		r->decoded = k;
+	}
+	*pixels = r->pixels;
+	return 0;
+}
@@ -0,0 +1,41 @@
+/*
+   Indexed screen capture file, see vidfile.c.
+*/
+#ifndef VIDFILE_H
+#define VIDFILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define VF_RAW		0	/* frames are whole, stride bytes per row */
+#define VF_TILES	1	/* frames are tile_encode() output */
+#define VF_SCC		2	/* frames are sc_encode() output */
+
+#define VF_KEY		1	/* frame decodes on its own */
+
+struct vf_frame {
+	const unsigned char *data;	/* points into the mapped file */
+	size_t size;
+	unsigned skip;		/* frame ticks missed right before this one */
+	unsigned flags;		/* VF_KEY */
+	int64_t tstamp;		/* CLOCK_MONOTONIC ns */
+};
+
+struct vf_writer;
+struct vf_reader;
+
+struct vf_writer *vf_create(const char *path, int width, int height,
+			    int stride, int fps, int codec);
+int vf_write(struct vf_writer *w, const void *data, size_t size,
+	     unsigned skip, int64_t tstamp, unsigned flags);
+int vf_finish(struct vf_writer *w);
+
+struct vf_reader *vf_open(const char *path);
+void vf_close(struct vf_reader *r);
+void vf_geometry(struct vf_reader *r, int *width, int *height, int *stride,
+		 int *fps, int *codec);
+unsigned vf_frames(struct vf_reader *r);
+int vf_get_frame(struct vf_reader *r, unsigned i, struct vf_frame *f);
+int vf_pixels(struct vf_reader *r, unsigned i, const unsigned char **pixels);
+
+#endif
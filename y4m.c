@@ -0,0 +1,409 @@
+/*
+   Streaming YUV4MPEG2 output.
+
+   y4m_open() (or y4m_fdopen() on a pipe) writes the stream header and
+   y4m_write() turns every grabbed BGRA frame into 8 bit YUV 4:2:0 on the
+   spot and appends it, so an encoder can read the video while it is being
+   recorded instead of from a pile of png files afterwards.
+
+   The colours are BT.601 in the limited (16-235) range, what encoders take
+   a Y4M stream without colour tags to be.  Each chroma sample is made from
+   the average of a 2x2 block of pixels, which puts it between them, hence
+   "C420jpeg".  Odd widths and heights repeat the last column or row.
+
+   The stream has a constant frame rate, so a frame after "skip" missed
+   ticks is preceded by that many copies of the one before it.
+
+   Two pixel rows are converted at a time, by plain C, SSE2 or AVX2 kernels
+   picked at runtime like in meter.c.  They all use the same 16 bit fixed
+   point arithmetic and give the same bytes.
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "cpu.h"
+#include "y4m.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define Y4M_X86 1
+#endif
+
+#define FRAME_TAG	6	/* "FRAME\n" */
+#define CHROMA_BIAS	32896	/* 128 << 8 plus rounding */
+
+struct y4m {
+	int fd;
+	int own;		/* fd was opened by y4m_open() */
+	int width, height;
+	int cw, ch;		/* chroma plane size */
+	unsigned char *frame;	/* "FRAME\n" and the Y, U and V planes */
+	size_t size;
+	int have;		/* frame holds a converted picture */
+	unsigned long frames, repeated;
+};
+
+/*
+ * Converts n pixels of the rows s0 and s1 below it to the luma rows y0 and
+ * y1 and n / 2 chroma samples (rounded up).
+ */
+typedef void (*yuv_rows_t)(const uint8_t *s0, const uint8_t *s1, uint8_t *y0,
+			   uint8_t *y1, uint8_t *u, uint8_t *v, int n);
+
+static inline uint8_t luma(int b, int g, int r)
+{
+	return ((66 * r + 129 * g + 25 * b + 128) >> 8) + 16;
+}
+
+static void yuv_rows_c(const uint8_t *s0, const uint8_t *s1, uint8_t *y0,
+		       uint8_t *y1, uint8_t *u, uint8_t *v, int n)
+{
+	int x, x1, b, g, r;
+
+	for (x = 0; x < n; x += 2) {
+		x1 = x + 1 < n ? x + 1 : x;
+		y0[x] = luma(s0[4 * x], s0[4 * x + 1], s0[4 * x + 2]);
+		y0[x1] = luma(s0[4 * x1], s0[4 * x1 + 1], s0[4 * x1 + 2]);
+		y1[x] = luma(s1[4 * x], s1[4 * x + 1], s1[4 * x + 2]);
+		y1[x1] = luma(s1[4 * x1], s1[4 * x1 + 1], s1[4 * x1 + 2]);
+		b = (s0[4 * x] + s0[4 * x1] + s1[4 * x] + s1[4 * x1] + 2) >> 2;
+		g = (s0[4 * x + 1] + s0[4 * x1 + 1] + s1[4 * x + 1] +
+		     s1[4 * x1 + 1] + 2) >> 2;
+		r = (s0[4 * x + 2] + s0[4 * x1 + 2] + s1[4 * x + 2] +
+		     s1[4 * x1 + 2] + 2) >> 2;
+		u[x / 2] = (112 * b - 38 * r - 74 * g + CHROMA_BIAS) >> 8;
+		v[x / 2] = (112 * r - 94 * g - 18 * b + CHROMA_BIAS) >> 8;
+	}
+}
+
+#ifdef Y4M_X86
+
+#pragma GCC push_options
+#pragma GCC target("sse2")
+
+/*
+ * The sums below wrap around in 16 bits, but every result is between 0 and
+ * 65535, so the logical shift still gives the right byte.
+ */
+static inline __m128i luma_sse2(__m128i b, __m128i g, __m128i r)
+{
+	__m128i y;
+
+	y = _mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(66)),
+			  _mm_mullo_epi16(g, _mm_set1_epi16(129)));
+	y = _mm_add_epi16(y, _mm_mullo_epi16(b, _mm_set1_epi16(25)));
+	y = _mm_srli_epi16(_mm_add_epi16(y, _mm_set1_epi16(128)), 8);
+	return _mm_add_epi16(y, _mm_set1_epi16(16));
+}
+
+/* 8 chroma samples from the 2x2 sums of b, g and r */
+static inline void chroma_sse2(__m128i b, __m128i g, __m128i r, uint8_t *u,
+			       uint8_t *v)
+{
+	const __m128i bias = _mm_set1_epi16((short)CHROMA_BIAS);
+	__m128i c;
+
+	b = _mm_srli_epi16(_mm_add_epi16(b, _mm_set1_epi16(2)), 2);
+	g = _mm_srli_epi16(_mm_add_epi16(g, _mm_set1_epi16(2)), 2);
+	r = _mm_srli_epi16(_mm_add_epi16(r, _mm_set1_epi16(2)), 2);
+	c = _mm_sub_epi16(_mm_mullo_epi16(b, _mm_set1_epi16(112)),
+			  _mm_mullo_epi16(r, _mm_set1_epi16(38)));
+	c = _mm_sub_epi16(c, _mm_mullo_epi16(g, _mm_set1_epi16(74)));
+	c = _mm_srli_epi16(_mm_add_epi16(c, bias), 8);
+	_mm_storel_epi64((__m128i *)u, _mm_packus_epi16(c, c));
+	c = _mm_sub_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(112)),
+			  _mm_mullo_epi16(g, _mm_set1_epi16(94)));
+	c = _mm_sub_epi16(c, _mm_mullo_epi16(b, _mm_set1_epi16(18)));
+	c = _mm_srli_epi16(_mm_add_epi16(c, bias), 8);
+	_mm_storel_epi64((__m128i *)v, _mm_packus_epi16(c, c));
+}
+
+/* 8 BGRA pixels to 16 bit b, g and r */
+static inline void split_sse2(const uint8_t *p, __m128i *b, __m128i *g,
+			      __m128i *r)
+{
+	const __m128i m = _mm_set1_epi32(0xff);
+	__m128i lo = _mm_loadu_si128((const __m128i *)p);
+	__m128i hi = _mm_loadu_si128((const __m128i *)(p + 16));
+
+	*b = _mm_packs_epi32(_mm_and_si128(lo, m), _mm_and_si128(hi, m));
+	*g = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(lo, 8), m),
+			     _mm_and_si128(_mm_srli_epi32(hi, 8), m));
+	*r = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(lo, 16), m),
+			     _mm_and_si128(_mm_srli_epi32(hi, 16), m));
+}
+
+/* sums of neighbouring 16 bit values, those of a then those of b */
+static inline __m128i pairs_sse2(__m128i a, __m128i b)
+{
+	const __m128i one = _mm_set1_epi16(1);
+
+	return _mm_packs_epi32(_mm_madd_epi16(a, one), _mm_madd_epi16(b, one));
+}
+
+static void yuv_rows_sse2(const uint8_t *s0, const uint8_t *s1, uint8_t *y0,
+			  uint8_t *y1, uint8_t *u, uint8_t *v, int n)
+{
+	__m128i b0, g0, r0, b1, g1, r1, b2, g2, r2, b3, g3, r3;
+	int x;
+
+	for (x = 0; x < n; x += 16) {
+		split_sse2(s0 + 4 * x, &b0, &g0, &r0);
+		split_sse2(s0 + 4 * x + 32, &b1, &g1, &r1);
+		split_sse2(s1 + 4 * x, &b2, &g2, &r2);
+		split_sse2(s1 + 4 * x + 32, &b3, &g3, &r3);
+		_mm_storeu_si128((__m128i *)(y0 + x),
+				 _mm_packus_epi16(luma_sse2(b0, g0, r0),
+						  luma_sse2(b1, g1, r1)));
+		_mm_storeu_si128((__m128i *)(y1 + x),
+				 _mm_packus_epi16(luma_sse2(b2, g2, r2),
+						  luma_sse2(b3, g3, r3)));
+		chroma_sse2(pairs_sse2(_mm_add_epi16(b0, b2), _mm_add_epi16(b1, b3)),
+			    pairs_sse2(_mm_add_epi16(g0, g2), _mm_add_epi16(g1, g3)),
+			    pairs_sse2(_mm_add_epi16(r0, r2), _mm_add_epi16(r1, r3)),
+			    u + x / 2, v + x / 2);
+	}
+}
+
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx2")
+
+/* 16 BGRA pixels to 16 bit b, g and r, in pixel order */
+static inline void split_avx2(const uint8_t *p, __m256i *b, __m256i *g,
+			      __m256i *r)
+{
+	const __m256i m = _mm256_set1_epi32(0xff);
+	__m256i lo = _mm256_loadu_si256((const __m256i *)p);
+	__m256i hi = _mm256_loadu_si256((const __m256i *)(p + 32));
+
+	/* the packs work per 128 bit lane, the permutes undo that */
+	*b = _mm256_permute4x64_epi64(_mm256_packs_epi32(
+		_mm256_and_si256(lo, m), _mm256_and_si256(hi, m)), 0xd8);
+	*g = _mm256_permute4x64_epi64(_mm256_packs_epi32(
+		_mm256_and_si256(_mm256_srli_epi32(lo, 8), m),
+		_mm256_and_si256(_mm256_srli_epi32(hi, 8), m)), 0xd8);
+	*r = _mm256_permute4x64_epi64(_mm256_packs_epi32(
+		_mm256_and_si256(_mm256_srli_epi32(lo, 16), m),
+		_mm256_and_si256(_mm256_srli_epi32(hi, 16), m)), 0xd8);
+}
+
+static inline void luma_avx2(__m256i b, __m256i g, __m256i r, uint8_t *y)
+{
+	__m256i l;
+
+	l = _mm256_add_epi16(_mm256_mullo_epi16(r, _mm256_set1_epi16(66)),
+			     _mm256_mullo_epi16(g, _mm256_set1_epi16(129)));
+	l = _mm256_add_epi16(l, _mm256_mullo_epi16(b, _mm256_set1_epi16(25)));
+	l = _mm256_srli_epi16(_mm256_add_epi16(l, _mm256_set1_epi16(128)), 8);
+	l = _mm256_add_epi16(l, _mm256_set1_epi16(16));
+	l = _mm256_permute4x64_epi64(_mm256_packus_epi16(l, l), 0x08);
+	_mm_storeu_si128((__m128i *)y, _mm256_castsi256_si128(l));
+}
+
+/* sums of the 2x2 blocks of two rows of 16 values, as 8 x 16 bit */
+static inline __m128i pairs_avx2(__m256i a, __m256i b)
+{
+	__m256i s;
+
+	s = _mm256_madd_epi16(_mm256_add_epi16(a, b), _mm256_set1_epi16(1));
+	s = _mm256_permute4x64_epi64(_mm256_packs_epi32(s, s), 0x08);
+	return _mm256_castsi256_si128(s);
+}
+
+static void yuv_rows_avx2(const uint8_t *s0, const uint8_t *s1, uint8_t *y0,
+			  uint8_t *y1, uint8_t *u, uint8_t *v, int n)
+{
+	__m256i b0, g0, r0, b1, g1, r1;
+	int x;
+
+	for (x = 0; x < n; x += 16) {
+		split_avx2(s0 + 4 * x, &b0, &g0, &r0);
+		split_avx2(s1 + 4 * x, &b1, &g1, &r1);
+		luma_avx2(b0, g0, r0, y0 + x);
+		luma_avx2(b1, g1, r1, y1 + x);
+		chroma_sse2(pairs_avx2(b0, b1), pairs_avx2(g0, g1),
+			    pairs_avx2(r0, r1), u + x / 2, v + x / 2);
+	}
+}
+
+#pragma GCC pop_options
+
+#endif /* Y4M_X86 */
+
+/* one row per CPU_*, see cpu.c */
+static const struct y4m_impl {
+	yuv_rows_t rows;
+	int step;		/* pixels per step, the rest goes to yuv_rows_c */
+} y4m_impls[] = {
+	{ yuv_rows_c,		1 },
+#ifdef Y4M_X86
+	{ yuv_rows_sse2,	16 },
+	{ yuv_rows_avx2,	16 },
+#endif
+};
+
+static const void *impl;
+
+static const struct y4m_impl *y4m_dispatch(void)
+{
+	return cpu_resolve(&impl, y4m_impls, sizeof(y4m_impls[0]),
+			   sizeof(y4m_impls) / sizeof(y4m_impls[0]), -1);
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	ssize_t r;
+
+	while (len > 0) {
+		r = write(fd, p, len);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		p += r;
+		len -= r;
+	}
+	return 0;
+}
+
+/*
+ * Starts a stream of width x height frames at fps on fd, which stays open
+ * after y4m_close().  Returns NULL with errno set on failure.
+ */
+struct y4m *y4m_fdopen(int fd, int width, int height, int fps)
+{
+	struct y4m *y;
+	char h[80];
+	int err;
+
+	if (width <= 0 || height <= 0 || fps <= 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+	y = calloc(1, sizeof(*y));
+	if (y == NULL)
+		return NULL;
+	y->fd = fd;
+	y->width = width;
+	y->height = height;
+	y->cw = (width + 1) / 2;
+	y->ch = (height + 1) / 2;
+	y->size = FRAME_TAG + (size_t)width * height + 2 * (size_t)y->cw * y->ch;
+	y->frame = malloc(y->size);
+	if (y->frame == NULL) {
+		free(y);
+		errno = ENOMEM;
+		return NULL;
+	}
+	memcpy(y->frame, "FRAME\n", FRAME_TAG);
+	snprintf(h, sizeof(h), "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg\n",
+		 width, height, fps);
+	if ((err = write_all(fd, h, strlen(h))) < 0) {
+		free(y->frame);
+		free(y);
+		errno = -err;
+		return NULL;
+	}
+	return y;
+}
+
+/* the same, into a new file "path" */
+struct y4m *y4m_open(const char *path, int width, int height, int fps)
+{
+	struct y4m *y;
+	int fd, err;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return NULL;
+	y = y4m_fdopen(fd, width, height, fps);
+	if (y == NULL) {
+		err = errno;
+		close(fd);
+		errno = err;
+		return NULL;
+	}
+	y->own = 1;
+	return y;
+}
+
+/* returns 0 or -errno from closing the file */
+int y4m_close(struct y4m *y)
+{
+	int err = 0;
+
+	if (y->own && close(y->fd) < 0)
+		err = -errno;
+	free(y->frame);
+	free(y);
+	return err;
+}
+
+static void convert(struct y4m *y, const unsigned char *bgra, int stride)
+{
+	const struct y4m_impl *k = y4m_dispatch();
+	unsigned char *py = y->frame + FRAME_TAG;
+	unsigned char *pu = py + (size_t)y->width * y->height;
+	unsigned char *pv = pu + (size_t)y->cw * y->ch;
+	const unsigned char *s0, *s1;
+	unsigned char *y0, *y1;
+	int n = y->width - y->width % k->step;
+	int row;
+
+	for (row = 0; row < y->height; row += 2) {
+		s0 = bgra + (size_t)row * stride;
+		y0 = py + (size_t)row * y->width;
+		if (row + 1 < y->height) {
+			s1 = s0 + stride;
+			y1 = y0 + y->width;
+		} else {
+			/* the odd last row stands in for the one below */
+			s1 = s0;
+			y1 = y0;
+		}
+		k->rows(s0, s1, y0, y1, pu, pv, n);
+		if (n < y->width)
+			yuv_rows_c(s0 + 4 * n, s1 + 4 * n, y0 + n, y1 + n,
+				   pu + n / 2, pv + n / 2, y->width - n);
+		pu += y->cw;
+		pv += y->cw;
+	}
+}
+
+/*
+ * Appends a frame of BGRA pixels, stride bytes per row, after "skip"
+ * repeats of the previous one.  Returns 0 or -errno.
+ */
+int y4m_write(struct y4m *y, const unsigned char *bgra, int stride,
+	      unsigned skip)
+{
+	int err;
+
+	for (; skip > 0 && y->have; skip--) {
+		if ((err = write_all(y->fd, y->frame, y->size)) < 0)
+			return err;
+		y->repeated++;
+	}
+	convert(y, bgra, stride);
+	y->have = 1;
+	if ((err = write_all(y->fd, y->frame, y->size)) < 0)
+		return err;
+	y->frames++;
+	return 0;
+}
+
+void y4m_stats(struct y4m *y, unsigned long *frames, unsigned long *repeated)
+{
+	*frames = y->frames;
+	*repeated = y->repeated;
+}
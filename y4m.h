@@ -0,0 +1,16 @@
+/*
+   Streaming YUV4MPEG2 output, see y4m.c.
+*/
+#ifndef Y4M_H
+#define Y4M_H
+
+struct y4m;
+
+struct y4m *y4m_open(const char *path, int width, int height, int fps);
+struct y4m *y4m_fdopen(int fd, int width, int height, int fps);
+int y4m_close(struct y4m *y);
+int y4m_write(struct y4m *y, const unsigned char *bgra, int stride,
+	      unsigned skip);
+void y4m_stats(struct y4m *y, unsigned long *frames, unsigned long *repeated);
+
+#endif